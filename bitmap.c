@@ -0,0 +1,404 @@
+/*
+ * Location Based Filesystem
+ *
+ * By, Robert Chrystie
+ */
+
+#include <linux/bitops.h>
+#include <linux/buffer_head.h>
+#include <linux/mutex.h>
+#include <linux/smp.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+#include "internal.h"
+
+/*
+ * In-memory bitmaps
+ *
+ * The inode and data block bitmaps are read into memory once at mount and
+ * kept there until unmount. Searches run a word at a time over the copy,
+ * skip groups whose free count is zero and start at a rotating cursor, so
+ * allocation does not slow down as the image fills. Changes are mirrored
+ * into the on-disk bitmap block, which is dirtied like any other metadata
+ * buffer.
+ *
+ * Each bitmap is split into allocation groups of a fixed number of bits.
+ * A group has its own lock, cursor and free count, so allocations landing
+ * in different groups, or on different mounts, run in parallel. Groups
+ * never straddle a bitmap block or share a word of the bitmap.
+ *
+ * The data block bitmap grows when the image does, see resize.c. The copy
+ * and the groups are then swapped for larger ones under b_resize_sem,
+ * which allocations only take for read.
+ */
+
+/* Counts the set bits among the first nbits bits of a bitmap */
+static uint64_t locfs_bitmap_weight(const void *data, uint64_t nbits)
+{
+    uint64_t used = memweight(data, nbits / 8);
+    uint64_t i;
+
+    for (i = nbits & ~7ULL; i < nbits; i++) {
+        if (test_bit_le(i, data)) {
+            used++;
+        }
+    }
+
+    return used;
+}
+
+int locfs_bitmap_load(struct super_block *sb,
+                        struct locfs_bitmap *bm,
+                        uint64_t start,
+                        uint64_t bits,
+                        uint64_t group_bits)
+{
+    struct buffer_head *bh;
+    struct locfs_group *group;
+    uint64_t b, g, first, nbits;
+
+    bm->b_start = start;
+    bm->b_bits = bits;
+    bm->b_bits_per_block = (uint64_t)sb->s_blocksize * 8;
+    bm->b_blocks = DIV_ROUND_UP(bits, bm->b_bits_per_block);
+    bm->b_group_bits = min(group_bits, bm->b_bits_per_block);
+    bm->b_groups = DIV_ROUND_UP(bits, bm->b_group_bits);
+
+    bm->b_map = vzalloc(bm->b_blocks * sb->s_blocksize);
+    bm->b_group = vzalloc(bm->b_groups * sizeof(*bm->b_group));
+    if (!bm->b_map || !bm->b_group
+            || percpu_init_rwsem(&bm->b_resize_sem)) {
+        locfs_bitmap_release(bm);
+        return -ENOMEM;
+    }
+
+    for (b = 0; b < bm->b_blocks; b++) {
+        bh = sb_bread(sb, start + b);
+        if (!bh) {
+            printk(KERN_ERR "locfs: Failed to read bitmap block %llu\n",
+                   start + b);
+            locfs_bitmap_release(bm);
+            return -EIO;
+        }
+
+        memcpy(bm->b_map + b * sb->s_blocksize, bh->b_data, sb->s_blocksize);
+        brelse(bh);
+    }
+
+    for (g = 0; g < bm->b_groups; g++) {
+        group = &bm->b_group[g];
+        first = g * bm->b_group_bits;
+        nbits = min(bm->b_group_bits, bits - first);
+
+        mutex_init(&group->g_lock);
+        group->g_cursor = first;
+        group->g_free = nbits - locfs_bitmap_weight(bm->b_map + first / 8,
+                                                    nbits);
+    }
+
+    return 0;
+}
+
+/* Adds up the free bits of all groups, to seed the counters at mount */
+uint64_t locfs_bitmap_free_count(struct locfs_bitmap *bm)
+{
+    uint64_t g, free = 0;
+
+    for (g = 0; g < bm->b_groups; g++) {
+        free += READ_ONCE(bm->b_group[g].g_free);
+    }
+
+    return free;
+}
+
+void locfs_bitmap_release(struct locfs_bitmap *bm)
+{
+    vfree(bm->b_map);
+    vfree(bm->b_group);
+    bm->b_map = NULL;
+    bm->b_group = NULL;
+    percpu_free_rwsem(&bm->b_resize_sem);
+}
+
+/*
+ * Extends the bitmap to cover bits bits, reading the on-disk blocks it
+ * did not hold yet. *out_free is set to how many of the new bits are
+ * clear. Allocations wait while the copy and the groups are swapped.
+ */
+int locfs_bitmap_grow(struct super_block *sb,
+                        struct locfs_bitmap *bm,
+                        uint64_t bits,
+                        uint64_t *out_free)
+{
+    struct buffer_head *bh;
+    struct locfs_group *new_group, *group;
+    uint64_t blocks, groups, b, g, first, nbits, free = 0;
+    void *new_map, *old_map;
+    struct locfs_group *old_group;
+
+    if (bits <= bm->b_bits) {
+        *out_free = 0;
+        return 0;
+    }
+
+    blocks = DIV_ROUND_UP(bits, bm->b_bits_per_block);
+    groups = DIV_ROUND_UP(bits, bm->b_group_bits);
+
+    new_map = vzalloc(blocks * sb->s_blocksize);
+    new_group = vzalloc(groups * sizeof(*bm->b_group));
+    if (!new_map || !new_group) {
+        vfree(new_map);
+        vfree(new_group);
+        return -ENOMEM;
+    }
+
+    // Nothing allocates from blocks past the old end, they can be read
+    // before allocations are stopped
+    for (b = bm->b_blocks; b < blocks; b++) {
+        bh = sb_bread(sb, bm->b_start + b);
+        if (!bh) {
+            printk(KERN_ERR "locfs: Failed to read bitmap block %llu\n",
+                   bm->b_start + b);
+            vfree(new_map);
+            vfree(new_group);
+            return -EIO;
+        }
+
+        memcpy(new_map + b * sb->s_blocksize, bh->b_data, sb->s_blocksize);
+        brelse(bh);
+    }
+
+    percpu_down_write(&bm->b_resize_sem);
+
+    memcpy(new_map, bm->b_map, bm->b_blocks * sb->s_blocksize);
+    for (g = 0; g < groups; g++) {
+        group = &new_group[g];
+        first = g * bm->b_group_bits;
+        nbits = min(bm->b_group_bits, bits - first);
+
+        // The groups hold mutexes, so they are set up afresh rather than
+        // copied. The last old group may have grown as well.
+        mutex_init(&group->g_lock);
+        if (g + 1 < bm->b_groups) {
+            group->g_free = bm->b_group[g].g_free;
+            group->g_cursor = bm->b_group[g].g_cursor;
+            continue;
+        }
+
+        group->g_free = nbits - locfs_bitmap_weight(new_map + first / 8, nbits);
+        group->g_cursor = g < bm->b_groups ? bm->b_group[g].g_cursor : first;
+        free += group->g_free;
+        if (g < bm->b_groups) {
+            free -= bm->b_group[g].g_free;
+        }
+    }
+
+    old_map = bm->b_map;
+    old_group = bm->b_group;
+    bm->b_map = new_map;
+    bm->b_group = new_group;
+    bm->b_bits = bits;
+    bm->b_blocks = blocks;
+    bm->b_groups = groups;
+
+    percpu_up_write(&bm->b_resize_sem);
+
+    vfree(old_map);
+    vfree(old_group);
+    *out_free = free;
+    return 0;
+}
+
+/*
+ * Marks len bits starting at bit as used, in memory and on disk. The bits
+ * lie within one group, whose lock the caller holds.
+ */
+static int locfs_bitmap_set_range(struct super_block *sb,
+                                    struct locfs_bitmap *bm,
+                                    uint64_t bit,
+                                    uint64_t len)
+{
+    struct buffer_head *bh;
+    uint64_t b, first, i;
+
+    b = bit / bm->b_bits_per_block;
+    first = b * bm->b_bits_per_block;
+
+    bh = sb_bread(sb, bm->b_start + b);
+    if (!bh) {
+        return -EIO;
+    }
+
+    // Other groups may be changing their own words of the same buffer,
+    // never the ones touched here
+    for (i = bit; i < bit + len; i++) {
+        __set_bit_le(i, bm->b_map);
+        __set_bit_le(i - first, bh->b_data);
+    }
+
+    locfs_dirty_buffer(sb, bh, NULL);
+    brelse(bh);
+
+    return 0;
+}
+
+/* Allocates up to count clear bits from one group, starting at from */
+static int locfs_group_alloc(struct super_block *sb,
+                               struct locfs_bitmap *bm,
+                               uint64_t g,
+                               uint64_t from,
+                               uint64_t count,
+                               uint64_t *out_bit,
+                               uint64_t *out_len)
+{
+    struct locfs_group *group = &bm->b_group[g];
+    uint64_t first, limit, bit, end;
+    int ret = -ENOSPC;
+
+    first = g * bm->b_group_bits;
+    limit = min(bm->b_bits, first + bm->b_group_bits);
+
+    mutex_lock(&group->g_lock);
+
+    if (group->g_free == 0) {
+        goto out;
+    }
+
+    if (from < first || from >= limit) {
+        from = group->g_cursor;
+    }
+
+    // Search from the hint to the end of the group, then from its start
+    bit = find_next_zero_bit_le(bm->b_map, limit, from);
+    if (bit >= limit) {
+        bit = find_next_zero_bit_le(bm->b_map, from, first);
+        if (bit >= from) {
+            goto out;
+        }
+    }
+
+    // Take as much of the free run as was asked for, without leaving the
+    // group so a transaction only dirties one bitmap block. Longer runs
+    // continue in the next call, which is given end as goal.
+    end = find_next_bit_le(bm->b_map, min(limit, bit + count), bit);
+
+    ret = locfs_bitmap_set_range(sb, bm, bit, end - bit);
+    if (ret) {
+        goto out;
+    }
+
+    group->g_free -= end - bit;
+    group->g_cursor = end < limit ? end : first;
+    *out_bit = bit;
+    *out_len = end - bit;
+
+out:
+    mutex_unlock(&group->g_lock);
+    return ret;
+}
+
+/*
+ * Allocates a run of up to count clear bits. The search starts at goal, or
+ * in a group picked by the calling CPU when goal is out of range, so that
+ * unrelated allocations spread over the groups instead of queueing on one
+ * lock. Every group is visited at most once.
+ */
+int locfs_bitmap_alloc(struct super_block *sb,
+                         struct locfs_bitmap *bm,
+                         uint64_t goal,
+                         uint64_t count,
+                         uint64_t *out_bit,
+                         uint64_t *out_len)
+{
+    uint64_t start, g, n;
+    int ret = -ENOSPC;
+
+    if (count == 0) {
+        return -ENOSPC;
+    }
+
+    percpu_down_read(&bm->b_resize_sem);
+    if (bm->b_bits == 0) {
+        goto out;
+    }
+
+    if (goal < bm->b_bits) {
+        start = goal / bm->b_group_bits;
+    } else {
+        start = raw_smp_processor_id() % bm->b_groups;
+    }
+
+    for (n = 0; n < bm->b_groups; n++) {
+        g = (start + n) % bm->b_groups;
+
+        // Unlocked peek, the group rechecks under its lock
+        if (READ_ONCE(bm->b_group[g].g_free) == 0) {
+            continue;
+        }
+
+        ret = locfs_group_alloc(sb, bm, g, n == 0 ? goal : U64_MAX,
+                                count, out_bit, out_len);
+        if (ret != -ENOSPC) {
+            break;
+        }
+    }
+
+out:
+    percpu_up_read(&bm->b_resize_sem);
+    return ret;
+}
+
+/*
+ * Clears len bits starting at bit, in memory and on disk, giving them back
+ * to their groups. Runs may span groups and bitmap blocks.
+ */
+int locfs_bitmap_free(struct super_block *sb,
+                        struct locfs_bitmap *bm,
+                        uint64_t bit,
+                        uint64_t len)
+{
+    struct locfs_group *group;
+    struct buffer_head *bh;
+    uint64_t b, first, end, i;
+    int ret = 0;
+
+    percpu_down_read(&bm->b_resize_sem);
+    if (bit >= bm->b_bits || len > bm->b_bits - bit) {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    while (len > 0) {
+        group = &bm->b_group[bit / bm->b_group_bits];
+        end = min(bit + len, (bit / bm->b_group_bits + 1) * bm->b_group_bits);
+        b = bit / bm->b_bits_per_block;
+        first = b * bm->b_bits_per_block;
+
+        bh = sb_bread(sb, bm->b_start + b);
+        if (!bh) {
+            ret = -EIO;
+            goto out;
+        }
+
+        mutex_lock(&group->g_lock);
+        for (i = bit; i < end; i++) {
+            if (!__test_and_clear_bit_le(i, bm->b_map)) {
+                printk(KERN_ERR "locfs: Freeing bit %llu, which is not in use\n", i);
+                continue;
+            }
+            __clear_bit_le(i - first, bh->b_data);
+            group->g_free++;
+        }
+        mutex_unlock(&group->g_lock);
+
+        locfs_dirty_buffer(sb, bh, NULL);
+        brelse(bh);
+
+        len -= end - bit;
+        bit = end;
+    }
+
+out:
+    percpu_up_read(&bm->b_resize_sem);
+    return ret;
+}
@@ -0,0 +1,561 @@
+/*
+ * Location Based Filesystem
+ *
+ * By, Robert Chrystie
+ */
+
+#include <linux/buffer_head.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/string.h>
+#include "internal.h"
+
+/*
+ * Hashed directories
+ *
+ * Names are found through the hash tree described next to struct
+ * locfs_dx_node, so a lookup reads the root, at most one interior node and
+ * a single leaf however many children the directory has. Callers hold the
+ * directory's i_rwsem, shared to look names up and exclusive to add them.
+ */
+
+/* One step of the path from the root down to a leaf */
+struct locfs_dx_frame {
+    struct buffer_head *bh;
+    struct locfs_dx_node *node;
+    uint32_t at;                /* entry that was followed */
+};
+
+static inline bool locfs_dir_match(struct locfs_dir_record *record,
+                                     const char *name,
+                                     size_t len)
+{
+    return memcmp(record->filename, name, len) == 0
+           && record->filename[len] == '\0';
+}
+
+static inline uint32_t locfs_dir_record_hash(struct locfs_dir_record *record)
+{
+    return locfs_name_hash(record->filename,
+                           strnlen(record->filename, LOCFS_FILENAME_MAXLEN));
+}
+
+/* Reads logical block lblock of the directory and checks its magic */
+static struct buffer_head *locfs_dir_bread(struct inode *dir,
+                                             uint64_t lblock,
+                                             uint64_t magic)
+{
+    struct locfs_inode_info *info = LOCFS_I(dir);
+    uint64_t block_no, len;
+    int ret;
+
+    down_read(&info->i_map_sem);
+    ret = locfs_extent_map(dir->i_sb, &info->i_disk, lblock, &block_no, &len);
+    up_read(&info->i_map_sem);
+    if (ret) {
+        return ERR_PTR(ret);
+    }
+
+    if (unlikely(block_no == 0)) {
+        printk(KERN_ERR "locfs: Directory inode %lu has no block %llu\n",
+               dir->i_ino, lblock);
+        return ERR_PTR(-EIO);
+    }
+
+    return locfs_read_chain_block(dir->i_sb, block_no, magic);
+}
+
+/*
+ * Works out the logical block the next new block of the directory goes
+ * in, one past the highest block its hash tree points at. The blocks from
+ * there to the end of the block map were mapped ahead and are unused.
+ */
+static int locfs_dir_next_block(struct inode *dir, uint64_t *out_next)
+{
+    struct locfs_inode_info *info = LOCFS_I(dir);
+    uint64_t max_entries = LOCFS_DX_ENTRIES_PER_BLOCK_HSB(LOCFS_SB(dir->i_sb));
+    struct buffer_head *bh, *node_bh;
+    struct locfs_dx_node *root, *node;
+    uint64_t next = 1;
+    uint32_t i, j;
+    int ret = 0;
+
+    if (info->i_dir_next != 0 || info->i_disk.extent_count == 0) {
+        *out_next = info->i_dir_next;
+        return 0;
+    }
+
+    bh = locfs_dir_bread(dir, 0, LOCFS_DX_ROOT_MAGIC);
+    if (IS_ERR(bh)) {
+        return PTR_ERR(bh);
+    }
+    root = (struct locfs_dx_node *)bh->b_data;
+
+    for (i = 0; i < root->count && i < max_entries; i++) {
+        next = max(next, (uint64_t)root->entries[i].block + 1);
+        if (root->levels == 0) {
+            continue;
+        }
+
+        node_bh = locfs_dir_bread(dir, root->entries[i].block,
+                                  LOCFS_DX_NODE_MAGIC);
+        if (IS_ERR(node_bh)) {
+            ret = PTR_ERR(node_bh);
+            break;
+        }
+        node = (struct locfs_dx_node *)node_bh->b_data;
+        for (j = 0; j < node->count && j < max_entries; j++) {
+            next = max(next, (uint64_t)node->entries[j].block + 1);
+        }
+        brelse(node_bh);
+    }
+    brelse(bh);
+
+    if (ret) {
+        return ret;
+    }
+    info->i_dir_next = next;
+    *out_next = next;
+    return 0;
+}
+
+/*
+ * Appends a zeroed block to the directory, marked with magic. Blocks are
+ * mapped in runs growing with the directory, see LOCFS_DIR_PREALLOC_MAX,
+ * and handed out one at a time.
+ */
+static struct buffer_head *locfs_dir_new_block(struct inode *dir,
+                                                 uint64_t magic,
+                                                 uint32_t *out_lblock)
+{
+    struct locfs_inode_info *info = LOCFS_I(dir);
+    struct super_block *sb = dir->i_sb;
+    struct buffer_head *bh;
+    uint64_t next, block_no, len, count;
+    int ret;
+
+    ret = locfs_dir_next_block(dir, &next);
+    if (ret) {
+        return ERR_PTR(ret);
+    }
+    if (next > U32_MAX) {
+        return ERR_PTR(-EFBIG);
+    }
+
+    down_write(&info->i_map_sem);
+    ret = locfs_extent_map(sb, &info->i_disk, next, &block_no, &len);
+    if (ret == 0 && block_no == 0) {
+        // A new directory gets its root and first leaf in one go
+        count = next == 0 ? 2 : clamp_t(uint64_t, next / 4,
+                                        LOCFS_DIR_PREALLOC_MIN,
+                                        LOCFS_DIR_PREALLOC_MAX);
+        ret = locfs_extent_alloc(dir, next, min(count, len), &block_no,
+                                 &len);
+    }
+    if (ret == 0) {
+        info->i_dir_next = next + 1;
+    }
+    up_write(&info->i_map_sem);
+    if (ret) {
+        return ERR_PTR(ret);
+    }
+
+    bh = sb_getblk(sb, block_no);
+    if (!bh) {
+        return ERR_PTR(-EIO);
+    }
+    lock_buffer(bh);
+    memset(bh->b_data, 0, bh->b_size);
+    *(uint64_t *)bh->b_data = magic;
+    set_buffer_uptodate(bh);
+    unlock_buffer(bh);
+
+    locfs_dirty_buffer(sb, bh, dir);
+    *out_lblock = next;
+    return bh;
+}
+
+/* Index of the entry of node covering hash */
+static uint32_t locfs_dx_search(struct locfs_dx_node *node, uint32_t hash)
+{
+    uint32_t lo = 1;
+    uint32_t hi = node->count;
+    uint32_t mid;
+
+    // The first entry covers everything below the second one
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (node->entries[mid].hash <= hash) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo - 1;
+}
+
+static void locfs_dx_release(struct locfs_dx_frame *frames, int depth)
+{
+    while (depth > 0) {
+        brelse(frames[--depth].bh);
+    }
+}
+
+/*
+ * Walks the hash tree from the root towards the leaf holding hash. Returns
+ * the number of frames filled in, the last one points at the leaf.
+ */
+static int locfs_dx_probe(struct inode *dir,
+                            uint32_t hash,
+                            struct locfs_dx_frame *frames)
+{
+    struct locfs_super_block *locfs_sb = LOCFS_SB(dir->i_sb);
+    struct locfs_dx_frame *frame;
+    uint64_t magic = LOCFS_DX_ROOT_MAGIC;
+    uint64_t lblock = 0;
+    uint32_t levels = 0;
+    int depth;
+
+    for (depth = 0; depth <= (int)levels; depth++) {
+        frame = &frames[depth];
+        frame->bh = locfs_dir_bread(dir, lblock, magic);
+        if (IS_ERR(frame->bh)) {
+            locfs_dx_release(frames, depth);
+            return PTR_ERR(frame->bh);
+        }
+        frame->node = (struct locfs_dx_node *)frame->bh->b_data;
+
+        if (depth == 0) {
+            levels = frame->node->levels;
+        }
+        if (unlikely(levels > LOCFS_DX_MAX_LEVELS
+                || frame->node->count == 0
+                || frame->node->count
+                    > LOCFS_DX_ENTRIES_PER_BLOCK_HSB(locfs_sb))) {
+            printk(KERN_ERR "locfs: Bad hash tree block %llu in directory "
+                            "inode %lu\n", lblock, dir->i_ino);
+            locfs_dx_release(frames, depth + 1);
+            return -EIO;
+        }
+
+        frame->at = locfs_dx_search(frame->node, hash);
+        lblock = frame->node->entries[frame->at].block;
+        magic = LOCFS_DX_NODE_MAGIC;
+    }
+
+    return depth;
+}
+
+/* Reads the leaf the last frame points at */
+static struct buffer_head *locfs_dx_leaf(struct inode *dir,
+                                           struct locfs_dx_frame *frame)
+{
+    struct buffer_head *bh;
+    struct locfs_dir_leaf *leaf;
+
+    bh = locfs_dir_bread(dir, frame->node->entries[frame->at].block,
+                         LOCFS_DIR_LEAF_MAGIC);
+    if (IS_ERR(bh)) {
+        return bh;
+    }
+
+    leaf = (struct locfs_dir_leaf *)bh->b_data;
+    if (unlikely(leaf->count
+            > LOCFS_DIR_RECORDS_PER_BLOCK_HSB(LOCFS_SB(dir->i_sb)))) {
+        printk(KERN_ERR "locfs: Bad leaf %u in directory inode %lu\n",
+               frame->node->entries[frame->at].block, dir->i_ino);
+        brelse(bh);
+        return ERR_PTR(-EIO);
+    }
+
+    return bh;
+}
+
+/* Adds an entry for the blocks from hash on right after entry at */
+static void locfs_dx_insert_entry(struct locfs_dx_node *node,
+                                    uint32_t at,
+                                    uint32_t hash,
+                                    uint32_t block)
+{
+    memmove(&node->entries[at + 2], &node->entries[at + 1],
+            (node->count - at - 1) * sizeof(struct locfs_dx_entry));
+    node->entries[at + 1].hash = hash;
+    node->entries[at + 1].block = block;
+    node->count += 1;
+}
+
+/*
+ * Makes room for one more entry in the node right above the leaf. A full
+ * root pushes its entries down into a new interior node, a full interior
+ * node is split in two.
+ */
+static int locfs_dx_grow(struct inode *dir,
+                           struct locfs_dx_frame *frames,
+                           int depth)
+{
+    struct super_block *sb = dir->i_sb;
+    struct locfs_dx_frame *root = &frames[0];
+    struct locfs_dx_frame *frame = &frames[depth - 1];
+    struct locfs_dx_node *node;
+    struct buffer_head *bh;
+    uint32_t lblock, half;
+
+    if (depth > 1 && root->node->count
+            >= LOCFS_DX_ENTRIES_PER_BLOCK_HSB(LOCFS_SB(sb))) {
+        return -ENOSPC;
+    }
+
+    bh = locfs_dir_new_block(dir, LOCFS_DX_NODE_MAGIC, &lblock);
+    if (IS_ERR(bh)) {
+        return PTR_ERR(bh);
+    }
+    node = (struct locfs_dx_node *)bh->b_data;
+
+    if (depth == 1) {
+        node->count = root->node->count;
+        memcpy(node->entries, root->node->entries,
+               node->count * sizeof(struct locfs_dx_entry));
+        root->node->levels = 1;
+        root->node->count = 1;
+        root->node->entries[0].hash = 0;
+        root->node->entries[0].block = lblock;
+    } else {
+        half = frame->node->count / 2;
+        node->count = frame->node->count - half;
+        memcpy(node->entries, &frame->node->entries[half],
+               node->count * sizeof(struct locfs_dx_entry));
+        frame->node->count = half;
+        locfs_dx_insert_entry(root->node, root->at,
+                              node->entries[0].hash, lblock);
+        locfs_dirty_buffer(sb, frame->bh, dir);
+    }
+
+    locfs_dirty_buffer(sb, root->bh, dir);
+    locfs_dirty_buffer(sb, bh, dir);
+    brelse(bh);
+    return 0;
+}
+
+static int locfs_cmp_hash(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Moves the upper half of the hashes in the full leaf bh to a new leaf.
+ * Returns in *out_bh whichever of the two hash now belongs in, the other
+ * one is released.
+ */
+static int locfs_dx_split_leaf(struct inode *dir,
+                                 struct locfs_dx_frame *frame,
+                                 struct buffer_head *bh,
+                                 uint32_t hash,
+                                 struct buffer_head **out_bh)
+{
+    struct super_block *sb = dir->i_sb;
+    struct locfs_dir_leaf *leaf = (struct locfs_dir_leaf *)bh->b_data;
+    struct locfs_dir_leaf *new_leaf;
+    struct buffer_head *new_bh;
+    uint32_t *hashes;
+    uint32_t split, lblock;
+    uint64_t count = leaf->count;
+    uint64_t i, kept;
+
+    hashes = kmalloc_array(count, sizeof(*hashes), GFP_NOFS);
+    if (!hashes) {
+        return -ENOMEM;
+    }
+    for (i = 0; i < count; i++) {
+        hashes[i] = locfs_dir_record_hash(&leaf->records[i]);
+    }
+    sort(hashes, count, sizeof(*hashes), locfs_cmp_hash, NULL);
+
+    // Equal hashes have to stay in one leaf, split at the first hash
+    // from the middle on that differs from the lowest
+    for (i = count / 2; i < count && hashes[i] == hashes[0]; i++)
+        ;
+    split = i < count ? hashes[i] : 0;
+    kfree(hashes);
+    if (i == count) {
+        return -ENOSPC;
+    }
+
+    new_bh = locfs_dir_new_block(dir, LOCFS_DIR_LEAF_MAGIC, &lblock);
+    if (IS_ERR(new_bh)) {
+        return PTR_ERR(new_bh);
+    }
+    new_leaf = (struct locfs_dir_leaf *)new_bh->b_data;
+
+    kept = 0;
+    for (i = 0; i < count; i++) {
+        if (locfs_dir_record_hash(&leaf->records[i]) >= split) {
+            new_leaf->records[new_leaf->count++] = leaf->records[i];
+        } else {
+            leaf->records[kept++] = leaf->records[i];
+        }
+    }
+    leaf->count = kept;
+
+    locfs_dx_insert_entry(frame->node, frame->at, split, lblock);
+    locfs_dirty_buffer(sb, frame->bh, dir);
+    locfs_dirty_buffer(sb, bh, dir);
+    locfs_dirty_buffer(sb, new_bh, dir);
+
+    if (hash >= split) {
+        brelse(bh);
+        *out_bh = new_bh;
+    } else {
+        brelse(new_bh);
+        *out_bh = bh;
+    }
+    return 0;
+}
+
+/*
+ * Gives a new directory its first block, the root of its hash tree, with
+ * every hash going to one empty leaf.
+ */
+int locfs_dir_init(struct inode *dir)
+{
+    struct super_block *sb = dir->i_sb;
+    struct buffer_head *bh, *leaf_bh;
+    struct locfs_dx_node *root;
+    uint32_t root_lblock, lblock;
+
+    // The root goes in block 0, the leaf right after it
+    bh = locfs_dir_new_block(dir, LOCFS_DX_ROOT_MAGIC, &root_lblock);
+    if (IS_ERR(bh)) {
+        return PTR_ERR(bh);
+    }
+
+    leaf_bh = locfs_dir_new_block(dir, LOCFS_DIR_LEAF_MAGIC, &lblock);
+    if (IS_ERR(leaf_bh)) {
+        brelse(bh);
+        return PTR_ERR(leaf_bh);
+    }
+    brelse(leaf_bh);
+
+    lock_buffer(bh);
+    root = (struct locfs_dx_node *)bh->b_data;
+    root->levels = 0;
+    root->count = 1;
+    root->entries[0].hash = 0;
+    root->entries[0].block = lblock;
+    unlock_buffer(bh);
+
+    locfs_dirty_buffer(sb, bh, dir);
+    brelse(bh);
+    return 0;
+}
+
+/* Finds the inode number of the child called name */
+int locfs_dir_find(struct inode *dir,
+                     const char *name,
+                     size_t len,
+                     uint64_t *out_inode_no)
+{
+    struct locfs_dx_frame frames[LOCFS_DX_MAX_LEVELS + 1];
+    struct buffer_head *bh;
+    struct locfs_dir_leaf *leaf;
+    uint64_t i;
+    int depth;
+    int ret = -ENOENT;
+
+    depth = locfs_dx_probe(dir, locfs_name_hash(name, len), frames);
+    if (depth < 0) {
+        return depth;
+    }
+
+    bh = locfs_dx_leaf(dir, &frames[depth - 1]);
+    locfs_dx_release(frames, depth);
+    if (IS_ERR(bh)) {
+        return PTR_ERR(bh);
+    }
+
+    leaf = (struct locfs_dir_leaf *)bh->b_data;
+    for (i = 0; i < leaf->count; i++) {
+        if (locfs_dir_match(&leaf->records[i], name, len)) {
+            *out_inode_no = leaf->records[i].inode_no;
+            ret = 0;
+            break;
+        }
+    }
+
+    brelse(bh);
+    return ret;
+}
+
+/*
+ * Adds a record for the child inode_no called name, splitting its leaf
+ * when it is full. Must be called inside a journal handle.
+ */
+int locfs_dir_insert(struct inode *dir,
+                       const char *name,
+                       size_t len,
+                       uint64_t inode_no)
+{
+    struct super_block *sb = dir->i_sb;
+    struct locfs_dx_frame frames[LOCFS_DX_MAX_LEVELS + 1];
+    struct locfs_dx_frame *frame;
+    struct buffer_head *bh;
+    struct locfs_dir_leaf *leaf;
+    struct locfs_dir_record *record;
+    uint32_t hash = locfs_name_hash(name, len);
+    int depth;
+    int ret;
+
+    if (len >= LOCFS_FILENAME_MAXLEN) {
+        return -ENAMETOOLONG;
+    }
+
+again:
+    depth = locfs_dx_probe(dir, hash, frames);
+    if (depth < 0) {
+        return depth;
+    }
+    frame = &frames[depth - 1];
+
+    bh = locfs_dx_leaf(dir, frame);
+    if (IS_ERR(bh)) {
+        ret = PTR_ERR(bh);
+        goto out;
+    }
+    leaf = (struct locfs_dir_leaf *)bh->b_data;
+
+    if (leaf->count >= LOCFS_DIR_RECORDS_PER_BLOCK_HSB(LOCFS_SB(sb))) {
+        // The split adds an entry above the leaf, make room for it first
+        if (frame->node->count >= LOCFS_DX_ENTRIES_PER_BLOCK_HSB(LOCFS_SB(sb))) {
+            brelse(bh);
+            ret = locfs_dx_grow(dir, frames, depth);
+            locfs_dx_release(frames, depth);
+            if (ret) {
+                return ret;
+            }
+            goto again;
+        }
+
+        ret = locfs_dx_split_leaf(dir, frame, bh, hash, &bh);
+        if (ret) {
+            brelse(bh);
+            goto out;
+        }
+        leaf = (struct locfs_dir_leaf *)bh->b_data;
+    }
+
+    record = &leaf->records[leaf->count++];
+    memset(record, 0, sizeof(*record));
+    memcpy(record->filename, name, len);
+    record->inode_no = inode_no;
+
+    locfs_dirty_buffer(sb, bh, dir);
+    brelse(bh);
+    ret = 0;
+
+out:
+    locfs_dx_release(frames, depth);
+    return ret;
+}
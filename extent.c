@@ -0,0 +1,357 @@
+/*
+ * Location Based Filesystem
+ *
+ * By, Robert Chrystie
+ */
+
+#include <linux/buffer_head.h>
+#include <linux/kernel.h>
+#include "internal.h"
+
+/* Returns the i-th extent of the inode, either inline or in the overflow block */
+static inline struct locfs_extent *locfs_extent_slot(struct locfs_inode *locfs_inode,
+                                                       struct buffer_head *ext_bh,
+                                                       uint32_t i)
+{
+    struct locfs_extent_block *ext_block;
+
+    if (i < LOCFS_INODE_EXTENTS) {
+        return &locfs_inode->extents[i];
+    }
+
+    ext_block = (struct locfs_extent_block *)ext_bh->b_data;
+    return &ext_block->extents[i - LOCFS_INODE_EXTENTS];
+}
+
+/* Reads the overflow extent block, NULL when the inode has none */
+static struct buffer_head *locfs_read_extent_block(struct super_block *sb,
+                                                     struct locfs_inode *locfs_inode)
+{
+    struct buffer_head *bh;
+    struct locfs_extent_block *ext_block;
+
+    // Block 0 holds the super_block, so it doubles as "no overflow block"
+    if (locfs_inode->extent_block_no == 0) {
+        return NULL;
+    }
+
+    bh = sb_bread(sb, locfs_inode->extent_block_no);
+    if (!bh) {
+        return ERR_PTR(-EIO);
+    }
+
+    ext_block = (struct locfs_extent_block *)bh->b_data;
+    if (unlikely(ext_block->magic != LOCFS_EXTENT_MAGIC)) {
+        printk(KERN_ERR "locfs: Bad extent block %llu for inode %llu\n",
+               locfs_inode->extent_block_no, locfs_inode->inode_no);
+        brelse(bh);
+        return ERR_PTR(-EIO);
+    }
+
+    return bh;
+}
+
+/* Index of the last extent starting at or before iblock, -1 if none */
+static int locfs_extent_search(struct locfs_inode *locfs_inode,
+                                 struct buffer_head *ext_bh,
+                                 uint64_t iblock)
+{
+    int lo = 0;
+    int hi = (int)locfs_inode->extent_count - 1;
+    int found = -1;
+    int mid;
+
+    while (lo <= hi) {
+        mid = lo + (hi - lo) / 2;
+        if (locfs_extent_slot(locfs_inode, ext_bh, mid)->ee_block <= iblock) {
+            found = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    return found;
+}
+
+/*
+ * Maps the logical block iblock of the inode to a physical block.
+ *
+ * On success *out_len is the number of blocks starting at iblock which are
+ * physically contiguous. For a hole *out_pblock is 0 and *out_len is the
+ * number of blocks until the next mapped extent.
+ */
+int locfs_extent_map(struct super_block *sb,
+                       struct locfs_inode *locfs_inode,
+                       uint64_t iblock,
+                       uint64_t *out_pblock,
+                       uint64_t *out_len)
+{
+    struct buffer_head *ext_bh;
+    struct locfs_extent *ext;
+    int i;
+
+    ext_bh = NULL;
+    if (locfs_inode->extent_count > LOCFS_INODE_EXTENTS) {
+        ext_bh = locfs_read_extent_block(sb, locfs_inode);
+        if (IS_ERR(ext_bh)) {
+            return PTR_ERR(ext_bh);
+        }
+    }
+
+    i = locfs_extent_search(locfs_inode, ext_bh, iblock);
+    if (i >= 0) {
+        ext = locfs_extent_slot(locfs_inode, ext_bh, i);
+        if (iblock < (uint64_t)ext->ee_block + ext->ee_len) {
+            *out_pblock = ext->ee_start + (iblock - ext->ee_block);
+            *out_len = (uint64_t)ext->ee_block + ext->ee_len - iblock;
+            brelse(ext_bh);
+            return 0;
+        }
+    }
+
+    // iblock falls in a hole, report how far the hole extends
+    *out_pblock = 0;
+    if (i + 1 < (int)locfs_inode->extent_count) {
+        ext = locfs_extent_slot(locfs_inode, ext_bh, i + 1);
+        *out_len = ext->ee_block - iblock;
+    } else {
+        *out_len = (uint64_t)U32_MAX + 1 - iblock;
+    }
+
+    brelse(ext_bh);
+    return 0;
+}
+
+/* Returns the logical block right after the last extent of the inode */
+int locfs_extent_end(struct super_block *sb,
+                       struct locfs_inode *locfs_inode,
+                       uint64_t *out_end)
+{
+    struct buffer_head *ext_bh;
+    struct locfs_extent *ext;
+
+    if (locfs_inode->extent_count == 0) {
+        *out_end = 0;
+        return 0;
+    }
+
+    ext_bh = NULL;
+    if (locfs_inode->extent_count > LOCFS_INODE_EXTENTS) {
+        ext_bh = locfs_read_extent_block(sb, locfs_inode);
+        if (IS_ERR(ext_bh)) {
+            return PTR_ERR(ext_bh);
+        }
+    }
+
+    ext = locfs_extent_slot(locfs_inode, ext_bh, locfs_inode->extent_count - 1);
+    *out_end = (uint64_t)ext->ee_block + ext->ee_len;
+
+    brelse(ext_bh);
+    return 0;
+}
+
+/*
+ * Allocates physical blocks for the hole starting at iblock and records
+ * them in the block map. At most count blocks are allocated, as a single
+ * contiguous run placed right after the preceding extent when possible.
+ */
+int locfs_extent_alloc(struct inode *inode,
+                         uint64_t iblock,
+                         uint64_t count,
+                         uint64_t *out_pblock,
+                         uint64_t *out_len)
+{
+    struct super_block *sb = inode->i_sb;
+    struct locfs_super_block *locfs_sb = LOCFS_SB(sb);
+    struct locfs_inode *locfs_inode = LOCFS_INODE(inode);
+    struct locfs_extent_block *ext_block;
+    struct buffer_head *ext_bh;
+    struct locfs_extent *prev = NULL;
+    struct locfs_extent new_ext;
+    uint64_t ext_block_no = 0;
+    uint64_t goal = 0;
+    uint64_t start, len;
+    uint32_t i;
+    int pos;
+    int ret;
+
+    if (iblock + count > (uint64_t)U32_MAX + 1) {
+        return -EFBIG;
+    }
+
+    ext_bh = locfs_read_extent_block(sb, locfs_inode);
+    if (IS_ERR(ext_bh)) {
+        return PTR_ERR(ext_bh);
+    }
+
+    pos = locfs_extent_search(locfs_inode, ext_bh, iblock);
+    if (pos >= 0) {
+        prev = locfs_extent_slot(locfs_inode, ext_bh, pos);
+        // Aim for the block that keeps the file physically contiguous
+        goal = prev->ee_start + (iblock - prev->ee_block);
+    }
+
+    // Make sure the new extent has somewhere to go before allocating it
+    if (locfs_inode->extent_count
+            >= LOCFS_INODE_EXTENTS + LOCFS_EXTENTS_PER_BLOCK_HSB(locfs_sb)) {
+        brelse(ext_bh);
+        return -EFBIG;
+    }
+
+    if (!ext_bh && locfs_inode->extent_count == LOCFS_INODE_EXTENTS) {
+        // Delayed writes set this block aside, see locfs_reserve_delayed
+        locfs_claim_meta_reservation(inode);
+        ret = locfs_alloc_data_block(sb, &ext_block_no);
+        if (ret) {
+            return ret;
+        }
+
+        ext_bh = sb_getblk(sb, ext_block_no);
+        if (!ext_bh) {
+            locfs_free_data_blocks(sb, ext_block_no, 1);
+            return -EIO;
+        }
+        lock_buffer(ext_bh);
+        memset(ext_bh->b_data, 0, ext_bh->b_size);
+        ext_block = (struct locfs_extent_block *)ext_bh->b_data;
+        ext_block->magic = LOCFS_EXTENT_MAGIC;
+        set_buffer_uptodate(ext_bh);
+        unlock_buffer(ext_bh);
+    }
+
+    ret = locfs_alloc_data_blocks(sb, goal, min_t(uint64_t, count, U32_MAX),
+                                  &start, &len);
+    if (ret) {
+        // A new overflow block is no use without the extent
+        if (ext_block_no) {
+            locfs_free_data_blocks(sb, ext_block_no, 1);
+        }
+        brelse(ext_bh);
+        return ret;
+    }
+    if (ext_block_no) {
+        locfs_inode->extent_block_no = ext_block_no;
+    }
+
+    *out_pblock = start;
+    *out_len = len;
+
+    // Grow the preceding extent when the new run continues it on disk
+    if (prev && (uint64_t)prev->ee_block + prev->ee_len == iblock
+             && prev->ee_start + prev->ee_len == start
+             && (uint64_t)prev->ee_len + len <= U32_MAX) {
+        prev->ee_len += len;
+    } else {
+        new_ext.ee_block = iblock;
+        new_ext.ee_len = len;
+        new_ext.ee_start = start;
+
+        // Keep the map sorted, shift the following extents up by one
+        for (i = locfs_inode->extent_count; i > (uint32_t)(pos + 1); i--) {
+            *locfs_extent_slot(locfs_inode, ext_bh, i)
+                = *locfs_extent_slot(locfs_inode, ext_bh, i - 1);
+        }
+        *locfs_extent_slot(locfs_inode, ext_bh, pos + 1) = new_ext;
+        locfs_inode->extent_count += 1;
+    }
+
+    if (ext_bh) {
+        ext_block = (struct locfs_extent_block *)ext_bh->b_data;
+        ext_block->count = locfs_inode->extent_count - LOCFS_INODE_EXTENTS;
+        locfs_dirty_buffer(sb, ext_bh, inode);
+        brelse(ext_bh);
+    }
+
+    // Log the new mapping together with the bitmap change
+    locfs_save_locfs_inode(inode, 0);
+    mark_inode_dirty(inode);
+    return 0;
+}
+
+/*
+ * Most extents, or pieces of one, a single call of locfs_extent_truncate
+ * frees. A piece is at most one bitmap block worth of blocks, so a call
+ * stays within LOCFS_TRUNCATE_CREDITS.
+ */
+#define LOCFS_TRUNCATE_PIECES 4
+
+/*
+ * Frees the blocks mapped from the logical block from on, last ones first,
+ * and drops them from the block map, along with the overflow block once
+ * the remaining extents fit in the inode. Returns 1 when there is more to
+ * free, the caller then goes on in a new handle. The caller holds
+ * i_map_sem for write and a journal handle.
+ */
+int locfs_extent_truncate(struct inode *inode, uint64_t from)
+{
+    struct super_block *sb = inode->i_sb;
+    struct locfs_inode *locfs_inode = LOCFS_INODE(inode);
+    struct locfs_extent_block *ext_block;
+    struct buffer_head *ext_bh;
+    struct locfs_extent *ext;
+    uint64_t piece = (uint64_t)sb->s_blocksize * 8;
+    uint64_t start, end;
+    uint32_t count;
+    int pieces = 0;
+    bool more = false;
+    int ret = 0;
+
+    ext_bh = locfs_read_extent_block(sb, locfs_inode);
+    if (IS_ERR(ext_bh)) {
+        return PTR_ERR(ext_bh);
+    }
+
+    // Each extent is only changed once its blocks are free, so the map
+    // stays right if freeing fails half way
+    count = locfs_inode->extent_count;
+    while (count > 0 && pieces < LOCFS_TRUNCATE_PIECES) {
+        ext = locfs_extent_slot(locfs_inode, ext_bh, count - 1);
+        end = (uint64_t)ext->ee_block + ext->ee_len;
+        if (end <= from) {
+            break;
+        }
+
+        start = max_t(uint64_t, ext->ee_block, from);
+        if (end - start > piece) {
+            start = end - piece;
+        }
+        ret = locfs_free_data_blocks(sb, ext->ee_start + (start - ext->ee_block),
+                                     end - start);
+        if (ret) {
+            break;
+        }
+        pieces++;
+
+        if (start > ext->ee_block) {
+            ext->ee_len = start - ext->ee_block;
+        } else {
+            memset(ext, 0, sizeof(*ext));
+            count--;
+        }
+    }
+    locfs_inode->extent_count = count;
+
+    if (!ret && count > 0) {
+        ext = locfs_extent_slot(locfs_inode, ext_bh, count - 1);
+        more = (uint64_t)ext->ee_block + ext->ee_len > from;
+    }
+
+    if (ext_bh) {
+        if (count <= LOCFS_INODE_EXTENTS
+                && locfs_free_data_blocks(sb, locfs_inode->extent_block_no,
+                                          1) == 0) {
+            locfs_inode->extent_block_no = 0;
+        } else {
+            ext_block = (struct locfs_extent_block *)ext_bh->b_data;
+            ext_block->count = count > LOCFS_INODE_EXTENTS
+                               ? count - LOCFS_INODE_EXTENTS : 0;
+            locfs_dirty_buffer(sb, ext_bh, inode);
+        }
+        brelse(ext_bh);
+    }
+
+    locfs_save_locfs_inode(inode, 0);
+    mark_inode_dirty(inode);
+    return ret ? ret : more;
+}
@@ -0,0 +1,240 @@
+/*
+ * Location Based Filesystem
+ *
+ * By, Robert Chrystie
+ */
+
+#include <linux/atomic.h>
+#include <linux/fs.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
+#include <linux/timekeeping.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+#include "internal.h"
+
+/*
+ * GPS feed device
+ *
+ * See include/locfs_feed.h for the interface. One feeder at a time can
+ * have the device open. Its ring is published through RCU, so a create
+ * picks the latest fix out of it without taking a lock or waking anyone.
+ */
+
+/* A mapped ring, with the kernel's own copy of its size */
+struct locfs_feed {
+    struct locfs_feed_ring *f_ring;
+    uint32_t f_size;
+    uint32_t f_consumed;        /* head when a fix was last taken */
+};
+
+static struct locfs_feed __rcu *feed;
+/* Serializes mapping and unmapping the ring */
+static DEFINE_MUTEX(feed_lock);
+static atomic_t feed_open = ATOMIC_INIT(0);
+
+/* Checks a fix from userspace and makes it the current one */
+static int locfs_feed_apply(const struct locfs_fix *fix)
+{
+    struct locfs_coords coords;
+
+    if (fix->reserved) {
+        return -EINVAL;
+    }
+
+    // A fix without a position clears the current one
+    if (fix->latitude == LOCFS_COORD_NONE
+            || fix->longitude == LOCFS_COORD_NONE) {
+        if (fix->latitude != fix->longitude) {
+            return -EINVAL;
+        }
+    } else if (fix->latitude < -90 * LOCFS_COORD_SCALE
+            || fix->latitude > 90 * LOCFS_COORD_SCALE
+            || fix->longitude < -180 * LOCFS_COORD_SCALE
+            || fix->longitude > 180 * LOCFS_COORD_SCALE) {
+        return -EINVAL;
+    }
+
+    coords.latitude = fix->latitude;
+    coords.longitude = fix->longitude;
+    coords.altitude = fix->altitude;
+    coords.timestamp = fix->timestamp ? fix->timestamp
+                                      : ktime_get_real_seconds();
+    locfs_set_curr_coords(&coords);
+    return 0;
+}
+
+/*
+ * Makes the latest fix in the ring current, if one was published since
+ * the last call. Never sleeps.
+ */
+void locfs_feed_pull(void)
+{
+    struct locfs_feed *f;
+    struct locfs_fix fix;
+    uint32_t head;
+
+    rcu_read_lock();
+    f = rcu_dereference(feed);
+    if (!f) {
+        goto out;
+    }
+
+    head = smp_load_acquire(&f->f_ring->head);
+    if (head == READ_ONCE(f->f_consumed)) {
+        goto out;
+    }
+
+    memcpy(&fix, &f->f_ring->fixes[(head - 1) % f->f_size], sizeof(fix));
+
+    // The feeder may have lapped the ring and be rewriting the slot that
+    // was just copied, the next call will find a newer fix
+    smp_rmb();
+    if (READ_ONCE(f->f_ring->head) - head >= f->f_size - 1) {
+        goto out;
+    }
+
+    // Fixes that do not check out are dropped
+    WRITE_ONCE(f->f_consumed, head);
+    locfs_feed_apply(&fix);
+
+out:
+    rcu_read_unlock();
+}
+
+static int locfs_feed_open(struct inode *inode, struct file *file)
+{
+    if (atomic_cmpxchg(&feed_open, 0, 1) != 0) {
+        return -EBUSY;
+    }
+
+    return nonseekable_open(inode, file);
+}
+
+static int locfs_feed_release(struct inode *inode, struct file *file)
+{
+    struct locfs_feed *f;
+
+    // Whatever was published last stays current after the feeder is gone
+    locfs_feed_pull();
+
+    // The ring is no longer mapped, that happens before the release
+    mutex_lock(&feed_lock);
+    f = rcu_dereference_protected(feed, lockdep_is_held(&feed_lock));
+    RCU_INIT_POINTER(feed, NULL);
+    mutex_unlock(&feed_lock);
+
+    if (f) {
+        synchronize_rcu();
+        vfree(f->f_ring);
+        kfree(f);
+    }
+
+    atomic_set(&feed_open, 0);
+    return 0;
+}
+
+/* Takes a batch of struct locfs_fix, only the last one is used */
+static ssize_t locfs_feed_write(struct file *file,
+                                  const char __user *buffer,
+                                  size_t count,
+                                  loff_t *f_pos)
+{
+    struct locfs_fix fix;
+    int ret;
+
+    if (count == 0 || count % sizeof(fix)) {
+        return -EINVAL;
+    }
+
+    if (copy_from_user(&fix, buffer + count - sizeof(fix), sizeof(fix))) {
+        return -EFAULT;
+    }
+
+    ret = locfs_feed_apply(&fix);
+    return ret ? ret : count;
+}
+
+/* Sets up the ring, once per open of the device */
+static int locfs_feed_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    unsigned long len = vma->vm_end - vma->vm_start;
+    struct locfs_feed_ring *ring = NULL;
+    struct locfs_feed *f = NULL;
+    int ret;
+
+    // Two slots at least, so the one being read is not also being written
+    if (vma->vm_pgoff != 0 || len > LOCFS_FEED_RING_MAX
+            || len < sizeof(*ring) + 2 * sizeof(struct locfs_fix)) {
+        return -EINVAL;
+    }
+
+    mutex_lock(&feed_lock);
+    if (rcu_access_pointer(feed)) {
+        ret = -EBUSY;
+        goto fail;
+    }
+
+    f = kzalloc(sizeof(*f), GFP_KERNEL);
+    ring = vmalloc_user(len);
+    if (!f || !ring) {
+        ret = -ENOMEM;
+        goto fail;
+    }
+    f->f_ring = ring;
+    f->f_size = (len - sizeof(*ring)) / sizeof(struct locfs_fix);
+    ring->size = f->f_size;
+
+    ret = remap_vmalloc_range(vma, ring, 0);
+    if (ret) {
+        goto fail;
+    }
+
+    rcu_assign_pointer(feed, f);
+    mutex_unlock(&feed_lock);
+    return 0;
+
+fail:
+    mutex_unlock(&feed_lock);
+    vfree(ring);
+    kfree(f);
+    return ret;
+}
+
+static const struct file_operations locfs_feed_fops = {
+    .owner   = THIS_MODULE,
+    .open    = locfs_feed_open,
+    .release = locfs_feed_release,
+    .write   = locfs_feed_write,
+    .mmap    = locfs_feed_mmap,
+    .llseek  = no_llseek,
+};
+
+static struct miscdevice locfs_feed_dev = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name  = "locfs_feed",
+    .fops  = &locfs_feed_fops,
+    .mode  = 0600,
+};
+
+static bool feed_registered;
+
+int locfs_feed_register(void)
+{
+    int ret;
+
+    ret = misc_register(&locfs_feed_dev);
+    feed_registered = ret == 0;
+    return ret;
+}
+
+void locfs_feed_unregister(void)
+{
+    if (feed_registered) {
+        misc_deregister(&locfs_feed_dev);
+        feed_registered = false;
+    }
+}
@@ -4,111 +4,786 @@
  * By, Robert Chrystie
  */
 
+#include <linux/blkdev.h>
 #include <linux/buffer_head.h>
+#include <linux/falloc.h>
+#include <linux/mpage.h>
+#include <linux/pagevec.h>
+#include <linux/uio.h>
 #include "internal.h"
+#include "trace.h"
 
-ssize_t locfs_read(struct file *filp, 
-                     char __user *buf, 
-                     size_t len,
-                     loff_t *ppos) 
-{
-    struct super_block *sb;
-    struct inode *inode;
-    struct locfs_inode *locfs_inode;
-    struct buffer_head *bh;
-    char *buffer;
-    int nbytes;
-
-    // Get the inode from the dentry cache
-    inode = filp->f_path.dentry->d_inode;
-    sb = inode->i_sb;
-    locfs_inode = LOCFS_INODE(inode);
-    
-    if (*ppos >= locfs_inode->file_size) {
+/* Block number of delayed buffers, past the end of any image */
+#define LOCFS_DELAY_BLOCK     (~(sector_t)0xffff)
+
+/* Most blocks one delayed run allocates in one go */
+#define LOCFS_DELAY_MAX_RUN   2048
+
+/*
+ * Maps the logical block iblock of the inode for the page cache.
+ *
+ * bh_result->b_size holds how many bytes the caller would like mapped, so
+ * a whole contiguous extent can be handed back in one go and mpage can
+ * build a single large bio out of it. When it is BH_Delay the request is
+ * for that many delayed blocks, whose reservations are settled here for
+ * all the blocks mapped.
+ */
+int locfs_get_block(struct inode *inode,
+                      sector_t iblock,
+                      struct buffer_head *bh_result,
+                      int create)
+{
+    struct super_block *sb = inode->i_sb;
+    struct locfs_inode_info *info = LOCFS_I(inode);
+    uint64_t max_blocks = bh_result->b_size >> inode->i_blkbits;
+    bool delay = buffer_delay(bh_result);
+    bool allocated = false;
+    uint64_t pblock, run, want;
+    int ret;
+
+    down_read(&info->i_map_sem);
+    ret = locfs_extent_map(sb, &info->i_disk, iblock, &pblock, &run);
+    up_read(&info->i_map_sem);
+    if (ret) {
+        return ret;
+    }
+
+    if (pblock == 0 && create) {
+        // The handle is taken before i_map_sem, as in locfs_write_inode
+        ret = locfs_journal_start(sb, LOCFS_ALLOC_CREDITS);
+        if (ret) {
+            return ret;
+        }
+        down_write(&info->i_map_sem);
+
+        // Someone may have filled the hole while the lock was dropped
+        ret = locfs_extent_map(sb, &info->i_disk, iblock, &pblock, &run);
+        if (!ret && pblock == 0) {
+            want = min(run, max_blocks);
+
+            // Delayed buffers hand their reservations to the allocation,
+            // whatever it could not cover stays reserved
+            if (delay) {
+                locfs_release_data_blocks(sb, want);
+            }
+            ret = locfs_extent_alloc(inode, iblock, want, &pblock, &run);
+            if (delay) {
+                locfs_reserve_data_blocks(sb, ret ? want : want - run, true);
+                if (!ret) {
+                    locfs_delayed_allocated(inode, run);
+                }
+            }
+            if (!ret) {
+                set_buffer_new(bh_result);
+                allocated = true;
+            }
+        }
+
+        up_write(&info->i_map_sem);
+        locfs_journal_stop(sb);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    if (pblock != 0) {
+        run = min(run, max_blocks);
+
+        // Blocks someone else allocated leave the reservations unused
+        if (delay) {
+            if (!allocated) {
+                locfs_release_delayed(inode, run);
+            }
+            clear_buffer_delay(bh_result);
+        }
+        map_bh(bh_result, sb, pblock);
+        bh_result->b_size = run << inode->i_blkbits;
+    }
+
+    return 0;
+}
+
+/*
+ * Reserves a block for a buffer of a hole and leaves it unmapped with
+ * BH_Delay, given the device and a block number no data block has.
+ * Returns -ENOSPC when nothing is left to reserve.
+ */
+int locfs_delay_buffer(struct inode *inode, struct buffer_head *bh)
+{
+    int ret;
+
+    ret = locfs_reserve_delayed(inode);
+    if (ret) {
+        return ret;
+    }
+
+    bh->b_bdev = inode->i_sb->s_bdev;
+    bh->b_blocknr = LOCFS_DELAY_BLOCK;
+    set_buffer_delay(bh);
+    return 0;
+}
+
+/*
+ * get_block for write_begin. A hole gets no block yet, only a reservation,
+ * and the buffer is left unmapped with BH_Delay so that writeback asks
+ * locfs_get_block for the block. It is given the device and a block
+ * number no data block has, so that block_write_begin can treat it as new.
+ */
+static int locfs_get_block_delay(struct inode *inode,
+                                   sector_t iblock,
+                                   struct buffer_head *bh_result,
+                                   int create)
+{
+    struct super_block *sb = inode->i_sb;
+    struct locfs_inode_info *info = LOCFS_I(inode);
+    uint64_t pblock, run;
+    int ret;
+
+    down_read(&info->i_map_sem);
+    ret = locfs_extent_map(sb, &info->i_disk, iblock, &pblock, &run);
+    up_read(&info->i_map_sem);
+    if (ret) {
+        return ret;
+    }
+
+    if (pblock != 0) {
+        map_bh(bh_result, sb, pblock);
+        return 0;
+    }
+
+    if (!buffer_delay(bh_result)) {
+        ret = locfs_delay_buffer(inode, bh_result);
+        if (ret) {
+            return ret;
+        }
+        set_buffer_new(bh_result);
+    }
+
+    return 0;
+}
+
+/*
+ * Counts the delayed buffers of a page from the first-th on, *whole says
+ * whether they run to the end of the page
+ */
+static unsigned int locfs_page_delayed(struct page *page,
+                                         unsigned int first,
+                                         bool *whole)
+{
+    struct buffer_head *bh, *head;
+    unsigned int i = 0, n = 0;
+
+    *whole = false;
+    if (!page_has_buffers(page)) {
         return 0;
     }
 
-    // Read the inode
-    bh = sb_bread(sb, locfs_inode->data_block_no);
-    if (!bh) {
-        printk(KERN_ERR "Failed to read data block %llu\n",
-               locfs_inode->data_block_no);
+    bh = head = page_buffers(page);
+    do {
+        if (i++ < first) {
+            continue;
+        }
+        if (!buffer_delay(bh) || buffer_mapped(bh)) {
+            return n;
+        }
+        n++;
+    } while ((bh = bh->b_this_page) != head);
+
+    *whole = true;
+    return n;
+}
+
+/*
+ * Counts the delayed blocks from the first-th buffer of the locked page
+ * on, into the following pages while they are delayed throughout, up to
+ * max. Pages someone else holds locked end the count.
+ */
+static uint64_t locfs_delay_count(struct page *page,
+                                    unsigned int first,
+                                    uint64_t max)
+{
+    struct page *next;
+    pgoff_t index = page->index + 1;
+    uint64_t count;
+    bool whole;
+
+    count = locfs_page_delayed(page, first, &whole);
+    while (whole && count < max) {
+        next = find_get_page(page->mapping, index++);
+        if (!next) {
+            break;
+        }
+        if (!trylock_page(next)) {
+            put_page(next);
+            break;
+        }
+        count += locfs_page_delayed(next, 0, &whole);
+        unlock_page(next);
+        put_page(next);
+    }
+
+    return min(count, max);
+}
+
+/*
+ * Picks the blocks for the delayed buffers of a dirty page, allocating a
+ * run for as many delayed blocks as follow so that a file written in one
+ * go is laid out in one extent. run carries the last allocated run over
+ * to the following pages.
+ */
+static int locfs_map_delayed_page(struct inode *inode,
+                                    struct page *page,
+                                    struct buffer_head *run)
+{
+    struct super_block *sb = inode->i_sb;
+    unsigned int bits = inode->i_blkbits;
+    struct buffer_head *bh, *head;
+    uint64_t iblock, run_start, run_len, last;
+    unsigned int i = 0;
+    int ret = 0;
+
+    lock_page(page);
+    if (page->mapping != inode->i_mapping || !PageDirty(page)
+            || !page_has_buffers(page)) {
+        goto out;
+    }
+
+    // Blocks past the end of the file are never written, nor kept reserved
+    last = (i_size_read(inode) + sb->s_blocksize - 1) >> bits;
+    iblock = (uint64_t)page->index << (PAGE_SHIFT - bits);
+    bh = head = page_buffers(page);
+    do {
+        if (!buffer_delay(bh) || buffer_mapped(bh)) {
+            continue;
+        }
+        if (iblock >= last) {
+            clear_buffer_delay(bh);
+            locfs_release_delayed(inode, 1);
+            continue;
+        }
+
+        run_start = run->b_page ? (uint64_t)run->b_private : 0;
+        run_len = run->b_page ? run->b_size >> bits : 0;
+        if (iblock < run_start || iblock >= run_start + run_len) {
+            run->b_state = 1UL << BH_Delay;
+            run->b_size = min_t(uint64_t,
+                                locfs_delay_count(page, i, last - iblock),
+                                LOCFS_DELAY_MAX_RUN) << bits;
+            ret = locfs_get_block(inode, iblock, run, 1);
+            if (ret) {
+                break;
+            }
+            if (!buffer_mapped(run)) {
+                ret = -EIO;
+                break;
+            }
+            run->b_page = page;
+            run->b_private = (void *)(unsigned long)iblock;
+            run_start = iblock;
+        }
+
+        map_bh(bh, sb, run->b_blocknr + (iblock - run_start));
+        clear_buffer_delay(bh);
+        clear_buffer_new(bh);
+    } while (iblock++, i++, (bh = bh->b_this_page) != head);
+
+out:
+    unlock_page(page);
+    return ret;
+}
+
+/*
+ * Maps the delayed buffers of the dirty pages writeback is about to write,
+ * so that mpage can put them into large bios. Buffers dirtied after this
+ * stay delayed, mpage hands their pages to locfs_writepage, which maps
+ * them one at a time.
+ */
+static void locfs_map_delayed(struct address_space *mapping,
+                                struct writeback_control *wbc)
+{
+    struct inode *inode = mapping->host;
+    struct buffer_head run = { .b_page = NULL };
+    struct pagevec pvec;
+    pgoff_t index, end;
+    long left = wbc->nr_to_write;
+    unsigned int i, nr;
+
+    if (wbc->range_cyclic) {
+        index = mapping->writeback_index;
+        end = -1;
+    } else {
+        index = wbc->range_start >> PAGE_SHIFT;
+        end = wbc->range_end >> PAGE_SHIFT;
+    }
+
+    pagevec_init(&pvec, 0);
+    while (left > 0 && index <= end) {
+        nr = pagevec_lookup_tag(&pvec, mapping, &index, PAGECACHE_TAG_DIRTY,
+                                min(end - index, (pgoff_t)PAGEVEC_SIZE - 1)
+                                + 1);
+        if (nr == 0) {
+            break;
+        }
+
+        for (i = 0; i < nr && left > 0; i++, left--) {
+            if (pvec.pages[i]->index > end
+                    || locfs_map_delayed_page(inode, pvec.pages[i], &run)) {
+                left = 0;
+                break;
+            }
+        }
+
+        pagevec_release(&pvec);
+        cond_resched();
+    }
+}
+
+/*
+ * Gives back the reservations of the delayed buffers of a locked page
+ * which lie within [offset, offset + length), as they will not be written
+ */
+static void locfs_release_delayed_buffers(struct page *page,
+                                            unsigned int offset,
+                                            unsigned int length)
+{
+    struct inode *inode = page->mapping->host;
+    struct buffer_head *bh, *head;
+    unsigned int start = 0;
+
+    if (!page_has_buffers(page)) {
+        return;
+    }
+
+    bh = head = page_buffers(page);
+    do {
+        if (buffer_delay(bh) && !buffer_mapped(bh) && start >= offset
+                && start + bh->b_size <= offset + length) {
+            clear_buffer_delay(bh);
+            locfs_release_delayed(inode, 1);
+        }
+        start += bh->b_size;
+    } while ((bh = bh->b_this_page) != head);
+}
+
+static int locfs_readpage(struct file *file, struct page *page)
+{
+    struct inode *inode = page->mapping->host;
+
+    if (locfs_has_inline_data(inode)) {
+        return locfs_inline_readpage(inode, page);
+    }
+
+    return mpage_readpage(page, locfs_get_block);
+}
+
+/* Called for readahead, reads the whole window with as few bios as possible */
+static int locfs_readpages(struct file *file,
+                             struct address_space *mapping,
+                             struct list_head *pages,
+                             unsigned nr_pages)
+{
+    // Inline files have a single page, left to locfs_readpage
+    if (locfs_has_inline_data(mapping->host)) {
         return 0;
     }
 
-    // Put the inode data read into a buffer
-    buffer = (char *)bh->b_data + *ppos;
-    nbytes = min((size_t)(locfs_inode->file_size - *ppos), len);
+    return mpage_readpages(mapping, pages, nr_pages, locfs_get_block);
+}
+
+static int locfs_writepage(struct page *page, struct writeback_control *wbc)
+{
+    struct inode *inode = page->mapping->host;
+    loff_t size = i_size_read(inode);
+    unsigned int offset;
+
+    if (locfs_has_inline_data(inode)) {
+        return locfs_inline_writepage(page, wbc);
+    }
+
+    // Delayed buffers past the end of the file are dropped, not written
+    if (page->index >= size >> PAGE_SHIFT) {
+        offset = 0;
+        if (page->index == size >> PAGE_SHIFT) {
+            offset = round_up(size & ~PAGE_MASK, 1 << inode->i_blkbits);
+        }
+        locfs_release_delayed_buffers(page, offset, PAGE_SIZE - offset);
+    }
+
+    return block_write_full_page(page, locfs_get_block, wbc);
+}
+
+static int locfs_writepages(struct address_space *mapping,
+                              struct writeback_control *wbc)
+{
+    if (locfs_has_inline_data(mapping->host)) {
+        return generic_writepages(mapping, wbc);
+    }
+
+    locfs_map_delayed(mapping, wbc);
+    return mpage_writepages(mapping, wbc, locfs_get_block);
+}
+
+static int locfs_write_begin(struct file *file,
+                               struct address_space *mapping,
+                               loff_t pos,
+                               unsigned len,
+                               unsigned flags,
+                               struct page **pagep,
+                               void **fsdata)
+{
+    struct inode *inode = mapping->host;
+    int ret;
+
+    // Writes are serialized by the inode lock, so whether the file is
+    // inline cannot change until write_end
+    if (locfs_has_inline_data(inode)) {
+        if (pos + len <= LOCFS_INLINE_DATA_MAX(inode->i_sb)) {
+            return locfs_inline_write_begin(mapping, pos, flags, pagep);
+        }
+
+        ret = locfs_inline_convert(inode);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    // Blocks are picked at writeback, see locfs_get_block_delay
+    return block_write_begin(mapping, pos, len, flags, pagep,
+                             locfs_get_block_delay);
+}
+
+static int locfs_write_end(struct file *file,
+                             struct address_space *mapping,
+                             loff_t pos,
+                             unsigned len,
+                             unsigned copied,
+                             struct page *page,
+                             void *fsdata)
+{
+    if (locfs_has_inline_data(mapping->host)) {
+        return locfs_inline_write_end(mapping, pos, copied, page);
+    }
+
+    return generic_write_end(file, mapping, pos, len, copied, page, fsdata);
+}
+
+/*
+ * O_DIRECT reads and writes, straight between the user's buffers and the
+ * blocks locfs_get_block maps, holes being filled as they are written.
+ * Called with the inode locked for writes, and after the page cache over
+ * the range has been written back, so no delayed buffer is left in it.
+ *
+ * An inline file has no blocks, reads of it and writes that still fit in
+ * the inode return 0 and are done through the page cache instead. A
+ * larger write moves its data to a block first.
+ */
+static ssize_t locfs_direct_IO(struct kiocb *iocb, struct iov_iter *iter)
+{
+    struct address_space *mapping = iocb->ki_filp->f_mapping;
+    struct inode *inode = mapping->host;
+    loff_t end = iocb->ki_pos + iov_iter_count(iter);
+    int ret;
+
+    if (locfs_has_inline_data(inode)) {
+        if (iov_iter_rw(iter) == READ
+                || end <= LOCFS_INLINE_DATA_MAX(inode->i_sb)) {
+            return 0;
+        }
 
-    // Pass the buffer to user space
-    if (copy_to_user(buf, buffer, nbytes)) {
-        brelse(bh);
-        printk(KERN_ERR
-               "Error while copying file content to userspace buffer\n");
-        return -EFAULT;
+        ret = locfs_inline_convert(inode);
+        if (!ret) {
+            ret = filemap_write_and_wait_range(mapping, 0, PAGE_SIZE - 1);
+        }
+        if (ret) {
+            return ret;
+        }
     }
 
-    brelse(bh);
+    // Without DIO_SKIP_HOLES, which blockdev_direct_IO sets, writes into
+    // holes below the size get their blocks here too instead of falling
+    // back to the page cache
+    return __blockdev_direct_IO(iocb, inode, inode->i_sb->s_bdev, iter,
+                                locfs_get_block, NULL, NULL, DIO_LOCKING);
+}
 
-    // Move the file pointer for what was read
-    *ppos += nbytes;
-    return nbytes;
+/* Gives back the reservations of delayed buffers that will not be written */
+static void locfs_invalidatepage(struct page *page,
+                                   unsigned int offset,
+                                   unsigned int length)
+{
+    locfs_release_delayed_buffers(page, offset, length);
+    block_invalidatepage(page, offset, length);
 }
 
-ssize_t locfs_write(struct file *filp, 
-                      const char __user *buf, 
-                      size_t len,
-                      loff_t *ppos) 
+/*
+ * Frees the buffers of a clean page. Delayed buffers left on it lie past
+ * the end of the file and give back their reservations.
+ */
+static int locfs_releasepage(struct page *page, gfp_t gfp)
 {
-    struct super_block *sb;
-    struct inode *inode;
-    struct locfs_inode *locfs_inode;
-    struct buffer_head *bh;
-    struct locfs_super_block *locfs_sb;
-    char *buffer;
+    struct buffer_head *bh, *head;
+
+    bh = head = page_buffers(page);
+    do {
+        if (buffer_dirty(bh) || buffer_locked(bh)) {
+            return 0;
+        }
+    } while ((bh = bh->b_this_page) != head);
 
-    // Get inode from dentry cache
-    inode = filp->f_path.dentry->d_inode;
-    sb = inode->i_sb;
-    locfs_inode = LOCFS_INODE(inode);
-    locfs_sb = LOCFS_SB(sb);
+    locfs_release_delayed_buffers(page, 0, PAGE_SIZE);
+    return try_to_free_buffers(page);
+}
 
-    bh = sb_bread(sb, locfs_inode->data_block_no);
-    if (!bh) {
-        printk(KERN_ERR "Failed to read data block %llu\n",
-               locfs_inode->data_block_no);
+static sector_t locfs_bmap(struct address_space *mapping, sector_t block)
+{
+    // Inline data has no block to point at
+    if (locfs_has_inline_data(mapping->host)) {
         return 0;
     }
 
-    buffer = (char *)bh->b_data + *ppos;
-    if (copy_from_user(buffer, buf, len)) {
-        brelse(bh);
-        printk(KERN_ERR
-               "Error while copying file content from userspace buffer "
-               "to kernel space\n");
-        return -EFAULT;
+    return generic_block_bmap(mapping, block, locfs_get_block);
+}
+
+/* address_space_operations, used by the page cache for regular files */
+const struct address_space_operations locfs_aops = {
+    .readpage    = locfs_readpage,
+    .readpages   = locfs_readpages,
+    .writepage   = locfs_writepage,
+    .writepages  = locfs_writepages,
+    .write_begin = locfs_write_begin,
+    .write_end   = locfs_write_end,
+    .invalidatepage = locfs_invalidatepage,
+    .releasepage = locfs_releasepage,
+    .direct_IO   = locfs_direct_IO,
+    .bmap        = locfs_bmap,
+};
+
+/* Preallocates contiguous blocks for the byte range, as fallocate(2) */
+static long locfs_fallocate(struct file *filp,
+                              int mode,
+                              loff_t offset,
+                              loff_t len)
+{
+    struct inode *inode = file_inode(filp);
+    struct super_block *sb = inode->i_sb;
+    struct locfs_inode_info *info = LOCFS_I(inode);
+    struct locfs_inode *locfs_inode = &info->i_disk;
+    uint64_t iblock, last, pblock, run, got;
+    loff_t end;
+    int ret = 0;
+
+    if (mode & ~FALLOC_FL_KEEP_SIZE) {
+        return -EOPNOTSUPP;
+    }
+
+    end = offset + len;
+    if (end > sb->s_maxbytes || end < offset) {
+        return -EFBIG;
+    }
+
+    inode_lock(inode);
+
+    // Preallocated blocks are no use to a file kept in its inode
+    if (locfs_has_inline_data(inode)) {
+        ret = locfs_inline_convert(inode);
+        if (ret) {
+            inode_unlock(inode);
+            return ret;
+        }
+    }
+
+    iblock = offset >> sb->s_blocksize_bits;
+    last = (end + sb->s_blocksize - 1) >> sb->s_blocksize_bits;
+
+    while (iblock < last) {
+        // One transaction per allocated run keeps each handle small
+        ret = locfs_journal_start(sb, LOCFS_ALLOC_CREDITS);
+        if (ret) {
+            break;
+        }
+        down_write(&info->i_map_sem);
+
+        got = 0;
+        ret = locfs_extent_map(sb, locfs_inode, iblock, &pblock, &run);
+        if (!ret) {
+            run = min_t(uint64_t, run, last - iblock);
+            if (pblock == 0) {
+                ret = locfs_extent_alloc(inode, iblock, run, &pblock, &got);
+                run = got;
+            }
+        }
+
+        up_write(&info->i_map_sem);
+        locfs_journal_stop(sb);
+        if (ret) {
+            break;
+        }
+
+        // Preallocated blocks must read back as zeroes
+        if (got) {
+            ret = sb_issue_zeroout(sb, pblock, got, GFP_NOFS);
+            if (ret) {
+                break;
+            }
+        }
+
+        iblock += run;
+    }
+
+    if (!ret && !(mode & FALLOC_FL_KEEP_SIZE) && end > i_size_read(inode)) {
+        i_size_write(inode, end);
+        mark_inode_dirty(inode);
+    }
+
+    inode_unlock(inode);
+    return ret;
+}
+
+/*
+ * Writes the file's dirty pages, then makes its metadata durable. With a
+ * journal that means committing the running transaction, which carries the
+ * metadata of every operation since the last commit. Without one the
+ * bitmaps and inode table blocks the file's blocks and inode were taken
+ * from are not tied to the inode, so all dirty metadata of the block
+ * device is written out along with it.
+ */
+int locfs_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+{
+    struct inode *inode = file->f_mapping->host;
+    struct super_block *sb = inode->i_sb;
+    int ret;
+
+    if (!LOCFS_SBI(sb)->s_journal) {
+        ret = __generic_file_fsync(file, start, end, datasync);
+        if (!ret) {
+            ret = sync_blockdev(sb->s_bdev);
+        }
+        if (!ret) {
+            ret = blkdev_issue_flush(sb->s_bdev, GFP_KERNEL, NULL);
+        }
+        return ret;
+    }
+
+    ret = filemap_write_and_wait_range(inode->i_mapping, start, end);
+    if (ret) {
+        return ret;
+    }
+
+    ret = sync_inode_metadata(inode, 1);
+    if (ret) {
+        return ret;
+    }
+
+    return locfs_journal_force_commit(sb);
+}
+
+static ssize_t locfs_file_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct inode *inode = file_inode(iocb->ki_filp);
+    loff_t pos = iocb->ki_pos;
+    size_t count = iov_iter_count(to);
+    u64 start;
+    ssize_t ret;
+
+    start = locfs_stats_start();
+    ret = generic_file_read_iter(iocb, to);
+
+    trace_locfs_read(inode, pos, count, ret);
+    locfs_stats_end(inode->i_sb, LOCFS_OP_READ, start);
+    return ret;
+}
+
+static ssize_t locfs_file_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct inode *inode = file_inode(iocb->ki_filp);
+    loff_t pos = iocb->ki_pos;
+    size_t count = iov_iter_count(from);
+    u64 start;
+    ssize_t ret;
+
+    start = locfs_stats_start();
+    ret = generic_file_write_iter(iocb, from);
+
+    trace_locfs_write(inode, pos, count, ret);
+    locfs_stats_end(inode->i_sb, LOCFS_OP_WRITE, start);
+    return ret;
+}
+
+/*
+ * Gets a page of a shared writable mapping ready to be written through it.
+ * Holes get delayed blocks as in write_begin, so writeback is sure to find
+ * room for them. An inline file only has page 0 within its size, which is
+ * stored in the inode as it is.
+ */
+static int locfs_page_mkwrite(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+    struct page *page = vmf->page;
+    struct inode *inode = file_inode(vma->vm_file);
+    int ret;
+
+    sb_start_pagefault(inode->i_sb);
+    file_update_time(vma->vm_file);
+
+    // Page 0 stays locked while a file is moved out of its inode
+    lock_page(page);
+    if (page->mapping != inode->i_mapping) {
+        unlock_page(page);
+        ret = VM_FAULT_NOPAGE;
+        goto out;
+    }
+    if (locfs_has_inline_data(inode)) {
+        set_page_dirty(page);
+        wait_for_stable_page(page);
+        ret = VM_FAULT_LOCKED;
+        goto out;
     }
-    *ppos += len;
+    unlock_page(page);
 
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
-    brelse(bh);
+    ret = block_page_mkwrite(vma, vmf, locfs_get_block_delay);
+    ret = block_page_mkwrite_return(ret);
 
-    // Update the inode and save it back
-    locfs_inode->file_size = max((size_t)(locfs_inode->file_size),
-                                   (size_t)(*ppos));
-    locfs_save_locfs_inode(sb, locfs_inode);
+out:
+    sb_end_pagefault(inode->i_sb);
+    return ret;
+}
+
+static const struct vm_operations_struct locfs_file_vm_ops = {
+    .fault        = filemap_fault,
+    .map_pages    = filemap_map_pages,
+    .page_mkwrite = locfs_page_mkwrite,
+};
 
-    return len;
+static int locfs_file_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    file_accessed(file);
+    vma->vm_ops = &locfs_file_vm_ops;
+    return 0;
 }
 
 /* file_operations */
 const struct file_operations locfs_file_operations = {
-    /* locfs_read is called when read() system call is made
-       happens in fs/read_write.c (calls vfs_read) */
-	.read	= locfs_read,
+    .llseek       = generic_file_llseek,
+
+    /* read() and write() go through the page cache, or past it with
+       O_DIRECT, see locfs_aops for how pages are mapped to blocks */
+    .read_iter    = locfs_file_read_iter,
+    .write_iter   = locfs_file_write_iter,
+
+    /* Writes through a shared mapping reserve their blocks in
+       locfs_page_mkwrite, as write() does */
+    .mmap         = locfs_file_mmap,
+
+    /* Lets sendfile() and splice() move pages without a copy */
+    .splice_read  = generic_file_splice_read,
+    .splice_write = iter_file_splice_write,
+
+    /* Dirty pages, buffers and the inode are written back lazily,
+       fsync() forces them out */
+    .fsync        = locfs_fsync,
+
+    /* locfs_fallocate preallocates blocks for fallocate() */
+    .fallocate    = locfs_fallocate,
 
-    /* locfs_write is called when write() system call is made 
-       happens in fs/read_write.c (calls vfs_write) */
-	.write	= locfs_write,
+    .unlocked_ioctl = locfs_ioctl,
+    .compat_ioctl   = locfs_ioctl,
 };
@@ -4,9 +4,31 @@
 #define LOCFS_MAGIC 0x050505
 #define LOCFS_FILENAME_MAXLEN 255
 #define LOCFS_LOCATION_MAXLEN 255
+#define LOCFS_EXTENT_MAGIC 0x0e7e0e7e
+#define LOCFS_INODE_EXTENTS 4
+#define LOCFS_JOURNAL_MAGIC 0x4a434f4c
+#define LOCFS_LOCINDEX_MAGIC 0x10c1d0c5
+#define LOCFS_LOCLIST_MAGIC 0x10c15157
+#define LOCFS_LOCTABLE_MAGIC 0x10c7ab1e
+#define LOCFS_SPATIAL_NODE_MAGIC 0x5a7a0de5
+#define LOCFS_SPATIAL_BUCKET_MAGIC 0x5a7ab0c7
+#define LOCFS_DX_ROOT_MAGIC 0xd1c7a00d
+#define LOCFS_DX_NODE_MAGIC 0xd1c7a0de
+#define LOCFS_DIR_LEAF_MAGIC 0xd1c71eaf
+#define LOCFS_INODE_SIZE 128
 
-static const uint64_t LOCFS_INODE_TABLE_START_BLOCK_NO = 3;
+static const uint64_t LOCFS_INODE_BITMAP_START_BLOCK_NO = 1;
 static const uint64_t LOCFS_ROOTDIR_INODE_NO = 0;
+/* Location IDs start at 1, 0 stands for no location */
+static const uint32_t LOCFS_LOCATION_NONE = 0;
+
+/*
+ * Coordinates are fixed point. Latitude and longitude count units of
+ * 1e-7 degrees, altitude counts millimetres. A latitude or altitude of
+ * LOCFS_COORD_NONE means the value is not known.
+ */
+#define LOCFS_COORD_NONE ((int32_t)0x80000000)
+#define LOCFS_COORD_SCALE 10000000
 
 /* Define filesystem structures */
 struct locfs_dir_record {
@@ -14,17 +36,116 @@ struct locfs_dir_record {
     uint64_t inode_no;
 };
 
+/*
+ * Directories
+ *
+ * Logical block 0 of a directory is the root of a hash tree over the names
+ * of its children, keyed by locfs_name_hash(). An entry of the root covers
+ * the hashes from its own up to the next entry's and points at a leaf, or
+ * at an interior node with the same layout when levels is 1. Leaves hold
+ * unsorted records, every hash lives in exactly one leaf. Block numbers in
+ * the tree are logical blocks of the directory.
+ */
+#define LOCFS_DX_MAX_LEVELS 1
+
+/*
+ * Blocks are added to a directory in runs of a quarter of its size, within
+ * these bounds, so that it takes few extents however large it grows. The
+ * blocks past the highest one its tree points at are mapped but unused.
+ */
+#define LOCFS_DIR_PREALLOC_MIN 8
+#define LOCFS_DIR_PREALLOC_MAX 1024
+
+struct locfs_dx_entry {
+    uint32_t hash;          /* lowest hash covered, 0 for the first entry */
+    uint32_t block;
+};
+
+struct locfs_dx_node {
+    uint64_t magic;
+    uint32_t levels;        /* interior levels below the root, root only */
+    uint32_t count;
+    struct locfs_dx_entry entries[];
+};
+
+struct locfs_dir_leaf {
+    uint64_t magic;
+    uint64_t count;
+    struct locfs_dir_record records[];
+};
+
+/* 32 bit FNV-1a over the name, orders the directory hash tree */
+static inline uint32_t locfs_name_hash(const char *name, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/* A run of physically contiguous blocks backing part of a file */
+struct locfs_extent {
+    uint32_t ee_block;      /* first logical block covered */
+    uint32_t ee_len;        /* number of blocks in the run */
+    uint64_t ee_start;      /* first physical block of the run */
+};
+
+/* Overflow block holding the extents that do not fit in the inode */
+struct locfs_extent_block {
+    uint64_t magic;
+    uint64_t count;
+    struct locfs_extent extents[];
+};
+
+/* Exactly LOCFS_INODE_SIZE bytes on disk */
 struct locfs_inode {
     mode_t mode;
+
+    /* Block map, sorted by ee_block. The first LOCFS_INODE_EXTENTS
+       entries live in the inode, the rest in extent_block_no. There is no
+       further level, a file or directory whose blocks need more extents
+       than that cannot grow, see LOCFS_EXTENTS_PER_BLOCK_HSB. */
+    uint32_t extent_count;
     uint64_t inode_no;
-    uint64_t data_block_no;
+    uint64_t extent_block_no;
+    struct locfs_extent extents[LOCFS_INODE_EXTENTS];
 
-    char location[LOCFS_LOCATION_MAXLEN];
+    /* Location the inode was created at, see the location table */
+    uint32_t location_id;
+    int32_t altitude;
 
     union {
         uint64_t file_size;
-        uint64_t dir_children_count;
+        struct {
+            uint64_t dir_children_count;
+            /* First block of the location index, 0 if there is none */
+            uint64_t dir_index_block_no;
+        };
     };
+
+    /* Position and time of the GPS fix the inode was created with */
+    int32_t latitude;
+    int32_t longitude;
+    uint64_t timestamp;     /* seconds since the epoch, 0 if unknown */
+};
+
+/* The data of the file is kept in the inode, it has no extents */
+#define LOCFS_INODE_INLINE_DATA 0x1
+
+/*
+ * Inodes larger than LOCFS_INODE_SIZE, see locfs_super_block.inode_size,
+ * continue with this. A small regular file keeps its data in the rest of
+ * the slot until it outgrows it.
+ */
+struct locfs_inode_extra {
+    uint32_t flags;
+    uint32_t reserved;
+    uint8_t inline_data[];
 };
 
 struct locfs_super_block {
@@ -37,19 +158,315 @@ struct locfs_super_block {
 
     uint64_t data_block_table_size;
     uint64_t data_block_count;
+
+    /* Blocks in the metadata journal, 0 for an unjournaled image */
+    uint64_t journal_size;
+
+    /* First block of the location table, 0 while it is empty */
+    uint64_t location_table_block_no;
+
+    /* Root node of the spatial index, 0 while it is empty */
+    uint64_t spatial_root_block_no;
+
+    /* Bytes per inode table slot, a power of two from LOCFS_INODE_SIZE to
+       the blocksize. 0 on older images, which have LOCFS_INODE_SIZE. */
+    uint64_t inode_size;
+
+    /* Blocks set aside for the data block bitmap, so the data region can
+       be grown in place. 0 on older images, whose bitmap only has the
+       blocks its table needs. */
+    uint64_t data_bitmap_blocks;
+};
+
+/* Header of every block in a chain of metadata blocks */
+struct locfs_chain_header {
+    uint64_t magic;
+    uint64_t next_block_no;     /* next block of the chain, 0 at the end */
+    uint64_t count;             /* entries or records used in this block */
+};
+
+/*
+ * Location table
+ *
+ * Interns location names. Inodes and location indexes refer to a location
+ * by the 32 bit ID it is given here, so checking whether an entry is
+ * visible is an integer compare. IDs are handed out in order starting at
+ * 1 and never reused. The table is a chain of blocks starting at
+ * locfs_super_block.location_table_block_no.
+ */
+struct locfs_location_entry {
+    uint32_t id;
+    char name[LOCFS_LOCATION_MAXLEN];
+};
+
+struct locfs_location_block {
+    struct locfs_chain_header header;
+    struct locfs_location_entry entries[];
+};
+
+/*
+ * Per-directory location index
+ *
+ * A chain of index blocks holds one entry per location that children of
+ * the directory were created at. Each entry points at a chain of list
+ * blocks with the records of those children, so the entries visible at a
+ * location can be listed without reading any child inode.
+ */
+struct locfs_locindex_entry {
+    uint32_t location_id;
+    uint32_t reserved;
+    uint64_t first_block_no;    /* list chain of the children's records */
+    uint64_t last_block_no;     /* list block new records are added to */
+};
+
+struct locfs_locindex_block {
+    struct locfs_chain_header header;
+    struct locfs_locindex_entry entries[];
+};
+
+struct locfs_loclist_block {
+    struct locfs_chain_header header;
+    struct locfs_dir_record records[];
+};
+
+/*
+ * Spatial index
+ *
+ * A fixed depth grid tree over latitude and longitude. Every level splits
+ * a cell into LOCFS_SPATIAL_SPLIT x LOCFS_SPATIAL_SPLIT children, so the
+ * leaves form a 4096 x 4096 grid with cells about 10 km wide. Nodes are
+ * only allocated once something lands below them. A child of the last
+ * level points at a chain of buckets listing the inodes in its cell,
+ * newest bucket first. The root is locfs_super_block.spatial_root_block_no.
+ */
+#define LOCFS_SPATIAL_LEVELS 4
+#define LOCFS_SPATIAL_SPLIT_BITS 3
+#define LOCFS_SPATIAL_SPLIT (1 << LOCFS_SPATIAL_SPLIT_BITS)
+#define LOCFS_SPATIAL_GRID_BITS (LOCFS_SPATIAL_LEVELS * LOCFS_SPATIAL_SPLIT_BITS)
+
+#define LOCFS_SPATIAL_GRID (1U << LOCFS_SPATIAL_GRID_BITS)
+
+/* Grid column of a longitude */
+static inline uint32_t locfs_cell_x(int32_t longitude)
+{
+    return ((uint64_t)((int64_t)longitude + 180LL * LOCFS_COORD_SCALE)
+            * LOCFS_SPATIAL_GRID) / (360ULL * LOCFS_COORD_SCALE + 1);
+}
+
+/* Grid row of a latitude */
+static inline uint32_t locfs_cell_y(int32_t latitude)
+{
+    return ((uint64_t)((int64_t)latitude + 90LL * LOCFS_COORD_SCALE)
+            * LOCFS_SPATIAL_GRID) / (180ULL * LOCFS_COORD_SCALE + 1);
+}
+
+/* Child of a node at level holding the grid cell x, y */
+static inline unsigned int locfs_spatial_slot(uint32_t x, uint32_t y, int level)
+{
+    int shift = (LOCFS_SPATIAL_LEVELS - 1 - level) * LOCFS_SPATIAL_SPLIT_BITS;
+
+    return ((y >> shift) & (LOCFS_SPATIAL_SPLIT - 1)) * LOCFS_SPATIAL_SPLIT
+           + ((x >> shift) & (LOCFS_SPATIAL_SPLIT - 1));
+}
+
+struct locfs_spatial_node {
+    struct locfs_chain_header header;
+    /* Indexed by row * LOCFS_SPATIAL_SPLIT + column, 0 if empty */
+    uint64_t children[LOCFS_SPATIAL_SPLIT * LOCFS_SPATIAL_SPLIT];
+};
+
+struct locfs_spatial_entry {
+    uint64_t inode_no;
+    int32_t latitude;
+    int32_t longitude;
+};
+
+struct locfs_spatial_bucket {
+    struct locfs_chain_header header;
+    struct locfs_spatial_entry entries[];
+};
+
+/*
+ * Metadata journal
+ *
+ * The journal sits between the inode table and the data blocks. Its first
+ * block is a locfs_journal_super_block, the log starts at journal block
+ * `first`. A transaction is written there as a descriptor block listing the
+ * home block of every logged block, a copy of each of those blocks and a
+ * commit block. After the commit block is on disk the blocks are written
+ * home, so at most the transaction at the start of the log needs replaying.
+ */
+enum {
+    LOCFS_JOURNAL_SUPER      = 1,
+    LOCFS_JOURNAL_DESCRIPTOR = 2,
+    LOCFS_JOURNAL_COMMIT     = 3,
 };
 
+struct locfs_journal_header {
+    uint32_t magic;
+    uint32_t blocktype;
+    uint64_t sequence;
+};
+
+struct locfs_journal_super_block {
+    /* header.sequence is the oldest transaction that may need replaying */
+    struct locfs_journal_header header;
+    uint64_t blocksize;
+    uint64_t maxlen;        /* blocks in the journal, this one included */
+    uint64_t first;         /* first log block, relative to the journal */
+};
+
+struct locfs_journal_descriptor {
+    struct locfs_journal_header header;
+    uint64_t count;
+    uint64_t tags[];        /* home block number of each logged block */
+};
+
+struct locfs_journal_commit {
+    struct locfs_journal_header header;
+    uint64_t count;
+    /* crc32_le over the logged blocks, seeded with ~0 */
+    uint32_t checksum;
+};
+
+/*
+ * On-disk layout
+ *
+ *   super_block | inode bitmap | data block bitmap | inode table |
+ *   journal | data blocks
+ *
+ * Each bitmap takes as many blocks as it needs to cover its table, bit i
+ * of a bitmap lives in byte i / 8 at position i % 8. The data block
+ * bitmap may have more, zeroed, blocks for the data region to grow into.
+ */
+
 /* Helper functions */
+static inline uint64_t LOCFS_INODE_SIZE_HSB(struct locfs_super_block *locfs_sb)
+{
+    return locfs_sb->inode_size ? locfs_sb->inode_size : LOCFS_INODE_SIZE;
+}
+
 static inline uint64_t LOCFS_INODES_PER_BLOCK_HSB(struct locfs_super_block *locfs_sb) 
 {
-    return locfs_sb->blocksize / sizeof(struct locfs_inode);
+    return locfs_sb->blocksize / LOCFS_INODE_SIZE_HSB(locfs_sb);
 }
 
-static inline uint64_t LOCFS_DATA_BLOCK_TABLE_START_BLOCK_NO_HSB(struct locfs_super_block *locfs_sb) 
+/* Bytes of data a file can keep in its inode, 0 with the smallest inodes */
+static inline uint64_t LOCFS_INLINE_DATA_MAX_HSB(struct locfs_super_block *locfs_sb)
 {
-    return LOCFS_INODE_TABLE_START_BLOCK_NO
+    if (LOCFS_INODE_SIZE_HSB(locfs_sb) <= LOCFS_INODE_SIZE) {
+        return 0;
+    }
+
+    return LOCFS_INODE_SIZE_HSB(locfs_sb) - LOCFS_INODE_SIZE
+           - sizeof(struct locfs_inode_extra);
+}
+
+static inline uint64_t LOCFS_BITS_PER_BLOCK_HSB(struct locfs_super_block *locfs_sb)
+{
+    return locfs_sb->blocksize * 8;
+}
+
+static inline uint64_t LOCFS_INODE_BITMAP_BLOCKS_HSB(struct locfs_super_block *locfs_sb)
+{
+    return (locfs_sb->inode_table_size + LOCFS_BITS_PER_BLOCK_HSB(locfs_sb) - 1)
+           / LOCFS_BITS_PER_BLOCK_HSB(locfs_sb);
+}
+
+static inline uint64_t LOCFS_DATA_BLOCK_BITMAP_START_BLOCK_NO_HSB(struct locfs_super_block *locfs_sb)
+{
+    return LOCFS_INODE_BITMAP_START_BLOCK_NO + LOCFS_INODE_BITMAP_BLOCKS_HSB(locfs_sb);
+}
+
+static inline uint64_t LOCFS_DATA_BLOCK_BITMAP_BLOCKS_HSB(struct locfs_super_block *locfs_sb)
+{
+    uint64_t needed = (locfs_sb->data_block_table_size
+                       + LOCFS_BITS_PER_BLOCK_HSB(locfs_sb) - 1)
+                      / LOCFS_BITS_PER_BLOCK_HSB(locfs_sb);
+
+    return needed > locfs_sb->data_bitmap_blocks ? needed
+                                                 : locfs_sb->data_bitmap_blocks;
+}
+
+/* Most data blocks the image can be grown to without moving anything */
+static inline uint64_t LOCFS_DATA_BLOCK_TABLE_MAX_HSB(struct locfs_super_block *locfs_sb)
+{
+    return LOCFS_DATA_BLOCK_BITMAP_BLOCKS_HSB(locfs_sb)
+           * LOCFS_BITS_PER_BLOCK_HSB(locfs_sb);
+}
+
+static inline uint64_t LOCFS_INODE_TABLE_START_BLOCK_NO_HSB(struct locfs_super_block *locfs_sb)
+{
+    return LOCFS_DATA_BLOCK_BITMAP_START_BLOCK_NO_HSB(locfs_sb)
+           + LOCFS_DATA_BLOCK_BITMAP_BLOCKS_HSB(locfs_sb);
+}
+
+static inline uint64_t LOCFS_JOURNAL_START_BLOCK_NO_HSB(struct locfs_super_block *locfs_sb)
+{
+    return LOCFS_INODE_TABLE_START_BLOCK_NO_HSB(locfs_sb)
            + locfs_sb->inode_table_size / LOCFS_INODES_PER_BLOCK_HSB(locfs_sb)
            + 1;
 }
 
+static inline uint64_t LOCFS_DATA_BLOCK_TABLE_START_BLOCK_NO_HSB(struct locfs_super_block *locfs_sb) 
+{
+    return LOCFS_JOURNAL_START_BLOCK_NO_HSB(locfs_sb) + locfs_sb->journal_size;
+}
+
+/* Number of home block numbers a journal descriptor block can hold */
+static inline uint64_t LOCFS_JOURNAL_TAGS_PER_BLOCK_HSB(struct locfs_super_block *locfs_sb)
+{
+    return (locfs_sb->blocksize - sizeof(struct locfs_journal_descriptor))
+           / sizeof(uint64_t);
+}
+
+/* Number of extents that fit in the overflow extent block */
+static inline uint64_t LOCFS_EXTENTS_PER_BLOCK_HSB(struct locfs_super_block *locfs_sb)
+{
+    return (locfs_sb->blocksize - sizeof(struct locfs_extent_block))
+           / sizeof(struct locfs_extent);
+}
+
+/* Number of entries a directory hash tree node can hold */
+static inline uint64_t LOCFS_DX_ENTRIES_PER_BLOCK_HSB(struct locfs_super_block *locfs_sb)
+{
+    return (locfs_sb->blocksize - sizeof(struct locfs_dx_node))
+           / sizeof(struct locfs_dx_entry);
+}
+
+/* Number of records a directory leaf can hold */
+static inline uint64_t LOCFS_DIR_RECORDS_PER_BLOCK_HSB(struct locfs_super_block *locfs_sb)
+{
+    return (locfs_sb->blocksize - sizeof(struct locfs_dir_leaf))
+           / sizeof(struct locfs_dir_record);
+}
+
+/* Number of names a location table block can hold */
+static inline uint64_t LOCFS_LOCATIONS_PER_BLOCK_HSB(struct locfs_super_block *locfs_sb)
+{
+    return (locfs_sb->blocksize - sizeof(struct locfs_location_block))
+           / sizeof(struct locfs_location_entry);
+}
+
+/* Number of locations a location index block can hold */
+static inline uint64_t LOCFS_LOCINDEX_ENTRIES_PER_BLOCK_HSB(struct locfs_super_block *locfs_sb)
+{
+    return (locfs_sb->blocksize - sizeof(struct locfs_locindex_block))
+           / sizeof(struct locfs_locindex_entry);
+}
+
+/* Number of directory records a location list block can hold */
+static inline uint64_t LOCFS_LOCLIST_RECORDS_PER_BLOCK_HSB(struct locfs_super_block *locfs_sb)
+{
+    return (locfs_sb->blocksize - sizeof(struct locfs_loclist_block))
+           / sizeof(struct locfs_dir_record);
+}
+
+/* Number of inodes a spatial index bucket can hold */
+static inline uint64_t LOCFS_SPATIAL_ENTRIES_PER_BLOCK_HSB(struct locfs_super_block *locfs_sb)
+{
+    return (locfs_sb->blocksize - sizeof(struct locfs_spatial_bucket))
+           / sizeof(struct locfs_spatial_entry);
+}
+
 #endif /*__LOCFS_H__*/
@@ -0,0 +1,42 @@
+#ifndef __LOCFS_FEED_H__
+#define __LOCFS_FEED_H__
+
+/*
+ * Binary GPS feed, /dev/locfs_feed
+ *
+ * A feeder either write()s whole struct locfs_fix records, as many per
+ * call as it likes, or maps a struct locfs_feed_ring and publishes fixes
+ * into it without a system call each. Either way only the latest fix
+ * counts, it becomes the fix new inodes are tagged with, just like a
+ * write to /proc/locationmod_coords. Coordinates use the fixed point
+ * units described in locfs.h.
+ */
+#define LOCFS_FEED_DEVICE "/dev/locfs_feed"
+
+/* One GPS fix */
+struct locfs_fix {
+    int32_t latitude;
+    int32_t longitude;
+    int32_t altitude;       /* LOCFS_COORD_NONE when unknown */
+    uint32_t reserved;      /* must be 0 */
+    uint64_t timestamp;     /* seconds since the epoch, 0 for "now" */
+};
+
+/*
+ * Layout of the mmap()ed ring, which fills the whole mapping. The kernel
+ * sets size to the number of slots when the ring is mapped. The feeder
+ * writes fix number head into fixes[head % size], then stores head + 1
+ * with release semantics. The kernel only ever reads the slot of the
+ * latest fix, when it needs one.
+ */
+struct locfs_feed_ring {
+    uint32_t head;          /* fixes published so far */
+    uint32_t size;
+    uint64_t reserved;
+    struct locfs_fix fixes[];
+};
+
+/* Largest ring that can be mapped */
+#define LOCFS_FEED_RING_MAX (1 << 20)
+
+#endif /*__LOCFS_FEED_H__*/
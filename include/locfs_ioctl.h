@@ -0,0 +1,60 @@
+#ifndef __LOCFS_IOCTL_H__
+#define __LOCFS_IOCTL_H__
+
+#include <linux/ioctl.h>
+
+/*
+ * ioctls understood by any file or directory on a locfs mount. Coordinates
+ * use the fixed point units described in locfs.h.
+ */
+#define LOCFS_IOC_MAGIC 'L'
+
+enum {
+    LOCFS_QUERY_BBOX   = 1,
+    LOCFS_QUERY_RADIUS = 2,
+};
+
+/* One inode found by LOCFS_IOC_SPATIAL_QUERY */
+struct locfs_spatial_hit {
+    uint64_t inode_no;
+    int32_t latitude;
+    int32_t longitude;
+};
+
+/*
+ * Finds the inodes created inside a bounding box, or within radius metres
+ * of a point. Matches are written to the array at hits, count holds its
+ * size on entry and the number of matches written on return. skip leaves
+ * out that many matches first so a large result can be read in pages,
+ * more is set when matches did not fit.
+ */
+struct locfs_spatial_query {
+    uint32_t type;              /* LOCFS_QUERY_BBOX or LOCFS_QUERY_RADIUS */
+
+    /* LOCFS_QUERY_BBOX, min_longitude > max_longitude crosses 180 degrees */
+    int32_t min_latitude;
+    int32_t min_longitude;
+    int32_t max_latitude;
+    int32_t max_longitude;
+
+    /* LOCFS_QUERY_RADIUS */
+    int32_t latitude;
+    int32_t longitude;
+    uint32_t radius;
+
+    uint64_t skip;
+    uint64_t hits;              /* struct locfs_spatial_hit * */
+    uint32_t count;
+    uint32_t more;
+};
+
+#define LOCFS_IOC_SPATIAL_QUERY _IOWR(LOCFS_IOC_MAGIC, 1, struct locfs_spatial_query)
+
+/*
+ * Grows a mounted image to the given number of blocks in all, once the
+ * device under it has been enlarged. The new blocks are added to the data
+ * region, as far as the room mkfs left in the data block bitmap allows.
+ */
+#define LOCFS_IOC_GROW _IOW(LOCFS_IOC_MAGIC, 2, uint64_t)
+
+#endif /*__LOCFS_IOCTL_H__*/
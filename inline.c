@@ -0,0 +1,259 @@
+/*
+ * Location Based Filesystem
+ *
+ * By, Robert Chrystie
+ */
+
+#include <linux/buffer_head.h>
+#include <linux/highmem.h>
+#include <linux/pagemap.h>
+#include <linux/writeback.h>
+#include "internal.h"
+
+/*
+ * Inline data
+ *
+ * On images with inodes larger than struct locfs_inode a new regular file
+ * keeps its data in the rest of its inode table slot, so a small file
+ * costs no data block and reading it costs no read beyond the inode. Its
+ * data is only ever in page 0, which is filled from the slot and written
+ * back into it. Once a write or truncate goes past what the slot holds,
+ * locfs_inline_convert hands the file over to the block map and page 0 is
+ * written out to a newly allocated block like any other dirty page.
+ */
+
+/* Fills a locked page 0 of an inline file from its inode */
+static int locfs_inline_fill(struct inode *inode, struct page *page)
+{
+    struct super_block *sb = inode->i_sb;
+    struct locfs_inode_extra *extra;
+    struct buffer_head *bh;
+    uint64_t size;
+    void *kaddr;
+
+    bh = locfs_inode_bh(sb, inode->i_ino, &extra);
+    if (IS_ERR(bh)) {
+        return PTR_ERR(bh);
+    }
+
+    size = min_t(uint64_t, i_size_read(inode), LOCFS_INLINE_DATA_MAX(sb));
+    kaddr = kmap_atomic(page);
+    memcpy(kaddr, extra->inline_data, size);
+    memset(kaddr + size, 0, PAGE_SIZE - size);
+    flush_dcache_page(page);
+    kunmap_atomic(kaddr);
+    brelse(bh);
+
+    SetPageUptodate(page);
+    return 0;
+}
+
+/* readpage for inline files, there is nothing past page 0 */
+int locfs_inline_readpage(struct inode *inode, struct page *page)
+{
+    int ret = 0;
+
+    if (page->index == 0) {
+        ret = locfs_inline_fill(inode, page);
+    } else {
+        zero_user(page, 0, PAGE_SIZE);
+        SetPageUptodate(page);
+    }
+
+    unlock_page(page);
+    return ret;
+}
+
+/* writepage for inline files, copies page 0 back into the inode */
+int locfs_inline_writepage(struct page *page, struct writeback_control *wbc)
+{
+    struct inode *inode = page->mapping->host;
+    struct super_block *sb = inode->i_sb;
+    struct locfs_inode_extra *extra;
+    struct buffer_head *bh;
+    uint64_t size;
+    void *kaddr;
+    int ret, err;
+
+    set_page_writeback(page);
+    unlock_page(page);
+
+    // Pages past the end hold nothing an inline file could keep
+    if (page->index != 0) {
+        end_page_writeback(page);
+        return 0;
+    }
+
+    ret = locfs_journal_start(sb, LOCFS_INODE_CREDITS);
+    if (ret) {
+        goto out;
+    }
+
+    bh = locfs_inode_bh(sb, inode->i_ino, &extra);
+    if (IS_ERR(bh)) {
+        ret = PTR_ERR(bh);
+        locfs_journal_stop(sb);
+        goto out;
+    }
+
+    size = min_t(uint64_t, i_size_read(inode), LOCFS_INLINE_DATA_MAX(sb));
+    kaddr = kmap_atomic(page);
+    memcpy(extra->inline_data, kaddr, size);
+    kunmap_atomic(kaddr);
+
+    locfs_dirty_buffer(sb, bh, NULL);
+    if (wbc->sync_mode == WB_SYNC_ALL) {
+        ret = locfs_sync_buffer(sb, bh);
+    }
+    brelse(bh);
+
+    err = locfs_journal_stop(sb);
+    if (!ret) {
+        ret = err;
+    }
+
+out:
+    if (ret) {
+        mapping_set_error(page->mapping, ret);
+    }
+    end_page_writeback(page);
+    return ret;
+}
+
+/* write_begin for a write that still fits in the inode */
+int locfs_inline_write_begin(struct address_space *mapping,
+                               loff_t pos,
+                               unsigned flags,
+                               struct page **pagep)
+{
+    struct page *page;
+    int ret;
+
+    page = grab_cache_page_write_begin(mapping, 0, flags);
+    if (!page) {
+        return -ENOMEM;
+    }
+
+    if (!PageUptodate(page)) {
+        ret = locfs_inline_fill(mapping->host, page);
+        if (ret) {
+            unlock_page(page);
+            put_page(page);
+            return ret;
+        }
+    }
+
+    *pagep = page;
+    return 0;
+}
+
+/* write_end for inline files, whose page 0 carries no buffers */
+int locfs_inline_write_end(struct address_space *mapping,
+                             loff_t pos,
+                             unsigned copied,
+                             struct page *page)
+{
+    struct inode *inode = mapping->host;
+    bool grown = false;
+
+    if (pos + copied > inode->i_size) {
+        i_size_write(inode, pos + copied);
+        grown = true;
+    }
+
+    set_page_dirty(page);
+    unlock_page(page);
+    put_page(page);
+
+    // The new size goes out with the inode, as in generic_write_end
+    if (grown) {
+        mark_inode_dirty(inode);
+    }
+    return copied;
+}
+
+/*
+ * Moves the data of an inline file to the block map. Called with the
+ * inode locked, before a write or truncate takes it past the inode.
+ *
+ * Page 0 is held locked throughout, so writeback either stores it in the
+ * inode before the switch or writes it to a block after it. The data all
+ * lies in the first block, whose buffer is dirtied as a delayed one with
+ * a reservation of its own, so the conversion fails with -ENOSPC here
+ * rather than in writeback once the caller has reported success.
+ */
+int locfs_inline_convert(struct inode *inode)
+{
+    struct locfs_inode_info *info = LOCFS_I(inode);
+    struct buffer_head *bh;
+    struct page *page;
+    int ret = 0;
+
+    page = grab_cache_page(inode->i_mapping, 0);
+    if (!page) {
+        return -ENOMEM;
+    }
+
+    if (!locfs_has_inline_data(inode)) {
+        goto out;
+    }
+
+    if (!PageUptodate(page)) {
+        ret = locfs_inline_fill(inode, page);
+        if (ret) {
+            goto out;
+        }
+    }
+
+    if (!page_has_buffers(page)) {
+        create_empty_buffers(page, 1 << inode->i_blkbits, 0);
+    }
+    bh = page_buffers(page);
+    if (!buffer_delay(bh)) {
+        ret = locfs_delay_buffer(inode, bh);
+        if (ret) {
+            // An inline page carries no buffers
+            try_to_free_buffers(page);
+            goto out;
+        }
+    }
+
+    down_write(&info->i_map_sem);
+    info->i_flags &= ~LOCFS_INODE_INLINE_DATA;
+    up_write(&info->i_map_sem);
+
+    set_buffer_uptodate(bh);
+    mark_buffer_dirty(bh);
+    mark_inode_dirty(inode);
+
+out:
+    unlock_page(page);
+    put_page(page);
+    return ret;
+}
+
+/*
+ * Clears the inline data past size after the file shrank, so growing it
+ * again reads back zeroes. Must be called inside a journal handle.
+ */
+int locfs_inline_truncate(struct inode *inode, loff_t size)
+{
+    struct super_block *sb = inode->i_sb;
+    struct locfs_inode_extra *extra;
+    struct buffer_head *bh;
+    uint64_t max = LOCFS_INLINE_DATA_MAX(sb);
+
+    if (size >= max) {
+        return 0;
+    }
+
+    bh = locfs_inode_bh(sb, inode->i_ino, &extra);
+    if (IS_ERR(bh)) {
+        return PTR_ERR(bh);
+    }
+
+    memset(extra->inline_data + size, 0, max - size);
+    locfs_dirty_buffer(sb, bh, NULL);
+    brelse(bh);
+    return 0;
+}
@@ -7,17 +7,16 @@
 #include <linux/slab.h>
 #include <linux/buffer_head.h>
 #include <linux/string.h>
+#include <linux/writeback.h>
 #include "include/locfs.h"
 #include "internal.h"
+#include "trace.h"
 
-DEFINE_MUTEX(locfs_sb_lock);
-
-#define BITS_IN_BYTE 8
-
-static const uint64_t LOCFS_INODE_BITMAP_BLOCK_NO = 1;
-static const uint64_t LOCFS_DATA_BLOCK_BITMAP_BLOCK_NO = 2;
-
-extern char *curr_location;
+/* Finds the starting block of the inode table */
+static inline uint64_t LOCFS_INODE_TABLE_START_BLOCK_NO(struct super_block *sb)
+{
+    return LOCFS_INODE_TABLE_START_BLOCK_NO_HSB(LOCFS_SB(sb));
+}
 
 /* Finds the starting block of the data blocks */
 static inline uint64_t LOCFS_DATA_BLOCK_TABLE_START_BLOCK_NO(struct super_block *sb) 
@@ -27,159 +26,410 @@ static inline uint64_t LOCFS_DATA_BLOCK_TABLE_START_BLOCK_NO(struct super_block
     return LOCFS_DATA_BLOCK_TABLE_START_BLOCK_NO_HSB(locfs_sb);
 }
 
-static inline uint64_t LOCFS_DIR_MAX_RECORD(struct super_block *sb) 
+static inline uint64_t LOCFS_INODE_BYTE_OFFSET(struct super_block *sb, 
+                                                 uint64_t inode_no) 
 {
     struct locfs_super_block *locfs_sb;
     locfs_sb = LOCFS_SB(sb);
-    return locfs_sb->blocksize / sizeof(struct locfs_dir_record);
+    return (inode_no % LOCFS_INODES_PER_BLOCK_HSB(locfs_sb))
+           * LOCFS_INODE_SIZE_HSB(locfs_sb);
 }
 
-static inline uint64_t LOCFS_INODE_BYTE_OFFSET(struct super_block *sb, 
-                                                 uint64_t inode_no) 
+/* Records what a lookup saw, see locfs_lookup */
+static inline void locfs_dentry_set(struct dentry *dentry,
+                                      unsigned int gen,
+                                      uint32_t hidden_location_id)
 {
-    struct locfs_super_block *locfs_sb;
-    locfs_sb = LOCFS_SB(sb);
-    return (inode_no % LOCFS_INODES_PER_BLOCK_HSB(locfs_sb)) * sizeof(struct locfs_inode);
+    dentry->d_time = gen;
+    dentry->d_fsdata = (void *)(unsigned long)hidden_location_id;
 }
 
+/*
+ * Links inode into dir. The directory record goes in last, so nothing
+ * can fail once the child is reachable by name.
+ */
 int locfs_add_dir_record(struct super_block *sb, struct inode *dir,
                            struct dentry *dentry, struct inode *inode) {
-    struct buffer_head *bh;
     struct locfs_inode *parent_locfs_inode;
-    struct locfs_dir_record *dir_record;
+    uint32_t location_id;
+    int ret;
 
     parent_locfs_inode = LOCFS_INODE(dir);
-    if (unlikely(parent_locfs_inode->dir_children_count
-            >= LOCFS_DIR_MAX_RECORD(sb))) {
-        return -ENOSPC;
-    }
+    location_id = LOCFS_INODE(inode)->location_id;
 
-    bh = sb_bread(sb, parent_locfs_inode->data_block_no);
-    BUG_ON(!bh);
-
-    dir_record = (struct locfs_dir_record *)bh->b_data;
-    dir_record += parent_locfs_inode->dir_children_count;
-    dir_record->inode_no = inode->i_ino;
-    strcpy(dir_record->filename, dentry->d_name.name);
+    // Make the child show up when listing the directory at its location
+    ret = locfs_locindex_add(dir, location_id, dentry->d_name.name,
+                             inode->i_ino);
+    if (ret) {
+        return ret;
+    }
 
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
-    brelse(bh);
+    ret = locfs_dir_insert(dir, dentry->d_name.name, dentry->d_name.len,
+                           inode->i_ino);
+    if (ret) {
+        locfs_locindex_remove(dir, location_id, inode->i_ino);
+        return ret;
+    }
 
     parent_locfs_inode->dir_children_count += 1;
-    locfs_save_locfs_inode(sb, parent_locfs_inode);
+    mark_inode_dirty(dir);
 
     return 0;
 }
 
+/*
+ * Data blocks neither allocated nor reserved. The per-CPU counts are only
+ * added up exactly when fewer than want blocks plus their possible error
+ * seem to be left.
+ */
+static s64 locfs_available_blocks(struct locfs_sb_info *sbi, s64 want)
+{
+    s64 free = percpu_counter_read_positive(&sbi->s_free_blocks);
+    s64 dirty = percpu_counter_read_positive(&sbi->s_dirty_blocks);
+
+    if (free - dirty < want + LOCFS_COUNTER_SLACK) {
+        free = percpu_counter_sum_positive(&sbi->s_free_blocks);
+        dirty = percpu_counter_sum_positive(&sbi->s_dirty_blocks);
+    }
+
+    return free - dirty;
+}
+
 static int locfs_alloc_locfs_inode(struct super_block *sb, 
                                      uint64_t *out_inode_no) 
 {
-    struct locfs_super_block *locfs_sb;
-    struct buffer_head *bh;
-    uint64_t i;
+    struct locfs_sb_info *sbi;
+    uint64_t len;
     int ret;
-    char *bitmap;
-    char *slot;
-    char needle;
 
-    locfs_sb = LOCFS_SB(sb);
+    u64 start;
 
-    mutex_lock(&locfs_sb_lock);
-
-    bh = sb_bread(sb, LOCFS_INODE_BITMAP_BLOCK_NO);
-    BUG_ON(!bh);
-
-    bitmap = bh->b_data;
-    ret = -ENOSPC;
-    for (i = 0; i < locfs_sb->inode_table_size; i++) {
-        slot = bitmap + i / BITS_IN_BYTE;
-        needle = 1 << (i % BITS_IN_BYTE);
-        if (0 == (*slot & needle)) {
-            *out_inode_no = i;
-            *slot |= needle;
-            locfs_sb->inode_count += 1;
-            ret = 0;
-            break;
-        }
+    sbi = LOCFS_SBI(sb);
+    start = locfs_stats_start();
+
+    // No goal, the allocator picks a group for the calling CPU
+    ret = locfs_bitmap_alloc(sb, &sbi->s_inode_bitmap, U64_MAX, 1,
+                             out_inode_no, &len);
+    if (0 == ret) {
+        percpu_counter_dec(&sbi->s_free_inodes);
     }
 
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
-    brelse(bh);
-    locfs_save_sb(sb);
+    trace_locfs_alloc(sb, true, U64_MAX, 1, ret ? 0 : *out_inode_no,
+                      ret ? 0 : len, ret);
+    locfs_stats_end(sb, LOCFS_OP_ALLOC, start);
+    return ret;
+}
 
-    mutex_unlock(&locfs_sb_lock);
+/* Gives back the bit of an inode whose creation failed */
+static void locfs_free_locfs_inode(struct super_block *sb, uint64_t inode_no)
+{
+    struct locfs_sb_info *sbi = LOCFS_SBI(sb);
+
+    if (0 == locfs_bitmap_free(sb, &sbi->s_inode_bitmap, inode_no, 1)) {
+        percpu_counter_inc(&sbi->s_free_inodes);
+    }
+}
+
+/*
+ * Allocates a run of up to count free data blocks, starting the search at
+ * the absolute block number goal and moving on through the other
+ * allocation groups when its group is full. The run is as long as possible so that file data
+ * ends up physically contiguous on the device.
+ *
+ * Blocks reserved for delayed writes are not handed out, writeback
+ * releases the reservations of the blocks it is about to allocate. Only
+ * the free count changes, the super_block goes out with locfs_sync_fs.
+ */
+int locfs_alloc_data_blocks(struct super_block *sb, uint64_t goal,
+                              uint64_t count, uint64_t *out_start,
+                              uint64_t *out_len) {
+    struct locfs_sb_info *sbi;
+    uint64_t table_start;
+    s64 available;
+    uint64_t bit;
+    uint64_t start;
+    int ret;
+
+    sbi = LOCFS_SBI(sb);
+    start = locfs_stats_start();
+    table_start = LOCFS_DATA_BLOCK_TABLE_START_BLOCK_NO(sb);
+
+    available = locfs_available_blocks(sbi, count);
+    if (available <= 0) {
+        ret = -ENOSPC;
+        goto out;
+    }
+    count = min_t(uint64_t, count, available);
+
+    // Out of range goals let the allocator pick a group
+    if (goal >= table_start) {
+        goal -= table_start;
+    } else {
+        goal = U64_MAX;
+    }
+
+    ret = locfs_bitmap_alloc(sb, &sbi->s_data_bitmap, goal, count,
+                             &bit, out_len);
+    if (0 == ret) {
+        *out_start = table_start + bit;
+        percpu_counter_sub(&sbi->s_free_blocks, *out_len);
+    }
+
+out:
+    trace_locfs_alloc(sb, false, goal, count, ret ? 0 : *out_start,
+                      ret ? 0 : *out_len, ret);
+    locfs_stats_end(sb, LOCFS_OP_ALLOC, start);
     return ret;
 }
 
 int locfs_alloc_data_block(struct super_block *sb, uint64_t *out_data_block_no) {
-    struct locfs_super_block *locfs_sb;
-    struct buffer_head *bh;
-    uint64_t i;
+    uint64_t len;
+
+    return locfs_alloc_data_blocks(sb, 0, 1, out_data_block_no, &len);
+}
+
+/* Frees count data blocks starting at the absolute block number start */
+int locfs_free_data_blocks(struct super_block *sb, uint64_t start,
+                             uint64_t count)
+{
+    struct locfs_sb_info *sbi = LOCFS_SBI(sb);
+    uint64_t table_start = LOCFS_DATA_BLOCK_TABLE_START_BLOCK_NO(sb);
     int ret;
-    char *bitmap;
-    char *slot;
-    char needle;
 
-    locfs_sb = LOCFS_SB(sb);
+    if (start < table_start) {
+        return -EINVAL;
+    }
 
-    mutex_lock(&locfs_sb_lock);
-
-    bh = sb_bread(sb, LOCFS_DATA_BLOCK_BITMAP_BLOCK_NO);
-    BUG_ON(!bh);
-
-    bitmap = bh->b_data;
-    ret = -ENOSPC;
-    for (i = 0; i < locfs_sb->data_block_table_size; i++) {
-        slot = bitmap + i / BITS_IN_BYTE;
-        needle = 1 << (i % BITS_IN_BYTE);
-        if (0 == (*slot & needle)) {
-            *out_data_block_no = LOCFS_DATA_BLOCK_TABLE_START_BLOCK_NO(sb) + i;
-            *slot |= needle;
-            locfs_sb->data_block_count += 1;
-            ret = 0;
-            break;
-        }
+    ret = locfs_bitmap_free(sb, &sbi->s_data_bitmap, start - table_start,
+                            count);
+    if (0 == ret) {
+        percpu_counter_add(&sbi->s_free_blocks, count);
     }
+    return ret;
+}
 
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
-    brelse(bh);
-    locfs_save_sb(sb);
+/*
+ * Sets aside data blocks for pages written without them, so that
+ * writeback is sure to find room for them when it picks the blocks. force
+ * puts back reservations an allocation could not use even if the room
+ * has been taken meanwhile.
+ */
+int locfs_reserve_data_blocks(struct super_block *sb, uint64_t count,
+                                bool force)
+{
+    struct locfs_sb_info *sbi = LOCFS_SBI(sb);
+
+    if (!force && locfs_available_blocks(sbi, count) < (s64)count) {
+        return -ENOSPC;
+    }
+
+    percpu_counter_add(&sbi->s_dirty_blocks, count);
+    return 0;
+}
+
+/* Gives back reservations, once their blocks are allocated or not needed */
+void locfs_release_data_blocks(struct super_block *sb, uint64_t count)
+{
+    percpu_counter_sub(&LOCFS_SBI(sb)->s_dirty_blocks, count);
+}
+
+/*
+ * Reserves a delayed block of a regular file. Allocating it may take the
+ * overflow extent block as well, so that is reserved along with the first
+ * delayed block of a file which has none, and kept until the file has no
+ * delayed blocks left.
+ */
+int locfs_reserve_delayed(struct inode *inode)
+{
+    struct locfs_inode_info *info = LOCFS_I(inode);
+    bool meta = false;
+    int ret;
+
+    spin_lock(&info->i_reserve_lock);
+    if (!info->i_reserved_meta && info->i_disk.extent_block_no == 0) {
+        info->i_reserved_meta = true;
+        meta = true;
+    }
+    spin_unlock(&info->i_reserve_lock);
+
+    ret = locfs_reserve_data_blocks(inode->i_sb, 1 + meta, false);
+
+    spin_lock(&info->i_reserve_lock);
+    if (ret) {
+        if (meta) {
+            info->i_reserved_meta = false;
+        }
+    } else {
+        info->i_reserved_data += 1;
+    }
+    spin_unlock(&info->i_reserve_lock);
 
-    mutex_unlock(&locfs_sb_lock);
     return ret;
 }
 
-int locfs_create_inode(struct inode *dir, struct dentry *dentry,
-                         umode_t mode) {
+/*
+ * Drops count delayed blocks from the inode's share once an allocation
+ * took over their reservations, and the overflow block's with the last.
+ */
+void locfs_delayed_allocated(struct inode *inode, uint64_t count)
+{
+    struct locfs_inode_info *info = LOCFS_I(inode);
+    bool meta = false;
+
+    spin_lock(&info->i_reserve_lock);
+    info->i_reserved_data -= min(count, info->i_reserved_data);
+    if (info->i_reserved_data == 0 && info->i_reserved_meta) {
+        info->i_reserved_meta = false;
+        meta = true;
+    }
+    spin_unlock(&info->i_reserve_lock);
+
+    if (meta) {
+        locfs_release_data_blocks(inode->i_sb, 1);
+    }
+}
+
+/* Gives back the reservations of count delayed blocks that are not needed */
+void locfs_release_delayed(struct inode *inode, uint64_t count)
+{
+    locfs_release_data_blocks(inode->i_sb, count);
+    locfs_delayed_allocated(inode, count);
+}
+
+/* Hands the overflow extent block's reservation to its allocation */
+void locfs_claim_meta_reservation(struct inode *inode)
+{
+    struct locfs_inode_info *info = LOCFS_I(inode);
+    bool meta;
+
+    spin_lock(&info->i_reserve_lock);
+    meta = info->i_reserved_meta;
+    info->i_reserved_meta = false;
+    spin_unlock(&info->i_reserve_lock);
+
+    if (meta) {
+        locfs_release_data_blocks(inode->i_sb, 1);
+    }
+}
+
+/*
+ * Allocates a block close to goal for a chain of metadata blocks, see
+ * struct locfs_chain_header. It starts out zeroed apart from its magic and
+ * is dirtied along with inode, which may be NULL.
+ */
+struct buffer_head *locfs_new_chain_block(struct super_block *sb,
+                                            struct inode *inode,
+                                            uint64_t magic,
+                                            uint64_t goal,
+                                            uint64_t *out_block_no)
+{
+    struct buffer_head *bh;
+    struct locfs_chain_header *header;
+    uint64_t len;
+    int ret;
+
+    ret = locfs_alloc_data_blocks(sb, goal, 1, out_block_no, &len);
+    if (ret) {
+        return ERR_PTR(ret);
+    }
+
+    bh = sb_getblk(sb, *out_block_no);
+    if (!bh) {
+        return ERR_PTR(-EIO);
+    }
+    lock_buffer(bh);
+    memset(bh->b_data, 0, bh->b_size);
+    header = (struct locfs_chain_header *)bh->b_data;
+    header->magic = magic;
+    set_buffer_uptodate(bh);
+    unlock_buffer(bh);
+
+    locfs_dirty_buffer(sb, bh, inode);
+    return bh;
+}
+
+/* Reads one block of a metadata chain and checks its magic */
+struct buffer_head *locfs_read_chain_block(struct super_block *sb,
+                                             uint64_t block_no,
+                                             uint64_t magic)
+{
+    struct buffer_head *bh;
+    struct locfs_chain_header *header;
+
+    bh = sb_bread(sb, block_no);
+    if (!bh) {
+        return ERR_PTR(-EIO);
+    }
+
+    header = (struct locfs_chain_header *)bh->b_data;
+    if (unlikely(header->magic != magic)) {
+        printk(KERN_ERR "locfs: Bad metadata block %llu, magic %llx\n",
+               block_no, header->magic);
+        brelse(bh);
+        return ERR_PTR(-EIO);
+    }
+
+    return bh;
+}
+
+static int __locfs_create_inode(struct inode *dir, struct dentry *dentry,
+                                  umode_t mode) {
     struct super_block *sb;
     struct locfs_super_block *locfs_sb;
     uint64_t inode_no;
     struct locfs_inode *locfs_inode;
+    struct locfs_coords coords;
     struct inode *inode;
     int ret;
 
-    printk(KERN_INFO "locfs: in locfs_create_inode");
-
     sb = dir->i_sb;
     locfs_sb = LOCFS_SB(sb);
 
+    if (dentry->d_name.len >= LOCFS_FILENAME_MAXLEN) {
+        return -ENAMETOOLONG;
+    }
+
+    // The name may be taken by a child hidden at another location
+    ret = locfs_dir_find(dir, dentry->d_name.name, dentry->d_name.len,
+                         &inode_no);
+    if (ret != -ENOENT) {
+        return ret ? ret : -EEXIST;
+    }
+
+    // Bitmaps, parent and child all change in one transaction
+    ret = locfs_journal_start(sb, LOCFS_CREATE_CREDITS);
+    if (ret) {
+        return ret;
+    }
+
     /* Create locfs_inode */
     ret = locfs_alloc_locfs_inode(sb, &inode_no);
     if (0 != ret) {
         printk(KERN_ERR "Unable to allocate on-disk inode. "
                         "Is inode table full? "
-                        "Inode count: %llu\n",
-                        locfs_sb->inode_count);
-        return -ENOSPC;
+                        "Inode table size: %llu\n",
+                        locfs_sb->inode_table_size);
+        ret = -ENOSPC;
+        goto out;
     }
-    locfs_inode = kmem_cache_alloc(locfs_inode_cache, GFP_KERNEL);
+
+    /* Create VFS inode, the locfs_inode lives inside it */
+    inode = new_inode(sb);
+    if (!inode) {
+        locfs_free_locfs_inode(sb, inode_no);
+        ret = -ENOMEM;
+        goto out;
+    }
+    locfs_inode = LOCFS_INODE(inode);
+    memset(locfs_inode, 0, sizeof(*locfs_inode));
+    LOCFS_I(inode)->i_flags = 0;
     locfs_inode->inode_no = inode_no;
     locfs_inode->mode = mode;
+    locfs_inode->extent_count = 0;
+    locfs_inode->extent_block_no = 0;
     if (S_ISDIR(mode)) {
         locfs_inode->dir_children_count = 0;
+        locfs_inode->dir_index_block_no = 0;
     } else if (S_ISREG(mode)) {
         locfs_inode->file_size = 0;
     } else {
@@ -189,39 +439,114 @@ int locfs_create_inode(struct inode *dir, struct dentry *dentry,
     }
 
     // Add the current location data
-    strcpy(locfs_inode->location, curr_location);
-    printk(KERN_INFO "Tagged file location %s", locfs_inode->location);
-
-    /* Allocate data block for the new locfs_inode */
-    ret = locfs_alloc_data_block(sb, &locfs_inode->data_block_no);
+    ret = locfs_curr_location_intern(sb, &locfs_inode->location_id);
     if (0 != ret) {
-        printk(KERN_ERR "Unable to allocate on-disk data block. "
-                        "Is data block table full? "
-                        "Data block count: %llu\n",
-                        locfs_sb->data_block_count);
-        return -ENOSPC;
+        goto fail;
+    }
+    // and the GPS fix, if one was given
+    locfs_get_curr_coords(&coords);
+    locfs_inode->latitude = coords.latitude;
+    locfs_inode->longitude = coords.longitude;
+    locfs_inode->altitude = coords.altitude;
+    locfs_inode->timestamp = coords.timestamp;
+
+    locfs_fill_inode(inode);
+    inode_init_owner(inode, dir, mode);
+    // Hashed inodes are found by lookups and picked up by writeback
+    insert_inode_hash(inode);
+
+    /* Regular files start out with their data in the inode when there is
+       room for it. Otherwise they get no block until writeback has data
+       for one, see locfs_writepages. */
+    if (S_ISREG(mode) && LOCFS_INLINE_DATA_MAX(sb) > 0) {
+        LOCFS_I(inode)->i_flags |= LOCFS_INODE_INLINE_DATA;
     }
 
-    /* Create VFS inode */
-    inode = new_inode(sb);
-    if (!inode) {
-        return -ENOMEM;
+    /* Directories find their children through a hash tree and list them
+       through a location index */
+    if (S_ISDIR(mode)) {
+        ret = locfs_dir_init(inode);
+        if (0 == ret) {
+            ret = locfs_locindex_create(inode);
+        }
+        if (0 != ret) {
+            goto fail;
+        }
+    }
+
+    /* Make the new inode show up in spatial queries */
+    ret = locfs_spatial_insert(sb, inode_no, locfs_inode->latitude,
+                               locfs_inode->longitude);
+    if (0 != ret) {
+        printk(KERN_ERR "Failed to add inode %lu to the spatial index\n",
+               inode->i_ino);
+        goto fail;
     }
-    locfs_fill_inode(sb, inode, locfs_inode);
 
-    /* Add new inode to parent dir */
+    /* Add new inode to parent dir, the last step that can fail */
     ret = locfs_add_dir_record(sb, dir, dentry, inode);
     if (0 != ret) {
         printk(KERN_ERR "Failed to add inode %lu to parent dir %lu\n",
                inode->i_ino, dir->i_ino);
-        return -ENOSPC;
+        locfs_spatial_remove(sb, inode_no, locfs_inode->latitude,
+                             locfs_inode->longitude);
+        goto fail;
     }
 
-    inode_init_owner(inode, dir, mode);
-    d_add(dentry, inode);
-    locfs_save_locfs_inode(sb, locfs_inode);
+    mark_inode_dirty(inode);
+    if (IS_DIRSYNC(dir)) {
+        sync_inode_metadata(inode, 1);
+        sync_inode_metadata(dir, 1);
+    }
+    // The dentry was hashed negative by the lookup before the create
+    locfs_dentry_set(dentry, locfs_location_gen(), LOCFS_LOCATION_NONE);
+    d_instantiate(dentry, inode);
+    goto out;
+
+fail:
+    // Nothing points at the inode yet, give back what it was given. The
+    // handle commits whatever was changed, see journal.c.
+    if (locfs_inode->dir_index_block_no != 0) {
+        locfs_free_data_blocks(sb, locfs_inode->dir_index_block_no, 1);
+        locfs_inode->dir_index_block_no = 0;
+    }
+    if (locfs_inode->extent_count > 0) {
+        down_write(&LOCFS_I(inode)->i_map_sem);
+        locfs_extent_truncate(inode, 0);
+        up_write(&LOCFS_I(inode)->i_map_sem);
+    }
+    locfs_free_locfs_inode(sb, inode_no);
 
-    return 0;
+    // Unlinked, so the last reference evicts it instead of caching it
+    invalidate_inode_buffers(inode);
+    clear_nlink(inode);
+    iput(inode);
+
+out:
+    if (0 == ret) {
+        ret = locfs_journal_stop(sb);
+    } else {
+        locfs_journal_stop(sb);
+    }
+    return ret;
+}
+
+int locfs_create_inode(struct inode *dir, struct dentry *dentry,
+                         umode_t mode) {
+    struct inode *inode;
+    u64 start;
+    int ret;
+
+    start = locfs_stats_start();
+    ret = __locfs_create_inode(dir, dentry, mode);
+
+    inode = ret ? NULL : d_inode(dentry);
+    trace_locfs_create(dir, dentry, mode, inode ? inode->i_ino : 0,
+                       inode ? LOCFS_INODE(inode)->location_id
+                             : LOCFS_LOCATION_NONE,
+                       ret);
+    locfs_stats_end(dir->i_sb, LOCFS_OP_CREATE, start);
+    return ret;
 }
 
 static int locfs_create(struct inode *dir, 
@@ -236,60 +561,213 @@ int locfs_mkdir(struct inode *dir,
                   struct dentry *dentry,
                   umode_t mode) 
 {
-    printk(KERN_INFO "locfs: in locfs_mkdir");
-
     // Set the mode explicitly to a directory
     mode |= S_IFDIR;
     return locfs_create_inode(dir, dentry, mode);
 }
 
+/*
+ * Only children created at the current location are visible. Lookups of
+ * the others give negative dentries. The location generation at the time
+ * a dentry was resolved is kept in d_time, and a negative dentry keeps the
+ * location of the child it hides in d_fsdata, so that revalidating after a
+ * location change needs no disk access.
+ */
+static struct dentry *__locfs_lookup(struct inode *dir,
+                                       struct dentry *child_dentry,
+                                       unsigned int flags) 
+{
+    struct super_block *sb = dir->i_sb;
+    struct inode *child_inode;
+    uint64_t inode_no;
+    uint32_t location_id;
+    unsigned int gen;
+    int ret;
+
+    if (child_dentry->d_name.len >= LOCFS_FILENAME_MAXLEN) {
+        return ERR_PTR(-ENAMETOOLONG);
+    }
+
+    // Sampled first, a location change during the lookup makes the
+    // dentry look stale rather than current
+    gen = locfs_location_gen();
+    location_id = locfs_curr_location_id(sb);
+
+    ret = locfs_dir_find(dir, child_dentry->d_name.name,
+                         child_dentry->d_name.len, &inode_no);
+    if (ret == -ENOENT) {
+        locfs_dentry_set(child_dentry, gen, LOCFS_LOCATION_NONE);
+        d_add(child_dentry, NULL);
+        return NULL;
+    } else if (ret) {
+        return ERR_PTR(ret);
+    }
+
+    child_inode = locfs_iget(sb, inode_no);
+    if (IS_ERR(child_inode)) {
+        return ERR_CAST(child_inode);
+    }
+
+    if (LOCFS_INODE(child_inode)->location_id != location_id) {
+        locfs_dentry_set(child_dentry, gen,
+                         LOCFS_INODE(child_inode)->location_id);
+        iput(child_inode);
+        child_inode = NULL;
+    } else {
+        locfs_dentry_set(child_dentry, gen, LOCFS_LOCATION_NONE);
+    }
+
+    d_add(child_dentry, child_inode);
+    return NULL;
+}
+
 struct dentry *locfs_lookup(struct inode *dir,
                               struct dentry *child_dentry,
                               unsigned int flags) 
 {
-    struct locfs_inode *parent_locfs_inode = LOCFS_INODE(dir);
-    struct super_block *sb = dir->i_sb;
-    struct buffer_head *bh;
-    struct locfs_dir_record *dir_record;
-    struct locfs_inode *locfs_child_inode;
-    struct inode *child_inode;
-    uint64_t i;
+    struct dentry *ret;
+    u64 start;
 
-    printk(KERN_INFO "locfs: in locfs_lookup");
+    start = locfs_stats_start();
+    ret = __locfs_lookup(dir, child_dentry, flags);
 
-    bh = sb_bread(sb, parent_locfs_inode->data_block_no);
-    BUG_ON(!bh);
+    trace_locfs_lookup(dir, child_dentry, IS_ERR(ret) ? PTR_ERR(ret) : 0);
+    locfs_stats_end(dir->i_sb, LOCFS_OP_LOOKUP, start);
+    return ret;
+}
 
-    dir_record = (struct locfs_dir_record *)bh->b_data;
+/*
+ * Keeps a dentry resolved at an older location generation when whether it
+ * is visible did not change, so only those entries are looked up again.
+ */
+static int locfs_d_revalidate(struct dentry *dentry, unsigned int flags)
+{
+    struct inode *inode;
+    uint32_t location_id;
+    unsigned int gen;
+    bool visible, was_visible;
+
+    gen = locfs_location_gen();
+    if (READ_ONCE(dentry->d_time) == gen) {
+        return 1;
+    }
+
+    // Everything used below is in memory, so this is safe in RCU walk
+    location_id = locfs_curr_location_id(dentry->d_sb);
+    inode = d_inode_rcu(dentry);
+    if (inode) {
+        was_visible = true;
+        visible = LOCFS_INODE(inode)->location_id == location_id;
+    } else {
+        // A name that does not exist at all stays negative
+        was_visible = false;
+        visible = (unsigned long)READ_ONCE(dentry->d_fsdata) == location_id
+                  && location_id != LOCFS_LOCATION_NONE;
+    }
+
+    if (visible != was_visible) {
+        return 0;
+    }
+
+    WRITE_ONCE(dentry->d_time, gen);
+    return 1;
+}
+
+const struct dentry_operations locfs_dentry_ops = {
+    .d_revalidate = locfs_d_revalidate,
+};
+
+/*
+ * Drops what a file holds past its size once it shrank: the tail of its
+ * inline data, or the stale end of its last block and the blocks after it.
+ * Large files are freed over several handles, see locfs_extent_truncate.
+ */
+static int locfs_truncate(struct inode *inode)
+{
+    struct super_block *sb = inode->i_sb;
+    struct locfs_inode_info *info = LOCFS_I(inode);
+    loff_t size = i_size_read(inode);
+    uint64_t from;
+    int ret, err;
+
+    if (locfs_has_inline_data(inode)) {
+        ret = locfs_journal_start(sb, LOCFS_INODE_CREDITS);
+        if (ret) {
+            return ret;
+        }
+        ret = locfs_inline_truncate(inode, size);
+        err = locfs_journal_stop(sb);
+        return ret ? ret : err;
+    }
 
-    for (i = 0; i < parent_locfs_inode->dir_children_count; i++) {
-        printk(KERN_INFO "locfs_lookup: i=%llu, dir_record->filename=%s, child_dentry->d_name.name=%s", i, dir_record->filename, child_dentry->d_name.name);
-        if (strcmp(dir_record->filename, child_dentry->d_name.name) == 0) {
-            locfs_child_inode = locfs_get_locfs_inode(sb, dir_record->inode_no);
-            printk(KERN_INFO "locfs: %s", locfs_child_inode->location);
-            child_inode = new_inode(sb);
-            if (!child_inode) {
-                printk(KERN_ERR "Cannot create new inode. No memory.\n");
-                return NULL; 
+    ret = block_truncate_page(inode->i_mapping, size, locfs_get_block);
+    if (ret) {
+        return ret;
+    }
+
+    from = DIV_ROUND_UP(size, sb->s_blocksize);
+    do {
+        ret = locfs_journal_start(sb, LOCFS_TRUNCATE_CREDITS);
+        if (ret) {
+            return ret;
+        }
+
+        down_write(&info->i_map_sem);
+        ret = locfs_extent_truncate(inode, from);
+        up_write(&info->i_map_sem);
+
+        err = locfs_journal_stop(sb);
+        if (ret >= 0 && err) {
+            ret = err;
+        }
+    } while (ret > 0);
+
+    return ret;
+}
+
+/*
+ * Moves inline data out to a block before a truncate grows past it, and
+ * frees what is past the end after one shrinks the file. Nothing changes
+ * until setattr_prepare has accepted the new attributes.
+ */
+static int locfs_setattr(struct dentry *dentry, struct iattr *attr)
+{
+    struct inode *inode = d_inode(dentry);
+    bool shrink = false;
+    int ret;
+
+    ret = setattr_prepare(dentry, attr);
+    if (ret) {
+        return ret;
+    }
+
+    if ((attr->ia_valid & ATTR_SIZE) && attr->ia_size != i_size_read(inode)) {
+        if (locfs_has_inline_data(inode)
+                && attr->ia_size > LOCFS_INLINE_DATA_MAX(inode->i_sb)) {
+            ret = locfs_inline_convert(inode);
+            if (ret) {
+                return ret;
             }
-            locfs_fill_inode(sb, child_inode, locfs_child_inode);
-            inode_init_owner(child_inode, dir, locfs_child_inode->mode);
-            d_add(child_dentry, child_inode);
-            return NULL;    
         }
-        dir_record++;
+        shrink = S_ISREG(inode->i_mode) && attr->ia_size < i_size_read(inode);
+        truncate_setsize(inode, attr->ia_size);
     }
 
-    printk(KERN_ERR
-           "No inode found for the filename: %s\n",
-           child_dentry->d_name.name);
-    return NULL;
+    setattr_copy(inode, attr);
+    mark_inode_dirty(inode);
+
+    if (!shrink) {
+        return 0;
+    }
+
+    return locfs_truncate(inode);
 }
 
 static const struct inode_operations locfs_inode_ops = {
-    .create = locfs_create,
-    .mkdir  = locfs_mkdir,
-    .lookup = locfs_lookup,
+    .create  = locfs_create,
+    .mkdir   = locfs_mkdir,
+    .lookup  = locfs_lookup,
+    .setattr = locfs_setattr,
 };
 
 // Given the inode_no, calcuate which block in inode table contains the corresponding inode
@@ -304,24 +782,17 @@ static inline uint64_t LOCFS_INODE_BLOCK_OFFSET(struct super_block *sb, uint64_t
 int locfs_iterate(struct file *filp, 
                     struct dir_context *ctx)
 {
-	loff_t pos;
 	struct inode *inode;
 	struct super_block *sb;
-	struct buffer_head *bh;
 	struct locfs_inode *lfs_inode;
-	struct locfs_inode *lfs_child_inode;
-	struct locfs_dir_record *record;
-	int i;
-
-    printk(KERN_INFO "In locfs_iterate");
+	uint32_t location_id = LOCFS_LOCATION_NONE;
+	loff_t pos = ctx->pos;
+	u64 start;
+	int ret = 0;
 
-	pos = ctx->pos;
 	inode = filp->f_inode;
 	sb = inode->i_sb;
-
-	if (pos) {
-		return 0;
-	}
+	start = locfs_stats_start();
 
 	lfs_inode = LOCFS_INODE(inode);
 
@@ -329,55 +800,60 @@ int locfs_iterate(struct file *filp,
 	if (unlikely(!S_ISDIR(lfs_inode->mode))) {
 		printk(KERN_ERR "inode [%llu][%lu] for fs object not a directory\n",
 		       lfs_inode->inode_no, inode->i_ino);
-		return -ENOTDIR;
+		ret = -ENOTDIR;
+		goto out;
 	}
 
-    // Read this inode
-	bh = sb_bread(sb, lfs_inode->data_block_no);
-	BUG_ON(!bh);
-
-	record = (struct locfs_dir_record *)bh->b_data;
-
-	for (i = 0; i < lfs_inode->dir_children_count; i++) {
-        lfs_child_inode = locfs_get_locfs_inode(sb, record->inode_no);
-
-        // Compare to see if this file was saved at the current location   
-        printk(KERN_INFO "lfs_inode->location=%s, record->filename=%s, record->inode_no=%llu", lfs_child_inode->location, record->filename, record->inode_no);
-        if (strcmp(lfs_child_inode->location, curr_location) == 0) {
-	        dir_emit(ctx, record->filename, LOCFS_FILENAME_MAXLEN, record->inode_no, DT_UNKNOWN);
-        } else {
-            printk(KERN_INFO "File %s not in %s location", record->filename, curr_location);
-        }
+    // Nothing was ever created at a location the table does not know
+	location_id = locfs_curr_location_id(sb);
+	if (location_id == LOCFS_LOCATION_NONE) {
+		goto out;
+	}
 
-        ctx->pos += sizeof(struct locfs_dir_record);
-        pos += sizeof(struct locfs_dir_record);
-        record++;
+    // A position points into the chain of the location the listing began
+    // at, after a location change the listing ends instead of going on
+    // with the records of that location
+	if (ctx->pos != 0 && filp->f_version != location_id) {
+		goto out;
 	}
-	brelse(bh);
+	filp->f_version = location_id;
+
+    // Only the records filed under the current location are read
+	ret = locfs_locindex_iterate(inode, location_id, ctx);
 
-	return 0;
+out:
+	trace_locfs_iterate(inode, location_id, pos, ctx->pos, ret);
+	locfs_stats_end(sb, LOCFS_OP_ITERATE, start);
+	return ret;
 }
 
 static const struct file_operations locfs_dir_operations = {
-    .owner   = THIS_MODULE,
-    .iterate = locfs_iterate,
+    .owner          = THIS_MODULE,
+    .iterate        = locfs_iterate,
+    .fsync          = locfs_fsync,
+    .unlocked_ioctl = locfs_ioctl,
+    .compat_ioctl   = locfs_ioctl,
 };
 
-void locfs_fill_inode(struct super_block *sb, struct inode *inode,
-                        struct locfs_inode *locfs_inode) {
+/* Sets up the VFS side of an inode from the locfs_inode embedded in it */
+void locfs_fill_inode(struct inode *inode) {
+    struct locfs_inode *locfs_inode = LOCFS_INODE(inode);
+
     inode->i_mode = locfs_inode->mode;
-    inode->i_sb = sb;
     inode->i_ino = locfs_inode->inode_no;
     inode->i_op = &locfs_inode_ops;    
     inode->i_atime = inode->i_mtime 
                    = inode->i_ctime
                    = CURRENT_TIME;
-    inode->i_private = locfs_inode;    
+    if (S_ISREG(locfs_inode->mode)) {
+        i_size_write(inode, locfs_inode->file_size);
+    }
     
     if (S_ISDIR(locfs_inode->mode)) { 
         inode->i_fop = &locfs_dir_operations;
     } else if (S_ISREG(locfs_inode->mode)) {
         inode->i_fop = &locfs_file_operations;
+        inode->i_mapping->a_ops = &locfs_aops;
     } else {
         printk(KERN_WARNING
                "Inode %lu is neither a directory nor a regular file",
@@ -386,37 +862,139 @@ void locfs_fill_inode(struct super_block *sb, struct inode *inode,
     }
 }
 
-struct locfs_inode *locfs_get_locfs_inode(struct super_block *sb,
-                                                uint64_t inode_no) {
+/*
+ * Reads the block of the inode table holding inode_no. *out_extra points
+ * at what follows the inode in its slot, NULL when the slots are no larger
+ * than struct locfs_inode.
+ */
+struct buffer_head *locfs_inode_bh(struct super_block *sb,
+                                     uint64_t inode_no,
+                                     struct locfs_inode_extra **out_extra)
+{
     struct buffer_head *bh;
+
+    bh = sb_bread(sb, LOCFS_INODE_TABLE_START_BLOCK_NO(sb) + LOCFS_INODE_BLOCK_OFFSET(sb, inode_no));
+    if (!bh) {
+        return ERR_PTR(-EIO);
+    }
+
+    *out_extra = NULL;
+    if (LOCFS_INODE_SIZE_HSB(LOCFS_SB(sb)) > LOCFS_INODE_SIZE) {
+        *out_extra = (struct locfs_inode_extra *)(bh->b_data
+                         + LOCFS_INODE_BYTE_OFFSET(sb, inode_no)
+                         + LOCFS_INODE_SIZE);
+    }
+
+    return bh;
+}
+
+/* Copies the slot of the inode table holding inode_no into info */
+static int locfs_read_locfs_inode(struct super_block *sb,
+                                    uint64_t inode_no,
+                                    struct locfs_inode_info *info) {
+    struct buffer_head *bh;
+    struct locfs_inode_extra *extra;
     struct locfs_inode *inode;
-    struct locfs_inode *inode_buf;
 
-    bh = sb_bread(sb, LOCFS_INODE_TABLE_START_BLOCK_NO + LOCFS_INODE_BLOCK_OFFSET(sb, inode_no));
-    BUG_ON(!bh);
+    bh = locfs_inode_bh(sb, inode_no, &extra);
+    if (IS_ERR(bh)) {
+        return PTR_ERR(bh);
+    }
     
     inode = (struct locfs_inode *)(bh->b_data + LOCFS_INODE_BYTE_OFFSET(sb, inode_no));
-    inode_buf = kmem_cache_alloc(locfs_inode_cache, GFP_KERNEL);
-    memcpy(inode_buf, inode, sizeof(*inode_buf));
+    memcpy(&info->i_disk, inode, sizeof(info->i_disk));
+    info->i_flags = extra ? extra->flags : 0;
 
     brelse(bh);
-    return inode_buf;
+    return 0;
+}
+
+/*
+ * Returns the in-core inode for inode_no, reading it from the inode table
+ * only when it is not cached already.
+ */
+struct inode *locfs_iget(struct super_block *sb, uint64_t inode_no)
+{
+    struct inode *inode;
+    int ret;
+
+    inode = iget_locked(sb, inode_no);
+    if (!inode) {
+        return ERR_PTR(-ENOMEM);
+    }
+    if (!(inode->i_state & I_NEW)) {
+        return inode;
+    }
+
+    ret = locfs_read_locfs_inode(sb, inode_no, LOCFS_I(inode));
+    if (ret == 0 && unlikely(LOCFS_INODE(inode)->inode_no != inode_no)) {
+        printk(KERN_ERR "locfs: Inode table slot %llu holds inode %llu\n",
+               inode_no, LOCFS_INODE(inode)->inode_no);
+        ret = -EIO;
+    }
+    if (ret) {
+        iget_failed(inode);
+        return ERR_PTR(ret);
+    }
+
+    locfs_fill_inode(inode);
+    // Owners are not stored on disk
+    inode_init_owner(inode, NULL, inode->i_mode);
+    unlock_new_inode(inode);
+    return inode;
 }
 
-void locfs_save_locfs_inode(struct super_block *sb,
-                                struct locfs_inode *inode_buf) {
+/* Copies the in-memory inode into its slot of the inode table */
+int locfs_save_locfs_inode(struct inode *vfs_inode, int sync) {
+    struct super_block *sb = vfs_inode->i_sb;
+    struct locfs_inode_info *info = LOCFS_I(vfs_inode);
     struct buffer_head *bh;
+    struct locfs_inode_extra *extra;
     struct locfs_inode *inode;
     uint64_t inode_no;
+    int ret = 0;
 
-    inode_no = inode_buf->inode_no;
-    bh = sb_bread(sb, LOCFS_INODE_TABLE_START_BLOCK_NO + LOCFS_INODE_BLOCK_OFFSET(sb, inode_no));
-    BUG_ON(!bh);
+    inode_no = info->i_disk.inode_no;
+    bh = locfs_inode_bh(sb, inode_no, &extra);
+    if (IS_ERR(bh)) {
+        return PTR_ERR(bh);
+    }
 
     inode = (struct locfs_inode *)(bh->b_data + LOCFS_INODE_BYTE_OFFSET(sb, inode_no));
-    memcpy(inode, inode_buf, sizeof(*inode));
+    memcpy(inode, &info->i_disk, sizeof(*inode));
+    // Inline data is stored by locfs_inline_writepage, not here
+    if (extra) {
+        extra->flags = info->i_flags;
+    }
 
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
+    locfs_dirty_buffer(sb, bh, NULL);
+    if (sync) {
+        ret = locfs_sync_buffer(sb, bh);
+    }
     brelse(bh);
+
+    return ret;
+}
+
+/* Called by writeback (super_operations.write_inode) for dirty inodes */
+int locfs_write_inode(struct inode *inode, struct writeback_control *wbc)
+{
+    struct locfs_inode_info *info = LOCFS_I(inode);
+    int ret, err;
+
+    // Size updates are logged like any other metadata change
+    ret = locfs_journal_start(inode->i_sb, LOCFS_INODE_CREDITS);
+    if (ret) {
+        return ret;
+    }
+
+    down_read(&info->i_map_sem);
+    if (S_ISREG(info->i_disk.mode)) {
+        info->i_disk.file_size = i_size_read(inode);
+    }
+    ret = locfs_save_locfs_inode(inode, wbc->sync_mode == WB_SYNC_ALL);
+    up_read(&info->i_map_sem);
+
+    err = locfs_journal_stop(inode->i_sb);
+    return ret ? ret : err;
 }
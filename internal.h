@@ -4,13 +4,164 @@
  * By, Robert Chrystie
  */
 
+#include <linux/hashtable.h>
+#include <linux/ktime.h>
+#include <linux/percpu_counter.h>
+#include <linux/percpu-rwsem.h>
 #include "include/locfs.h"
+#include "include/locfs_ioctl.h"
+#include "include/locfs_feed.h"
+
+/* Default interval between journal commits, the commit= mount option */
+#define LOCFS_DEFAULT_COMMIT_INTERVAL (5 * HZ)
+
+/* Most metadata blocks dirtied by one operation, used to size handles */
+#define LOCFS_CREATE_CREDITS 44
+#define LOCFS_ALLOC_CREDITS 4
+#define LOCFS_INODE_CREDITS 1
+#define LOCFS_TRUNCATE_CREDITS 10
+
+/* How far the per-CPU free counts may be from their exact sum */
+#define LOCFS_COUNTER_SLACK (4 * percpu_counter_batch * nr_cpu_ids)
+
+/* Inodes and data blocks in one allocation group, see bitmap.c */
+#define LOCFS_INODE_GROUP_BITS 256
+#define LOCFS_DATA_GROUP_BITS 4096
+
+struct locfs_journal;
+
+/* Operations counted in the per-CPU statistics, see stats.c */
+enum locfs_op {
+    LOCFS_OP_LOOKUP,
+    LOCFS_OP_ITERATE,
+    LOCFS_OP_CREATE,
+    LOCFS_OP_ALLOC,
+    LOCFS_OP_READ,
+    LOCFS_OP_WRITE,
+    LOCFS_OP_NR,
+};
+
+/* Latency histogram buckets, bucket i counts [2^i, 2^(i+1)) nanoseconds */
+#define LOCFS_STATS_BUCKETS 32
+
+struct locfs_stats {
+    u64 st_count[LOCFS_OP_NR];
+    u64 st_ns[LOCFS_OP_NR];
+    u64 st_hist[LOCFS_OP_NR][LOCFS_STATS_BUCKETS];
+};
+
+/* A slice of a bitmap which is allocated from under its own lock */
+struct locfs_group {
+    struct mutex g_lock;
+    uint32_t g_free;            /* clear bits in the group */
+    uint64_t g_cursor;          /* where the next search starts */
+};
+
+/* An inode or data block bitmap, cached in memory while mounted */
+struct locfs_bitmap {
+    void *b_map;                /* copy of the on-disk bitmap */
+    uint64_t b_bits;            /* inodes or blocks covered */
+    uint64_t b_start;           /* first on-disk bitmap block */
+    uint64_t b_blocks;          /* on-disk bitmap blocks */
+    uint64_t b_bits_per_block;
+    uint64_t b_group_bits;      /* bits per allocation group */
+    uint64_t b_groups;
+    struct locfs_group *b_group;
+    /* Held for read by allocations, for write while the bitmap grows */
+    struct percpu_rw_semaphore b_resize_sem;
+};
+
+/* The location table, see location.c */
+struct locfs_location_table {
+    DECLARE_HASHTABLE(t_hash, 8);
+    /* Serializes adding names */
+    struct mutex t_lock;
+    uint32_t t_count;           /* highest ID handed out */
+    uint64_t t_last_block_no;   /* block new names are added to */
+};
+
+/* In-memory super_block information, hung off super_block.s_fs_info */
+struct locfs_sb_info {
+    /* Buffer holding the on-disk super_block, pinned while mounted */
+    struct buffer_head *s_sbh;
+    struct locfs_super_block *s_lsb;
+
+    /* Free inodes and data blocks, the counts in s_lsb are only brought
+       up to date from them by locfs_sync_fs */
+    struct percpu_counter s_free_inodes;
+    struct percpu_counter s_free_blocks;
+    /* Data blocks set aside for delayed writes */
+    struct percpu_counter s_dirty_blocks;
+    /* Serializes growing the image, see resize.c */
+    struct mutex s_resize_lock;
+
+    /* NULL when the image was formatted without a journal */
+    struct locfs_journal *s_journal;
+    unsigned long s_commit_interval;
+
+    struct locfs_bitmap s_inode_bitmap;
+    struct locfs_bitmap s_data_bitmap;
+
+    struct locfs_location_table s_locations;
+    /* From the location= mount option, NULL follows /proc/locationmod */
+    struct locfs_curr_location __rcu *s_location;
+
+    /* Held for write while the spatial index changes */
+    struct rw_semaphore s_spatial_sem;
+
+    struct locfs_stats __percpu *s_stats;
+    /* /proc/fs/locfs/<dev>, NULL when it could not be created */
+    struct proc_dir_entry *s_proc;
+};
+
+/* A location name published through RCU, see locationmod.c */
+struct locfs_curr_location {
+    struct rcu_head l_rcu;
+    char l_name[LOCFS_LOCATION_MAXLEN];
+};
+
+/* A GPS fix, in the units of struct locfs_inode */
+struct locfs_coords {
+    int32_t latitude;
+    int32_t longitude;
+    int32_t altitude;
+    uint64_t timestamp;
+};
+
+/* In-memory inode, the on-disk inode plus the locks guarding it */
+struct locfs_inode_info {
+    struct locfs_inode i_disk;
+    /* LOCFS_INODE_* flags, kept past i_disk on images with larger inodes */
+    uint32_t i_flags;
+
+    /* Protects the block map against concurrent allocation */
+    struct rw_semaphore i_map_sem;
+    /* Directories: logical block the next tree block goes in, 0 until
+       it has been worked out, see locfs_dir_new_block */
+    uint64_t i_dir_next;
+
+    /* Reservations of the delayed blocks of a regular file, and whether
+       the overflow extent block is reserved too, see locfs_reserve_delayed */
+    spinlock_t i_reserve_lock;
+    uint64_t i_reserved_data;
+    bool i_reserved_meta;
+
+    struct inode vfs_inode;
+};
 
 /* main.c */
 extern struct kmem_cache *locfs_inode_cache;
 
 /* file.c */
 extern const struct file_operations locfs_file_operations;
+extern const struct address_space_operations locfs_aops;
+
+int locfs_get_block(struct inode *inode, sector_t iblock,
+                      struct buffer_head *bh_result, int create);
+
+int locfs_delay_buffer(struct inode *inode, struct buffer_head *bh);
+
+int locfs_fsync(struct file *file, loff_t start, loff_t end, int datasync);
 
 /* super.c */
 struct dentry *locfs_mount(struct file_system_type *fs_type,
@@ -20,38 +171,287 @@ struct dentry *locfs_mount(struct file_system_type *fs_type,
 
 void locfs_save_sb(struct super_block *sb);
 
+void locfs_dirty_buffer(struct super_block *sb,
+                          struct buffer_head *bh,
+                          struct inode *inode);
+
+int locfs_sync_buffer(struct super_block *sb, struct buffer_head *bh);
+
 /* inode.c */
-void locfs_save_locfs_inode(struct super_block *sb,
-                              struct locfs_inode *inode);
+int locfs_save_locfs_inode(struct inode *inode, int sync);
 
-struct locfs_inode *locfs_get_locfs_inode(struct super_block *sb,
-                                            uint64_t inode_no);
+struct buffer_head *locfs_inode_bh(struct super_block *sb,
+                                     uint64_t inode_no,
+                                     struct locfs_inode_extra **out_extra);
 
-void locfs_fill_inode(struct super_block *sb, 
-                        struct inode *inode,
-                        struct locfs_inode *locfs_inode);
+int locfs_write_inode(struct inode *inode, struct writeback_control *wbc);
+
+struct inode *locfs_iget(struct super_block *sb, uint64_t inode_no);
+
+void locfs_fill_inode(struct inode *inode);
+
+extern const struct dentry_operations locfs_dentry_ops;
 
 int locfs_mkdir(struct inode *dir, struct dentry *dentry,
                    umode_t mode);
 
+int locfs_alloc_data_blocks(struct super_block *sb, uint64_t goal,
+                              uint64_t count, uint64_t *out_start,
+                              uint64_t *out_len);
+
+int locfs_alloc_data_block(struct super_block *sb, uint64_t *out_data_block_no);
+
+int locfs_reserve_data_blocks(struct super_block *sb, uint64_t count,
+                                bool force);
+
+void locfs_release_data_blocks(struct super_block *sb, uint64_t count);
+
+int locfs_free_data_blocks(struct super_block *sb, uint64_t start,
+                             uint64_t count);
+
+int locfs_reserve_delayed(struct inode *inode);
+
+void locfs_delayed_allocated(struct inode *inode, uint64_t count);
+
+void locfs_release_delayed(struct inode *inode, uint64_t count);
+
+void locfs_claim_meta_reservation(struct inode *inode);
+
+struct buffer_head *locfs_new_chain_block(struct super_block *sb,
+                                            struct inode *inode,
+                                            uint64_t magic,
+                                            uint64_t goal,
+                                            uint64_t *out_block_no);
+
+struct buffer_head *locfs_read_chain_block(struct super_block *sb,
+                                             uint64_t block_no,
+                                             uint64_t magic);
+
+/* inline.c */
+int locfs_inline_readpage(struct inode *inode, struct page *page);
+
+int locfs_inline_writepage(struct page *page, struct writeback_control *wbc);
+
+int locfs_inline_write_begin(struct address_space *mapping,
+                               loff_t pos,
+                               unsigned flags,
+                               struct page **pagep);
+
+int locfs_inline_write_end(struct address_space *mapping,
+                             loff_t pos,
+                             unsigned copied,
+                             struct page *page);
+
+int locfs_inline_convert(struct inode *inode);
+
+int locfs_inline_truncate(struct inode *inode, loff_t size);
+
+/* extent.c */
+int locfs_extent_map(struct super_block *sb,
+                       struct locfs_inode *locfs_inode,
+                       uint64_t iblock,
+                       uint64_t *out_pblock,
+                       uint64_t *out_len);
+
+int locfs_extent_alloc(struct inode *inode,
+                         uint64_t iblock,
+                         uint64_t count,
+                         uint64_t *out_pblock,
+                         uint64_t *out_len);
+
+int locfs_extent_end(struct super_block *sb,
+                       struct locfs_inode *locfs_inode,
+                       uint64_t *out_end);
+
+int locfs_extent_truncate(struct inode *inode, uint64_t from);
+
+/* dir.c */
+int locfs_dir_init(struct inode *dir);
+
+int locfs_dir_find(struct inode *dir,
+                     const char *name,
+                     size_t len,
+                     uint64_t *out_inode_no);
+
+int locfs_dir_insert(struct inode *dir,
+                       const char *name,
+                       size_t len,
+                       uint64_t inode_no);
+
+/* bitmap.c */
+int locfs_bitmap_load(struct super_block *sb,
+                        struct locfs_bitmap *bm,
+                        uint64_t start,
+                        uint64_t bits,
+                        uint64_t group_bits);
+
+uint64_t locfs_bitmap_free_count(struct locfs_bitmap *bm);
+
+int locfs_bitmap_grow(struct super_block *sb,
+                        struct locfs_bitmap *bm,
+                        uint64_t bits,
+                        uint64_t *out_free);
+
+void locfs_bitmap_release(struct locfs_bitmap *bm);
+
+int locfs_bitmap_alloc(struct super_block *sb,
+                         struct locfs_bitmap *bm,
+                         uint64_t goal,
+                         uint64_t count,
+                         uint64_t *out_bit,
+                         uint64_t *out_len);
+
+int locfs_bitmap_free(struct super_block *sb,
+                        struct locfs_bitmap *bm,
+                        uint64_t bit,
+                        uint64_t len);
+
+/* locindex.c */
+int locfs_locindex_create(struct inode *dir);
+
+int locfs_locindex_add(struct inode *dir,
+                         uint32_t location_id,
+                         const char *filename,
+                         uint64_t inode_no);
+
+int locfs_locindex_remove(struct inode *dir,
+                            uint32_t location_id,
+                            uint64_t inode_no);
+
+int locfs_locindex_iterate(struct inode *dir,
+                             uint32_t location_id,
+                             struct dir_context *ctx);
+
+/* location.c */
+int locfs_location_load(struct super_block *sb);
+
+void locfs_location_release(struct super_block *sb);
+
+uint32_t locfs_location_lookup(struct super_block *sb, const char *name);
+
+int locfs_location_intern(struct super_block *sb,
+                            const char *name,
+                            uint32_t *out_id);
+
+/* spatial.c */
+int locfs_spatial_insert(struct super_block *sb,
+                           uint64_t inode_no,
+                           int32_t latitude,
+                           int32_t longitude);
+
+int locfs_spatial_remove(struct super_block *sb,
+                           uint64_t inode_no,
+                           int32_t latitude,
+                           int32_t longitude);
+
+int locfs_spatial_query(struct super_block *sb,
+                          struct locfs_spatial_query *query);
+
+/* resize.c */
+int locfs_grow(struct super_block *sb, uint64_t blocks);
+
+/* ioctl.c */
+long locfs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+
+/* feed.c */
+int locfs_feed_register(void);
+
+void locfs_feed_unregister(void);
+
+void locfs_feed_pull(void);
+
+/* stats.c */
+int locfs_stats_register(void);
+
+void locfs_stats_unregister(void);
+
+int locfs_stats_init(struct super_block *sb);
+
+void locfs_stats_destroy(struct super_block *sb);
+
+void locfs_stats_end(struct super_block *sb, enum locfs_op op, u64 start);
+
+/* Timestamp to pass to locfs_stats_end once the operation is done */
+static inline u64 locfs_stats_start(void)
+{
+    return ktime_get_ns();
+}
+
+/* journal.c */
+int locfs_journal_load(struct super_block *sb, unsigned long commit_interval);
+
+void locfs_journal_destroy(struct super_block *sb);
+
+int locfs_journal_start(struct super_block *sb, int credits);
+
+int locfs_journal_stop(struct super_block *sb);
+
+void locfs_journal_dirty_metadata(struct super_block *sb,
+                                    struct buffer_head *bh);
+
+void locfs_journal_set_sync(struct super_block *sb);
+
+int locfs_journal_force_commit(struct super_block *sb);
+
+void locfs_journal_set_commit_interval(struct super_block *sb,
+                                         unsigned long commit_interval);
+
 /* locationmod.c */
-extern char *curr_location;
+unsigned int locfs_location_gen(void);
+
+struct locfs_curr_location *locfs_new_curr_location(const char *name,
+                                                      size_t len);
+
+void locfs_set_curr_location(struct locfs_curr_location __rcu **slot,
+                               struct locfs_curr_location *loc);
+
+uint32_t locfs_curr_location_id(struct super_block *sb);
+
+int locfs_curr_location_intern(struct super_block *sb, uint32_t *out_id);
+
+void locfs_get_curr_coords(struct locfs_coords *coords);
+
+void locfs_set_curr_coords(const struct locfs_coords *coords);
 
 int create_locationmod_proc(void);
 
 void remove_locationmod_proc(void);
 
 /* Helper functions */
+/* Used to get the locfs_sb_info out of the super_block */
+static inline struct locfs_sb_info *LOCFS_SBI(struct super_block *sb)
+{
+    return sb->s_fs_info;
+}
+
 /* Used to get the locfs_super_block out of the super_block */
 static inline struct locfs_super_block *LOCFS_SB(struct super_block *sb) 
 {
-    return sb->s_fs_info;
+    return LOCFS_SBI(sb)->s_lsb;
+}
+
+/* Used to get the locfs_inode_info out of the inode */
+static inline struct locfs_inode_info *LOCFS_I(struct inode *inode)
+{
+    return container_of(inode, struct locfs_inode_info, vfs_inode);
 }
 
 /* Used to get the locfs_inode out of the super_block */
 static inline struct locfs_inode *LOCFS_INODE(struct inode *inode) 
 {
-    return inode->i_private;
+    return &LOCFS_I(inode)->i_disk;
+}
+
+/* Bytes of data a file can keep in its inode */
+static inline uint64_t LOCFS_INLINE_DATA_MAX(struct super_block *sb)
+{
+    return LOCFS_INLINE_DATA_MAX_HSB(LOCFS_SB(sb));
+}
+
+/* Whether the data of the file lives in its inode rather than in blocks */
+static inline bool locfs_has_inline_data(struct inode *inode)
+{
+    return LOCFS_I(inode)->i_flags & LOCFS_INODE_INLINE_DATA;
 }
 
 /* Used to retrieve the number of inodes in a block */
@@ -0,0 +1,56 @@
+/*
+ * Location Based Filesystem
+ *
+ * By, Robert Chrystie
+ */
+
+#include <linux/capability.h>
+#include <linux/fs.h>
+#include <linux/mount.h>
+#include <linux/uaccess.h>
+#include "internal.h"
+
+/* file_operations.unlocked_ioctl for files and directories */
+long locfs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct super_block *sb = file_inode(filp)->i_sb;
+    struct locfs_spatial_query query;
+    uint64_t blocks;
+    int ret;
+
+    switch (cmd) {
+    case LOCFS_IOC_SPATIAL_QUERY:
+        if (copy_from_user(&query, (void __user *)arg, sizeof(query))) {
+            return -EFAULT;
+        }
+
+        ret = locfs_spatial_query(sb, &query);
+        if (ret) {
+            return ret;
+        }
+
+        if (copy_to_user((void __user *)arg, &query, sizeof(query))) {
+            return -EFAULT;
+        }
+        return 0;
+
+    case LOCFS_IOC_GROW:
+        if (!capable(CAP_SYS_RESOURCE)) {
+            return -EPERM;
+        }
+        if (copy_from_user(&blocks, (void __user *)arg, sizeof(blocks))) {
+            return -EFAULT;
+        }
+
+        ret = mnt_want_write_file(filp);
+        if (ret) {
+            return ret;
+        }
+        ret = locfs_grow(sb, blocks);
+        mnt_drop_write_file(filp);
+        return ret;
+
+    default:
+        return -ENOTTY;
+    }
+}
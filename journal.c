@@ -0,0 +1,813 @@
+/*
+ * Location Based Filesystem
+ *
+ * By, Robert Chrystie
+ */
+
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/crc32.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+#include "internal.h"
+
+/*
+ * Metadata journal
+ *
+ * Every metadata update runs inside a handle. All handles share one running
+ * transaction, which collects the buffers they dirtied. A commit waits for
+ * the open handles to finish, logs the collected buffers and writes the
+ * commit block. New handles are let in as soon as the commit block is
+ * durable, while the logged copies are written home. Commits are triggered
+ * by the commit interval timer, by fsync()/sync() or when the transaction is
+ * full, so many operations share a single journal flush.
+ *
+ * Buffers are modified in place and shared with every other handle in the
+ * transaction, so a handle cannot be rolled back. An operation that fails
+ * half way has to undo its own changes to the buffers, and give back what
+ * it allocated, before it stops its handle; whatever is left is committed.
+ */
+
+/* Marks buffers already collected by the running transaction */
+enum locfs_bh_state_bits {
+    BH_LocfsJournaled = BH_PrivateStart,
+};
+
+BUFFER_FNS(LocfsJournaled, locfs_journaled)
+
+struct locfs_journal {
+    struct super_block *j_sb;
+
+    uint64_t j_start;           /* block of the journal super_block */
+    uint64_t j_maxlen;          /* blocks in the journal */
+    uint64_t j_first;           /* first log block, relative to j_start */
+    uint64_t j_sequence;        /* sequence of the running transaction */
+    int j_max_buffers;          /* blocks a single transaction may log */
+
+    /* Held shared by handles, exclusively by a commit */
+    struct rw_semaphore j_barrier;
+    struct mutex j_commit_mutex;
+
+    spinlock_t j_lock;          /* protects the running transaction */
+    int j_nr_buffers;
+    int j_reserved;
+    struct buffer_head **j_buffers;
+    struct buffer_head **j_log_buffers;
+
+    /* The committed transaction while it is written home */
+    struct buffer_head **j_checkpoint;
+    struct buffer_head **j_home_buffers;
+
+    bool j_need_flush;          /* home writes not yet flushed */
+    bool j_aborted;
+
+    unsigned long j_commit_interval;
+    struct delayed_work j_commit_work;
+};
+
+struct locfs_handle {
+    struct locfs_journal *h_journal;
+    int h_ref;
+    int h_credits;
+    int h_added;
+    int h_sync;
+};
+
+static inline struct locfs_journal *LOCFS_JOURNAL(struct super_block *sb)
+{
+    return LOCFS_SBI(sb)->s_journal;
+}
+
+/* Returns a zeroed, up to date buffer for a block that is about to be overwritten */
+static struct buffer_head *locfs_journal_new_block(struct locfs_journal *journal,
+                                                     uint64_t block)
+{
+    struct buffer_head *bh;
+
+    bh = sb_getblk(journal->j_sb, block);
+    if (!bh) {
+        return NULL;
+    }
+
+    lock_buffer(bh);
+    memset(bh->b_data, 0, bh->b_size);
+    set_buffer_uptodate(bh);
+    unlock_buffer(bh);
+
+    return bh;
+}
+
+static void locfs_journal_header(struct locfs_journal_header *header,
+                                   uint32_t blocktype,
+                                   uint64_t sequence)
+{
+    header->magic = LOCFS_JOURNAL_MAGIC;
+    header->blocktype = blocktype;
+    header->sequence = sequence;
+}
+
+/*
+ * Stops journaling after an I/O error and makes the file system read
+ * only. Journaled buffers are never written home from here on: the log
+ * is left as it is, so replaying it on the next mount is the only way
+ * committed changes get home, each transaction whole or not at all.
+ */
+static void locfs_journal_abort(struct locfs_journal *journal, int err)
+{
+    struct super_block *sb = journal->j_sb;
+
+    if (journal->j_aborted) {
+        return;
+    }
+
+    printk(KERN_ERR "locfs: Journal aborted on %s, error %d, remounting "
+                    "read only\n", sb->s_id, err);
+
+    journal->j_aborted = true;
+    sb->s_flags |= MS_RDONLY;
+}
+
+/*
+ * Writes the logged copies of the committed transaction home, through
+ * buffers of their own, so handles are free to modify the live buffers in
+ * the meantime. Those stay pinned in j_checkpoint until the writes are done,
+ * so a stale home block is never read back in their place.
+ */
+static int locfs_journal_checkpoint(struct locfs_journal *journal,
+                                      uint64_t *tags,
+                                      int nr)
+{
+    struct super_block *sb = journal->j_sb;
+    struct buffer_head *log_bh, *bh;
+    struct blk_plug plug;
+    int nr_home = 0;
+    int i;
+    int ret = 0;
+
+    blk_start_plug(&plug);
+    for (i = 0; i < nr; i++) {
+        log_bh = journal->j_log_buffers[i];
+
+        bh = alloc_buffer_head(GFP_NOFS);
+        if (!bh) {
+            ret = -ENOMEM;
+            break;
+        }
+        set_bh_page(bh, log_bh->b_page, bh_offset(log_bh));
+        bh->b_size = log_bh->b_size;
+        bh->b_bdev = sb->s_bdev;
+        bh->b_blocknr = tags[i];
+        set_buffer_mapped(bh);
+        set_buffer_uptodate(bh);
+
+        lock_buffer(bh);
+        get_bh(bh);
+        bh->b_end_io = end_buffer_write_sync;
+        submit_bh(REQ_OP_WRITE, 0, bh);
+        journal->j_home_buffers[nr_home++] = bh;
+    }
+    blk_finish_plug(&plug);
+
+    for (i = 0; i < nr_home; i++) {
+        bh = journal->j_home_buffers[i];
+        wait_on_buffer(bh);
+        if (!buffer_uptodate(bh)) {
+            printk(KERN_ERR "locfs: Failed writing block %llu home\n",
+                   (uint64_t)bh->b_blocknr);
+            ret = -EIO;
+        }
+        free_buffer_head(bh);
+    }
+
+    for (i = 0; i < nr; i++) {
+        brelse(journal->j_checkpoint[i]);
+    }
+
+    return ret;
+}
+
+static int locfs_journal_commit(struct locfs_journal *journal)
+{
+    struct super_block *sb = journal->j_sb;
+    struct locfs_journal_descriptor *desc;
+    struct locfs_journal_commit *commit;
+    struct buffer_head *desc_bh = NULL;
+    struct buffer_head *commit_bh = NULL;
+    struct buffer_head *bh;
+    struct blk_plug plug;
+    uint64_t block;
+    uint32_t crc = ~0U;
+    int nr_logged = 0;
+    int nr, i;
+    int ret = 0;
+
+    mutex_lock(&journal->j_commit_mutex);
+    down_write(&journal->j_barrier);
+
+    nr = journal->j_nr_buffers;
+    if (nr == 0 || journal->j_aborted) {
+        goto out;
+    }
+
+    // The previous transaction's home writes must be stable before its
+    // log blocks are overwritten
+    if (journal->j_need_flush) {
+        ret = blkdev_issue_flush(sb->s_bdev, GFP_NOFS, NULL);
+        if (ret) {
+            goto abort;
+        }
+        journal->j_need_flush = false;
+    }
+
+    block = journal->j_start + journal->j_first;
+    desc_bh = locfs_journal_new_block(journal, block);
+    if (!desc_bh) {
+        ret = -EIO;
+        goto abort;
+    }
+    desc = (struct locfs_journal_descriptor *)desc_bh->b_data;
+    locfs_journal_header(&desc->header, LOCFS_JOURNAL_DESCRIPTOR,
+                         journal->j_sequence);
+    desc->count = nr;
+
+    for (i = 0; i < nr; i++) {
+        bh = journal->j_buffers[i];
+        desc->tags[i] = bh->b_blocknr;
+
+        journal->j_log_buffers[i] = locfs_journal_new_block(journal, block + 1 + i);
+        if (!journal->j_log_buffers[i]) {
+            ret = -EIO;
+            goto abort;
+        }
+        nr_logged++;
+
+        memcpy(journal->j_log_buffers[i]->b_data, bh->b_data, bh->b_size);
+        crc = crc32_le(crc, journal->j_log_buffers[i]->b_data, bh->b_size);
+        mark_buffer_dirty(journal->j_log_buffers[i]);
+    }
+    mark_buffer_dirty(desc_bh);
+
+    blk_start_plug(&plug);
+    write_dirty_buffer(desc_bh, 0);
+    for (i = 0; i < nr; i++) {
+        write_dirty_buffer(journal->j_log_buffers[i], 0);
+    }
+    blk_finish_plug(&plug);
+
+    wait_on_buffer(desc_bh);
+    if (!buffer_uptodate(desc_bh)) {
+        ret = -EIO;
+    }
+    for (i = 0; i < nr; i++) {
+        wait_on_buffer(journal->j_log_buffers[i]);
+        if (!buffer_uptodate(journal->j_log_buffers[i])) {
+            ret = -EIO;
+        }
+    }
+    if (ret) {
+        goto abort;
+    }
+
+    // The flush ahead of the commit block orders it after the log blocks
+    commit_bh = locfs_journal_new_block(journal, block + 1 + nr);
+    if (!commit_bh) {
+        ret = -EIO;
+        goto abort;
+    }
+    commit = (struct locfs_journal_commit *)commit_bh->b_data;
+    locfs_journal_header(&commit->header, LOCFS_JOURNAL_COMMIT,
+                         journal->j_sequence);
+    commit->count = nr;
+    commit->checksum = crc;
+    mark_buffer_dirty(commit_bh);
+
+    ret = __sync_dirty_buffer(commit_bh, REQ_SYNC | REQ_PREFLUSH | REQ_FUA);
+    if (ret) {
+        goto abort;
+    }
+
+    // The transaction is durable, the next one can start while it is
+    // checkpointed. The commit mutex keeps its log blocks from being
+    // reused until they are home.
+    for (i = 0; i < nr; i++) {
+        clear_buffer_locfs_journaled(journal->j_buffers[i]);
+        journal->j_checkpoint[i] = journal->j_buffers[i];
+    }
+    journal->j_nr_buffers = 0;
+    journal->j_reserved = 0;
+    journal->j_sequence += 1;
+    up_write(&journal->j_barrier);
+
+    ret = locfs_journal_checkpoint(journal, desc->tags, nr);
+    if (ret) {
+        // Keep the transaction in the log to be replayed on the next mount.
+        // The next one, already running, is dropped with the abort.
+        down_write(&journal->j_barrier);
+        locfs_journal_abort(journal, ret);
+        up_write(&journal->j_barrier);
+    }
+    journal->j_need_flush = true;
+
+    for (i = 0; i < nr; i++) {
+        brelse(journal->j_log_buffers[i]);
+    }
+    brelse(desc_bh);
+    brelse(commit_bh);
+
+    mutex_unlock(&journal->j_commit_mutex);
+    return ret;
+
+abort:
+    locfs_journal_abort(journal, ret);
+
+    // The transaction is dropped, its buffers are not written home
+    for (i = 0; i < nr; i++) {
+        clear_buffer_locfs_journaled(journal->j_buffers[i]);
+        brelse(journal->j_buffers[i]);
+    }
+    for (i = 0; i < nr_logged; i++) {
+        brelse(journal->j_log_buffers[i]);
+    }
+    brelse(desc_bh);
+    brelse(commit_bh);
+
+    journal->j_nr_buffers = 0;
+    journal->j_reserved = 0;
+
+out:
+    up_write(&journal->j_barrier);
+    mutex_unlock(&journal->j_commit_mutex);
+    return ret;
+}
+
+static void locfs_journal_commit_work(struct work_struct *work)
+{
+    struct locfs_journal *journal = container_of(to_delayed_work(work),
+                                                 struct locfs_journal,
+                                                 j_commit_work);
+
+    locfs_journal_commit(journal);
+}
+
+/*
+ * Opens a handle for an update dirtying at most credits metadata blocks.
+ * Handles nest, an inner handle is charged to the outermost one.
+ */
+int locfs_journal_start(struct super_block *sb, int credits)
+{
+    struct locfs_journal *journal = LOCFS_JOURNAL(sb);
+    struct locfs_handle *handle = current->journal_info;
+
+    if (!journal) {
+        return 0;
+    }
+
+    if (handle) {
+        WARN_ON(handle->h_journal != journal);
+        handle->h_ref += 1;
+        return 0;
+    }
+
+    if (credits > journal->j_max_buffers) {
+        credits = journal->j_max_buffers;
+    }
+
+    handle = kzalloc(sizeof(*handle), GFP_NOFS);
+    if (!handle) {
+        return -ENOMEM;
+    }
+    handle->h_journal = journal;
+    handle->h_ref = 1;
+    handle->h_credits = credits;
+
+    for (;;) {
+        down_read(&journal->j_barrier);
+        if (journal->j_aborted) {
+            up_read(&journal->j_barrier);
+            kfree(handle);
+            return -EIO;
+        }
+
+        spin_lock(&journal->j_lock);
+        if (journal->j_reserved + credits <= journal->j_max_buffers) {
+            journal->j_reserved += credits;
+            spin_unlock(&journal->j_lock);
+            break;
+        }
+        spin_unlock(&journal->j_lock);
+        up_read(&journal->j_barrier);
+
+        // The running transaction is full, commit it to make room
+        locfs_journal_commit(journal);
+    }
+
+    current->journal_info = handle;
+    return 0;
+}
+
+/*
+ * Closes the handle, committing straight away when it was marked sync.
+ * There is no rolling back, whatever the handle changed is committed.
+ */
+int locfs_journal_stop(struct super_block *sb)
+{
+    struct locfs_journal *journal = LOCFS_JOURNAL(sb);
+    struct locfs_handle *handle = current->journal_info;
+    bool pending;
+    bool sync;
+
+    if (!journal) {
+        return 0;
+    }
+
+    if (WARN_ON(!handle)) {
+        return -EIO;
+    }
+
+    handle->h_ref -= 1;
+    if (handle->h_ref > 0) {
+        return 0;
+    }
+    current->journal_info = NULL;
+
+    // Give back the credits this handle did not use
+    spin_lock(&journal->j_lock);
+    journal->j_reserved -= handle->h_credits
+                           - min(handle->h_added, handle->h_credits);
+    pending = journal->j_nr_buffers > 0;
+    spin_unlock(&journal->j_lock);
+
+    up_read(&journal->j_barrier);
+
+    sync = handle->h_sync || (sb->s_flags & MS_SYNCHRONOUS);
+    kfree(handle);
+
+    if (!pending) {
+        return 0;
+    }
+
+    if (sync) {
+        return locfs_journal_commit(journal);
+    }
+
+    queue_delayed_work(system_long_wq, &journal->j_commit_work,
+                       READ_ONCE(journal->j_commit_interval));
+    return 0;
+}
+
+/* Adds a modified metadata buffer to the running transaction */
+void locfs_journal_dirty_metadata(struct super_block *sb,
+                                    struct buffer_head *bh)
+{
+    struct locfs_journal *journal = LOCFS_JOURNAL(sb);
+    struct locfs_handle *handle = current->journal_info;
+
+    if (WARN_ON_ONCE(!handle)) {
+        mark_buffer_dirty(bh);
+        return;
+    }
+
+    spin_lock(&journal->j_lock);
+    if (buffer_locfs_journaled(bh)) {
+        spin_unlock(&journal->j_lock);
+        return;
+    }
+
+    if (likely(journal->j_nr_buffers < journal->j_max_buffers)) {
+        set_buffer_locfs_journaled(bh);
+        get_bh(bh);
+        journal->j_buffers[journal->j_nr_buffers++] = bh;
+        handle->h_added += 1;
+        spin_unlock(&journal->j_lock);
+        return;
+    }
+    spin_unlock(&journal->j_lock);
+
+    // A handle used more credits than it asked for
+    WARN_ONCE(1, "locfs: Journal transaction overflow\n");
+    mark_buffer_dirty(bh);
+}
+
+/* Makes the current handle commit its transaction when it stops */
+void locfs_journal_set_sync(struct super_block *sb)
+{
+    struct locfs_handle *handle = current->journal_info;
+
+    if (LOCFS_JOURNAL(sb) && handle) {
+        handle->h_sync = 1;
+    }
+}
+
+/* Commits the running transaction, used by fsync() and sync() */
+int locfs_journal_force_commit(struct super_block *sb)
+{
+    struct locfs_journal *journal = LOCFS_JOURNAL(sb);
+
+    if (!journal) {
+        return 0;
+    }
+
+    // Committing from inside a handle would wait on ourselves
+    if (current->journal_info) {
+        locfs_journal_set_sync(sb);
+        return 0;
+    }
+
+    return locfs_journal_commit(journal);
+}
+
+/* Changes how long a stopped handle waits for company before committing */
+void locfs_journal_set_commit_interval(struct super_block *sb,
+                                         unsigned long commit_interval)
+{
+    struct locfs_journal *journal = LOCFS_JOURNAL(sb);
+
+    if (journal) {
+        WRITE_ONCE(journal->j_commit_interval, commit_interval);
+    }
+}
+
+/* Checks that a logged block belongs outside of the journal and on the device */
+static bool locfs_journal_valid_tag(struct locfs_journal *journal, uint64_t block)
+{
+    struct super_block *sb = journal->j_sb;
+    uint64_t nr_blocks = i_size_read(sb->s_bdev->bd_inode) >> sb->s_blocksize_bits;
+
+    if (block >= journal->j_start && block < journal->j_start + journal->j_maxlen) {
+        return false;
+    }
+
+    return block < nr_blocks;
+}
+
+/*
+ * Replays the transaction at the start of the log if it is complete and no
+ * older than the journal super_block says. Returns the sequence number to
+ * use for the next transaction.
+ */
+static int locfs_journal_recover(struct locfs_journal *journal,
+                                   uint64_t expected,
+                                   uint64_t *out_sequence)
+{
+    struct super_block *sb = journal->j_sb;
+    struct locfs_journal_descriptor *desc;
+    struct locfs_journal_commit *commit;
+    struct buffer_head *desc_bh;
+    struct buffer_head *commit_bh = NULL;
+    struct buffer_head *log_bh, *home_bh;
+    uint64_t block, sequence, nr, i;
+    uint32_t crc = ~0U;
+    int ret = 0;
+
+    *out_sequence = expected;
+    block = journal->j_start + journal->j_first;
+
+    desc_bh = sb_bread(sb, block);
+    if (!desc_bh) {
+        return -EIO;
+    }
+    desc = (struct locfs_journal_descriptor *)desc_bh->b_data;
+
+    if (desc->header.magic != LOCFS_JOURNAL_MAGIC
+            || desc->header.blocktype != LOCFS_JOURNAL_DESCRIPTOR
+            || desc->header.sequence < expected
+            || desc->count == 0
+            || desc->count > journal->j_max_buffers) {
+        goto out;
+    }
+    sequence = desc->header.sequence;
+    nr = desc->count;
+
+    commit_bh = sb_bread(sb, block + 1 + nr);
+    if (!commit_bh) {
+        ret = -EIO;
+        goto out;
+    }
+    commit = (struct locfs_journal_commit *)commit_bh->b_data;
+
+    if (commit->header.magic != LOCFS_JOURNAL_MAGIC
+            || commit->header.blocktype != LOCFS_JOURNAL_COMMIT
+            || commit->header.sequence != sequence
+            || commit->count != nr) {
+        // The commit block never made it, the transaction did not happen
+        goto out;
+    }
+
+    for (i = 0; i < nr; i++) {
+        if (!locfs_journal_valid_tag(journal, desc->tags[i])) {
+            printk(KERN_ERR "locfs: Journal transaction %llu logs bad block %llu\n",
+                   sequence, desc->tags[i]);
+            ret = -EIO;
+            goto out;
+        }
+
+        log_bh = sb_bread(sb, block + 1 + i);
+        if (!log_bh) {
+            ret = -EIO;
+            goto out;
+        }
+        crc = crc32_le(crc, log_bh->b_data, log_bh->b_size);
+        brelse(log_bh);
+    }
+
+    if (crc != commit->checksum) {
+        printk(KERN_WARNING "locfs: Journal transaction %llu is torn, skipping\n",
+               sequence);
+        goto out;
+    }
+
+    for (i = 0; i < nr; i++) {
+        log_bh = sb_bread(sb, block + 1 + i);
+        home_bh = sb_getblk(sb, desc->tags[i]);
+        if (!log_bh || !home_bh) {
+            brelse(log_bh);
+            brelse(home_bh);
+            ret = -EIO;
+            goto out;
+        }
+
+        lock_buffer(home_bh);
+        memcpy(home_bh->b_data, log_bh->b_data, home_bh->b_size);
+        set_buffer_uptodate(home_bh);
+        unlock_buffer(home_bh);
+        mark_buffer_dirty(home_bh);
+
+        brelse(log_bh);
+        brelse(home_bh);
+    }
+
+    ret = sync_blockdev(sb->s_bdev);
+    if (!ret) {
+        ret = blkdev_issue_flush(sb->s_bdev, GFP_KERNEL, NULL);
+    }
+    if (!ret) {
+        printk(KERN_INFO "locfs: Replayed journal transaction %llu (%llu blocks) on %s\n",
+               sequence, nr, sb->s_id);
+        *out_sequence = sequence + 1;
+    }
+
+out:
+    brelse(commit_bh);
+    brelse(desc_bh);
+    return ret;
+}
+
+/* Writes the journal super_block, recording where replay has to start */
+static int locfs_journal_write_super(struct locfs_journal *journal)
+{
+    struct locfs_journal_super_block *jsb;
+    struct buffer_head *bh;
+    int ret;
+
+    bh = sb_bread(journal->j_sb, journal->j_start);
+    if (!bh) {
+        return -EIO;
+    }
+
+    jsb = (struct locfs_journal_super_block *)bh->b_data;
+    lock_buffer(bh);
+    jsb->header.sequence = journal->j_sequence;
+    unlock_buffer(bh);
+
+    mark_buffer_dirty(bh);
+    ret = __sync_dirty_buffer(bh, REQ_SYNC | REQ_FUA);
+    brelse(bh);
+
+    return ret;
+}
+
+/* Loads the journal at mount time and replays it if needed */
+int locfs_journal_load(struct super_block *sb, unsigned long commit_interval)
+{
+    struct locfs_super_block *locfs_sb = LOCFS_SB(sb);
+    struct locfs_journal_super_block *jsb;
+    struct locfs_journal *journal;
+    struct buffer_head *bh;
+    uint64_t sequence;
+    int ret = -EINVAL;
+
+    if (locfs_sb->journal_size == 0) {
+        return 0;
+    }
+
+    journal = kzalloc(sizeof(*journal), GFP_KERNEL);
+    if (!journal) {
+        return -ENOMEM;
+    }
+
+    journal->j_sb = sb;
+    journal->j_start = LOCFS_JOURNAL_START_BLOCK_NO_HSB(locfs_sb);
+    journal->j_maxlen = locfs_sb->journal_size;
+    journal->j_commit_interval = commit_interval;
+    init_rwsem(&journal->j_barrier);
+    mutex_init(&journal->j_commit_mutex);
+    spin_lock_init(&journal->j_lock);
+    INIT_DELAYED_WORK(&journal->j_commit_work, locfs_journal_commit_work);
+
+    bh = sb_bread(sb, journal->j_start);
+    if (!bh) {
+        ret = -EIO;
+        goto free;
+    }
+    jsb = (struct locfs_journal_super_block *)bh->b_data;
+
+    if (jsb->header.magic != LOCFS_JOURNAL_MAGIC
+            || jsb->header.blocktype != LOCFS_JOURNAL_SUPER
+            || jsb->blocksize != locfs_sb->blocksize
+            || jsb->maxlen != journal->j_maxlen
+            || jsb->first == 0
+            || jsb->first + 2 >= jsb->maxlen) {
+        printk(KERN_ERR "locfs: Bad journal super_block at block %llu\n",
+               journal->j_start);
+        brelse(bh);
+        goto free;
+    }
+
+    journal->j_first = jsb->first;
+    sequence = jsb->header.sequence;
+    brelse(bh);
+
+    // Room for the descriptor and commit blocks around the logged ones
+    journal->j_max_buffers = min_t(uint64_t,
+                                   journal->j_maxlen - journal->j_first - 2,
+                                   LOCFS_JOURNAL_TAGS_PER_BLOCK_HSB(locfs_sb));
+    if (journal->j_max_buffers < LOCFS_CREATE_CREDITS) {
+        printk(KERN_ERR "locfs: Journal of %llu blocks is too small\n",
+               journal->j_maxlen);
+        goto free;
+    }
+
+    journal->j_buffers = kcalloc(journal->j_max_buffers,
+                                 sizeof(struct buffer_head *), GFP_KERNEL);
+    journal->j_log_buffers = kcalloc(journal->j_max_buffers,
+                                     sizeof(struct buffer_head *), GFP_KERNEL);
+    journal->j_checkpoint = kcalloc(journal->j_max_buffers,
+                                    sizeof(struct buffer_head *), GFP_KERNEL);
+    journal->j_home_buffers = kcalloc(journal->j_max_buffers,
+                                      sizeof(struct buffer_head *), GFP_KERNEL);
+    if (!journal->j_buffers || !journal->j_log_buffers
+            || !journal->j_checkpoint || !journal->j_home_buffers) {
+        ret = -ENOMEM;
+        goto free;
+    }
+
+    ret = locfs_journal_recover(journal, sequence, &journal->j_sequence);
+    if (ret) {
+        printk(KERN_ERR "locfs: Journal recovery failed on %s, error %d\n",
+               sb->s_id, ret);
+        goto free;
+    }
+
+    ret = locfs_journal_write_super(journal);
+    if (ret) {
+        goto free;
+    }
+
+    LOCFS_SBI(sb)->s_journal = journal;
+    return 0;
+
+free:
+    kfree(journal->j_buffers);
+    kfree(journal->j_log_buffers);
+    kfree(journal->j_checkpoint);
+    kfree(journal->j_home_buffers);
+    kfree(journal);
+    return ret;
+}
+
+/* Commits what is left at unmount and marks the log as fully checkpointed */
+void locfs_journal_destroy(struct super_block *sb)
+{
+    struct locfs_journal *journal = LOCFS_JOURNAL(sb);
+    int i;
+
+    if (!journal) {
+        return;
+    }
+
+    cancel_delayed_work_sync(&journal->j_commit_work);
+    locfs_journal_commit(journal);
+
+    if (!journal->j_aborted) {
+        if (journal->j_need_flush) {
+            blkdev_issue_flush(sb->s_bdev, GFP_KERNEL, NULL);
+        }
+        // Everything logged so far is home, nothing to replay next time
+        locfs_journal_write_super(journal);
+    } else {
+        // What an aborted journal still holds never goes home
+        for (i = 0; i < journal->j_nr_buffers; i++) {
+            clear_buffer_locfs_journaled(journal->j_buffers[i]);
+            brelse(journal->j_buffers[i]);
+        }
+        journal->j_nr_buffers = 0;
+    }
+
+    LOCFS_SBI(sb)->s_journal = NULL;
+    kfree(journal->j_buffers);
+    kfree(journal->j_log_buffers);
+    kfree(journal->j_checkpoint);
+    kfree(journal->j_home_buffers);
+    kfree(journal);
+}
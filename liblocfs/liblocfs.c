@@ -0,0 +1,2256 @@
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#include "liblocfs.h"
+
+/*
+ * The userspace twin of the kernel module. Each part below follows the
+ * kernel source file named in its heading, so a change to the format or to
+ * an algorithm there has an obvious counterpart here.
+ */
+
+/* An interned location name */
+struct locfs_location {
+    uint32_t id;
+    char name[LOCFS_LOCATION_MAXLEN];
+};
+
+struct locfs_fs {
+    int fd;
+    int readonly;
+    struct locfs_super_block sb;
+    uint64_t blocksize;
+    uint64_t data_start;
+
+    /* Both bitmaps live in memory, the bytes from lo up to hi changed */
+    uint8_t *inode_bitmap;
+    uint8_t *data_bitmap;
+    uint64_t inode_dirty_lo, inode_dirty_hi;
+    uint64_t data_dirty_lo, data_dirty_hi;
+    int sb_dirty;
+    /* Where the next search for a free inode or block starts */
+    uint64_t inode_hint;
+    uint64_t data_hint;
+
+    /* Location table, with an open addressing hash of index + 1 */
+    struct locfs_location *locations;
+    uint32_t nr_locations;
+    uint32_t *location_hash;
+    uint32_t location_hash_size;
+    uint64_t location_last_block_no;
+
+    /* What new inodes are tagged with */
+    char location[LOCFS_LOCATION_MAXLEN];
+    int32_t latitude;
+    int32_t longitude;
+    int32_t altitude;
+    uint64_t timestamp;
+};
+
+/* Blocks */
+
+static int read_block(struct locfs_fs *fs, uint64_t block_no, void *buf)
+{
+    if (pread(fs->fd, buf, fs->blocksize, block_no * fs->blocksize)
+            != (ssize_t)fs->blocksize) {
+        return -EIO;
+    }
+
+    return 0;
+}
+
+static int write_block(struct locfs_fs *fs, uint64_t block_no,
+                       const void *buf)
+{
+    if (fs->readonly) {
+        return -EROFS;
+    }
+
+    if (pwrite(fs->fd, buf, fs->blocksize, block_no * fs->blocksize)
+            != (ssize_t)fs->blocksize) {
+        return -EIO;
+    }
+
+    return 0;
+}
+
+/* Reads one block of a metadata chain and checks its magic */
+static int read_chain_block(struct locfs_fs *fs, uint64_t block_no,
+                            uint64_t magic, void *buf)
+{
+    int ret;
+
+    if (block_no < fs->data_start
+            || block_no >= fs->data_start + fs->sb.data_block_table_size) {
+        return -EIO;
+    }
+
+    ret = read_block(fs, block_no, buf);
+    if (ret) {
+        return ret;
+    }
+
+    return *(uint64_t *)buf == magic ? 0 : -EIO;
+}
+
+/* Bitmaps, see bitmap.c */
+
+static inline int test_bit(const uint8_t *bitmap, uint64_t i)
+{
+    return (bitmap[i / 8] >> (i % 8)) & 1;
+}
+
+static inline void set_bit(uint8_t *bitmap, uint64_t i,
+                           uint64_t *dirty_lo, uint64_t *dirty_hi)
+{
+    bitmap[i / 8] |= 1 << (i % 8);
+    if (i / 8 < *dirty_lo) {
+        *dirty_lo = i / 8;
+    }
+    if (i / 8 + 1 > *dirty_hi) {
+        *dirty_hi = i / 8 + 1;
+    }
+}
+
+/* Finds a free bit from hint on, wrapping around once */
+static int find_free(const uint8_t *bitmap, uint64_t bits, uint64_t hint,
+                     uint64_t *out_bit)
+{
+    uint64_t i = hint < bits ? hint : 0;
+    uint64_t left = bits;
+
+    while (left) {
+        // Full bytes are skipped whole
+        if (i % 8 == 0 && i + 8 <= bits && left >= 8
+                && bitmap[i / 8] == 0xff) {
+            i += 8;
+            left -= 8;
+        } else if (!test_bit(bitmap, i)) {
+            *out_bit = i;
+            return 0;
+        } else {
+            i++;
+            left--;
+        }
+
+        if (i == bits) {
+            i = 0;
+        }
+    }
+
+    return -ENOSPC;
+}
+
+static int alloc_inode(struct locfs_fs *fs, uint64_t *out_inode_no)
+{
+    int ret;
+
+    ret = find_free(fs->inode_bitmap, fs->sb.inode_table_size,
+                    fs->inode_hint, out_inode_no);
+    if (ret) {
+        return ret;
+    }
+
+    set_bit(fs->inode_bitmap, *out_inode_no, &fs->inode_dirty_lo,
+            &fs->inode_dirty_hi);
+    fs->inode_hint = *out_inode_no + 1;
+    fs->sb.inode_count += 1;
+    fs->sb_dirty = 1;
+    return 0;
+}
+
+/*
+ * Allocates a run of up to count free data blocks, starting the search at
+ * the absolute block number goal, as locfs_alloc_data_blocks
+ */
+static int alloc_data_blocks(struct locfs_fs *fs, uint64_t goal,
+                             uint64_t count, uint64_t *out_start,
+                             uint64_t *out_len)
+{
+    uint64_t bits = fs->sb.data_block_table_size;
+    uint64_t bit, len;
+    int ret;
+
+    if (fs->readonly) {
+        return -EROFS;
+    }
+
+    // Out of range goals continue from the last allocation
+    if (goal >= fs->data_start && goal < fs->data_start + bits) {
+        goal -= fs->data_start;
+    } else {
+        goal = fs->data_hint;
+    }
+
+    ret = find_free(fs->data_bitmap, bits, goal, &bit);
+    if (ret) {
+        return ret;
+    }
+
+    for (len = 0; len < count && bit + len < bits
+                  && !test_bit(fs->data_bitmap, bit + len); len++) {
+        set_bit(fs->data_bitmap, bit + len, &fs->data_dirty_lo,
+                &fs->data_dirty_hi);
+    }
+
+    fs->data_hint = bit + len;
+    fs->sb.data_block_count += len;
+    fs->sb_dirty = 1;
+    *out_start = fs->data_start + bit;
+    *out_len = len;
+    return 0;
+}
+
+/*
+ * Allocates a block close to goal for a chain of metadata blocks and
+ * fills buf with it, zeroed apart from its magic, as locfs_new_chain_block
+ */
+static int new_chain_block(struct locfs_fs *fs, uint64_t magic,
+                           uint64_t goal, void *buf, uint64_t *out_block_no)
+{
+    uint64_t len;
+    int ret;
+
+    ret = alloc_data_blocks(fs, goal, 1, out_block_no, &len);
+    if (ret) {
+        return ret;
+    }
+
+    memset(buf, 0, fs->blocksize);
+    ((struct locfs_chain_header *)buf)->magic = magic;
+    return 0;
+}
+
+/* Inodes, see inode.c */
+
+static off_t inode_offset(struct locfs_fs *fs, uint64_t inode_no)
+{
+    uint64_t ipb = LOCFS_INODES_PER_BLOCK_HSB(&fs->sb);
+
+    return (LOCFS_INODE_TABLE_START_BLOCK_NO_HSB(&fs->sb) + inode_no / ipb)
+               * fs->blocksize
+           + inode_no % ipb * LOCFS_INODE_SIZE_HSB(&fs->sb);
+}
+
+static int read_inode(struct locfs_fs *fs, uint64_t inode_no,
+                      struct locfs_inode *li)
+{
+    if (inode_no >= fs->sb.inode_table_size
+            || !test_bit(fs->inode_bitmap, inode_no)) {
+        return -ENOENT;
+    }
+
+    if (pread(fs->fd, li, sizeof(*li), inode_offset(fs, inode_no))
+            != sizeof(*li)) {
+        return -EIO;
+    }
+
+    return li->inode_no == inode_no ? 0 : -EIO;
+}
+
+static int write_inode(struct locfs_fs *fs, const struct locfs_inode *li)
+{
+    if (pwrite(fs->fd, li, sizeof(*li), inode_offset(fs, li->inode_no))
+            != sizeof(*li)) {
+        return -EIO;
+    }
+
+    return 0;
+}
+
+/* Flags kept past the inode, 0 on images with the smallest inodes */
+static int read_inode_flags(struct locfs_fs *fs, uint64_t inode_no,
+                            uint32_t *out_flags)
+{
+    *out_flags = 0;
+    if (LOCFS_INODE_SIZE_HSB(&fs->sb) <= LOCFS_INODE_SIZE) {
+        return 0;
+    }
+
+    if (pread(fs->fd, out_flags, sizeof(*out_flags),
+              inode_offset(fs, inode_no) + LOCFS_INODE_SIZE
+              + offsetof(struct locfs_inode_extra, flags))
+            != sizeof(*out_flags)) {
+        return -EIO;
+    }
+
+    return 0;
+}
+
+static int write_inode_flags(struct locfs_fs *fs, uint64_t inode_no,
+                             uint32_t flags)
+{
+    if (pwrite(fs->fd, &flags, sizeof(flags),
+               inode_offset(fs, inode_no) + LOCFS_INODE_SIZE
+               + offsetof(struct locfs_inode_extra, flags))
+            != sizeof(flags)) {
+        return -EIO;
+    }
+
+    return 0;
+}
+
+/* Byte offset of the inline data of the inode, see inline.c */
+static off_t inline_offset(struct locfs_fs *fs, uint64_t inode_no)
+{
+    return inode_offset(fs, inode_no) + LOCFS_INODE_SIZE
+           + offsetof(struct locfs_inode_extra, inline_data);
+}
+
+/* Extents, see extent.c */
+
+/* Reads the whole block map of the inode, with room for one more extent */
+static int load_extents(struct locfs_fs *fs, const struct locfs_inode *li,
+                        struct locfs_extent **out_extents)
+{
+    struct locfs_extent_block *ext_block;
+    struct locfs_extent *extents;
+    uint32_t n = li->extent_count;
+    int ret = 0;
+
+    extents = malloc((n + 1) * sizeof(*extents));
+    if (!extents) {
+        return -ENOMEM;
+    }
+    memcpy(extents, li->extents,
+           (n < LOCFS_INODE_EXTENTS ? n : LOCFS_INODE_EXTENTS)
+               * sizeof(*extents));
+
+    if (n > LOCFS_INODE_EXTENTS) {
+        ext_block = malloc(fs->blocksize);
+        if (!ext_block) {
+            ret = -ENOMEM;
+        } else {
+            ret = read_chain_block(fs, li->extent_block_no,
+                                   LOCFS_EXTENT_MAGIC, ext_block);
+        }
+        if (!ret && (ext_block->count != n - LOCFS_INODE_EXTENTS
+                     || ext_block->count
+                         > LOCFS_EXTENTS_PER_BLOCK_HSB(&fs->sb))) {
+            ret = -EIO;
+        }
+        if (!ret) {
+            memcpy(extents + LOCFS_INODE_EXTENTS, ext_block->extents,
+                   (n - LOCFS_INODE_EXTENTS) * sizeof(*extents));
+        }
+        free(ext_block);
+    }
+
+    if (ret) {
+        free(extents);
+        return ret;
+    }
+
+    *out_extents = extents;
+    return 0;
+}
+
+/* Writes a block map back to the inode and its overflow block */
+static int store_extents(struct locfs_fs *fs, struct locfs_inode *li,
+                         const struct locfs_extent *extents, uint32_t n)
+{
+    struct locfs_extent_block *ext_block;
+    int ret;
+
+    memcpy(li->extents, extents,
+           (n < LOCFS_INODE_EXTENTS ? n : LOCFS_INODE_EXTENTS)
+               * sizeof(*extents));
+    li->extent_count = n;
+
+    if (n > LOCFS_INODE_EXTENTS) {
+        ext_block = calloc(1, fs->blocksize);
+        if (!ext_block) {
+            return -ENOMEM;
+        }
+        ext_block->magic = LOCFS_EXTENT_MAGIC;
+        ext_block->count = n - LOCFS_INODE_EXTENTS;
+        memcpy(ext_block->extents, extents + LOCFS_INODE_EXTENTS,
+               ext_block->count * sizeof(*extents));
+        ret = write_block(fs, li->extent_block_no, ext_block);
+        free(ext_block);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    return write_inode(fs, li);
+}
+
+/* Index of the last extent starting at or before iblock, -1 if none */
+static int extent_search(const struct locfs_extent *extents, uint32_t n,
+                         uint64_t iblock)
+{
+    int lo = 0;
+    int hi = (int)n - 1;
+    int found = -1;
+    int mid;
+
+    while (lo <= hi) {
+        mid = lo + (hi - lo) / 2;
+        if (extents[mid].ee_block <= iblock) {
+            found = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    return found;
+}
+
+/*
+ * Maps a logical block to a physical one, with the number of blocks that
+ * follow it contiguously. A hole maps to 0, as locfs_extent_map.
+ */
+static int extent_map(struct locfs_fs *fs, const struct locfs_inode *li,
+                      uint64_t iblock, uint64_t *out_pblock,
+                      uint64_t *out_len)
+{
+    struct locfs_extent *extents;
+    int i, ret;
+
+    ret = load_extents(fs, li, &extents);
+    if (ret) {
+        return ret;
+    }
+
+    i = extent_search(extents, li->extent_count, iblock);
+    if (i >= 0 && iblock < (uint64_t)extents[i].ee_block + extents[i].ee_len) {
+        *out_pblock = extents[i].ee_start + (iblock - extents[i].ee_block);
+        *out_len = (uint64_t)extents[i].ee_block + extents[i].ee_len - iblock;
+    } else {
+        *out_pblock = 0;
+        *out_len = i + 1 < (int)li->extent_count
+                       ? extents[i + 1].ee_block - iblock
+                       : (uint64_t)UINT32_MAX + 1 - iblock;
+    }
+
+    free(extents);
+    return 0;
+}
+
+/*
+ * Allocates up to count blocks for the hole at iblock and adds them to the
+ * block map, which is written back along with the inode. As
+ * locfs_extent_alloc.
+ */
+static int extent_alloc(struct locfs_fs *fs, struct locfs_inode *li,
+                        uint64_t iblock, uint64_t count,
+                        uint64_t *out_pblock, uint64_t *out_len)
+{
+    struct locfs_extent *extents, *prev = NULL;
+    uint64_t goal = 0, start, len;
+    uint32_t n = li->extent_count;
+    int pos, ret;
+
+    if (iblock + count > (uint64_t)UINT32_MAX + 1) {
+        return -EFBIG;
+    }
+    if (n >= LOCFS_INODE_EXTENTS + LOCFS_EXTENTS_PER_BLOCK_HSB(&fs->sb)) {
+        return -EFBIG;
+    }
+
+    ret = load_extents(fs, li, &extents);
+    if (ret) {
+        return ret;
+    }
+
+    pos = extent_search(extents, n, iblock);
+    if (pos >= 0) {
+        prev = &extents[pos];
+        // Aim for the block that keeps the file physically contiguous
+        goal = prev->ee_start + (iblock - prev->ee_block);
+    }
+
+    if (n == LOCFS_INODE_EXTENTS && li->extent_block_no == 0) {
+        ret = alloc_data_blocks(fs, 0, 1, &li->extent_block_no, &len);
+        if (ret) {
+            goto out;
+        }
+    }
+
+    ret = alloc_data_blocks(fs, goal, count < UINT32_MAX ? count : UINT32_MAX,
+                            &start, &len);
+    if (ret) {
+        goto out;
+    }
+    *out_pblock = start;
+    *out_len = len;
+
+    // Grow the preceding extent when the new run continues it on disk
+    if (prev && (uint64_t)prev->ee_block + prev->ee_len == iblock
+             && prev->ee_start + prev->ee_len == start
+             && (uint64_t)prev->ee_len + len <= UINT32_MAX) {
+        prev->ee_len += len;
+    } else {
+        memmove(&extents[pos + 2], &extents[pos + 1],
+                (n - pos - 1) * sizeof(*extents));
+        extents[pos + 1].ee_block = iblock;
+        extents[pos + 1].ee_len = len;
+        extents[pos + 1].ee_start = start;
+        n++;
+    }
+
+    ret = store_extents(fs, li, extents, n);
+
+out:
+    free(extents);
+    return ret;
+}
+
+/* Hashed directories, see dir.c */
+
+struct dx_frame {
+    uint64_t block_no;
+    struct locfs_dx_node *node;
+    uint32_t at;
+};
+
+/* Reads logical block lblock of the directory and checks its magic */
+static int dir_bread(struct locfs_fs *fs, const struct locfs_inode *dir,
+                     uint64_t lblock, uint64_t magic, void *buf,
+                     uint64_t *out_block_no)
+{
+    uint64_t len;
+    int ret;
+
+    ret = extent_map(fs, dir, lblock, out_block_no, &len);
+    if (ret) {
+        return ret;
+    }
+    if (*out_block_no == 0) {
+        return -EIO;
+    }
+
+    return read_chain_block(fs, *out_block_no, magic, buf);
+}
+
+/*
+ * The logical block the next new block of the directory goes in, one past
+ * the highest block its hash tree points at. As locfs_dir_next_block, the
+ * blocks after it may already be mapped.
+ */
+static int dir_next_block(struct locfs_fs *fs, const struct locfs_inode *dir,
+                          uint64_t *out_next)
+{
+    uint64_t max_entries = LOCFS_DX_ENTRIES_PER_BLOCK_HSB(&fs->sb);
+    struct locfs_dx_node *root, *node;
+    uint64_t block_no, next = 1;
+    uint32_t i, j;
+    int ret;
+
+    root = malloc(fs->blocksize);
+    node = malloc(fs->blocksize);
+    if (!root || !node) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    ret = dir_bread(fs, dir, 0, LOCFS_DX_ROOT_MAGIC, root, &block_no);
+    for (i = 0; !ret && i < root->count && i < max_entries; i++) {
+        if ((uint64_t)root->entries[i].block + 1 > next) {
+            next = (uint64_t)root->entries[i].block + 1;
+        }
+        if (root->levels == 0) {
+            continue;
+        }
+
+        ret = dir_bread(fs, dir, root->entries[i].block, LOCFS_DX_NODE_MAGIC,
+                        node, &block_no);
+        for (j = 0; !ret && j < node->count && j < max_entries; j++) {
+            if ((uint64_t)node->entries[j].block + 1 > next) {
+                next = (uint64_t)node->entries[j].block + 1;
+            }
+        }
+    }
+    *out_next = next;
+
+out:
+    free(root);
+    free(node);
+    return ret;
+}
+
+/*
+ * Appends a block to the directory, buf is zeroed apart from magic. Blocks
+ * are mapped in runs, see LOCFS_DIR_PREALLOC_MAX.
+ */
+static int dir_new_block(struct locfs_fs *fs, struct locfs_inode *dir,
+                         uint64_t magic, void *buf, uint32_t *out_lblock,
+                         uint64_t *out_block_no)
+{
+    uint64_t next, len, count;
+    int ret;
+
+    ret = dir_next_block(fs, dir, &next);
+    if (ret) {
+        return ret;
+    }
+    if (next > UINT32_MAX) {
+        return -EFBIG;
+    }
+
+    ret = extent_map(fs, dir, next, out_block_no, &len);
+    if (!ret && *out_block_no == 0) {
+        count = next / 4;
+        if (count < LOCFS_DIR_PREALLOC_MIN) {
+            count = LOCFS_DIR_PREALLOC_MIN;
+        } else if (count > LOCFS_DIR_PREALLOC_MAX) {
+            count = LOCFS_DIR_PREALLOC_MAX;
+        }
+        ret = extent_alloc(fs, dir, next, count < len ? count : len,
+                           out_block_no, &len);
+    }
+    if (ret) {
+        return ret;
+    }
+
+    memset(buf, 0, fs->blocksize);
+    *(uint64_t *)buf = magic;
+    *out_lblock = next;
+    return 0;
+}
+
+/* Index of the entry of node covering hash */
+static uint32_t dx_search(const struct locfs_dx_node *node, uint32_t hash)
+{
+    uint32_t lo = 1;
+    uint32_t hi = node->count;
+    uint32_t mid;
+
+    // The first entry covers everything below the second one
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (node->entries[mid].hash <= hash) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo - 1;
+}
+
+static void dx_release(struct dx_frame *frames, int depth)
+{
+    while (depth > 0) {
+        free(frames[--depth].node);
+    }
+}
+
+/*
+ * Walks the hash tree from the root towards the leaf holding hash. Returns
+ * the number of frames filled in, the last one points at the leaf.
+ */
+static int dx_probe(struct locfs_fs *fs, const struct locfs_inode *dir,
+                    uint32_t hash, struct dx_frame *frames)
+{
+    struct dx_frame *frame;
+    uint64_t magic = LOCFS_DX_ROOT_MAGIC;
+    uint64_t lblock = 0;
+    uint32_t levels = 0;
+    int depth, ret;
+
+    for (depth = 0; depth <= (int)levels; depth++) {
+        frame = &frames[depth];
+        frame->node = malloc(fs->blocksize);
+        if (!frame->node) {
+            dx_release(frames, depth);
+            return -ENOMEM;
+        }
+
+        ret = dir_bread(fs, dir, lblock, magic, frame->node,
+                        &frame->block_no);
+        if (!ret && depth == 0) {
+            levels = frame->node->levels;
+        }
+        if (!ret && (levels > LOCFS_DX_MAX_LEVELS
+                     || frame->node->count == 0
+                     || frame->node->count
+                         > LOCFS_DX_ENTRIES_PER_BLOCK_HSB(&fs->sb))) {
+            ret = -EIO;
+        }
+        if (ret) {
+            dx_release(frames, depth + 1);
+            return ret;
+        }
+
+        frame->at = dx_search(frame->node, hash);
+        lblock = frame->node->entries[frame->at].block;
+        magic = LOCFS_DX_NODE_MAGIC;
+    }
+
+    return depth;
+}
+
+/* Reads the leaf the frame points at */
+static int dx_leaf(struct locfs_fs *fs, const struct locfs_inode *dir,
+                   struct dx_frame *frame, struct locfs_dir_leaf *leaf,
+                   uint64_t *out_block_no)
+{
+    int ret;
+
+    ret = dir_bread(fs, dir, frame->node->entries[frame->at].block,
+                    LOCFS_DIR_LEAF_MAGIC, leaf, out_block_no);
+    if (!ret && leaf->count > LOCFS_DIR_RECORDS_PER_BLOCK_HSB(&fs->sb)) {
+        ret = -EIO;
+    }
+
+    return ret;
+}
+
+/* Adds an entry for the blocks from hash on right after entry at */
+static void dx_insert_entry(struct locfs_dx_node *node, uint32_t at,
+                            uint32_t hash, uint32_t block)
+{
+    memmove(&node->entries[at + 2], &node->entries[at + 1],
+            (node->count - at - 1) * sizeof(struct locfs_dx_entry));
+    node->entries[at + 1].hash = hash;
+    node->entries[at + 1].block = block;
+    node->count += 1;
+}
+
+/*
+ * Makes room for one more entry in the node right above the leaf. A full
+ * root pushes its entries down into a new interior node, a full interior
+ * node is split in two.
+ */
+static int dx_grow(struct locfs_fs *fs, struct locfs_inode *dir,
+                   struct dx_frame *frames, int depth)
+{
+    struct dx_frame *root = &frames[0];
+    struct dx_frame *frame = &frames[depth - 1];
+    struct locfs_dx_node *node;
+    uint64_t block_no;
+    uint32_t lblock, half;
+    int ret;
+
+    if (depth > 1
+            && root->node->count >= LOCFS_DX_ENTRIES_PER_BLOCK_HSB(&fs->sb)) {
+        return -ENOSPC;
+    }
+
+    node = malloc(fs->blocksize);
+    if (!node) {
+        return -ENOMEM;
+    }
+
+    ret = dir_new_block(fs, dir, LOCFS_DX_NODE_MAGIC, node, &lblock,
+                        &block_no);
+    if (ret) {
+        goto out;
+    }
+
+    if (depth == 1) {
+        node->count = root->node->count;
+        memcpy(node->entries, root->node->entries,
+               node->count * sizeof(struct locfs_dx_entry));
+        root->node->levels = 1;
+        root->node->count = 1;
+        root->node->entries[0].hash = 0;
+        root->node->entries[0].block = lblock;
+    } else {
+        half = frame->node->count / 2;
+        node->count = frame->node->count - half;
+        memcpy(node->entries, &frame->node->entries[half],
+               node->count * sizeof(struct locfs_dx_entry));
+        frame->node->count = half;
+        dx_insert_entry(root->node, root->at, node->entries[0].hash, lblock);
+        ret = write_block(fs, frame->block_no, frame->node);
+    }
+
+    if (!ret) {
+        ret = write_block(fs, block_no, node);
+    }
+    if (!ret) {
+        ret = write_block(fs, root->block_no, root->node);
+    }
+
+out:
+    free(node);
+    return ret;
+}
+
+static int cmp_hash(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static inline uint32_t dir_record_hash(const struct locfs_dir_record *record)
+{
+    return locfs_name_hash(record->filename,
+                           strnlen(record->filename, LOCFS_FILENAME_MAXLEN));
+}
+
+/*
+ * Moves the upper half of the hashes in the full leaf to a new leaf. leaf
+ * and *leaf_no are left holding whichever of the two hash belongs in, the
+ * other one is written out.
+ */
+static int dx_split_leaf(struct locfs_fs *fs, struct locfs_inode *dir,
+                         struct dx_frame *frame, struct locfs_dir_leaf *leaf,
+                         uint64_t *leaf_no, uint32_t hash)
+{
+    struct locfs_dir_leaf *new_leaf;
+    uint64_t count = leaf->count;
+    uint64_t i, kept, new_no;
+    uint32_t *hashes;
+    uint32_t split, lblock;
+    int ret;
+
+    hashes = malloc(count * sizeof(*hashes));
+    if (!hashes) {
+        return -ENOMEM;
+    }
+    for (i = 0; i < count; i++) {
+        hashes[i] = dir_record_hash(&leaf->records[i]);
+    }
+    qsort(hashes, count, sizeof(*hashes), cmp_hash);
+
+    // Equal hashes have to stay in one leaf, split at the first hash
+    // from the middle on that differs from the lowest
+    for (i = count / 2; i < count && hashes[i] == hashes[0]; i++)
+        ;
+    split = i < count ? hashes[i] : 0;
+    free(hashes);
+    if (i == count) {
+        return -ENOSPC;
+    }
+
+    new_leaf = malloc(fs->blocksize);
+    if (!new_leaf) {
+        return -ENOMEM;
+    }
+    ret = dir_new_block(fs, dir, LOCFS_DIR_LEAF_MAGIC, new_leaf, &lblock,
+                        &new_no);
+    if (ret) {
+        goto out;
+    }
+
+    kept = 0;
+    for (i = 0; i < count; i++) {
+        if (dir_record_hash(&leaf->records[i]) >= split) {
+            new_leaf->records[new_leaf->count++] = leaf->records[i];
+        } else {
+            leaf->records[kept++] = leaf->records[i];
+        }
+    }
+    leaf->count = kept;
+
+    dx_insert_entry(frame->node, frame->at, split, lblock);
+    ret = write_block(fs, frame->block_no, frame->node);
+    if (ret) {
+        goto out;
+    }
+
+    if (hash >= split) {
+        ret = write_block(fs, *leaf_no, leaf);
+        memcpy(leaf, new_leaf, fs->blocksize);
+        *leaf_no = new_no;
+    } else {
+        ret = write_block(fs, new_no, new_leaf);
+    }
+
+out:
+    free(new_leaf);
+    return ret;
+}
+
+/* Turns the first block of a new directory into the root of its hash tree */
+static int dir_init(struct locfs_fs *fs, struct locfs_inode *dir)
+{
+    struct locfs_dx_node *root;
+    struct locfs_dir_leaf *leaf;
+    uint64_t root_no, leaf_no, len;
+    int ret;
+
+    ret = extent_map(fs, dir, 0, &root_no, &len);
+    if (ret) {
+        return ret;
+    }
+
+    root = malloc(fs->blocksize);
+    leaf = malloc(fs->blocksize);
+    if (!root || !leaf) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    // The leaf goes right after the root, usually mapped along with it
+    ret = extent_map(fs, dir, 1, &leaf_no, &len);
+    if (!ret && leaf_no == 0) {
+        ret = extent_alloc(fs, dir, 1, 1, &leaf_no, &len);
+    }
+    if (!ret) {
+        memset(leaf, 0, fs->blocksize);
+        leaf->magic = LOCFS_DIR_LEAF_MAGIC;
+        ret = write_block(fs, leaf_no, leaf);
+    }
+    if (ret) {
+        goto out;
+    }
+
+    memset(root, 0, fs->blocksize);
+    root->magic = LOCFS_DX_ROOT_MAGIC;
+    root->levels = 0;
+    root->count = 1;
+    root->entries[0].hash = 0;
+    root->entries[0].block = 1;
+    ret = write_block(fs, root_no, root);
+
+out:
+    free(root);
+    free(leaf);
+    return ret;
+}
+
+/* Finds the inode number of the child called name */
+static int dir_find(struct locfs_fs *fs, const struct locfs_inode *dir,
+                    const char *name, size_t len, uint64_t *out_inode_no)
+{
+    struct dx_frame frames[LOCFS_DX_MAX_LEVELS + 1];
+    struct locfs_dir_leaf *leaf;
+    uint64_t leaf_no, i;
+    int depth, ret;
+
+    depth = dx_probe(fs, dir, locfs_name_hash(name, len), frames);
+    if (depth < 0) {
+        return depth;
+    }
+
+    leaf = malloc(fs->blocksize);
+    ret = leaf ? dx_leaf(fs, dir, &frames[depth - 1], leaf, &leaf_no)
+               : -ENOMEM;
+    dx_release(frames, depth);
+    if (ret) {
+        free(leaf);
+        return ret;
+    }
+
+    ret = -ENOENT;
+    for (i = 0; i < leaf->count; i++) {
+        if (memcmp(leaf->records[i].filename, name, len) == 0
+                && leaf->records[i].filename[len] == '\0') {
+            *out_inode_no = leaf->records[i].inode_no;
+            ret = 0;
+            break;
+        }
+    }
+
+    free(leaf);
+    return ret;
+}
+
+/* Adds a record for the child inode_no called name */
+static int dir_insert(struct locfs_fs *fs, struct locfs_inode *dir,
+                      const char *name, size_t len, uint64_t inode_no)
+{
+    struct dx_frame frames[LOCFS_DX_MAX_LEVELS + 1];
+    struct dx_frame *frame;
+    struct locfs_dir_leaf *leaf;
+    struct locfs_dir_record *record;
+    uint32_t hash = locfs_name_hash(name, len);
+    uint64_t leaf_no;
+    int depth, ret;
+
+    leaf = malloc(fs->blocksize);
+    if (!leaf) {
+        return -ENOMEM;
+    }
+
+again:
+    depth = dx_probe(fs, dir, hash, frames);
+    if (depth < 0) {
+        free(leaf);
+        return depth;
+    }
+    frame = &frames[depth - 1];
+
+    ret = dx_leaf(fs, dir, frame, leaf, &leaf_no);
+    if (ret) {
+        goto out;
+    }
+
+    if (leaf->count >= LOCFS_DIR_RECORDS_PER_BLOCK_HSB(&fs->sb)) {
+        // The split adds an entry above the leaf, make room for it first
+        if (frame->node->count >= LOCFS_DX_ENTRIES_PER_BLOCK_HSB(&fs->sb)) {
+            ret = dx_grow(fs, dir, frames, depth);
+            dx_release(frames, depth);
+            if (ret) {
+                free(leaf);
+                return ret;
+            }
+            goto again;
+        }
+
+        ret = dx_split_leaf(fs, dir, frame, leaf, &leaf_no, hash);
+        if (ret) {
+            goto out;
+        }
+    }
+
+    record = &leaf->records[leaf->count++];
+    memset(record, 0, sizeof(*record));
+    memcpy(record->filename, name, len);
+    record->inode_no = inode_no;
+    ret = write_block(fs, leaf_no, leaf);
+
+out:
+    dx_release(frames, depth);
+    free(leaf);
+    return ret;
+}
+
+/* Location index, see locindex.c */
+
+/*
+ * Looks up the index entry of location_id. Returns 0 and its position, or
+ * -ENOENT and the last block of the index chain. Either way index holds
+ * the block read last.
+ */
+static int locindex_find(struct locfs_fs *fs, const struct locfs_inode *dir,
+                         uint32_t location_id,
+                         struct locfs_locindex_block *index,
+                         uint64_t *out_block_no, uint64_t *out_entry)
+{
+    uint64_t block_no = dir->dir_index_block_no;
+    uint64_t i;
+    int ret;
+
+    for (;;) {
+        ret = read_chain_block(fs, block_no, LOCFS_LOCINDEX_MAGIC, index);
+        if (ret) {
+            return ret;
+        }
+        *out_block_no = block_no;
+
+        for (i = 0; i < index->header.count; i++) {
+            if (index->entries[i].location_id == location_id) {
+                *out_entry = i;
+                return 0;
+            }
+        }
+
+        if (index->header.next_block_no == 0) {
+            return -ENOENT;
+        }
+        block_no = index->header.next_block_no;
+    }
+}
+
+/* Gives a new directory an empty location index */
+static int locindex_create(struct locfs_fs *fs, struct locfs_inode *dir)
+{
+    void *buf;
+    uint64_t goal = 0, len;
+    int ret;
+
+    // Keep the index next to the directory's records
+    extent_map(fs, dir, 0, &goal, &len);
+
+    buf = malloc(fs->blocksize);
+    if (!buf) {
+        return -ENOMEM;
+    }
+
+    ret = new_chain_block(fs, LOCFS_LOCINDEX_MAGIC, goal, buf,
+                          &dir->dir_index_block_no);
+    if (!ret) {
+        ret = write_block(fs, dir->dir_index_block_no, buf);
+    }
+
+    free(buf);
+    return ret;
+}
+
+/* Records that the child inode_no called filename was created at location_id */
+static int locindex_add(struct locfs_fs *fs, const struct locfs_inode *dir,
+                        uint32_t location_id, const char *filename,
+                        uint64_t inode_no)
+{
+    struct locfs_locindex_block *index, *new_index;
+    struct locfs_locindex_entry *entry;
+    struct locfs_loclist_block *list;
+    struct locfs_dir_record *record;
+    uint64_t goal, list_no, block_no, at;
+    uint64_t index_no = 0;
+    int ret;
+
+    // Directories from before the index have nowhere to record it
+    if (dir->dir_index_block_no == 0) {
+        return 0;
+    }
+    goal = dir->dir_index_block_no;
+
+    index = malloc(fs->blocksize);
+    list = malloc(fs->blocksize);
+    new_index = malloc(fs->blocksize);
+    if (!index || !list || !new_index) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    ret = locindex_find(fs, dir, location_id, index, &index_no, &at);
+    if (ret == -ENOENT) {
+        // First child at this location, it gets an entry and a list block
+        if (index->header.count
+                >= LOCFS_LOCINDEX_ENTRIES_PER_BLOCK_HSB(&fs->sb)) {
+            ret = new_chain_block(fs, LOCFS_LOCINDEX_MAGIC, goal, new_index,
+                                  &block_no);
+            if (ret) {
+                goto out;
+            }
+            index->header.next_block_no = block_no;
+            ret = write_block(fs, index_no, index);
+            if (ret) {
+                goto out;
+            }
+
+            memcpy(index, new_index, fs->blocksize);
+            index_no = block_no;
+        }
+
+        ret = new_chain_block(fs, LOCFS_LOCLIST_MAGIC, goal, list, &list_no);
+        if (ret) {
+            goto out;
+        }
+
+        entry = &index->entries[index->header.count++];
+        entry->location_id = location_id;
+        entry->first_block_no = list_no;
+        entry->last_block_no = list_no;
+    } else if (ret == 0) {
+        entry = &index->entries[at];
+        list_no = entry->last_block_no;
+        ret = read_chain_block(fs, list_no, LOCFS_LOCLIST_MAGIC, list);
+        if (ret) {
+            goto out;
+        }
+
+        // The list is full, chain a new block after it
+        if (list->header.count
+                >= LOCFS_LOCLIST_RECORDS_PER_BLOCK_HSB(&fs->sb)) {
+            ret = new_chain_block(fs, LOCFS_LOCLIST_MAGIC, list_no,
+                                  new_index, &block_no);
+            if (ret) {
+                goto out;
+            }
+            list->header.next_block_no = block_no;
+            ret = write_block(fs, list_no, list);
+            if (ret) {
+                goto out;
+            }
+
+            memcpy(list, new_index, fs->blocksize);
+            list_no = block_no;
+            entry->last_block_no = block_no;
+        }
+    } else {
+        goto out;
+    }
+
+    record = &list->records[list->header.count++];
+    memset(record, 0, sizeof(*record));
+    memcpy(record->filename, filename,
+           strnlen(filename, LOCFS_FILENAME_MAXLEN - 1));
+    record->inode_no = inode_no;
+
+    ret = write_block(fs, list_no, list);
+    if (!ret) {
+        ret = write_block(fs, index_no, index);
+    }
+
+out:
+    free(index);
+    free(list);
+    free(new_index);
+    return ret;
+}
+
+/* Location table, see location.c */
+
+static uint32_t *location_slot(struct locfs_fs *fs, const char *name)
+{
+    uint32_t mask = fs->location_hash_size - 1;
+    uint32_t i = locfs_name_hash(name, strlen(name)) & mask;
+    uint32_t *slot;
+
+    for (;; i = (i + 1) & mask) {
+        slot = &fs->location_hash[i];
+        if (*slot == 0
+                || strcmp(fs->locations[*slot - 1].name, name) == 0) {
+            return slot;
+        }
+    }
+}
+
+/* Adds a name read from or written to the table to memory */
+static int location_add(struct locfs_fs *fs, uint32_t id, const char *name)
+{
+    struct locfs_location *grown;
+    uint32_t *hash, size, i;
+
+    // Keep the hash at most half full, and the array as large as it
+    if (fs->nr_locations + 1 > fs->location_hash_size / 2) {
+        size = fs->location_hash_size ? fs->location_hash_size * 2 : 64;
+        hash = calloc(size, sizeof(*hash));
+        grown = realloc(fs->locations, size * sizeof(*grown));
+        if (!hash || !grown) {
+            free(hash);
+            if (grown) {
+                fs->locations = grown;
+            }
+            return -ENOMEM;
+        }
+
+        free(fs->location_hash);
+        fs->locations = grown;
+        fs->location_hash = hash;
+        fs->location_hash_size = size;
+        for (i = 0; i < fs->nr_locations; i++) {
+            *location_slot(fs, fs->locations[i].name) = i + 1;
+        }
+    }
+
+    i = fs->nr_locations++;
+    fs->locations[i].id = id;
+    memset(fs->locations[i].name, 0, LOCFS_LOCATION_MAXLEN);
+    memcpy(fs->locations[i].name, name,
+           strnlen(name, LOCFS_LOCATION_MAXLEN - 1));
+    *location_slot(fs, fs->locations[i].name) = i + 1;
+    return 0;
+}
+
+static int location_load(struct locfs_fs *fs)
+{
+    struct locfs_location_block *block;
+    char name[LOCFS_LOCATION_MAXLEN];
+    uint64_t block_no, i;
+    int ret = 0;
+
+    block = malloc(fs->blocksize);
+    if (!block) {
+        return -ENOMEM;
+    }
+
+    for (block_no = fs->sb.location_table_block_no; block_no;
+         block_no = block->header.next_block_no) {
+        ret = read_chain_block(fs, block_no, LOCFS_LOCTABLE_MAGIC, block);
+        if (!ret && block->header.count
+                > LOCFS_LOCATIONS_PER_BLOCK_HSB(&fs->sb)) {
+            ret = -EIO;
+        }
+        if (ret) {
+            break;
+        }
+
+        for (i = 0; i < block->header.count && !ret; i++) {
+            memcpy(name, block->entries[i].name, sizeof(name));
+            name[sizeof(name) - 1] = '\0';
+            ret = location_add(fs, block->entries[i].id, name);
+        }
+        fs->location_last_block_no = block_no;
+    }
+
+    free(block);
+    return ret;
+}
+
+/* ID of a location name, LOCFS_LOCATION_NONE if it is not in the table */
+static uint32_t location_lookup(struct locfs_fs *fs, const char *name)
+{
+    uint32_t *slot;
+
+    if (fs->nr_locations == 0) {
+        return LOCFS_LOCATION_NONE;
+    }
+
+    slot = location_slot(fs, name);
+    return *slot ? fs->locations[*slot - 1].id : LOCFS_LOCATION_NONE;
+}
+
+/* ID of a location name, which is added to the table when it is new */
+static int location_intern(struct locfs_fs *fs, const char *name,
+                           uint32_t *out_id)
+{
+    struct locfs_location_block *block;
+    struct locfs_location_entry *entry;
+    uint64_t block_no, new_no, len;
+    uint32_t id = 0;
+    uint32_t i;
+    int ret;
+
+    *out_id = location_lookup(fs, name);
+    if (*out_id != LOCFS_LOCATION_NONE) {
+        return 0;
+    }
+
+    for (i = 0; i < fs->nr_locations; i++) {
+        if (fs->locations[i].id > id) {
+            id = fs->locations[i].id;
+        }
+    }
+    if (id == UINT32_MAX) {
+        return -ENOSPC;
+    }
+
+    block = malloc(fs->blocksize);
+    if (!block) {
+        return -ENOMEM;
+    }
+
+    ret = -ENOENT;
+    block_no = fs->location_last_block_no;
+    if (block_no) {
+        ret = read_chain_block(fs, block_no, LOCFS_LOCTABLE_MAGIC, block);
+        if (ret) {
+            goto out;
+        }
+        if (block->header.count >= LOCFS_LOCATIONS_PER_BLOCK_HSB(&fs->sb)) {
+            ret = -ENOENT;
+        }
+    }
+
+    // The last block is full, or there is none yet
+    if (ret == -ENOENT) {
+        ret = alloc_data_blocks(fs, block_no, 1, &new_no, &len);
+        if (ret) {
+            goto out;
+        }
+
+        if (block_no) {
+            block->header.next_block_no = new_no;
+            ret = write_block(fs, block_no, block);
+            if (ret) {
+                goto out;
+            }
+        } else {
+            fs->sb.location_table_block_no = new_no;
+            fs->sb_dirty = 1;
+        }
+
+        memset(block, 0, fs->blocksize);
+        block->header.magic = LOCFS_LOCTABLE_MAGIC;
+        block_no = new_no;
+        fs->location_last_block_no = new_no;
+    }
+
+    entry = &block->entries[block->header.count++];
+    entry->id = id + 1;
+    memset(entry->name, 0, sizeof(entry->name));
+    memcpy(entry->name, name, strnlen(name, LOCFS_LOCATION_MAXLEN - 1));
+    ret = write_block(fs, block_no, block);
+    if (!ret) {
+        ret = location_add(fs, entry->id, name);
+    }
+    if (!ret) {
+        *out_id = id + 1;
+    }
+
+out:
+    free(block);
+    return ret;
+}
+
+/* Spatial index, see spatial.c */
+
+static int spatial_valid_coords(int32_t latitude, int32_t longitude)
+{
+    return latitude >= -90 * LOCFS_COORD_SCALE
+        && latitude <= 90 * LOCFS_COORD_SCALE
+        && longitude >= -180 * LOCFS_COORD_SCALE
+        && longitude <= 180 * LOCFS_COORD_SCALE;
+}
+
+/* Adds an entry to the bucket chain starting at *head */
+static int spatial_bucket_add(struct locfs_fs *fs, uint64_t node_no,
+                              struct locfs_spatial_node *node, uint64_t *head,
+                              const struct locfs_spatial_entry *new_entry)
+{
+    struct locfs_spatial_bucket *bucket;
+    uint64_t block_no = *head;
+    int ret = -ENOENT;
+
+    bucket = malloc(fs->blocksize);
+    if (!bucket) {
+        return -ENOMEM;
+    }
+
+    if (*head != 0) {
+        ret = read_chain_block(fs, *head, LOCFS_SPATIAL_BUCKET_MAGIC, bucket);
+        if (ret) {
+            goto out;
+        }
+        if (bucket->header.count
+                >= LOCFS_SPATIAL_ENTRIES_PER_BLOCK_HSB(&fs->sb)) {
+            ret = -ENOENT;
+        }
+    }
+
+    // The cell is empty or its newest bucket is full, push a new one
+    if (ret == -ENOENT) {
+        ret = new_chain_block(fs, LOCFS_SPATIAL_BUCKET_MAGIC, node_no,
+                              bucket, &block_no);
+        if (ret) {
+            goto out;
+        }
+        bucket->header.next_block_no = *head;
+        *head = block_no;
+        ret = write_block(fs, node_no, node);
+        if (ret) {
+            goto out;
+        }
+    }
+
+    bucket->entries[bucket->header.count++] = *new_entry;
+    ret = write_block(fs, block_no, bucket);
+
+out:
+    free(bucket);
+    return ret;
+}
+
+/* Files inode_no under its coordinates, inodes without a fix are left out */
+static int spatial_insert(struct locfs_fs *fs, uint64_t inode_no,
+                          int32_t latitude, int32_t longitude)
+{
+    struct locfs_spatial_entry entry = {
+        .inode_no = inode_no,
+        .latitude = latitude,
+        .longitude = longitude,
+    };
+    struct locfs_spatial_node *node, *child;
+    uint64_t block_no, child_no;
+    unsigned int slot;
+    uint32_t x, y;
+    int level;
+    int ret = 0;
+
+    if (!spatial_valid_coords(latitude, longitude)) {
+        return 0;
+    }
+
+    x = locfs_cell_x(longitude);
+    y = locfs_cell_y(latitude);
+
+    node = malloc(fs->blocksize);
+    child = malloc(fs->blocksize);
+    if (!node || !child) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    if (fs->sb.spatial_root_block_no == 0) {
+        ret = new_chain_block(fs, LOCFS_SPATIAL_NODE_MAGIC, 0, node,
+                              &block_no);
+        if (!ret) {
+            ret = write_block(fs, block_no, node);
+        }
+        if (ret) {
+            goto out;
+        }
+
+        fs->sb.spatial_root_block_no = block_no;
+        fs->sb_dirty = 1;
+    }
+
+    block_no = fs->sb.spatial_root_block_no;
+    for (level = 0; level < LOCFS_SPATIAL_LEVELS; level++) {
+        ret = read_chain_block(fs, block_no, LOCFS_SPATIAL_NODE_MAGIC, node);
+        if (ret) {
+            goto out;
+        }
+        slot = locfs_spatial_slot(x, y, level);
+
+        if (level == LOCFS_SPATIAL_LEVELS - 1) {
+            ret = spatial_bucket_add(fs, block_no, node,
+                                     &node->children[slot], &entry);
+            break;
+        }
+
+        child_no = node->children[slot];
+        if (child_no == 0) {
+            ret = new_chain_block(fs, LOCFS_SPATIAL_NODE_MAGIC, block_no,
+                                  child, &child_no);
+            if (!ret) {
+                ret = write_block(fs, child_no, child);
+            }
+            if (ret) {
+                goto out;
+            }
+
+            node->children[slot] = child_no;
+            node->header.count++;
+            ret = write_block(fs, block_no, node);
+            if (ret) {
+                goto out;
+            }
+        }
+
+        block_no = child_no;
+    }
+
+out:
+    free(node);
+    free(child);
+    return ret;
+}
+
+/* Journal, see journal.c */
+
+/* Standard reflected CRC-32 without the final inversion, as crc32_le */
+static uint32_t crc32_le(uint32_t crc, const uint8_t *p, size_t len)
+{
+    static uint32_t table[256];
+    uint32_t c;
+    int i, k;
+
+    if (table[1] == 0) {
+        for (i = 0; i < 256; i++) {
+            c = i;
+            for (k = 0; k < 8; k++) {
+                c = c & 1 ? (c >> 1) ^ 0xedb88320 : c >> 1;
+            }
+            table[i] = c;
+        }
+    }
+
+    while (len--) {
+        crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+/*
+ * Checks whether the start of the log holds a complete transaction the
+ * kernel would replay at mount, as locfs_journal_recover
+ */
+static int journal_needs_recovery(struct locfs_fs *fs)
+{
+    struct locfs_journal_super_block *jsb;
+    struct locfs_journal_descriptor *desc;
+    struct locfs_journal_commit *commit;
+    uint64_t start, log, i;
+    uint32_t crc = ~0U;
+    uint8_t *buf;
+    int ret = 0;
+
+    if (fs->sb.journal_size == 0) {
+        return 0;
+    }
+
+    buf = malloc(4 * fs->blocksize);
+    if (!buf) {
+        return -ENOMEM;
+    }
+    jsb = (struct locfs_journal_super_block *)buf;
+    desc = (struct locfs_journal_descriptor *)(buf + fs->blocksize);
+    commit = (struct locfs_journal_commit *)(buf + 2 * fs->blocksize);
+
+    start = LOCFS_JOURNAL_START_BLOCK_NO_HSB(&fs->sb);
+    if (read_block(fs, start, jsb)
+            || jsb->header.magic != LOCFS_JOURNAL_MAGIC
+            || jsb->header.blocktype != LOCFS_JOURNAL_SUPER
+            || jsb->first == 0 || jsb->first + 2 >= jsb->maxlen
+            || jsb->maxlen != fs->sb.journal_size) {
+        ret = -EIO;
+        goto out;
+    }
+    log = start + jsb->first;
+
+    if (read_block(fs, log, desc)
+            || desc->header.magic != LOCFS_JOURNAL_MAGIC
+            || desc->header.blocktype != LOCFS_JOURNAL_DESCRIPTOR
+            || desc->header.sequence < jsb->header.sequence
+            || desc->count == 0
+            || desc->count > jsb->maxlen - jsb->first - 2
+            || desc->count > LOCFS_JOURNAL_TAGS_PER_BLOCK_HSB(&fs->sb)) {
+        goto out;
+    }
+
+    if (read_block(fs, log + 1 + desc->count, commit)
+            || commit->header.magic != LOCFS_JOURNAL_MAGIC
+            || commit->header.blocktype != LOCFS_JOURNAL_COMMIT
+            || commit->header.sequence != desc->header.sequence
+            || commit->count != desc->count) {
+        goto out;
+    }
+
+    for (i = 0; i < desc->count; i++) {
+        if (read_block(fs, log + 1 + i, buf + 3 * fs->blocksize)) {
+            ret = -EIO;
+            goto out;
+        }
+        crc = crc32_le(crc, buf + 3 * fs->blocksize, fs->blocksize);
+    }
+    ret = crc == commit->checksum;
+
+out:
+    free(buf);
+    return ret;
+}
+
+/* The file system */
+
+int locfs_fs_open(const char *path, int readonly, struct locfs_fs **out_fs)
+{
+    struct locfs_fs *fs;
+    struct stat st;
+    uint64_t size;
+    int ret;
+
+    fs = calloc(1, sizeof(*fs));
+    if (!fs) {
+        return -ENOMEM;
+    }
+    fs->readonly = readonly;
+    fs->inode_dirty_lo = fs->data_dirty_lo = UINT64_MAX;
+    strcpy(fs->location, "Home");
+    fs->latitude = LOCFS_COORD_NONE;
+    fs->longitude = LOCFS_COORD_NONE;
+    fs->altitude = LOCFS_COORD_NONE;
+
+    fs->fd = open(path, readonly ? O_RDONLY : O_RDWR);
+    if (fs->fd == -1) {
+        ret = -errno;
+        free(fs);
+        return ret;
+    }
+
+    ret = -EINVAL;
+    if (pread(fs->fd, &fs->sb, sizeof(fs->sb), 0) != sizeof(fs->sb)
+            || fs->sb.magic != LOCFS_MAGIC
+            || fs->sb.blocksize < 1024 || fs->sb.blocksize > 65536
+            || (fs->sb.blocksize & (fs->sb.blocksize - 1))
+            || LOCFS_INODE_SIZE_HSB(&fs->sb) < LOCFS_INODE_SIZE
+            || LOCFS_INODE_SIZE_HSB(&fs->sb) > fs->sb.blocksize
+            || (LOCFS_INODE_SIZE_HSB(&fs->sb)
+                & (LOCFS_INODE_SIZE_HSB(&fs->sb) - 1))) {
+        goto fail;
+    }
+    fs->blocksize = fs->sb.blocksize;
+    fs->data_start = LOCFS_DATA_BLOCK_TABLE_START_BLOCK_NO_HSB(&fs->sb);
+
+    if (fstat(fs->fd, &st) == -1) {
+        ret = -errno;
+        goto fail;
+    }
+    size = st.st_size;
+    if (S_ISBLK(st.st_mode) && ioctl(fs->fd, BLKGETSIZE64, &size) == -1) {
+        ret = -errno;
+        goto fail;
+    }
+    if ((fs->data_start + fs->sb.data_block_table_size) * fs->blocksize
+            > size) {
+        goto fail;
+    }
+
+    ret = journal_needs_recovery(fs);
+    if (ret) {
+        ret = ret > 0 ? -EUCLEAN : ret;
+        goto fail;
+    }
+
+    fs->inode_bitmap = malloc(LOCFS_INODE_BITMAP_BLOCKS_HSB(&fs->sb)
+                              * fs->blocksize);
+    fs->data_bitmap = malloc(LOCFS_DATA_BLOCK_BITMAP_BLOCKS_HSB(&fs->sb)
+                             * fs->blocksize);
+    if (!fs->inode_bitmap || !fs->data_bitmap) {
+        ret = -ENOMEM;
+        goto fail;
+    }
+
+    ret = -EIO;
+    if (pread(fs->fd, fs->inode_bitmap,
+              LOCFS_INODE_BITMAP_BLOCKS_HSB(&fs->sb) * fs->blocksize,
+              LOCFS_INODE_BITMAP_START_BLOCK_NO * fs->blocksize)
+            != (ssize_t)(LOCFS_INODE_BITMAP_BLOCKS_HSB(&fs->sb)
+                         * fs->blocksize)
+            || pread(fs->fd, fs->data_bitmap,
+                     LOCFS_DATA_BLOCK_BITMAP_BLOCKS_HSB(&fs->sb)
+                         * fs->blocksize,
+                     LOCFS_DATA_BLOCK_BITMAP_START_BLOCK_NO_HSB(&fs->sb)
+                         * fs->blocksize)
+                != (ssize_t)(LOCFS_DATA_BLOCK_BITMAP_BLOCKS_HSB(&fs->sb)
+                             * fs->blocksize)) {
+        goto fail;
+    }
+
+    ret = location_load(fs);
+    if (ret) {
+        goto fail;
+    }
+
+    *out_fs = fs;
+    return 0;
+
+fail:
+    fs->readonly = 1;
+    locfs_fs_close(fs);
+    return ret;
+}
+
+int locfs_fs_sync(struct locfs_fs *fs)
+{
+    uint64_t start;
+
+    if (fs->readonly) {
+        return 0;
+    }
+
+    if (fs->inode_dirty_lo < fs->inode_dirty_hi) {
+        start = LOCFS_INODE_BITMAP_START_BLOCK_NO * fs->blocksize;
+        if (pwrite(fs->fd, fs->inode_bitmap + fs->inode_dirty_lo,
+                   fs->inode_dirty_hi - fs->inode_dirty_lo,
+                   start + fs->inode_dirty_lo)
+                != (ssize_t)(fs->inode_dirty_hi - fs->inode_dirty_lo)) {
+            return -EIO;
+        }
+        fs->inode_dirty_lo = UINT64_MAX;
+        fs->inode_dirty_hi = 0;
+    }
+
+    if (fs->data_dirty_lo < fs->data_dirty_hi) {
+        start = LOCFS_DATA_BLOCK_BITMAP_START_BLOCK_NO_HSB(&fs->sb)
+                * fs->blocksize;
+        if (pwrite(fs->fd, fs->data_bitmap + fs->data_dirty_lo,
+                   fs->data_dirty_hi - fs->data_dirty_lo,
+                   start + fs->data_dirty_lo)
+                != (ssize_t)(fs->data_dirty_hi - fs->data_dirty_lo)) {
+            return -EIO;
+        }
+        fs->data_dirty_lo = UINT64_MAX;
+        fs->data_dirty_hi = 0;
+    }
+
+    if (fs->sb_dirty) {
+        if (pwrite(fs->fd, &fs->sb, sizeof(fs->sb), 0) != sizeof(fs->sb)) {
+            return -EIO;
+        }
+        fs->sb_dirty = 0;
+    }
+
+    return fsync(fs->fd) == -1 ? -errno : 0;
+}
+
+int locfs_fs_close(struct locfs_fs *fs)
+{
+    int ret;
+
+    ret = locfs_fs_sync(fs);
+    close(fs->fd);
+    free(fs->inode_bitmap);
+    free(fs->data_bitmap);
+    free(fs->locations);
+    free(fs->location_hash);
+    free(fs);
+    return ret;
+}
+
+void locfs_fs_super(struct locfs_fs *fs, struct locfs_super_block *out_sb)
+{
+    *out_sb = fs->sb;
+}
+
+int locfs_fs_set_location(struct locfs_fs *fs, const char *name)
+{
+    size_t len = strlen(name);
+
+    if (len == 0 || len >= LOCFS_LOCATION_MAXLEN) {
+        return -EINVAL;
+    }
+
+    memcpy(fs->location, name, len + 1);
+    return 0;
+}
+
+const char *locfs_fs_location(struct locfs_fs *fs)
+{
+    return fs->location;
+}
+
+void locfs_fs_set_coords(struct locfs_fs *fs, int32_t latitude,
+                         int32_t longitude, int32_t altitude,
+                         uint64_t timestamp)
+{
+    fs->latitude = latitude;
+    fs->longitude = longitude;
+    fs->altitude = altitude;
+    fs->timestamp = timestamp;
+}
+
+int locfs_fs_getattr(struct locfs_fs *fs, uint64_t inode_no,
+                     struct locfs_inode *out_inode)
+{
+    return read_inode(fs, inode_no, out_inode);
+}
+
+/* Only children created at the current location can be found */
+int locfs_fs_lookup(struct locfs_fs *fs, uint64_t dir, const char *name,
+                    uint64_t *out_inode_no)
+{
+    struct locfs_inode dir_inode, child;
+    size_t len = strlen(name);
+    int ret;
+
+    if (len >= LOCFS_FILENAME_MAXLEN) {
+        return -ENAMETOOLONG;
+    }
+
+    ret = read_inode(fs, dir, &dir_inode);
+    if (ret) {
+        return ret;
+    }
+    if (!S_ISDIR(dir_inode.mode)) {
+        return -ENOTDIR;
+    }
+
+    ret = dir_find(fs, &dir_inode, name, len, out_inode_no);
+    if (ret) {
+        return ret;
+    }
+
+    ret = read_inode(fs, *out_inode_no, &child);
+    if (ret) {
+        return ret;
+    }
+
+    return child.location_id == location_lookup(fs, fs->location)
+           ? 0 : -ENOENT;
+}
+
+int locfs_fs_readdir(struct locfs_fs *fs, uint64_t dir, uint64_t pos,
+                     locfs_filldir_t filldir, void *ctx)
+{
+    struct locfs_inode dir_inode;
+    struct locfs_locindex_block *index;
+    struct locfs_loclist_block *list;
+    uint64_t block_no, at, n, i;
+    uint32_t location_id;
+    int ret;
+
+    ret = read_inode(fs, dir, &dir_inode);
+    if (ret) {
+        return ret;
+    }
+    if (!S_ISDIR(dir_inode.mode)) {
+        return -ENOTDIR;
+    }
+
+    // Nothing was ever created at a location the table does not know
+    location_id = location_lookup(fs, fs->location);
+    if (location_id == LOCFS_LOCATION_NONE
+            || dir_inode.dir_index_block_no == 0) {
+        return 0;
+    }
+
+    index = malloc(fs->blocksize);
+    list = malloc(fs->blocksize);
+    if (!index || !list) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    ret = locindex_find(fs, &dir_inode, location_id, index, &block_no, &at);
+    if (ret) {
+        ret = ret == -ENOENT ? 0 : ret;
+        goto out;
+    }
+
+    // Only the records filed under the current location are read
+    n = 0;
+    for (block_no = index->entries[at].first_block_no; block_no;
+         block_no = list->header.next_block_no) {
+        ret = read_chain_block(fs, block_no, LOCFS_LOCLIST_MAGIC, list);
+        if (ret) {
+            goto out;
+        }
+
+        for (i = 0; i < list->header.count; i++, n++) {
+            if (n < pos) {
+                continue;
+            }
+            list->records[i].filename[LOCFS_FILENAME_MAXLEN - 1] = '\0';
+            if (filldir(ctx, list->records[i].filename,
+                        list->records[i].inode_no, n + 1)) {
+                goto out;
+            }
+        }
+    }
+
+out:
+    free(index);
+    free(list);
+    return ret;
+}
+
+int locfs_fs_create(struct locfs_fs *fs, uint64_t dir, const char *name,
+                    mode_t mode, uint64_t *out_inode_no)
+{
+    struct locfs_inode dir_inode, child;
+    uint64_t inode_no, block_no, len;
+    size_t name_len = strlen(name);
+    uint32_t location_id;
+    int ret;
+
+    if (fs->readonly) {
+        return -EROFS;
+    }
+    if (name_len == 0) {
+        return -EINVAL;
+    }
+    if (name_len >= LOCFS_FILENAME_MAXLEN) {
+        return -ENAMETOOLONG;
+    }
+    if (!(mode & S_IFMT)) {
+        mode |= S_IFREG;
+    }
+    if (!S_ISDIR(mode) && !S_ISREG(mode)) {
+        return -EINVAL;
+    }
+
+    ret = read_inode(fs, dir, &dir_inode);
+    if (ret) {
+        return ret;
+    }
+    if (!S_ISDIR(dir_inode.mode)) {
+        return -ENOTDIR;
+    }
+
+    // The name may be taken by a child hidden at another location
+    ret = dir_find(fs, &dir_inode, name, name_len, &inode_no);
+    if (ret != -ENOENT) {
+        return ret ? ret : -EEXIST;
+    }
+
+    ret = location_intern(fs, fs->location, &location_id);
+    if (ret) {
+        return ret;
+    }
+
+    ret = alloc_inode(fs, &inode_no);
+    if (ret) {
+        return ret;
+    }
+
+    memset(&child, 0, sizeof(child));
+    child.inode_no = inode_no;
+    child.mode = mode;
+    child.location_id = location_id;
+    child.latitude = fs->latitude;
+    child.longitude = fs->longitude;
+    child.altitude = fs->altitude;
+    child.timestamp = fs->timestamp;
+
+    // Regular files start out with their data in the inode where there
+    // is room and otherwise get blocks as they are written, directories
+    // get the blocks of their hash tree root and first leaf, as in the
+    // kernel
+    if (S_ISREG(mode)) {
+        if (LOCFS_INLINE_DATA_MAX_HSB(&fs->sb) > 0) {
+            ret = write_inode_flags(fs, inode_no, LOCFS_INODE_INLINE_DATA);
+        }
+    } else {
+        ret = extent_alloc(fs, &child, 0, 2, &block_no, &len);
+    }
+    if (ret) {
+        return ret;
+    }
+
+    if (S_ISDIR(mode)) {
+        ret = dir_init(fs, &child);
+        if (!ret) {
+            ret = locindex_create(fs, &child);
+        }
+        if (ret) {
+            return ret;
+        }
+    }
+
+    ret = write_inode(fs, &child);
+    if (ret) {
+        return ret;
+    }
+
+    ret = dir_insert(fs, &dir_inode, name, name_len, inode_no);
+    if (!ret) {
+        ret = locindex_add(fs, &dir_inode, location_id, name, inode_no);
+    }
+    if (ret) {
+        return ret;
+    }
+
+    dir_inode.dir_children_count += 1;
+    ret = write_inode(fs, &dir_inode);
+    if (ret) {
+        return ret;
+    }
+
+    ret = spatial_insert(fs, inode_no, child.latitude, child.longitude);
+    if (ret) {
+        return ret;
+    }
+
+    *out_inode_no = inode_no;
+    return 0;
+}
+
+ssize_t locfs_fs_read(struct locfs_fs *fs, uint64_t inode_no, void *buf,
+                      size_t size, uint64_t offset)
+{
+    struct locfs_inode li;
+    uint64_t pblock, run, boff;
+    uint32_t flags;
+    size_t done, n;
+    int ret;
+
+    ret = read_inode(fs, inode_no, &li);
+    if (!ret) {
+        ret = read_inode_flags(fs, inode_no, &flags);
+    }
+    if (ret) {
+        return ret;
+    }
+    if (S_ISDIR(li.mode)) {
+        return -EISDIR;
+    }
+
+    if (offset >= li.file_size) {
+        return 0;
+    }
+    if (size > li.file_size - offset) {
+        size = li.file_size - offset;
+    }
+
+    if (flags & LOCFS_INODE_INLINE_DATA) {
+        if (pread(fs->fd, buf, size, inline_offset(fs, inode_no) + offset)
+                != (ssize_t)size) {
+            return -EIO;
+        }
+        return size;
+    }
+
+    // One pread() per physically contiguous run
+    for (done = 0; done < size; done += n) {
+        boff = (offset + done) % fs->blocksize;
+        ret = extent_map(fs, &li, (offset + done) / fs->blocksize, &pblock,
+                         &run);
+        if (ret) {
+            return ret;
+        }
+
+        n = size - done;
+        if (run * fs->blocksize - boff < n) {
+            n = run * fs->blocksize - boff;
+        }
+
+        if (pblock == 0) {
+            memset((char *)buf + done, 0, n);
+        } else if (pread(fs->fd, (char *)buf + done, n,
+                         pblock * fs->blocksize + boff) != (ssize_t)n) {
+            return -EIO;
+        }
+    }
+
+    return size;
+}
+
+/* Zeroes len bytes at byte offset off of the image */
+static int zero_bytes(struct locfs_fs *fs, uint64_t off, uint64_t len)
+{
+    char *zeroes;
+    ssize_t n;
+
+    if (len == 0) {
+        return 0;
+    }
+
+    zeroes = calloc(1, len);
+    if (!zeroes) {
+        return -ENOMEM;
+    }
+    n = pwrite(fs->fd, zeroes, len, off);
+    free(zeroes);
+
+    return n == (ssize_t)len ? 0 : -EIO;
+}
+
+/*
+ * Writes to a file kept in its inode, which fits there. The bytes between
+ * the old end and offset may be left over from a longer past, so they are
+ * cleared.
+ */
+static ssize_t write_inline(struct locfs_fs *fs, struct locfs_inode *li,
+                            const void *buf, size_t size, uint64_t offset)
+{
+    int ret;
+
+    if (offset > li->file_size) {
+        ret = zero_bytes(fs, inline_offset(fs, li->inode_no) + li->file_size,
+                         offset - li->file_size);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    if (pwrite(fs->fd, buf, size, inline_offset(fs, li->inode_no) + offset)
+            != (ssize_t)size) {
+        return -EIO;
+    }
+
+    if (offset + size > li->file_size) {
+        li->file_size = offset + size;
+        ret = write_inode(fs, li);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    return size;
+}
+
+/* Moves the data of a file kept in its inode out to data blocks */
+static int spill_inline(struct locfs_fs *fs, struct locfs_inode *li)
+{
+    ssize_t n = 0;
+    char *data;
+    int ret;
+
+    data = malloc(li->file_size ? li->file_size : 1);
+    if (!data) {
+        return -ENOMEM;
+    }
+
+    if (pread(fs->fd, data, li->file_size, inline_offset(fs, li->inode_no))
+            != (ssize_t)li->file_size) {
+        free(data);
+        return -EIO;
+    }
+
+    ret = write_inode_flags(fs, li->inode_no, 0);
+    if (!ret && li->file_size) {
+        n = locfs_fs_write(fs, li->inode_no, data, li->file_size, 0);
+        ret = n < 0 ? (int)n : 0;
+    }
+    free(data);
+    if (ret) {
+        return ret;
+    }
+
+    return read_inode(fs, li->inode_no, li);
+}
+
+ssize_t locfs_fs_write(struct locfs_fs *fs, uint64_t inode_no,
+                       const void *buf, size_t size, uint64_t offset)
+{
+    struct locfs_inode li;
+    uint64_t pblock, run, boff, iblock, last, end;
+    uint32_t flags;
+    size_t done, n;
+    int fresh;
+    int ret;
+
+    if (fs->readonly) {
+        return -EROFS;
+    }
+
+    ret = read_inode(fs, inode_no, &li);
+    if (!ret) {
+        ret = read_inode_flags(fs, inode_no, &flags);
+    }
+    if (ret) {
+        return ret;
+    }
+    if (S_ISDIR(li.mode)) {
+        return -EISDIR;
+    }
+    if (size == 0) {
+        return 0;
+    }
+
+    // Small files stay in their inode until a write takes them past it
+    if (flags & LOCFS_INODE_INLINE_DATA) {
+        if (offset + size <= LOCFS_INLINE_DATA_MAX_HSB(&fs->sb)
+                && offset + size > offset) {
+            return write_inline(fs, &li, buf, size, offset);
+        }
+
+        ret = spill_inline(fs, &li);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    // Logical block numbers in an extent are 32 bits wide
+    if (offset + size > ((uint64_t)UINT32_MAX + 1) * fs->blocksize
+            || offset + size < offset) {
+        return -EFBIG;
+    }
+    last = (offset + size - 1) / fs->blocksize;
+
+    // One pwrite() per physically contiguous run, holes are allocated
+    // as one run where the bitmap allows
+    for (done = 0; done < size; done += n) {
+        iblock = (offset + done) / fs->blocksize;
+        boff = (offset + done) % fs->blocksize;
+        ret = extent_map(fs, &li, iblock, &pblock, &run);
+        if (ret) {
+            return ret;
+        }
+
+        fresh = pblock == 0;
+        if (fresh) {
+            ret = extent_alloc(fs, &li, iblock,
+                               run < last - iblock + 1 ? run
+                                                       : last - iblock + 1,
+                               &pblock, &run);
+            if (ret) {
+                return done ? (ssize_t)done : ret;
+            }
+        }
+
+        n = size - done;
+        if (run * fs->blocksize - boff < n) {
+            n = run * fs->blocksize - boff;
+        }
+
+        // New blocks must read back as zeroes where they are not written
+        if (fresh) {
+            end = boff + n;
+            ret = zero_bytes(fs, pblock * fs->blocksize, boff);
+            if (!ret && end % fs->blocksize) {
+                ret = zero_bytes(fs, pblock * fs->blocksize + end,
+                                 fs->blocksize - end % fs->blocksize);
+            }
+            if (ret) {
+                return ret;
+            }
+        }
+
+        if (pwrite(fs->fd, (const char *)buf + done, n,
+                   pblock * fs->blocksize + boff) != (ssize_t)n) {
+            return -EIO;
+        }
+    }
+
+    if (offset + size > li.file_size) {
+        li.file_size = offset + size;
+        ret = write_inode(fs, &li);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    return size;
+}
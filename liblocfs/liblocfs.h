@@ -0,0 +1,70 @@
+#ifndef __LIBLOCFS_H__
+#define __LIBLOCFS_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "../include/locfs.h"
+
+/*
+ * liblocfs
+ *
+ * Reads and writes locfs images from userspace, using the on-disk format
+ * of include/locfs.h just like the kernel module does. Directories are
+ * hash trees with a location index next to them, new inodes are tagged
+ * with the current location and GPS fix and filed in the spatial index,
+ * and only children created at the current location can be looked up or
+ * listed.
+ *
+ * Errors are returned as negative errno values. A struct locfs_fs may be
+ * used by one thread at a time. Changes are written to the image straight
+ * away, bypassing the journal, except for the bitmaps and the super block
+ * which are written by locfs_fs_sync() and locfs_fs_close().
+ */
+
+struct locfs_fs;
+
+/* Called for each entry by locfs_fs_readdir(), non-zero stops the listing */
+typedef int (*locfs_filldir_t)(void *ctx, const char *name, uint64_t inode_no,
+                               uint64_t next_pos);
+
+/*
+ * Opens the image at path. An image whose journal still holds a committed
+ * transaction is refused with -EUCLEAN, fsck.locfs -y replays it.
+ */
+int locfs_fs_open(const char *path, int readonly, struct locfs_fs **out_fs);
+int locfs_fs_close(struct locfs_fs *fs);
+int locfs_fs_sync(struct locfs_fs *fs);
+
+/* The super block, with the counts as they are in memory */
+void locfs_fs_super(struct locfs_fs *fs, struct locfs_super_block *out_sb);
+
+/* Sets the location new inodes are tagged with and listings show */
+int locfs_fs_set_location(struct locfs_fs *fs, const char *name);
+const char *locfs_fs_location(struct locfs_fs *fs);
+/* Sets the GPS fix new inodes are tagged with, see locfs.h for the units */
+void locfs_fs_set_coords(struct locfs_fs *fs, int32_t latitude,
+                         int32_t longitude, int32_t altitude,
+                         uint64_t timestamp);
+
+int locfs_fs_getattr(struct locfs_fs *fs, uint64_t inode_no,
+                     struct locfs_inode *out_inode);
+int locfs_fs_lookup(struct locfs_fs *fs, uint64_t dir, const char *name,
+                    uint64_t *out_inode_no);
+/*
+ * Lists the children of dir created at the current location, starting at
+ * the pos-th one. Returns 0 at the end of the listing too.
+ */
+int locfs_fs_readdir(struct locfs_fs *fs, uint64_t dir, uint64_t pos,
+                     locfs_filldir_t filldir, void *ctx);
+/* Creates a regular file or, with S_IFDIR in mode, a directory */
+int locfs_fs_create(struct locfs_fs *fs, uint64_t dir, const char *name,
+                    mode_t mode, uint64_t *out_inode_no);
+
+ssize_t locfs_fs_read(struct locfs_fs *fs, uint64_t inode_no, void *buf,
+                      size_t size, uint64_t offset);
+ssize_t locfs_fs_write(struct locfs_fs *fs, uint64_t inode_no,
+                       const void *buf, size_t size, uint64_t offset);
+
+#endif /*__LIBLOCFS_H__*/
@@ -0,0 +1,556 @@
+#define FUSE_USE_VERSION 31
+#define _GNU_SOURCE
+#include <fuse_lowlevel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/statvfs.h>
+
+#include "liblocfs.h"
+
+/*
+ * Mounts a locfs image through FUSE, without the kernel module
+ *
+ * ./locfs-fuse [-o location=<name>] <image> <mountpoint>
+ *
+ * The location new files are tagged with and listings show can be changed
+ * at run time through the user.locfs.location extended attribute of any
+ * file, and the GPS fix through user.locfs.coords ("lat lon [alt [time]]").
+ */
+
+/* FUSE reserves inode 1 for the root, locfs numbers it 0 */
+#define LOCFS_FUSE_INO(inode_no) ((fuse_ino_t)(inode_no) + 1)
+#define LOCFS_INODE_NO(ino) ((uint64_t)(ino) - 1)
+
+#define XATTR_LOCATION "user.locfs.location"
+#define XATTR_COORDS "user.locfs.coords"
+
+struct locfs_fuse_options {
+    char *image;
+    char *location;
+};
+
+static const struct fuse_opt locfs_fuse_opts[] = {
+    {"location=%s", offsetof(struct locfs_fuse_options, location), 0},
+    FUSE_OPT_END
+};
+
+static struct locfs_fs *fs;
+/* liblocfs takes one caller at a time */
+static pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void locfs_fuse_stat(const struct locfs_inode *li, struct stat *st)
+{
+    struct locfs_super_block sb;
+
+    locfs_fs_super(fs, &sb);
+    memset(st, 0, sizeof(*st));
+    st->st_ino = LOCFS_FUSE_INO(li->inode_no);
+    st->st_mode = li->mode;
+    st->st_nlink = S_ISDIR(li->mode) ? 2 : 1;
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+    st->st_size = S_ISDIR(li->mode) ? sb.blocksize : li->file_size;
+    st->st_blksize = sb.blocksize;
+    st->st_blocks = (st->st_size + 511) / 512;
+    st->st_atime = st->st_mtime = st->st_ctime = li->timestamp;
+}
+
+/* Fills e with the attributes of inode_no, under fs_lock */
+static int locfs_fuse_entry(uint64_t inode_no, struct fuse_entry_param *e)
+{
+    struct locfs_inode li;
+    int ret;
+
+    ret = locfs_fs_getattr(fs, inode_no, &li);
+    if (ret) {
+        return ret;
+    }
+
+    memset(e, 0, sizeof(*e));
+    e->ino = LOCFS_FUSE_INO(inode_no);
+    // Whether a name resolves depends on the current location, which can
+    // change at any time, so nothing is cached by the kernel
+    e->attr_timeout = 0;
+    e->entry_timeout = 0;
+    locfs_fuse_stat(&li, &e->attr);
+    return 0;
+}
+
+static void locfs_fuse_lookup(fuse_req_t req, fuse_ino_t parent,
+                              const char *name)
+{
+    struct fuse_entry_param e;
+    uint64_t inode_no;
+    int ret;
+
+    pthread_mutex_lock(&fs_lock);
+    ret = locfs_fs_lookup(fs, LOCFS_INODE_NO(parent), name, &inode_no);
+    if (!ret) {
+        ret = locfs_fuse_entry(inode_no, &e);
+    }
+    pthread_mutex_unlock(&fs_lock);
+
+    if (ret) {
+        fuse_reply_err(req, -ret);
+    } else {
+        fuse_reply_entry(req, &e);
+    }
+}
+
+static void locfs_fuse_getattr(fuse_req_t req, fuse_ino_t ino,
+                               struct fuse_file_info *fi)
+{
+    struct fuse_entry_param e;
+    int ret;
+
+    (void)fi;
+    pthread_mutex_lock(&fs_lock);
+    ret = locfs_fuse_entry(LOCFS_INODE_NO(ino), &e);
+    pthread_mutex_unlock(&fs_lock);
+
+    if (ret) {
+        fuse_reply_err(req, -ret);
+    } else {
+        fuse_reply_attr(req, &e.attr, 0);
+    }
+}
+
+/* locfs keeps no owners or times apart from the GPS timestamp, and files
+   cannot shrink, so only a no-op size change is accepted */
+static void locfs_fuse_setattr(fuse_req_t req, fuse_ino_t ino,
+                               struct stat *attr, int to_set,
+                               struct fuse_file_info *fi)
+{
+    struct fuse_entry_param e;
+    int ret;
+
+    (void)fi;
+    pthread_mutex_lock(&fs_lock);
+    ret = locfs_fuse_entry(LOCFS_INODE_NO(ino), &e);
+    pthread_mutex_unlock(&fs_lock);
+
+    if (!ret && (to_set & FUSE_SET_ATTR_SIZE)
+             && attr->st_size != e.attr.st_size) {
+        ret = -EOPNOTSUPP;
+    }
+
+    if (ret) {
+        fuse_reply_err(req, -ret);
+    } else {
+        fuse_reply_attr(req, &e.attr, 0);
+    }
+}
+
+struct locfs_fuse_dirbuf {
+    fuse_req_t req;
+    char *buf;
+    size_t size;
+    size_t used;
+};
+
+static int locfs_fuse_filldir(void *ctx, const char *name, uint64_t inode_no,
+                              uint64_t next_pos)
+{
+    struct locfs_fuse_dirbuf *db = ctx;
+    struct stat st;
+    size_t len;
+
+    // Only the inode number and type are used from st, the type is left
+    // out as it would cost a read of every child inode
+    memset(&st, 0, sizeof(st));
+    st.st_ino = LOCFS_FUSE_INO(inode_no);
+
+    len = fuse_add_direntry(db->req, db->buf + db->used, db->size - db->used,
+                            name, &st, next_pos);
+    if (len > db->size - db->used) {
+        return 1;
+    }
+
+    db->used += len;
+    return 0;
+}
+
+static void locfs_fuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                               off_t off, struct fuse_file_info *fi)
+{
+    struct locfs_fuse_dirbuf db = {.req = req, .size = size};
+    int ret;
+
+    (void)fi;
+    db.buf = malloc(size);
+    if (!db.buf) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    pthread_mutex_lock(&fs_lock);
+    ret = locfs_fs_readdir(fs, LOCFS_INODE_NO(ino), off, locfs_fuse_filldir,
+                           &db);
+    pthread_mutex_unlock(&fs_lock);
+
+    if (ret) {
+        fuse_reply_err(req, -ret);
+    } else {
+        fuse_reply_buf(req, db.buf, db.used);
+    }
+    free(db.buf);
+}
+
+/* Creates name in parent and fills e with it, under fs_lock */
+static int locfs_fuse_new(fuse_ino_t parent, const char *name, mode_t mode,
+                          struct fuse_entry_param *e)
+{
+    uint64_t inode_no;
+    int ret;
+
+    ret = locfs_fs_create(fs, LOCFS_INODE_NO(parent), name, mode, &inode_no);
+    if (ret) {
+        return ret;
+    }
+
+    return locfs_fuse_entry(inode_no, e);
+}
+
+static void locfs_fuse_mkdir(fuse_req_t req, fuse_ino_t parent,
+                             const char *name, mode_t mode)
+{
+    struct fuse_entry_param e;
+    int ret;
+
+    pthread_mutex_lock(&fs_lock);
+    ret = locfs_fuse_new(parent, name, S_IFDIR | (mode & 07777), &e);
+    pthread_mutex_unlock(&fs_lock);
+
+    if (ret) {
+        fuse_reply_err(req, -ret);
+    } else {
+        fuse_reply_entry(req, &e);
+    }
+}
+
+static void locfs_fuse_create(fuse_req_t req, fuse_ino_t parent,
+                              const char *name, mode_t mode,
+                              struct fuse_file_info *fi)
+{
+    struct fuse_entry_param e;
+    int ret;
+
+    if (!S_ISREG(mode)) {
+        fuse_reply_err(req, EPERM);
+        return;
+    }
+
+    pthread_mutex_lock(&fs_lock);
+    ret = locfs_fuse_new(parent, name, mode, &e);
+    pthread_mutex_unlock(&fs_lock);
+
+    if (ret) {
+        fuse_reply_err(req, -ret);
+    } else {
+        fuse_reply_create(req, &e, fi);
+    }
+}
+
+static void locfs_fuse_open(fuse_req_t req, fuse_ino_t ino,
+                            struct fuse_file_info *fi)
+{
+    struct locfs_inode li;
+    int ret;
+
+    pthread_mutex_lock(&fs_lock);
+    ret = locfs_fs_getattr(fs, LOCFS_INODE_NO(ino), &li);
+    pthread_mutex_unlock(&fs_lock);
+
+    if (!ret && S_ISDIR(li.mode)) {
+        ret = -EISDIR;
+    }
+    // Files cannot be truncated, see locfs_fuse_setattr
+    if (!ret && (fi->flags & O_TRUNC) && li.file_size) {
+        ret = -EOPNOTSUPP;
+    }
+
+    if (ret) {
+        fuse_reply_err(req, -ret);
+    } else {
+        fuse_reply_open(req, fi);
+    }
+}
+
+static void locfs_fuse_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+                            off_t off, struct fuse_file_info *fi)
+{
+    ssize_t ret;
+    char *buf;
+
+    (void)fi;
+    buf = malloc(size);
+    if (!buf) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    pthread_mutex_lock(&fs_lock);
+    ret = locfs_fs_read(fs, LOCFS_INODE_NO(ino), buf, size, off);
+    pthread_mutex_unlock(&fs_lock);
+
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+    } else {
+        fuse_reply_buf(req, buf, ret);
+    }
+    free(buf);
+}
+
+static void locfs_fuse_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+                             size_t size, off_t off,
+                             struct fuse_file_info *fi)
+{
+    ssize_t ret;
+
+    (void)fi;
+    pthread_mutex_lock(&fs_lock);
+    ret = locfs_fs_write(fs, LOCFS_INODE_NO(ino), buf, size, off);
+    pthread_mutex_unlock(&fs_lock);
+
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+    } else {
+        fuse_reply_write(req, ret);
+    }
+}
+
+static void locfs_fuse_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                             struct fuse_file_info *fi)
+{
+    int ret;
+
+    (void)ino;
+    (void)datasync;
+    (void)fi;
+    pthread_mutex_lock(&fs_lock);
+    ret = locfs_fs_sync(fs);
+    pthread_mutex_unlock(&fs_lock);
+
+    fuse_reply_err(req, -ret);
+}
+
+static void locfs_fuse_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+    struct locfs_super_block sb;
+    struct statvfs st;
+
+    (void)ino;
+    pthread_mutex_lock(&fs_lock);
+    locfs_fs_super(fs, &sb);
+    pthread_mutex_unlock(&fs_lock);
+
+    memset(&st, 0, sizeof(st));
+    st.f_bsize = sb.blocksize;
+    st.f_frsize = sb.blocksize;
+    st.f_blocks = sb.data_block_table_size;
+    st.f_bfree = sb.data_block_table_size - sb.data_block_count;
+    st.f_bavail = st.f_bfree;
+    st.f_files = sb.inode_table_size;
+    st.f_ffree = sb.inode_table_size - sb.inode_count;
+    st.f_favail = st.f_ffree;
+    st.f_namemax = LOCFS_FILENAME_MAXLEN - 1;
+    fuse_reply_statfs(req, &st);
+}
+
+/* Parses "lat lon [alt [time]]" in degrees and metres, like
+   /proc/locationmod_coords */
+static int locfs_fuse_parse_coords(const char *value, size_t size)
+{
+    double latitude, longitude, altitude = 0;
+    unsigned long long timestamp = 0;
+    char text[128];
+    int n;
+
+    if (size >= sizeof(text)) {
+        return -EINVAL;
+    }
+    memcpy(text, value, size);
+    text[size] = '\0';
+
+    n = sscanf(text, "%lf %lf %lf %llu", &latitude, &longitude, &altitude,
+               &timestamp);
+    if (n < 2 || latitude < -90 || latitude > 90
+            || longitude < -180 || longitude > 180) {
+        return -EINVAL;
+    }
+
+    locfs_fs_set_coords(fs, latitude * LOCFS_COORD_SCALE,
+                        longitude * LOCFS_COORD_SCALE,
+                        n >= 3 ? altitude * 1000 : LOCFS_COORD_NONE,
+                        timestamp);
+    return 0;
+}
+
+static void locfs_fuse_setxattr(fuse_req_t req, fuse_ino_t ino,
+                                const char *name, const char *value,
+                                size_t size, int flags)
+{
+    char location[LOCFS_LOCATION_MAXLEN];
+    int ret;
+
+    (void)ino;
+    (void)flags;
+    pthread_mutex_lock(&fs_lock);
+    if (strcmp(name, XATTR_LOCATION) == 0) {
+        ret = -EINVAL;
+        if (size < sizeof(location)) {
+            memcpy(location, value, size);
+            location[size] = '\0';
+            ret = locfs_fs_set_location(fs, location);
+        }
+    } else if (strcmp(name, XATTR_COORDS) == 0) {
+        ret = locfs_fuse_parse_coords(value, size);
+    } else {
+        ret = -ENOTSUP;
+    }
+    pthread_mutex_unlock(&fs_lock);
+
+    fuse_reply_err(req, -ret);
+}
+
+static void locfs_fuse_getxattr(fuse_req_t req, fuse_ino_t ino,
+                                const char *name, size_t size)
+{
+    char location[LOCFS_LOCATION_MAXLEN];
+    size_t len;
+
+    (void)ino;
+    if (strcmp(name, XATTR_LOCATION) != 0) {
+        fuse_reply_err(req, ENODATA);
+        return;
+    }
+
+    pthread_mutex_lock(&fs_lock);
+    len = strlen(locfs_fs_location(fs));
+    memcpy(location, locfs_fs_location(fs), len);
+    pthread_mutex_unlock(&fs_lock);
+
+    if (size == 0) {
+        fuse_reply_xattr(req, len);
+    } else if (size < len) {
+        fuse_reply_err(req, ERANGE);
+    } else {
+        fuse_reply_buf(req, location, len);
+    }
+}
+
+static const struct fuse_lowlevel_ops locfs_fuse_ops = {
+    .lookup     = locfs_fuse_lookup,
+    .getattr    = locfs_fuse_getattr,
+    .setattr    = locfs_fuse_setattr,
+    .readdir    = locfs_fuse_readdir,
+    .mkdir      = locfs_fuse_mkdir,
+    .create     = locfs_fuse_create,
+    .open       = locfs_fuse_open,
+    .read       = locfs_fuse_read,
+    .write      = locfs_fuse_write,
+    .fsync      = locfs_fuse_fsync,
+    .statfs     = locfs_fuse_statfs,
+    .setxattr   = locfs_fuse_setxattr,
+    .getxattr   = locfs_fuse_getxattr,
+};
+
+/* The first argument that is not an option names the image */
+static int locfs_fuse_opt_proc(void *data, const char *arg, int key,
+                               struct fuse_args *outargs)
+{
+    struct locfs_fuse_options *options = data;
+
+    (void)outargs;
+    if (key == FUSE_OPT_KEY_NONOPT && !options->image) {
+        options->image = strdup(arg);
+        return 0;
+    }
+
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct locfs_fuse_options options = {0};
+    struct fuse_cmdline_opts opts;
+    struct fuse_loop_config config;
+    struct fuse_session *se;
+    int ret = 1;
+
+    if (fuse_opt_parse(&args, &options, locfs_fuse_opts,
+                       locfs_fuse_opt_proc) == -1
+            || fuse_parse_cmdline(&args, &opts) != 0) {
+        return 1;
+    }
+
+    if (opts.show_help || !options.image || !opts.mountpoint) {
+        printf("Usage: %s [-o location=<name>] [options] <image> "
+               "<mountpoint>\n", argv[0]);
+        fuse_cmdline_help();
+        fuse_lowlevel_help();
+        goto out_args;
+    }
+
+    ret = locfs_fs_open(options.image, 0, &fs);
+    if (ret) {
+        fprintf(stderr, "Could not open %s: %s\n", options.image,
+                strerror(-ret));
+        ret = 1;
+        goto out_args;
+    }
+    ret = 1;
+
+    if (options.location && locfs_fs_set_location(fs, options.location)) {
+        fprintf(stderr, "Invalid location %s\n", options.location);
+        goto out_fs;
+    }
+
+    se = fuse_session_new(&args, &locfs_fuse_ops, sizeof(locfs_fuse_ops),
+                          NULL);
+    if (!se) {
+        goto out_fs;
+    }
+
+    if (fuse_set_signal_handlers(se) != 0) {
+        goto out_session;
+    }
+
+    if (fuse_session_mount(se, opts.mountpoint) != 0) {
+        goto out_signals;
+    }
+
+    fuse_daemonize(opts.foreground);
+
+    // Requests are serialized on fs_lock, the extra threads still overlap
+    // the kernel round trips with the work on the image
+    if (opts.singlethread) {
+        ret = fuse_session_loop(se);
+    } else {
+        config.clone_fd = opts.clone_fd;
+        config.max_idle_threads = opts.max_idle_threads;
+        ret = fuse_session_loop_mt(se, &config);
+    }
+
+    fuse_session_unmount(se);
+out_signals:
+    fuse_remove_signal_handlers(se);
+out_session:
+    fuse_session_destroy(se);
+out_fs:
+    if (locfs_fs_close(fs)) {
+        ret = 1;
+    }
+out_args:
+    free(opts.mountpoint);
+    free(options.image);
+    free(options.location);
+    fuse_opt_free_args(&args);
+    return ret ? 1 : 0;
+}
@@ -0,0 +1,244 @@
+/*
+ * Location Based Filesystem
+ *
+ * By, Robert Chrystie
+ */
+
+#include <linux/buffer_head.h>
+#include <linux/hashtable.h>
+#include <linux/rculist.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/stringhash.h>
+#include "internal.h"
+
+/*
+ * Location table
+ *
+ * The on-disk table, see struct locfs_location_block, is read into a hash
+ * table at mount. Lookups walk the hash under RCU and take no lock, new
+ * names are appended under t_lock. Names are never removed while mounted.
+ */
+
+/* An interned location name */
+struct locfs_location {
+    struct hlist_node l_node;
+    uint32_t l_id;
+    char l_name[];
+};
+
+/* Names are compared as stored, cut to fit struct locfs_location_entry */
+static inline size_t locfs_location_len(const char *name)
+{
+    return strnlen(name, LOCFS_LOCATION_MAXLEN - 1);
+}
+
+static inline unsigned int locfs_location_hash(const char *name, size_t len)
+{
+    return full_name_hash(NULL, name, len);
+}
+
+static struct locfs_location *locfs_location_new(uint32_t id,
+                                                   const char *name)
+{
+    struct locfs_location *loc;
+    size_t len = locfs_location_len(name);
+
+    loc = kmalloc(sizeof(*loc) + len + 1, GFP_NOFS);
+    if (loc) {
+        loc->l_id = id;
+        memcpy(loc->l_name, name, len);
+        loc->l_name[len] = '\0';
+    }
+
+    return loc;
+}
+
+static void locfs_location_add(struct locfs_location_table *table,
+                                 struct locfs_location *loc)
+{
+    size_t len = strlen(loc->l_name);
+
+    hash_add_rcu(table->t_hash, &loc->l_node,
+                 locfs_location_hash(loc->l_name, len));
+}
+
+/* Reads the location table of the image into memory */
+int locfs_location_load(struct super_block *sb)
+{
+    struct locfs_location_table *table = &LOCFS_SBI(sb)->s_locations;
+    struct buffer_head *bh;
+    struct locfs_location_block *block;
+    struct locfs_location *loc;
+    uint64_t block_no, i;
+    int ret;
+
+    mutex_init(&table->t_lock);
+    hash_init(table->t_hash);
+    table->t_count = 0;
+    table->t_last_block_no = 0;
+
+    block_no = LOCFS_SB(sb)->location_table_block_no;
+    while (block_no != 0) {
+        bh = locfs_read_chain_block(sb, block_no, LOCFS_LOCTABLE_MAGIC);
+        if (IS_ERR(bh)) {
+            ret = PTR_ERR(bh);
+            goto release;
+        }
+        block = (struct locfs_location_block *)bh->b_data;
+
+        for (i = 0; i < block->header.count; i++) {
+            loc = locfs_location_new(block->entries[i].id,
+                                     block->entries[i].name);
+            if (!loc) {
+                brelse(bh);
+                ret = -ENOMEM;
+                goto release;
+            }
+            locfs_location_add(table, loc);
+            table->t_count = max(table->t_count, block->entries[i].id);
+        }
+
+        table->t_last_block_no = block_no;
+        block_no = block->header.next_block_no;
+        brelse(bh);
+    }
+
+    return 0;
+
+release:
+    locfs_location_release(sb);
+    return ret;
+}
+
+void locfs_location_release(struct super_block *sb)
+{
+    struct locfs_location_table *table = &LOCFS_SBI(sb)->s_locations;
+    struct locfs_location *loc;
+    struct hlist_node *tmp;
+    int bkt;
+
+    // Unmounting, nobody can be looking names up any more
+    hash_for_each_safe(table->t_hash, bkt, tmp, loc, l_node) {
+        hash_del(&loc->l_node);
+        kfree(loc);
+    }
+}
+
+/* Returns the ID of the location name, LOCFS_LOCATION_NONE if unknown */
+uint32_t locfs_location_lookup(struct super_block *sb, const char *name)
+{
+    struct locfs_location_table *table = &LOCFS_SBI(sb)->s_locations;
+    struct locfs_location *loc;
+    size_t len = locfs_location_len(name);
+    uint32_t id = LOCFS_LOCATION_NONE;
+
+    rcu_read_lock();
+    hash_for_each_possible_rcu(table->t_hash, loc, l_node,
+                               locfs_location_hash(name, len)) {
+        if (memcmp(loc->l_name, name, len) == 0 && loc->l_name[len] == '\0') {
+            id = loc->l_id;
+            break;
+        }
+    }
+    rcu_read_unlock();
+
+    return id;
+}
+
+/*
+ * Returns the ID of the location name, adding it to the table when it is
+ * new. Must be called inside a journal handle.
+ */
+int locfs_location_intern(struct super_block *sb,
+                            const char *name,
+                            uint32_t *out_id)
+{
+    struct locfs_sb_info *sbi = LOCFS_SBI(sb);
+    struct locfs_location_table *table = &sbi->s_locations;
+    struct buffer_head *bh = NULL, *prev_bh = NULL;
+    struct locfs_location_block *block;
+    struct locfs_location_entry *entry;
+    struct locfs_location *loc;
+    uint64_t block_no;
+    int ret = 0;
+
+    *out_id = locfs_location_lookup(sb, name);
+    if (*out_id != LOCFS_LOCATION_NONE) {
+        return 0;
+    }
+
+    // Allocated up front so nothing can fail after the disk is changed
+    loc = locfs_location_new(LOCFS_LOCATION_NONE, name);
+    if (!loc) {
+        return -ENOMEM;
+    }
+
+    mutex_lock(&table->t_lock);
+
+    // Somebody else may have added it while the lock was not held
+    *out_id = locfs_location_lookup(sb, name);
+    if (*out_id != LOCFS_LOCATION_NONE) {
+        goto out;
+    }
+
+    if (table->t_count == U32_MAX) {
+        ret = -ENOSPC;
+        goto out;
+    }
+
+    if (table->t_last_block_no != 0) {
+        bh = sb_bread(sb, table->t_last_block_no);
+        if (!bh) {
+            ret = -EIO;
+            goto out;
+        }
+
+        block = (struct locfs_location_block *)bh->b_data;
+        if (block->header.count >= LOCFS_LOCATIONS_PER_BLOCK_HSB(sbi->s_lsb)) {
+            prev_bh = bh;
+            bh = NULL;
+        }
+    }
+
+    // The last block is full, or there is none yet
+    if (!bh) {
+        bh = locfs_new_chain_block(sb, NULL, LOCFS_LOCTABLE_MAGIC,
+                                   table->t_last_block_no, &block_no);
+        if (IS_ERR(bh)) {
+            brelse(prev_bh);
+            ret = PTR_ERR(bh);
+            goto out;
+        }
+
+        if (prev_bh) {
+            block = (struct locfs_location_block *)prev_bh->b_data;
+            block->header.next_block_no = block_no;
+            locfs_dirty_buffer(sb, prev_bh, NULL);
+            brelse(prev_bh);
+        } else {
+            sbi->s_lsb->location_table_block_no = block_no;
+            locfs_save_sb(sb);
+        }
+        table->t_last_block_no = block_no;
+    }
+
+    loc->l_id = table->t_count + 1;
+
+    block = (struct locfs_location_block *)bh->b_data;
+    entry = &block->entries[block->header.count++];
+    entry->id = loc->l_id;
+    strlcpy(entry->name, name, LOCFS_LOCATION_MAXLEN);
+    locfs_dirty_buffer(sb, bh, NULL);
+    brelse(bh);
+
+    locfs_location_add(table, loc);
+    table->t_count = loc->l_id;
+    *out_id = loc->l_id;
+    loc = NULL;
+
+out:
+    mutex_unlock(&table->t_lock);
+    kfree(loc);
+    return ret;
+}
@@ -5,43 +5,390 @@
  */
 
 #include <linux/proc_fs.h>
+#include <linux/rcupdate.h>
 #include <linux/uaccess.h>
 #include <linux/seq_file.h>
 #include <linux/slab.h>
 #include <linux/string.h>
+#include <linux/ctype.h>
+#include <linux/timekeeping.h>
 
 #include "include/locfs.h"
 #include "internal.h"
+#include "trace.h"
 
-char *curr_location = "Home";
-EXPORT_SYMBOL(curr_location);
+/*
+ * Current location
+ *
+ * New inodes are tagged with, and listings show, the location last written
+ * to /proc/locationmod, unless the mount was given one of its own with the
+ * location= option. Either is published through RCU: readers never block
+ * or take a lock, the writers are serialized by curr_location_lock and the
+ * name they replace is freed after a grace period.
+ */
+static struct locfs_curr_location default_location = {
+    .l_name = "Home",
+};
+static struct locfs_curr_location __rcu *curr_location = &default_location;
+static DEFINE_MUTEX(curr_location_lock);
+
+/* Bumped every time a current location changes, see locfs_d_revalidate */
+static atomic_t curr_location_gen = ATOMIC_INIT(0);
+
+unsigned int locfs_location_gen(void)
+{
+    unsigned int gen = atomic_read(&curr_location_gen);
+
+    // Pairs with the atomic_inc_return in locfs_set_curr_location, a
+    // caller that sees the new generation also sees the new location
+    smp_rmb();
+    return gen;
+}
 
 static int locationmod_seq_show(struct seq_file *m, void *v)
 {
-	seq_printf(m, "%s", curr_location);
+	rcu_read_lock();
+	seq_printf(m, "%s", rcu_dereference(curr_location)->l_name);
+	rcu_read_unlock();
 	return 0;
 }
 
-static ssize_t locationmod_write(struct file* file, const char __user *buffer, size_t count, loff_t *f_pos)
+/* Copies name into a new location to publish, ERR_PTR on failure */
+struct locfs_curr_location *locfs_new_curr_location(const char *name,
+                                                      size_t len)
+{
+    struct locfs_curr_location *loc;
+
+    if (len == 0 || len >= LOCFS_LOCATION_MAXLEN) {
+        return ERR_PTR(-EINVAL);
+    }
+
+    loc = kzalloc(sizeof(*loc), GFP_KERNEL);
+    if (!loc) {
+        return ERR_PTR(-ENOMEM);
+    }
+    memcpy(loc->l_name, name, len);
+
+    return loc;
+}
+
+/*
+ * Publishes loc as the global location when slot is NULL, or as the
+ * location of a mount. A mount given NULL follows the global one again.
+ */
+void locfs_set_curr_location(struct locfs_curr_location __rcu **slot,
+                               struct locfs_curr_location *loc)
 {
-	char *tmp = kzalloc((count+1),GFP_KERNEL);
+    struct locfs_curr_location *old;
+    unsigned int gen;
+
+    if (!slot) {
+        slot = &curr_location;
+    }
+
+    mutex_lock(&curr_location_lock);
+    old = rcu_dereference_protected(*slot,
+                                    lockdep_is_held(&curr_location_lock));
+    rcu_assign_pointer(*slot, loc);
 
-	if(!tmp) {
+    // Anyone seeing the new generation also sees the new location
+    gen = atomic_inc_return(&curr_location_gen);
+    trace_locfs_location_change(loc ? loc->l_name : "", gen);
+    mutex_unlock(&curr_location_lock);
+
+    if (old && old != &default_location) {
+        kfree_rcu(old, l_rcu);
+    }
+}
+
+/* The location in effect for sb, called under rcu_read_lock() */
+static struct locfs_curr_location *locfs_curr_location_rcu(struct super_block *sb)
+{
+    struct locfs_curr_location *loc;
+
+    loc = rcu_dereference(LOCFS_SBI(sb)->s_location);
+    return loc ? loc : rcu_dereference(curr_location);
+}
+
+/*
+ * ID of the current location of sb, LOCFS_LOCATION_NONE when nothing was
+ * ever created there. Never sleeps.
+ */
+uint32_t locfs_curr_location_id(struct super_block *sb)
+{
+    uint32_t id;
+
+    rcu_read_lock();
+    id = locfs_location_lookup(sb, locfs_curr_location_rcu(sb)->l_name);
+    rcu_read_unlock();
+
+    return id;
+}
+
+/*
+ * ID of the current location of sb, added to its location table when it
+ * is new. Must be called inside a journal handle.
+ */
+int locfs_curr_location_intern(struct super_block *sb, uint32_t *out_id)
+{
+    char *name;
+    int ret;
+
+    *out_id = locfs_curr_location_id(sb);
+    if (*out_id != LOCFS_LOCATION_NONE) {
+        return 0;
+    }
+
+    // Interning sleeps, so it works on a copy taken under RCU
+    name = kmalloc(LOCFS_LOCATION_MAXLEN, GFP_NOFS);
+    if (!name) {
         return -ENOMEM;
     }
+    rcu_read_lock();
+    strlcpy(name, locfs_curr_location_rcu(sb)->l_name, LOCFS_LOCATION_MAXLEN);
+    rcu_read_unlock();
 
-	if(copy_from_user(tmp, buffer, count)){
-		kfree(tmp);
-		return EFAULT;
+    ret = locfs_location_intern(sb, name, out_id);
+    kfree(name);
+    return ret;
+}
+
+static ssize_t locationmod_write(struct file* file, const char __user *buffer, size_t count, loff_t *f_pos)
+{
+	struct locfs_curr_location *loc;
+	char buf[LOCFS_LOCATION_MAXLEN];
+	size_t len = count;
+
+	if (count >= sizeof(buf)) {
+		return -EINVAL;
 	}
 
-    curr_location = tmp;
+	if(copy_from_user(buf, buffer, count)){
+		return -EFAULT;
+	}
+	buf[count] = '\0';
+
+    // echo appends a newline which is not part of the name
+	if (len && buf[len - 1] == '\n') {
+		buf[--len] = '\0';
+	}
 
-    printk(KERN_INFO "locationmod: Location set to %s", curr_location);
+	loc = locfs_new_curr_location(buf, len);
+	if (IS_ERR(loc)) {
+		return PTR_ERR(loc);
+	}
+	locfs_set_curr_location(NULL, loc);
 
 	return count;
 }
 
+/*
+ * GPS fix new inodes are tagged with, set through /proc/locationmod_coords
+ * or the binary feed in feed.c. Readers retry instead of taking the lock.
+ */
+static struct locfs_coords curr_coords = {
+    .latitude = LOCFS_COORD_NONE,
+    .longitude = LOCFS_COORD_NONE,
+    .altitude = LOCFS_COORD_NONE,
+    .timestamp = 0,
+};
+static DEFINE_SEQLOCK(curr_coords_lock);
+
+void locfs_get_curr_coords(struct locfs_coords *coords)
+{
+    unsigned int seq;
+
+    // A fix published in the feed ring since the last call wins
+    locfs_feed_pull();
+
+    do {
+        seq = read_seqbegin(&curr_coords_lock);
+        *coords = curr_coords;
+    } while (read_seqretry(&curr_coords_lock, seq));
+}
+
+void locfs_set_curr_coords(const struct locfs_coords *coords)
+{
+    write_seqlock(&curr_coords_lock);
+    curr_coords = *coords;
+    write_sequnlock(&curr_coords_lock);
+}
+
+/* Parses a decimal such as "-122.4194" into a count of 10^-digits units */
+static int locationmod_parse_fixed(const char *s, int digits, int64_t *out)
+{
+    int64_t value = 0;
+    int frac = -1;
+    bool neg = false;
+
+    if (*s == '-' || *s == '+') {
+        neg = *s == '-';
+        s++;
+    }
+    if (!*s) {
+        return -EINVAL;
+    }
+
+    for (; *s; s++) {
+        if (*s == '.' && frac < 0) {
+            frac = 0;
+            continue;
+        }
+        if (!isdigit(*s)) {
+            return -EINVAL;
+        }
+        // Digits beyond the precision kept are dropped
+        if (frac >= digits) {
+            continue;
+        }
+        if (value > S32_MAX) {
+            return -ERANGE;
+        }
+        value = value * 10 + (*s - '0');
+        if (frac >= 0) {
+            frac++;
+        }
+    }
+
+    for (frac = max(frac, 0); frac < digits; frac++) {
+        value *= 10;
+    }
+    if (value > S32_MAX) {
+        return -ERANGE;
+    }
+
+    *out = neg ? -value : value;
+    return 0;
+}
+
+/* Prints a fixed point value with digits decimals */
+static void locationmod_show_fixed(struct seq_file *m, int32_t value,
+                                     int digits, int scale)
+{
+    int64_t v = value;
+
+    seq_printf(m, "%s%lld.%0*lld", v < 0 ? "-" : "", abs(v) / scale,
+               digits, abs(v) % scale);
+}
+
+static int locationmod_coords_show(struct seq_file *m, void *v)
+{
+    struct locfs_coords coords;
+
+    locfs_get_curr_coords(&coords);
+    if (coords.latitude == LOCFS_COORD_NONE) {
+        seq_puts(m, "none\n");
+        return 0;
+    }
+
+    locationmod_show_fixed(m, coords.latitude, 7, LOCFS_COORD_SCALE);
+    seq_putc(m, ' ');
+    locationmod_show_fixed(m, coords.longitude, 7, LOCFS_COORD_SCALE);
+    if (coords.altitude != LOCFS_COORD_NONE) {
+        seq_putc(m, ' ');
+        locationmod_show_fixed(m, coords.altitude, 3, 1000);
+    }
+    seq_printf(m, " @%llu\n", coords.timestamp);
+    return 0;
+}
+
+/*
+ * Sets the GPS fix from "latitude longitude [altitude [timestamp]]", with
+ * degrees, metres and seconds since the epoch. "none" clears it. The
+ * timestamp defaults to the time of the write.
+ */
+static ssize_t locationmod_coords_write(struct file *file,
+                                          const char __user *buffer,
+                                          size_t count,
+                                          loff_t *f_pos)
+{
+    struct locfs_coords coords = {
+        .latitude = LOCFS_COORD_NONE,
+        .longitude = LOCFS_COORD_NONE,
+        .altitude = LOCFS_COORD_NONE,
+        .timestamp = 0,
+    };
+    char buf[128];
+    char *p, *field[4];
+    int64_t value;
+    int n = 0;
+    int ret;
+
+    if (count >= sizeof(buf)) {
+        return -EINVAL;
+    }
+    if (copy_from_user(buf, buffer, count)) {
+        return -EFAULT;
+    }
+    buf[count] = '\0';
+
+    p = strim(buf);
+    if (strcmp(p, "none") == 0) {
+        goto set;
+    }
+
+    while (p && n < ARRAY_SIZE(field)) {
+        field[n] = strsep(&p, " \t");
+        if (*field[n]) {
+            n++;
+        }
+    }
+    if (n < 2 || p) {
+        return -EINVAL;
+    }
+
+    ret = locationmod_parse_fixed(field[0], 7, &value);
+    if (ret || value < -90LL * LOCFS_COORD_SCALE
+            || value > 90LL * LOCFS_COORD_SCALE) {
+        return -EINVAL;
+    }
+    coords.latitude = value;
+
+    ret = locationmod_parse_fixed(field[1], 7, &value);
+    if (ret || value < -180LL * LOCFS_COORD_SCALE
+            || value > 180LL * LOCFS_COORD_SCALE) {
+        return -EINVAL;
+    }
+    coords.longitude = value;
+
+    if (n > 2) {
+        ret = locationmod_parse_fixed(field[2], 3, &value);
+        if (ret || value == LOCFS_COORD_NONE) {
+            return -EINVAL;
+        }
+        coords.altitude = value;
+    }
+
+    if (n > 3) {
+        ret = kstrtou64(field[3], 10, &coords.timestamp);
+        if (ret) {
+            return ret;
+        }
+    } else {
+        coords.timestamp = ktime_get_real_seconds();
+    }
+
+set:
+    locfs_set_curr_coords(&coords);
+
+    return count;
+}
+
+static int locationmod_coords_open(struct inode *inode,
+                                     struct file *file)
+{
+    return single_open(file, locationmod_coords_show, NULL);
+}
+
+static struct file_operations locationmod_coords_fops = {
+    .owner = THIS_MODULE,
+    .open = locationmod_coords_open,
+    .write = locationmod_coords_write,
+    .release = single_release,
+    .read = seq_read,
+    .llseek = seq_lseek,
+};
+
 static int locationmod_open(struct inode *inode,
                               struct file *file)
 {
@@ -66,11 +413,19 @@ int create_locationmod_proc(void)
 		return -1;	
     }
 
+	entry = proc_create("locationmod_coords", 0666, NULL,
+	                    &locationmod_coords_fops);
+	if (!entry) {
+		remove_proc_entry("locationmod", NULL);
+		return -1;
+	}
+
 	return 0;
 }
 
 void remove_locationmod_proc(void) 
 {
+	remove_proc_entry("locationmod_coords", NULL);
 	remove_proc_entry("locationmod", NULL);
 	printk(KERN_INFO "locationmod: Removed proc file\n");
 }
@@ -0,0 +1,295 @@
+/*
+ * Location Based Filesystem
+ *
+ * By, Robert Chrystie
+ */
+
+#include <linux/buffer_head.h>
+#include <linux/string.h>
+#include "internal.h"
+
+/*
+ * Location index
+ *
+ * Next to its records every directory keeps an index of the locations its
+ * children were created at. The entry of a location points at a chain of
+ * list blocks holding the records of the children tagged with it, so
+ * readdir reads just that chain and never loads a child inode to decide
+ * whether it should be shown. See struct locfs_locindex_block.
+ */
+
+/*
+ * Looks up the index entry of location_id. Returns 0 and the entry with the
+ * index block holding it, or -ENOENT and the last block of the index chain.
+ */
+static int locfs_locindex_find(struct super_block *sb,
+                                 struct locfs_inode *dir_locfs_inode,
+                                 uint32_t location_id,
+                                 struct buffer_head **out_bh,
+                                 struct locfs_locindex_entry **out_entry)
+{
+    struct buffer_head *bh;
+    struct locfs_locindex_block *index;
+    uint64_t block_no = dir_locfs_inode->dir_index_block_no;
+    uint64_t i;
+
+    for (;;) {
+        bh = locfs_read_chain_block(sb, block_no, LOCFS_LOCINDEX_MAGIC);
+        if (IS_ERR(bh)) {
+            return PTR_ERR(bh);
+        }
+
+        index = (struct locfs_locindex_block *)bh->b_data;
+        for (i = 0; i < index->header.count; i++) {
+            if (index->entries[i].location_id == location_id) {
+                *out_bh = bh;
+                *out_entry = &index->entries[i];
+                return 0;
+            }
+        }
+
+        if (index->header.next_block_no == 0) {
+            *out_bh = bh;
+            *out_entry = NULL;
+            return -ENOENT;
+        }
+
+        block_no = index->header.next_block_no;
+        brelse(bh);
+    }
+}
+
+/* Gives a new directory an empty location index */
+int locfs_locindex_create(struct inode *dir)
+{
+    struct locfs_inode *dir_locfs_inode = LOCFS_INODE(dir);
+    struct buffer_head *bh;
+    uint64_t goal = 0;
+    uint64_t len;
+
+    // Keep the index next to the directory's records
+    locfs_extent_map(dir->i_sb, dir_locfs_inode, 0, &goal, &len);
+
+    bh = locfs_new_chain_block(dir->i_sb, dir, LOCFS_LOCINDEX_MAGIC, goal,
+                               &dir_locfs_inode->dir_index_block_no);
+    if (IS_ERR(bh)) {
+        return PTR_ERR(bh);
+    }
+
+    brelse(bh);
+    return 0;
+}
+
+/* Records that the child inode_no called filename was created at location_id */
+int locfs_locindex_add(struct inode *dir,
+                         uint32_t location_id,
+                         const char *filename,
+                         uint64_t inode_no)
+{
+    struct super_block *sb = dir->i_sb;
+    struct locfs_super_block *locfs_sb = LOCFS_SB(sb);
+    struct locfs_inode *dir_locfs_inode = LOCFS_INODE(dir);
+    struct buffer_head *bh, *list_bh, *new_bh;
+    struct locfs_locindex_block *index;
+    struct locfs_locindex_entry *entry;
+    struct locfs_loclist_block *list;
+    struct locfs_dir_record *record;
+    uint64_t goal, block_no;
+    int ret;
+
+    // Directories from before the index have nowhere to record it
+    if (dir_locfs_inode->dir_index_block_no == 0) {
+        return 0;
+    }
+    goal = dir_locfs_inode->dir_index_block_no;
+
+    ret = locfs_locindex_find(sb, dir_locfs_inode, location_id, &bh, &entry);
+    if (ret == -ENOENT) {
+        // First child at this location, it gets an entry and a list block
+        index = (struct locfs_locindex_block *)bh->b_data;
+        if (index->header.count
+                >= LOCFS_LOCINDEX_ENTRIES_PER_BLOCK_HSB(locfs_sb)) {
+            new_bh = locfs_new_chain_block(sb, dir, LOCFS_LOCINDEX_MAGIC,
+                                           goal, &block_no);
+            if (IS_ERR(new_bh)) {
+                brelse(bh);
+                return PTR_ERR(new_bh);
+            }
+            index->header.next_block_no = block_no;
+            locfs_dirty_buffer(sb, bh, dir);
+            brelse(bh);
+
+            bh = new_bh;
+            index = (struct locfs_locindex_block *)bh->b_data;
+        }
+
+        list_bh = locfs_new_chain_block(sb, dir, LOCFS_LOCLIST_MAGIC,
+                                        goal, &block_no);
+        if (IS_ERR(list_bh)) {
+            brelse(bh);
+            return PTR_ERR(list_bh);
+        }
+
+        entry = &index->entries[index->header.count++];
+        entry->location_id = location_id;
+        entry->first_block_no = block_no;
+        entry->last_block_no = block_no;
+        locfs_dirty_buffer(sb, bh, dir);
+    } else if (ret == 0) {
+        list_bh = locfs_read_chain_block(sb, entry->last_block_no,
+                                         LOCFS_LOCLIST_MAGIC);
+        if (IS_ERR(list_bh)) {
+            brelse(bh);
+            return PTR_ERR(list_bh);
+        }
+
+        // The list is full, chain a new block after it
+        list = (struct locfs_loclist_block *)list_bh->b_data;
+        if (list->header.count
+                >= LOCFS_LOCLIST_RECORDS_PER_BLOCK_HSB(locfs_sb)) {
+            new_bh = locfs_new_chain_block(sb, dir, LOCFS_LOCLIST_MAGIC,
+                                           entry->last_block_no,
+                                           &block_no);
+            if (IS_ERR(new_bh)) {
+                brelse(list_bh);
+                brelse(bh);
+                return PTR_ERR(new_bh);
+            }
+            list->header.next_block_no = block_no;
+            locfs_dirty_buffer(sb, list_bh, dir);
+            brelse(list_bh);
+
+            list_bh = new_bh;
+            entry->last_block_no = block_no;
+            locfs_dirty_buffer(sb, bh, dir);
+        }
+    } else {
+        return ret;
+    }
+
+    list = (struct locfs_loclist_block *)list_bh->b_data;
+    record = &list->records[list->header.count++];
+    strlcpy(record->filename, filename, LOCFS_FILENAME_MAXLEN);
+    record->inode_no = inode_no;
+    locfs_dirty_buffer(sb, list_bh, dir);
+
+    brelse(list_bh);
+    brelse(bh);
+    return 0;
+}
+
+/*
+ * Takes back the record locfs_locindex_add just made for inode_no, when
+ * creating the child failed after it. Blocks chained on for the record
+ * stay behind, empty.
+ */
+int locfs_locindex_remove(struct inode *dir,
+                            uint32_t location_id,
+                            uint64_t inode_no)
+{
+    struct super_block *sb = dir->i_sb;
+    struct buffer_head *bh, *list_bh;
+    struct locfs_locindex_entry *entry;
+    struct locfs_loclist_block *list;
+    int ret;
+
+    if (LOCFS_INODE(dir)->dir_index_block_no == 0) {
+        return 0;
+    }
+
+    ret = locfs_locindex_find(sb, LOCFS_INODE(dir), location_id, &bh, &entry);
+    if (ret == -ENOENT) {
+        brelse(bh);
+        return 0;
+    } else if (ret) {
+        return ret;
+    }
+
+    list_bh = locfs_read_chain_block(sb, entry->last_block_no,
+                                     LOCFS_LOCLIST_MAGIC);
+    brelse(bh);
+    if (IS_ERR(list_bh)) {
+        return PTR_ERR(list_bh);
+    }
+
+    list = (struct locfs_loclist_block *)list_bh->b_data;
+    if (list->header.count > 0
+            && list->records[list->header.count - 1].inode_no == inode_no) {
+        list->header.count--;
+        memset(&list->records[list->header.count], 0,
+               sizeof(struct locfs_dir_record));
+        locfs_dirty_buffer(sb, list_bh, dir);
+    }
+
+    brelse(list_bh);
+    return 0;
+}
+
+/*
+ * A readdir position is the list block to go on from and the slot in it,
+ * 0 being the start of the listing. Records are only ever appended, so a
+ * position stays valid and a listing resumes without walking the chain.
+ */
+#define LOCFS_LOCLIST_POS_BITS 16
+#define LOCFS_LOCLIST_POS(block_no, slot) \
+    ((loff_t)((block_no) << LOCFS_LOCLIST_POS_BITS | (slot)))
+
+/*
+ * Emits the children of dir created at location_id, from the position
+ * ctx->pos holds, see LOCFS_LOCLIST_POS.
+ */
+int locfs_locindex_iterate(struct inode *dir,
+                             uint32_t location_id,
+                             struct dir_context *ctx)
+{
+    struct super_block *sb = dir->i_sb;
+    struct buffer_head *bh;
+    struct locfs_locindex_entry *entry;
+    struct locfs_loclist_block *list;
+    struct locfs_dir_record *record;
+    uint64_t block_no, slot;
+    int ret;
+
+    if (ctx->pos == 0) {
+        ret = locfs_locindex_find(sb, LOCFS_INODE(dir), location_id,
+                                  &bh, &entry);
+        if (ret == -ENOENT) {
+            // Nothing was ever created here
+            brelse(bh);
+            return 0;
+        } else if (ret) {
+            return ret;
+        }
+        block_no = entry->first_block_no;
+        brelse(bh);
+        slot = 0;
+    } else {
+        block_no = (uint64_t)ctx->pos >> LOCFS_LOCLIST_POS_BITS;
+        slot = ctx->pos & ((1 << LOCFS_LOCLIST_POS_BITS) - 1);
+    }
+
+    while (block_no != 0) {
+        bh = locfs_read_chain_block(sb, block_no, LOCFS_LOCLIST_MAGIC);
+        if (IS_ERR(bh)) {
+            return PTR_ERR(bh);
+        }
+        list = (struct locfs_loclist_block *)bh->b_data;
+
+        for (; slot < list->header.count; slot++) {
+            record = &list->records[slot];
+            if (!dir_emit(ctx, record->filename,
+                          strnlen(record->filename, LOCFS_FILENAME_MAXLEN),
+                          record->inode_no, DT_UNKNOWN)) {
+                brelse(bh);
+                return 0;
+            }
+            ctx->pos = LOCFS_LOCLIST_POS(block_no, slot + 1);
+        }
+
+        block_no = list->header.next_block_no;
+        brelse(bh);
+        slot = 0;
+    }
+
+    return 0;
+}
@@ -14,6 +14,16 @@
 /* Cache used to store the inodes in memory. */
 struct kmem_cache *locfs_inode_cache = NULL;
 
+/* Initializes the parts of a cached inode that survive kmem_cache_free */
+static void locfs_inode_init_once(void *obj)
+{
+    struct locfs_inode_info *info = obj;
+
+    init_rwsem(&info->i_map_sem);
+    spin_lock_init(&info->i_reserve_lock);
+    inode_init_once(&info->vfs_inode);
+}
+
 static struct file_system_type locfs_type = {
     /* Defined in <linux/export.h> */
     .owner      = THIS_MODULE,
@@ -37,18 +47,31 @@ static int __init locfs_init(void)
 {
     int err;
 
+    // The inode table is laid out in LOCFS_INODE_SIZE slots
+    BUILD_BUG_ON(sizeof(struct locfs_inode) != LOCFS_INODE_SIZE);
+
     // Create SLAB
     locfs_inode_cache = kmem_cache_create("locfs_inode_cache",
-                                           sizeof(struct locfs_inode),
+                                           sizeof(struct locfs_inode_info),
                                            0,
                                            (SLAB_RECLAIM_ACCOUNT| SLAB_MEM_SPREAD),
-                                           NULL);
+                                           locfs_inode_init_once);
 
     if (locfs_inode_cache == NULL) {
         printk(KERN_ERR "locfs: Error creating locfs_inode_cache\n");
         return -ENOMEM;
     }
 
+    // /proc/fs/locfs is optional, mounts just go without statistics
+    if (locfs_stats_register() != 0) {
+        printk(KERN_WARNING "locfs: Failed to create /proc/fs/locfs\n");
+    }
+
+    // Fixes can still be set through /proc/locationmod_coords without it
+    if (locfs_feed_register() != 0) {
+        printk(KERN_WARNING "locfs: Failed to create " LOCFS_FEED_DEVICE "\n");
+    }
+
     err = register_filesystem(&locfs_type);
 
     if (likely(err == 0)) {
@@ -66,6 +89,8 @@ static int __init locfs_init(void)
 
     if (unlikely(err != 0)) {        
         // Cleanup SLAB on error
+        locfs_feed_unregister();
+        locfs_stats_unregister();
         kmem_cache_destroy(locfs_inode_cache);
     }
     
@@ -77,6 +102,8 @@ static void __exit locfs_exit(void)
     int err;
 
     err = unregister_filesystem(&locfs_type);
+    // Inodes are freed after a grace period, wait for the last of them
+    rcu_barrier();
     kmem_cache_destroy(locfs_inode_cache);
 
     if (likely(err == 0)) {
@@ -86,6 +113,8 @@ static void __exit locfs_exit(void)
     }
 
     remove_locationmod_proc();
+    locfs_feed_unregister();
+    locfs_stats_unregister();
 }
 
 MODULE_LICENSE("GPL");
@@ -0,0 +1,105 @@
+/*
+ * Location Based Filesystem
+ *
+ * By, Robert Chrystie
+ */
+
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include "internal.h"
+
+/*
+ * Online grow
+ *
+ * The data region is the last part of the image, so a larger device only
+ * needs the data block table size in the super_block raised and the data
+ * block bitmap extended to cover the new blocks. Nothing moves: the
+ * bitmap has to fit the blocks mkfs set aside for it, see
+ * data_bitmap_blocks, which bounds how far an image can grow.
+ */
+
+/*
+ * Grows the image to blocks blocks in all, for LOCFS_IOC_GROW. The device
+ * must already be that large.
+ */
+int locfs_grow(struct super_block *sb, uint64_t blocks)
+{
+    struct locfs_sb_info *sbi = LOCFS_SBI(sb);
+    struct locfs_super_block *lsb = sbi->s_lsb;
+    struct buffer_head *bh;
+    uint64_t data_start, old_size, new_size, free;
+    int ret, err;
+
+    mutex_lock(&sbi->s_resize_lock);
+
+    data_start = LOCFS_DATA_BLOCK_TABLE_START_BLOCK_NO_HSB(lsb);
+    old_size = lsb->data_block_table_size;
+    if (blocks < data_start + old_size) {
+        // Shrinking would have to move data out of the way first
+        ret = -EINVAL;
+        goto out;
+    }
+    new_size = blocks - data_start;
+    if (new_size == old_size) {
+        ret = 0;
+        goto out;
+    }
+
+    if (new_size > LOCFS_DATA_BLOCK_TABLE_MAX_HSB(lsb)) {
+        printk(KERN_ERR "locfs: The data block bitmap only has room for "
+                        "%llu blocks, not %llu\n",
+                        LOCFS_DATA_BLOCK_TABLE_MAX_HSB(lsb), new_size);
+        ret = -ENOSPC;
+        goto out;
+    }
+
+    if (blocks > i_size_read(sb->s_bdev->bd_inode) >> sb->s_blocksize_bits) {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    // Make sure the last new block can actually be read
+    bh = sb_bread(sb, blocks - 1);
+    if (!bh) {
+        ret = -EIO;
+        goto out;
+    }
+    brelse(bh);
+
+    // The handle keeps the new size and the first allocations from the
+    // new blocks in the same transaction
+    ret = locfs_journal_start(sb, LOCFS_INODE_CREDITS);
+    if (ret) {
+        goto out;
+    }
+
+    ret = locfs_bitmap_grow(sb, &sbi->s_data_bitmap, new_size, &free);
+    if (!ret) {
+        lsb->data_block_table_size = new_size;
+        locfs_save_sb(sb);
+        percpu_counter_add(&sbi->s_free_blocks, free);
+    }
+
+    err = locfs_journal_stop(sb);
+    if (!ret) {
+        ret = err;
+    }
+    if (ret) {
+        goto out;
+    }
+
+    if (sbi->s_journal) {
+        ret = locfs_journal_force_commit(sb);
+    } else {
+        ret = locfs_sync_buffer(sb, sbi->s_sbh);
+    }
+
+    if (!ret) {
+        printk(KERN_INFO "locfs: Grew the data region from %llu to %llu "
+                         "blocks\n", old_size, new_size);
+    }
+
+out:
+    mutex_unlock(&sbi->s_resize_lock);
+    return ret;
+}
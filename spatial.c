@@ -0,0 +1,541 @@
+/*
+ * Location Based Filesystem
+ *
+ * By, Robert Chrystie
+ */
+
+#include <linux/buffer_head.h>
+#include <linux/kernel.h>
+#include <linux/uaccess.h>
+#include "internal.h"
+
+/*
+ * Spatial index
+ *
+ * Inodes created with a GPS fix are filed in the grid tree described by
+ * struct locfs_spatial_node. A query only descends into the cells which
+ * overlap the area asked for and only reads the buckets of those cells.
+ * s_spatial_sem lets queries run side by side while inserts are exclusive.
+ *
+ * Distances are worked out on an equirectangular projection in whole
+ * centimetres, which is plenty for radii up to a few hundred kilometres
+ * and needs no floating point.
+ */
+
+/* Centimetres per 1e-7 degree of latitude, as a fraction */
+#define LOCFS_CM_PER_UNIT_NUM 111319
+#define LOCFS_CM_PER_UNIT_DEN 100000
+
+/* Largest radius accepted, keeps every square below 2^63 */
+#define LOCFS_MAX_RADIUS 20000000
+
+/* cos() of each whole degree from 0 to 90, scaled by 65536 */
+static const uint32_t locfs_cos_table[91] = {
+    65536, 65526, 65496, 65446, 65376, 65287, 65177, 65048,
+    64898, 64729, 64540, 64332, 64104, 63856, 63589, 63303,
+    62997, 62672, 62328, 61966, 61584, 61183, 60764, 60326,
+    59870, 59396, 58903, 58393, 57865, 57319, 56756, 56175,
+    55578, 54963, 54332, 53684, 53020, 52339, 51643, 50931,
+    50203, 49461, 48703, 47930, 47143, 46341, 45525, 44695,
+    43852, 42995, 42126, 41243, 40348, 39441, 38521, 37590,
+    36647, 35693, 34729, 33754, 32768, 31772, 30767, 29753,
+    28729, 27697, 26656, 25607, 24550, 23486, 22415, 21336,
+    20252, 19161, 18064, 16962, 15855, 14742, 13626, 12505,
+    11380, 10252, 9121, 7987, 6850, 5712, 4572, 3430,
+    2287, 1144, 0,
+};
+
+/* cos() of a latitude, scaled by 65536 */
+static uint32_t locfs_cos(int32_t latitude)
+{
+    uint64_t units = abs((int64_t)latitude);
+    uint32_t deg = units / LOCFS_COORD_SCALE;
+    uint32_t frac = units % LOCFS_COORD_SCALE;
+
+    if (deg >= 90) {
+        return 0;
+    }
+
+    return locfs_cos_table[deg]
+           - (uint64_t)(locfs_cos_table[deg] - locfs_cos_table[deg + 1])
+             * frac / LOCFS_COORD_SCALE;
+}
+
+static inline bool locfs_valid_coords(int32_t latitude, int32_t longitude)
+{
+    return latitude >= -90 * LOCFS_COORD_SCALE
+        && latitude <= 90 * LOCFS_COORD_SCALE
+        && longitude >= -180 * LOCFS_COORD_SCALE
+        && longitude <= 180 * LOCFS_COORD_SCALE;
+}
+
+/* Adds an entry to the bucket chain starting at *head */
+static int locfs_spatial_bucket_add(struct super_block *sb,
+                                      struct buffer_head *node_bh,
+                                      uint64_t *head,
+                                      struct locfs_spatial_entry *new_entry)
+{
+    struct buffer_head *bh = NULL;
+    struct locfs_spatial_bucket *bucket;
+    uint64_t block_no;
+
+    if (*head != 0) {
+        bh = locfs_read_chain_block(sb, *head, LOCFS_SPATIAL_BUCKET_MAGIC);
+        if (IS_ERR(bh)) {
+            return PTR_ERR(bh);
+        }
+
+        bucket = (struct locfs_spatial_bucket *)bh->b_data;
+        if (bucket->header.count
+                >= LOCFS_SPATIAL_ENTRIES_PER_BLOCK_HSB(LOCFS_SB(sb))) {
+            brelse(bh);
+            bh = NULL;
+        }
+    }
+
+    // The cell is empty or its newest bucket is full, push a new one
+    if (!bh) {
+        bh = locfs_new_chain_block(sb, NULL, LOCFS_SPATIAL_BUCKET_MAGIC,
+                                   node_bh->b_blocknr, &block_no);
+        if (IS_ERR(bh)) {
+            return PTR_ERR(bh);
+        }
+
+        bucket = (struct locfs_spatial_bucket *)bh->b_data;
+        bucket->header.next_block_no = *head;
+        *head = block_no;
+        locfs_dirty_buffer(sb, node_bh, NULL);
+    }
+
+    bucket = (struct locfs_spatial_bucket *)bh->b_data;
+    bucket->entries[bucket->header.count++] = *new_entry;
+    locfs_dirty_buffer(sb, bh, NULL);
+    brelse(bh);
+
+    return 0;
+}
+
+/*
+ * Files inode_no under its coordinates. Inodes without a fix are left out.
+ * Must be called inside a journal handle.
+ */
+int locfs_spatial_insert(struct super_block *sb,
+                           uint64_t inode_no,
+                           int32_t latitude,
+                           int32_t longitude)
+{
+    struct locfs_sb_info *sbi = LOCFS_SBI(sb);
+    struct locfs_super_block *locfs_sb = sbi->s_lsb;
+    struct locfs_spatial_entry entry = {
+        .inode_no = inode_no,
+        .latitude = latitude,
+        .longitude = longitude,
+    };
+    struct buffer_head *bh, *child_bh;
+    struct locfs_spatial_node *node;
+    uint64_t block_no, child;
+    uint32_t x, y;
+    unsigned int slot;
+    int level;
+    int ret = 0;
+
+    if (!locfs_valid_coords(latitude, longitude)) {
+        return 0;
+    }
+
+    x = locfs_cell_x(longitude);
+    y = locfs_cell_y(latitude);
+
+    down_write(&sbi->s_spatial_sem);
+
+    if (locfs_sb->spatial_root_block_no == 0) {
+        bh = locfs_new_chain_block(sb, NULL, LOCFS_SPATIAL_NODE_MAGIC, 0,
+                                   &block_no);
+        if (IS_ERR(bh)) {
+            ret = PTR_ERR(bh);
+            goto out;
+        }
+        brelse(bh);
+
+        locfs_sb->spatial_root_block_no = block_no;
+        locfs_save_sb(sb);
+    }
+
+    block_no = locfs_sb->spatial_root_block_no;
+    for (level = 0; level < LOCFS_SPATIAL_LEVELS; level++) {
+        bh = locfs_read_chain_block(sb, block_no, LOCFS_SPATIAL_NODE_MAGIC);
+        if (IS_ERR(bh)) {
+            ret = PTR_ERR(bh);
+            goto out;
+        }
+        node = (struct locfs_spatial_node *)bh->b_data;
+        slot = locfs_spatial_slot(x, y, level);
+
+        if (level == LOCFS_SPATIAL_LEVELS - 1) {
+            ret = locfs_spatial_bucket_add(sb, bh, &node->children[slot],
+                                           &entry);
+            brelse(bh);
+            break;
+        }
+
+        child = node->children[slot];
+        if (child == 0) {
+            child_bh = locfs_new_chain_block(sb, NULL,
+                                             LOCFS_SPATIAL_NODE_MAGIC,
+                                             block_no, &child);
+            if (IS_ERR(child_bh)) {
+                brelse(bh);
+                ret = PTR_ERR(child_bh);
+                goto out;
+            }
+            brelse(child_bh);
+
+            node->children[slot] = child;
+            node->header.count++;
+            locfs_dirty_buffer(sb, bh, NULL);
+        }
+
+        brelse(bh);
+        block_no = child;
+    }
+
+out:
+    up_write(&sbi->s_spatial_sem);
+    return ret;
+}
+
+/*
+ * Takes back the entry locfs_spatial_insert just filed for inode_no, when
+ * creating the inode failed after it. Nodes and buckets added for it stay
+ * behind, empty. Must be called inside a journal handle.
+ */
+int locfs_spatial_remove(struct super_block *sb,
+                           uint64_t inode_no,
+                           int32_t latitude,
+                           int32_t longitude)
+{
+    struct locfs_sb_info *sbi = LOCFS_SBI(sb);
+    struct buffer_head *bh;
+    struct locfs_spatial_node *node;
+    struct locfs_spatial_bucket *bucket;
+    uint64_t block_no;
+    uint32_t x, y;
+    int level;
+    int ret = 0;
+
+    if (!locfs_valid_coords(latitude, longitude)) {
+        return 0;
+    }
+
+    x = locfs_cell_x(longitude);
+    y = locfs_cell_y(latitude);
+
+    down_write(&sbi->s_spatial_sem);
+
+    block_no = sbi->s_lsb->spatial_root_block_no;
+    for (level = 0; level < LOCFS_SPATIAL_LEVELS && block_no != 0; level++) {
+        bh = locfs_read_chain_block(sb, block_no, LOCFS_SPATIAL_NODE_MAGIC);
+        if (IS_ERR(bh)) {
+            ret = PTR_ERR(bh);
+            goto out;
+        }
+        node = (struct locfs_spatial_node *)bh->b_data;
+        block_no = node->children[locfs_spatial_slot(x, y, level)];
+        brelse(bh);
+    }
+    if (block_no == 0) {
+        goto out;
+    }
+
+    // New entries go to the newest bucket of the cell, the head of its chain
+    bh = locfs_read_chain_block(sb, block_no, LOCFS_SPATIAL_BUCKET_MAGIC);
+    if (IS_ERR(bh)) {
+        ret = PTR_ERR(bh);
+        goto out;
+    }
+    bucket = (struct locfs_spatial_bucket *)bh->b_data;
+    if (bucket->header.count > 0
+            && bucket->entries[bucket->header.count - 1].inode_no == inode_no) {
+        bucket->header.count--;
+        memset(&bucket->entries[bucket->header.count], 0,
+               sizeof(struct locfs_spatial_entry));
+        locfs_dirty_buffer(sb, bh, NULL);
+    }
+    brelse(bh);
+
+out:
+    up_write(&sbi->s_spatial_sem);
+    return ret;
+}
+
+/* State of one query while the tree is walked */
+struct locfs_spatial_search {
+    struct super_block *sb;
+    struct locfs_spatial_query *query;
+    struct locfs_spatial_hit __user *hits;
+
+    /* Area searched, in coordinates and in grid cells. When
+       min_longitude > max_longitude the area wraps around 180 degrees. */
+    int32_t min_latitude, max_latitude;
+    int32_t min_longitude, max_longitude;
+    uint32_t min_x, max_x, min_y, max_y;
+
+    uint64_t radius_sq;         /* in cm^2, for LOCFS_QUERY_RADIUS */
+    uint64_t skipped;
+};
+
+/* Whether the cell columns [x, x + span) overlap the search */
+static bool locfs_search_overlaps_x(struct locfs_spatial_search *s,
+                                      uint32_t x, uint32_t span)
+{
+    if (s->min_x <= s->max_x) {
+        return x + span > s->min_x && x <= s->max_x;
+    }
+    return x + span > s->min_x || x <= s->max_x;
+}
+
+static bool locfs_search_overlaps_y(struct locfs_spatial_search *s,
+                                      uint32_t y, uint32_t span)
+{
+    return y + span > s->min_y && y <= s->max_y;
+}
+
+/* Whether an entry of a bucket matches the query */
+static bool locfs_search_match(struct locfs_spatial_search *s,
+                                 struct locfs_spatial_entry *entry)
+{
+    struct locfs_spatial_query *q = s->query;
+    int64_t dlat, dlon, dx, dy;
+
+    if (entry->latitude < s->min_latitude
+            || entry->latitude > s->max_latitude) {
+        return false;
+    }
+
+    if (s->min_longitude <= s->max_longitude) {
+        if (entry->longitude < s->min_longitude
+                || entry->longitude > s->max_longitude) {
+            return false;
+        }
+    } else if (entry->longitude < s->min_longitude
+                   && entry->longitude > s->max_longitude) {
+        return false;
+    }
+
+    if (q->type != LOCFS_QUERY_RADIUS) {
+        return true;
+    }
+
+    dlat = (int64_t)entry->latitude - q->latitude;
+    dlon = (int64_t)entry->longitude - q->longitude;
+    if (dlon > 180LL * LOCFS_COORD_SCALE) {
+        dlon -= 360LL * LOCFS_COORD_SCALE;
+    } else if (dlon < -180LL * LOCFS_COORD_SCALE) {
+        dlon += 360LL * LOCFS_COORD_SCALE;
+    }
+
+    dy = dlat * LOCFS_CM_PER_UNIT_NUM / LOCFS_CM_PER_UNIT_DEN;
+    dx = dlon * LOCFS_CM_PER_UNIT_NUM / LOCFS_CM_PER_UNIT_DEN;
+    dx = dx * locfs_cos((entry->latitude + q->latitude) / 2) / 65536;
+
+    return (uint64_t)(dx * dx) + (uint64_t)(dy * dy) <= s->radius_sq;
+}
+
+/* Copies out the matches in one cell's bucket chain */
+static int locfs_search_bucket(struct locfs_spatial_search *s,
+                                 uint64_t block_no)
+{
+    struct locfs_spatial_query *q = s->query;
+    struct buffer_head *bh;
+    struct locfs_spatial_bucket *bucket;
+    struct locfs_spatial_hit hit;
+    uint64_t i;
+
+    while (block_no != 0) {
+        bh = locfs_read_chain_block(s->sb, block_no,
+                                    LOCFS_SPATIAL_BUCKET_MAGIC);
+        if (IS_ERR(bh)) {
+            return PTR_ERR(bh);
+        }
+        bucket = (struct locfs_spatial_bucket *)bh->b_data;
+
+        for (i = 0; i < bucket->header.count; i++) {
+            if (!locfs_search_match(s, &bucket->entries[i])) {
+                continue;
+            }
+
+            if (s->skipped < q->skip) {
+                s->skipped++;
+                continue;
+            }
+
+            // Out of room, one more match is all the caller needs to know
+            if (q->count == 0) {
+                q->more = 1;
+                brelse(bh);
+                return 1;
+            }
+
+            hit.inode_no = bucket->entries[i].inode_no;
+            hit.latitude = bucket->entries[i].latitude;
+            hit.longitude = bucket->entries[i].longitude;
+            if (copy_to_user(s->hits, &hit, sizeof(hit))) {
+                brelse(bh);
+                return -EFAULT;
+            }
+            s->hits++;
+            q->count--;
+        }
+
+        block_no = bucket->header.next_block_no;
+        brelse(bh);
+    }
+
+    return 0;
+}
+
+/*
+ * Visits the children of the node at level whose lowest cell is x, y
+ * and which overlap the search. Returns 1 once the result is full.
+ */
+static int locfs_search_node(struct locfs_spatial_search *s,
+                               uint64_t block_no,
+                               int level,
+                               uint32_t x,
+                               uint32_t y)
+{
+    struct buffer_head *bh;
+    struct locfs_spatial_node *node;
+    uint32_t span, cx, cy;
+    unsigned int row, col;
+    int ret = 0;
+
+    bh = locfs_read_chain_block(s->sb, block_no, LOCFS_SPATIAL_NODE_MAGIC);
+    if (IS_ERR(bh)) {
+        return PTR_ERR(bh);
+    }
+    node = (struct locfs_spatial_node *)bh->b_data;
+
+    span = 1U << ((LOCFS_SPATIAL_LEVELS - 1 - level)
+                  * LOCFS_SPATIAL_SPLIT_BITS);
+
+    for (row = 0; row < LOCFS_SPATIAL_SPLIT && ret == 0; row++) {
+        cy = y + row * span;
+        if (!locfs_search_overlaps_y(s, cy, span)) {
+            continue;
+        }
+
+        for (col = 0; col < LOCFS_SPATIAL_SPLIT && ret == 0; col++) {
+            cx = x + col * span;
+            block_no = node->children[row * LOCFS_SPATIAL_SPLIT + col];
+            if (block_no == 0 || !locfs_search_overlaps_x(s, cx, span)) {
+                continue;
+            }
+
+            if (level == LOCFS_SPATIAL_LEVELS - 1) {
+                ret = locfs_search_bucket(s, block_no);
+            } else {
+                ret = locfs_search_node(s, block_no, level + 1, cx, cy);
+            }
+        }
+    }
+
+    brelse(bh);
+    return ret;
+}
+
+/* Turns the query into the area of the grid that has to be searched */
+static int locfs_search_area(struct locfs_spatial_search *s)
+{
+    struct locfs_spatial_query *q = s->query;
+    int64_t dlat, dlon, radius_cm;
+    uint32_t cos_max;
+
+    switch (q->type) {
+    case LOCFS_QUERY_BBOX:
+        if (!locfs_valid_coords(q->min_latitude, q->min_longitude)
+                || !locfs_valid_coords(q->max_latitude, q->max_longitude)
+                || q->min_latitude > q->max_latitude) {
+            return -EINVAL;
+        }
+        s->min_latitude = q->min_latitude;
+        s->max_latitude = q->max_latitude;
+        s->min_longitude = q->min_longitude;
+        s->max_longitude = q->max_longitude;
+        break;
+
+    case LOCFS_QUERY_RADIUS:
+        if (!locfs_valid_coords(q->latitude, q->longitude)
+                || q->radius > LOCFS_MAX_RADIUS) {
+            return -EINVAL;
+        }
+        radius_cm = (int64_t)q->radius * 100;
+        s->radius_sq = radius_cm * radius_cm;
+
+        // The box around the circle, widened in longitude by 1 / cos of
+        // the latitude furthest from the equator
+        dlat = radius_cm * LOCFS_CM_PER_UNIT_DEN / LOCFS_CM_PER_UNIT_NUM + 1;
+        s->min_latitude = max_t(int64_t, (int64_t)q->latitude - dlat,
+                                -90LL * LOCFS_COORD_SCALE);
+        s->max_latitude = min_t(int64_t, (int64_t)q->latitude + dlat,
+                                90LL * LOCFS_COORD_SCALE);
+
+        cos_max = locfs_cos(max(abs(s->min_latitude), abs(s->max_latitude)));
+        dlon = cos_max ? dlat * 65536 / cos_max : S64_MAX;
+        if (dlon >= 180LL * LOCFS_COORD_SCALE) {
+            s->min_longitude = -180 * LOCFS_COORD_SCALE;
+            s->max_longitude = 180 * LOCFS_COORD_SCALE;
+        } else {
+            s->min_longitude = q->longitude - dlon;
+            s->max_longitude = q->longitude + dlon;
+            if (s->min_longitude < -180 * LOCFS_COORD_SCALE) {
+                s->min_longitude += 360 * LOCFS_COORD_SCALE;
+            }
+            if (s->max_longitude > 180 * LOCFS_COORD_SCALE) {
+                s->max_longitude -= 360 * LOCFS_COORD_SCALE;
+            }
+        }
+        break;
+
+    default:
+        return -EINVAL;
+    }
+
+    s->min_x = locfs_cell_x(s->min_longitude);
+    s->max_x = locfs_cell_x(s->max_longitude);
+    s->min_y = locfs_cell_y(s->min_latitude);
+    s->max_y = locfs_cell_y(s->max_latitude);
+    return 0;
+}
+
+/* Runs a LOCFS_IOC_SPATIAL_QUERY, see struct locfs_spatial_query */
+int locfs_spatial_query(struct super_block *sb,
+                          struct locfs_spatial_query *query)
+{
+    struct locfs_sb_info *sbi = LOCFS_SBI(sb);
+    struct locfs_spatial_search search = {
+        .sb = sb,
+        .query = query,
+        .hits = (struct locfs_spatial_hit __user *)(uintptr_t)query->hits,
+    };
+    uint32_t room = query->count;
+    int ret;
+
+    ret = locfs_search_area(&search);
+    if (ret) {
+        return ret;
+    }
+
+    query->more = 0;
+
+    down_read(&sbi->s_spatial_sem);
+    if (sbi->s_lsb->spatial_root_block_no != 0) {
+        ret = locfs_search_node(&search, sbi->s_lsb->spatial_root_block_no,
+                                0, 0, 0);
+    }
+    up_read(&sbi->s_spatial_sem);
+
+    // count counted down the free room, hand back how much was used
+    query->count = room - query->count;
+    return ret < 0 ? ret : 0;
+}
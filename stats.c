@@ -0,0 +1,172 @@
+/*
+ * Location Based Filesystem
+ *
+ * By, Robert Chrystie
+ */
+
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/percpu.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include "internal.h"
+
+#define CREATE_TRACE_POINTS
+#include "trace.h"
+
+/*
+ * Operation statistics
+ *
+ * Every mount counts its operations and their latencies per CPU, so the
+ * hot paths never share a cache line. The counters are summed when
+ * /proc/fs/locfs/<dev>/stats is read. Latencies go into power of two
+ * nanosecond buckets.
+ */
+
+static const char * const locfs_op_names[LOCFS_OP_NR] = {
+    [LOCFS_OP_LOOKUP]  = "lookup",
+    [LOCFS_OP_ITERATE] = "iterate",
+    [LOCFS_OP_CREATE]  = "create",
+    [LOCFS_OP_ALLOC]   = "alloc",
+    [LOCFS_OP_READ]    = "read",
+    [LOCFS_OP_WRITE]   = "write",
+};
+
+/* /proc/fs/locfs, one directory per mounted device below it */
+static struct proc_dir_entry *locfs_proc_root;
+
+void locfs_stats_end(struct super_block *sb, enum locfs_op op, u64 start)
+{
+    struct locfs_stats __percpu *stats = LOCFS_SBI(sb)->s_stats;
+    u64 ns = ktime_get_ns() - start;
+    unsigned int bucket;
+
+    bucket = min_t(unsigned int, ilog2(ns | 1), LOCFS_STATS_BUCKETS - 1);
+
+    this_cpu_inc(stats->st_count[op]);
+    this_cpu_add(stats->st_ns[op], ns);
+    this_cpu_inc(stats->st_hist[op][bucket]);
+}
+
+static int locfs_stats_show(struct seq_file *m, void *v)
+{
+    struct super_block *sb = m->private;
+    struct locfs_stats __percpu *stats = LOCFS_SBI(sb)->s_stats;
+    struct locfs_stats *sum;
+    struct locfs_stats *cpu_stats;
+    int cpu, op, i, last;
+
+    sum = kzalloc(sizeof(*sum), GFP_KERNEL);
+    if (!sum) {
+        return -ENOMEM;
+    }
+
+    for_each_possible_cpu(cpu) {
+        cpu_stats = per_cpu_ptr(stats, cpu);
+        for (op = 0; op < LOCFS_OP_NR; op++) {
+            sum->st_count[op] += cpu_stats->st_count[op];
+            sum->st_ns[op] += cpu_stats->st_ns[op];
+            for (i = 0; i < LOCFS_STATS_BUCKETS; i++) {
+                sum->st_hist[op][i] += cpu_stats->st_hist[op][i];
+            }
+        }
+    }
+
+    seq_printf(m, "%-8s %12s %16s %12s\n", "op", "count", "total_ns",
+               "avg_ns");
+    for (op = 0; op < LOCFS_OP_NR; op++) {
+        seq_printf(m, "%-8s %12llu %16llu %12llu\n", locfs_op_names[op],
+                   sum->st_count[op], sum->st_ns[op],
+                   sum->st_count[op] ? div64_u64(sum->st_ns[op],
+                                                 sum->st_count[op]) : 0);
+    }
+
+    // One histogram per operation, leaving out the empty buckets at
+    // either end
+    for (op = 0; op < LOCFS_OP_NR; op++) {
+        if (!sum->st_count[op]) {
+            continue;
+        }
+
+        for (i = 0; !sum->st_hist[op][i]; i++)
+            ;
+        for (last = LOCFS_STATS_BUCKETS - 1; !sum->st_hist[op][last]; last--)
+            ;
+
+        seq_printf(m, "\n%s latency (ns):\n", locfs_op_names[op]);
+        for (; i <= last; i++) {
+            if (i == LOCFS_STATS_BUCKETS - 1) {
+                seq_printf(m, "  %12llu+            %12llu\n",
+                           1ULL << i, sum->st_hist[op][i]);
+            } else {
+                seq_printf(m, "  %12llu - %-12llu %12llu\n", i ? 1ULL << i : 0,
+                           (1ULL << (i + 1)) - 1, sum->st_hist[op][i]);
+            }
+        }
+    }
+
+    kfree(sum);
+    return 0;
+}
+
+static int locfs_stats_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, locfs_stats_show, PDE_DATA(inode));
+}
+
+static const struct file_operations locfs_stats_fops = {
+    .owner   = THIS_MODULE,
+    .open    = locfs_stats_open,
+    .read    = seq_read,
+    .llseek  = seq_lseek,
+    .release = single_release,
+};
+
+/* Allocates the counters of a new mount and its /proc/fs/locfs entries */
+int locfs_stats_init(struct super_block *sb)
+{
+    struct locfs_sb_info *sbi = LOCFS_SBI(sb);
+
+    sbi->s_stats = alloc_percpu(struct locfs_stats);
+    if (!sbi->s_stats) {
+        return -ENOMEM;
+    }
+
+    // Statistics are a debugging aid, the mount goes ahead without them
+    if (locfs_proc_root) {
+        sbi->s_proc = proc_mkdir(sb->s_id, locfs_proc_root);
+    }
+    if (sbi->s_proc) {
+        proc_create_data("stats", 0444, sbi->s_proc, &locfs_stats_fops, sb);
+    }
+
+    return 0;
+}
+
+void locfs_stats_destroy(struct super_block *sb)
+{
+    struct locfs_sb_info *sbi = LOCFS_SBI(sb);
+
+    if (sbi->s_proc) {
+        remove_proc_subtree(sb->s_id, locfs_proc_root);
+        sbi->s_proc = NULL;
+    }
+    free_percpu(sbi->s_stats);
+    sbi->s_stats = NULL;
+}
+
+int locfs_stats_register(void)
+{
+    locfs_proc_root = proc_mkdir("fs/locfs", NULL);
+    return locfs_proc_root ? 0 : -ENOMEM;
+}
+
+void locfs_stats_unregister(void)
+{
+    if (locfs_proc_root) {
+        remove_proc_entry("fs/locfs", NULL);
+        locfs_proc_root = NULL;
+    }
+}
@@ -6,21 +6,281 @@
 
 #include <linux/slab.h>
 #include <linux/buffer_head.h>
+#include <linux/parser.h>
+#include <linux/statfs.h>
 #include "internal.h"
 
-/* Used to free inodes when the file system is unmounted */
+enum {
+    Opt_commit,
+    Opt_location,
+    Opt_nolocation,
+    Opt_err,
+};
+
+static const match_table_t locfs_tokens = {
+    {Opt_commit, "commit=%u"},
+    {Opt_location, "location=%s"},
+    {Opt_nolocation, "location="},
+    {Opt_nolocation, "nolocation"},
+    {Opt_err, NULL},
+};
+
+/*
+ * Parses the mount options passed through mount -o, when mounting and on
+ * a remount. location= with no name, or nolocation, makes the mount follow
+ * /proc/locationmod again. Nothing changes unless all of them are valid.
+ */
+static int locfs_parse_options(char *options, struct locfs_sb_info *sbi)
+{
+    struct locfs_curr_location *loc = NULL, *new_loc;
+    unsigned long commit_interval = sbi->s_commit_interval;
+    bool set_location = false;
+    substring_t args[MAX_OPT_ARGS];
+    char *p;
+    int option;
+    int ret;
+
+    if (!options) {
+        return 0;
+    }
+
+    while ((p = strsep(&options, ",")) != NULL) {
+        if (!*p) {
+            continue;
+        }
+
+        switch (match_token(p, locfs_tokens, args)) {
+        case Opt_commit:
+            if (match_int(&args[0], &option) || option < 0) {
+                ret = -EINVAL;
+                goto fail;
+            }
+            commit_interval = option ? option * HZ
+                                     : LOCFS_DEFAULT_COMMIT_INTERVAL;
+            break;
+        case Opt_location:
+            // Lookups and creates on this mount ignore /proc/locationmod
+            new_loc = locfs_new_curr_location(args[0].from,
+                                              args[0].to - args[0].from);
+            if (IS_ERR(new_loc)) {
+                ret = PTR_ERR(new_loc);
+                goto fail;
+            }
+            kfree(loc);
+            loc = new_loc;
+            set_location = true;
+            break;
+        case Opt_nolocation:
+            kfree(loc);
+            loc = NULL;
+            set_location = true;
+            break;
+        default:
+            printk(KERN_ERR "locfs: Unknown mount option \"%s\"\n", p);
+            ret = -EINVAL;
+            goto fail;
+        }
+    }
+
+    sbi->s_commit_interval = commit_interval;
+    if (set_location) {
+        locfs_set_curr_location(&sbi->s_location, loc);
+    }
+    return 0;
+
+fail:
+    kfree(loc);
+    return ret;
+}
+
+/* Allocates an in-core inode together with its locfs_inode */
+static struct inode *locfs_alloc_inode(struct super_block *sb)
+{
+    struct locfs_inode_info *info;
+
+    info = kmem_cache_alloc(locfs_inode_cache, GFP_NOFS);
+    if (!info) {
+        return NULL;
+    }
+    info->i_dir_next = 0;
+    info->i_reserved_data = 0;
+    info->i_reserved_meta = false;
+
+    return &info->vfs_inode;
+}
+
+static void locfs_i_callback(struct rcu_head *head)
+{
+    struct inode *inode = container_of(head, struct inode, i_rcu);
+
+    kmem_cache_free(locfs_inode_cache, LOCFS_I(inode));
+}
+
+/* Frees an inode evicted from the inode cache, after an RCU grace period
+   as path walks may still be looking at it */
 static void locfs_destroy_inode(struct inode *inode) 
 {
-    struct locfs_inode *locfs_inode = LOCFS_INODE(inode);
+    call_rcu(&inode->i_rcu, locfs_i_callback);
+}
+
+/* Drops the location= of the mount, nobody can be looking at it any more */
+static void locfs_release_location(struct locfs_sb_info *sbi)
+{
+    kfree(rcu_dereference_protected(sbi->s_location, 1));
+    RCU_INIT_POINTER(sbi->s_location, NULL);
+}
+
+/* Called for mount -o remount, location= and commit= can change */
+static int locfs_remount(struct super_block *sb, int *flags, char *data)
+{
+    struct locfs_sb_info *sbi = LOCFS_SBI(sb);
+    int ret;
+
+    sync_filesystem(sb);
+
+    ret = locfs_parse_options(data, sbi);
+    if (ret) {
+        return ret;
+    }
+
+    // Handles stopped from now on wait the new interval
+    locfs_journal_set_commit_interval(sb, sbi->s_commit_interval);
+    return 0;
+}
+
+/* Sets up the free counts from the bitmaps, the ones on disk may be stale */
+static int locfs_counters_init(struct super_block *sb)
+{
+    struct locfs_sb_info *sbi = LOCFS_SBI(sb);
+    int ret;
+
+    ret = percpu_counter_init(&sbi->s_free_inodes,
+                              locfs_bitmap_free_count(&sbi->s_inode_bitmap),
+                              GFP_KERNEL);
+    if (!ret) {
+        ret = percpu_counter_init(&sbi->s_free_blocks,
+                                  locfs_bitmap_free_count(&sbi->s_data_bitmap),
+                                  GFP_KERNEL);
+    }
+    if (!ret) {
+        ret = percpu_counter_init(&sbi->s_dirty_blocks, 0, GFP_KERNEL);
+    }
+
+    return ret;
+}
+
+static void locfs_counters_destroy(struct locfs_sb_info *sbi)
+{
+    percpu_counter_destroy(&sbi->s_free_inodes);
+    percpu_counter_destroy(&sbi->s_free_blocks);
+    percpu_counter_destroy(&sbi->s_dirty_blocks);
+}
+
+/*
+ * Brings the counts in the on-disk super_block up to date. Allocations
+ * only touch the per-CPU counters, so block 0 is written here, from
+ * sync_fs, rather than on every allocation.
+ */
+static int locfs_commit_sb(struct super_block *sb)
+{
+    struct locfs_sb_info *sbi = LOCFS_SBI(sb);
+    struct locfs_super_block *lsb = sbi->s_lsb;
+    uint64_t inodes, blocks;
+    int ret;
+
+    inodes = lsb->inode_table_size
+             - percpu_counter_sum_positive(&sbi->s_free_inodes);
+    blocks = lsb->data_block_table_size
+             - percpu_counter_sum_positive(&sbi->s_free_blocks);
+    if (lsb->inode_count == inodes && lsb->data_block_count == blocks) {
+        return 0;
+    }
+
+    ret = locfs_journal_start(sb, LOCFS_INODE_CREDITS);
+    if (ret) {
+        return ret;
+    }
+
+    lsb->inode_count = inodes;
+    lsb->data_block_count = blocks;
+    locfs_save_sb(sb);
+
+    return locfs_journal_stop(sb);
+}
+
+/* Called from statfs(2), answered from the counters without any I/O */
+static int locfs_statfs(struct dentry *dentry, struct kstatfs *buf)
+{
+    struct super_block *sb = dentry->d_sb;
+    struct locfs_sb_info *sbi = LOCFS_SBI(sb);
+    s64 free;
+
+    free = percpu_counter_read_positive(&sbi->s_free_blocks)
+           - percpu_counter_read_positive(&sbi->s_dirty_blocks);
+
+    buf->f_type = sb->s_magic;
+    buf->f_bsize = sb->s_blocksize;
+    buf->f_blocks = sbi->s_lsb->data_block_table_size;
+    buf->f_bfree = max_t(s64, free, 0);
+    buf->f_bavail = buf->f_bfree;
+    buf->f_files = sbi->s_lsb->inode_table_size;
+    buf->f_ffree = percpu_counter_read_positive(&sbi->s_free_inodes);
+    buf->f_namelen = LOCFS_FILENAME_MAXLEN - 1;
+    buf->f_fsid.val[0] = (u32)huge_encode_dev(sb->s_bdev->bd_dev);
+    buf->f_fsid.val[1] = (u32)(huge_encode_dev(sb->s_bdev->bd_dev) >> 32);
+
+    return 0;
+}
+
+/* Called when the file system is unmounted, after all inodes are gone */
+static void locfs_put_super(struct super_block *sb)
+{
+    struct locfs_sb_info *sbi = LOCFS_SBI(sb);
+
+    locfs_journal_destroy(sb);
+    locfs_bitmap_release(&sbi->s_inode_bitmap);
+    locfs_bitmap_release(&sbi->s_data_bitmap);
+    locfs_location_release(sb);
+    locfs_stats_destroy(sb);
+    locfs_counters_destroy(sbi);
+    locfs_release_location(sbi);
+    brelse(sbi->s_sbh);
+    sb->s_fs_info = NULL;
+    kfree(sbi);
+}
 
-    printk(KERN_INFO "locfs: Freeing private data of inode %p (%lu)\n",
-           locfs_inode, inode->i_ino);
+/* Called from sync(2) and on unmount, after the inodes have been written */
+static int locfs_sync_fs(struct super_block *sb, int wait)
+{
+    struct locfs_sb_info *sbi = LOCFS_SBI(sb);
+    int ret = 0;
+
+    if (!(sb->s_flags & MS_RDONLY)) {
+        ret = locfs_commit_sb(sb);
+    }
 
-    kmem_cache_free(locfs_inode_cache, locfs_inode);
+    // With a journal everything dirty lives in the running transaction
+    if (sbi->s_journal) {
+        return wait && !ret ? locfs_journal_force_commit(sb) : ret;
+    }
+
+    // Bitmaps and the inode table are flushed along with the block
+    // device, only the super_block needs pushing out here
+    if (wait && !ret) {
+        sync_dirty_buffer(sbi->s_sbh);
+    }
+
+    return ret;
 }
 
 static const struct super_operations locfs_sb_ops = {
+    .alloc_inode    = locfs_alloc_inode,
     .destroy_inode  = locfs_destroy_inode,
+    .write_inode    = locfs_write_inode,
+    .put_super      = locfs_put_super,
+    .remount_fs     = locfs_remount,
+    .sync_fs        = locfs_sync_fs,
+    .statfs         = locfs_statfs,
 };
 
 /* Function called from mount_bdev() */
@@ -29,15 +289,28 @@ static int locfs_fill_super(struct super_block *sb,
                               int silent) 
 {
     struct inode *root_inode;
-    struct locfs_inode *root_locfs_inode;
     struct buffer_head *bh;
     struct locfs_super_block *locfs_sb;
-    int ret = 0;
+    struct locfs_sb_info *sbi;
+    int ret = -EINVAL;
+
+    sbi = kzalloc(sizeof(*sbi), GFP_KERNEL);
+    if (!sbi) {
+        return -ENOMEM;
+    }
+    sb->s_fs_info = sbi;
+    sbi->s_commit_interval = LOCFS_DEFAULT_COMMIT_INTERVAL;
+    mutex_init(&sbi->s_resize_lock);
+    init_rwsem(&sbi->s_spatial_sem);
 
     // Read the block containint the super_block
     // super_block is stored at the first block
     bh = sb_bread(sb, 0);
-    BUG_ON(!bh);
+    if (!bh) {
+        sb->s_fs_info = NULL;
+        kfree(sbi);
+        return -EIO;
+    }
     locfs_sb = (struct locfs_super_block *)bh->b_data;
 
     // Verify that this is a locfs by comparing the magic numbers
@@ -48,29 +321,92 @@ static int locfs_fill_super(struct super_block *sb,
         goto release;
     }
 
-    if (unlikely(sb->s_blocksize != locfs_sb->blocksize)) {
-        printk(KERN_ERR
-               "locfs: Formatted with mismatching blocksize %lu != %llu\n",
-               sb->s_blocksize, locfs_sb->blocksize);
-        goto release;
+    // Block 0 was read with the device's own blocksize, switch to the one
+    // the image was formatted with and read the super_block again
+    if (sb->s_blocksize != locfs_sb->blocksize) {
+        if (locfs_sb->blocksize > INT_MAX
+                || !sb_set_blocksize(sb, locfs_sb->blocksize)) {
+            printk(KERN_ERR "locfs: Unsupported blocksize %llu\n",
+                   locfs_sb->blocksize);
+            goto release;
+        }
+
+        brelse(bh);
+        bh = sb_bread(sb, 0);
+        if (!bh) {
+            ret = -EIO;
+            goto release;
+        }
+        locfs_sb = (struct locfs_super_block *)bh->b_data;
+
+        if (unlikely(locfs_sb->magic != LOCFS_MAGIC
+                     || sb->s_blocksize != locfs_sb->blocksize)) {
+            printk(KERN_ERR "locfs: Super block changed under the mount\n");
+            goto release;
+        }
     }
 
+    // The buffer stays pinned for the life of the mount, updates to the
+    // super_block are written back along with the rest of the metadata
+    sbi->s_sbh = bh;
+    sbi->s_lsb = locfs_sb;
+
     // Take the data from the device and write it to the super_block
     sb->s_magic = locfs_sb->magic;
-    sb->s_fs_info = locfs_sb;
-    sb->s_maxbytes = locfs_sb->blocksize;
+    // Logical block numbers in an extent are 32 bits wide
+    sb->s_maxbytes = min_t(loff_t, MAX_LFS_FILESIZE,
+                           ((loff_t)U32_MAX + 1) * locfs_sb->blocksize);
     sb->s_op = &locfs_sb_ops;
+    sb->s_d_op = &locfs_dentry_ops;
 
-    // Time to setup the root inode, get it from the device
-    root_locfs_inode = locfs_get_locfs_inode(sb, LOCFS_ROOTDIR_INODE_NO);
-    root_inode = new_inode(sb);
-    if (!root_inode || !root_locfs_inode) {
-        ret = -ENOMEM;
+    ret = locfs_parse_options(data, sbi);
+    if (ret) {
+        goto release;
+    }
+
+    ret = locfs_stats_init(sb);
+    if (ret) {
+        goto release;
+    }
+
+    // Replays an interrupted transaction before anything else is read
+    ret = locfs_journal_load(sb, sbi->s_commit_interval);
+    if (ret) {
+        goto release;
+    }
+
+    ret = locfs_bitmap_load(sb, &sbi->s_inode_bitmap,
+                            LOCFS_INODE_BITMAP_START_BLOCK_NO,
+                            locfs_sb->inode_table_size,
+                            LOCFS_INODE_GROUP_BITS);
+    if (ret) {
         goto release;
     }
 
-    locfs_fill_inode(sb, root_inode, root_locfs_inode);
-    inode_init_owner(root_inode, NULL, root_inode->i_mode);
+    ret = locfs_bitmap_load(sb, &sbi->s_data_bitmap,
+                            LOCFS_DATA_BLOCK_BITMAP_START_BLOCK_NO_HSB(locfs_sb),
+                            locfs_sb->data_block_table_size,
+                            LOCFS_DATA_GROUP_BITS);
+    if (ret) {
+        goto release;
+    }
+
+    ret = locfs_counters_init(sb);
+    if (ret) {
+        goto release;
+    }
+
+    ret = locfs_location_load(sb);
+    if (ret) {
+        goto release;
+    }
+
+    // Time to setup the root inode, get it from the device
+    root_inode = locfs_iget(sb, LOCFS_ROOTDIR_INODE_NO);
+    if (IS_ERR(root_inode)) {
+        ret = PTR_ERR(root_inode);
+        goto release;
+    }
 
     sb->s_root = d_make_root(root_inode);
     if (!sb->s_root) {
@@ -78,8 +414,19 @@ static int locfs_fill_super(struct super_block *sb,
         goto release;
     }
 
+    return 0;
+
 release:
+    locfs_journal_destroy(sb);
+    locfs_bitmap_release(&sbi->s_inode_bitmap);
+    locfs_bitmap_release(&sbi->s_data_bitmap);
+    locfs_location_release(sb);
+    locfs_stats_destroy(sb);
+    locfs_counters_destroy(sbi);
+    locfs_release_location(sbi);
+    sb->s_fs_info = NULL;
     brelse(bh);
+    kfree(sbi);
     return ret;
 }
 
@@ -104,15 +451,48 @@ struct dentry *locfs_mount(struct file_system_type *fs_type,
 /* Save the super_block back to the device */
 void locfs_save_sb(struct super_block *sb) 
 {
-    struct buffer_head *bh;
-    struct locfs_super_block *locfs_sb = LOCFS_SB(sb);
+    locfs_dirty_buffer(sb, LOCFS_SBI(sb)->s_sbh, NULL);
+}
 
-    // super_block is stored at the first block
-    bh = sb_bread(sb, 0);
-    BUG_ON(!bh);
+/*
+ * Marks a metadata buffer dirty so writeback picks it up. Buffers which
+ * belong to an inode are tied to it so fsync() on that inode flushes them.
+ * With the sync mount option the buffer is written out straight away.
+ *
+ * On a journaled image the buffer joins the running transaction instead
+ * and reaches the device when that transaction commits.
+ */
+void locfs_dirty_buffer(struct super_block *sb,
+                          struct buffer_head *bh,
+                          struct inode *inode)
+{
+    if (LOCFS_SBI(sb)->s_journal) {
+        locfs_journal_dirty_metadata(sb, bh);
+        if (inode && IS_DIRSYNC(inode)) {
+            locfs_journal_set_sync(sb);
+        }
+        return;
+    }
+
+    if (inode) {
+        mark_buffer_dirty_inode(bh, inode);
+    } else {
+        mark_buffer_dirty(bh);
+    }
+
+    if ((sb->s_flags & MS_SYNCHRONOUS) || (inode && IS_DIRSYNC(inode))) {
+        sync_dirty_buffer(bh);
+    }
+}
+
+/* Makes a buffer dirtied through locfs_dirty_buffer durable */
+int locfs_sync_buffer(struct super_block *sb, struct buffer_head *bh)
+{
+    if (LOCFS_SBI(sb)->s_journal) {
+        locfs_journal_set_sync(sb);
+        return 0;
+    }
 
-    bh->b_data = (char *)locfs_sb;
-    mark_buffer_dirty(bh);
     sync_dirty_buffer(bh);
-    brelse(bh);
+    return buffer_write_io_error(bh) ? -EIO : 0;
 }
@@ -0,0 +1,1140 @@
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <linux/fs.h>
+
+#include "../include/locfs.h"
+
+/* Exit codes, as for fsck(8) */
+#define FSCK_OK         0
+#define FSCK_CORRECTED  1
+#define FSCK_UNCORRECTED 4
+#define FSCK_ERROR      8
+
+/* Inodes a worker claims at a time */
+#define FSCK_CHUNK 4096
+/* Problems printed before the rest are only counted */
+#define FSCK_MAX_REPORTS 100
+
+/* What the inode table scan makes of each inode */
+enum {
+    INODE_FREE,
+    INODE_FILE,
+    INODE_DIR,
+    INODE_BAD,
+};
+#define INODE_REACHABLE 0x80
+#define INODE_STATE(s) ((s) & ~INODE_REACHABLE)
+
+#define NO_PARENT UINT64_MAX
+
+struct fsck {
+    int fd;
+    int repair;
+    int verbose;
+    int nthreads;
+
+    const uint8_t *map;
+    uint64_t map_len;
+    struct locfs_super_block sb;
+    uint64_t blocksize;
+    uint64_t data_start;
+    uint64_t data_end;
+    uint64_t inodes;
+
+    /* Per inode, filled in by the scans */
+    uint8_t *state;
+    uint32_t *links;
+    uint64_t *parent;
+
+    /* Bitmaps rebuilt from what is reachable */
+    uint8_t *inode_bitmap;
+    uint8_t *data_bitmap;
+
+    /* Work cursor of the running phase */
+    uint64_t next;
+
+    uint64_t bytes;
+    uint64_t dirs;
+    uint64_t problems;
+    uint64_t uncorrected;
+    pthread_mutex_t report_lock;
+};
+
+typedef void (*fsck_work_fn)(struct fsck *f, uint64_t ino);
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-n | -y] [-j threads] [-v] <device|image>\n"
+            "\n"
+            "Checks the inode table, directories, location indexes and both\n"
+            "bitmaps. -n only reports, -y also rebuilds the bitmaps, the super\n"
+            "block counts and directory child counts from what is reachable\n"
+            "from the root, after replaying the journal.\n",
+            prog);
+}
+
+/* Records a problem, corrected says whether -y takes care of it */
+static void problem(struct fsck *f, int corrected, const char *fmt, ...)
+{
+    va_list ap;
+    uint64_t n;
+
+    n = __atomic_fetch_add(&f->problems, 1, __ATOMIC_RELAXED);
+    if (!corrected || !f->repair) {
+        __atomic_fetch_add(&f->uncorrected, 1, __ATOMIC_RELAXED);
+    }
+    if (n >= FSCK_MAX_REPORTS && !f->verbose) {
+        return;
+    }
+
+    pthread_mutex_lock(&f->report_lock);
+    va_start(ap, fmt);
+    vfprintf(stdout, fmt, ap);
+    va_end(ap);
+    fputc('\n', stdout);
+    pthread_mutex_unlock(&f->report_lock);
+}
+
+static inline int test_bit(const uint8_t *bitmap, uint64_t i)
+{
+    return (bitmap[i / 8] >> (i % 8)) & 1;
+}
+
+/* Sets a bit of a rebuilt bitmap, returns whether it already was */
+static inline int claim_bit(uint8_t *bitmap, uint64_t i)
+{
+    uint8_t mask = 1 << (i % 8);
+
+    return __atomic_fetch_or(&bitmap[i / 8], mask, __ATOMIC_RELAXED) & mask;
+}
+
+static inline const void *block(struct fsck *f, uint64_t block_no)
+{
+    __atomic_fetch_add(&f->bytes, f->blocksize, __ATOMIC_RELAXED);
+    return f->map + block_no * f->blocksize;
+}
+
+static inline int data_block(struct fsck *f, uint64_t block_no)
+{
+    return block_no >= f->data_start && block_no < f->data_end;
+}
+
+/* Reads a chain block, NULL when it is outside the data region or its
+   magic is wrong */
+static const void *chain_block(struct fsck *f, uint64_t block_no,
+                               uint64_t magic)
+{
+    const void *b;
+
+    if (!data_block(f, block_no)) {
+        return NULL;
+    }
+
+    b = block(f, block_no);
+    return *(const uint64_t *)b == magic ? b : NULL;
+}
+
+/*
+ * Marks a block as used by ino, or by the file system as a whole. Returns
+ * whether something else already claimed it, which also ends a chain that
+ * loops back on itself.
+ */
+static int claim_block(struct fsck *f, uint64_t block_no, uint64_t ino)
+{
+    if (!claim_bit(f->data_bitmap, block_no - f->data_start)) {
+        return 0;
+    }
+
+    if (ino == NO_PARENT) {
+        problem(f, 0, "Block %llu is claimed twice",
+                (unsigned long long)block_no);
+    } else {
+        problem(f, 0, "Block %llu of inode %llu is also claimed elsewhere",
+                (unsigned long long)block_no, (unsigned long long)ino);
+    }
+    return 1;
+}
+
+static inline const struct locfs_inode *inode_at(struct fsck *f, uint64_t ino)
+{
+    uint64_t ipb = LOCFS_INODES_PER_BLOCK_HSB(&f->sb);
+
+    return (const struct locfs_inode *)(f->map
+            + (LOCFS_INODE_TABLE_START_BLOCK_NO_HSB(&f->sb) + ino / ipb)
+                * f->blocksize
+            + ino % ipb * LOCFS_INODE_SIZE_HSB(&f->sb));
+}
+
+/* Flags kept past the inode, 0 on images with the smallest inodes */
+static inline uint32_t inode_flags(struct fsck *f, const struct locfs_inode *li)
+{
+    if (LOCFS_INODE_SIZE_HSB(&f->sb) <= LOCFS_INODE_SIZE) {
+        return 0;
+    }
+
+    return ((const struct locfs_inode_extra *)((const uint8_t *)li
+                                               + LOCFS_INODE_SIZE))->flags;
+}
+
+/* Returns the i-th extent of the inode, checked by scan_inode */
+static const struct locfs_extent *extent_slot(struct fsck *f,
+                                              const struct locfs_inode *li,
+                                              uint32_t i)
+{
+    const struct locfs_extent_block *ext_block;
+
+    if (i < LOCFS_INODE_EXTENTS) {
+        return &li->extents[i];
+    }
+
+    ext_block = block(f, li->extent_block_no);
+    return &ext_block->extents[i - LOCFS_INODE_EXTENTS];
+}
+
+/* Maps a logical block of the inode, 0 for a hole */
+static uint64_t map_block(struct fsck *f, const struct locfs_inode *li,
+                          uint64_t lblock)
+{
+    const struct locfs_extent *ext;
+    uint32_t i;
+
+    for (i = 0; i < li->extent_count; i++) {
+        ext = extent_slot(f, li, i);
+        if (lblock >= ext->ee_block
+                && lblock < (uint64_t)ext->ee_block + ext->ee_len) {
+            return ext->ee_start + (lblock - ext->ee_block);
+        }
+    }
+
+    return 0;
+}
+
+struct fsck_worker {
+    struct fsck *f;
+    fsck_work_fn fn;
+};
+
+static void *fsck_worker(void *arg)
+{
+    struct fsck_worker *w = arg;
+    struct fsck *f = w->f;
+    uint64_t start, ino, end;
+
+    for (;;) {
+        start = __atomic_fetch_add(&f->next, FSCK_CHUNK, __ATOMIC_RELAXED);
+        if (start >= f->inodes) {
+            break;
+        }
+
+        end = start + FSCK_CHUNK < f->inodes ? start + FSCK_CHUNK : f->inodes;
+        for (ino = start; ino < end; ino++) {
+            w->fn(f, ino);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Runs fn on every inode from a pool of workers, which take FSCK_CHUNK
+ * inodes at a time so that they stay busy however uneven the work is
+ */
+static void run_phase(struct fsck *f, fsck_work_fn fn)
+{
+    struct fsck_worker w = { f, fn };
+    pthread_t threads[f->nthreads];
+    int i, started;
+
+    f->next = 0;
+    for (started = 0; started < f->nthreads; started++) {
+        if (pthread_create(&threads[started], NULL, fsck_worker, &w)) {
+            break;
+        }
+    }
+    // Whatever could be started finishes the phase
+    if (started == 0) {
+        fsck_worker(&w);
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+/* Checks the block map of the inode */
+static int check_extents(struct fsck *f, uint64_t ino,
+                         const struct locfs_inode *li)
+{
+    const struct locfs_extent_block *ext_block;
+    const struct locfs_extent *ext;
+    uint64_t end = 0;
+    uint32_t i;
+
+    if (li->extent_count > LOCFS_INODE_EXTENTS) {
+        ext_block = chain_block(f, li->extent_block_no, LOCFS_EXTENT_MAGIC);
+        if (!ext_block
+                || ext_block->count != li->extent_count - LOCFS_INODE_EXTENTS
+                || ext_block->count > LOCFS_EXTENTS_PER_BLOCK_HSB(&f->sb)) {
+            problem(f, 0, "Inode %llu has a bad extent block %llu",
+                    (unsigned long long)ino,
+                    (unsigned long long)li->extent_block_no);
+            return -1;
+        }
+    }
+
+    for (i = 0; i < li->extent_count; i++) {
+        ext = extent_slot(f, li, i);
+        if (ext->ee_len == 0 || ext->ee_block < end
+                || !data_block(f, ext->ee_start)
+                || ext->ee_start + ext->ee_len > f->data_end) {
+            problem(f, 0, "Inode %llu has a bad extent %u: %u+%u at %llu",
+                    (unsigned long long)ino, i, ext->ee_block, ext->ee_len,
+                    (unsigned long long)ext->ee_start);
+            return -1;
+        }
+        end = (uint64_t)ext->ee_block + ext->ee_len;
+    }
+
+    return 0;
+}
+
+/* Phase 1, works out which inodes are in use and sane */
+static void scan_inode(struct fsck *f, uint64_t ino)
+{
+    const struct locfs_inode *li = inode_at(f, ino);
+
+    if (ino % LOCFS_INODES_PER_BLOCK_HSB(&f->sb) == 0) {
+        __atomic_fetch_add(&f->bytes, f->blocksize, __ATOMIC_RELAXED);
+    }
+
+    // mkfs zeroes the table, an inode that was ever used has a mode. A
+    // bitmap bit set without one is found when the bitmaps are compared.
+    if (li->mode == 0) {
+        f->state[ino] = INODE_FREE;
+        return;
+    }
+
+    if (li->inode_no != ino) {
+        problem(f, 1, "Inode %llu claims to be inode %llu",
+                (unsigned long long)ino, (unsigned long long)li->inode_no);
+        f->state[ino] = INODE_BAD;
+        return;
+    }
+
+    if (!S_ISDIR(li->mode) && !S_ISREG(li->mode)) {
+        problem(f, 1, "Inode %llu has a bad mode %o",
+                (unsigned long long)ino, li->mode);
+        f->state[ino] = INODE_BAD;
+        return;
+    }
+
+    // Inline data takes the place of the block map
+    if (inode_flags(f, li) & LOCFS_INODE_INLINE_DATA) {
+        if (!S_ISREG(li->mode) || li->extent_count != 0
+                || li->file_size > LOCFS_INLINE_DATA_MAX_HSB(&f->sb)) {
+            problem(f, 0, "Inode %llu has bad inline data, %u extents and "
+                    "%llu bytes", (unsigned long long)ino, li->extent_count,
+                    (unsigned long long)li->file_size);
+            f->state[ino] = INODE_BAD;
+            return;
+        }
+    } else if (check_extents(f, ino, li)) {
+        f->state[ino] = INODE_BAD;
+        return;
+    }
+
+    f->state[ino] = S_ISDIR(li->mode) ? INODE_DIR : INODE_FILE;
+}
+
+/* Counts a directory record pointing at child */
+static void link_child(struct fsck *f, uint64_t dir, uint64_t child,
+                       const char *name)
+{
+    uint64_t none = NO_PARENT;
+
+    if (child >= f->inodes
+            || (INODE_STATE(f->state[child]) != INODE_FILE
+                && INODE_STATE(f->state[child]) != INODE_DIR)) {
+        problem(f, 0, "Entry \"%s\" of directory %llu points at %s inode "
+                "%llu", name, (unsigned long long)dir,
+                child >= f->inodes ? "nonexistent" : "unused",
+                (unsigned long long)child);
+        return;
+    }
+
+    __atomic_fetch_add(&f->links[child], 1, __ATOMIC_RELAXED);
+    __atomic_compare_exchange_n(&f->parent[child], &none, dir, 0,
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+/* Checks one leaf covering the hashes from lo to hi, both inclusive */
+static uint64_t check_leaf(struct fsck *f, uint64_t ino,
+                           const struct locfs_inode *li, uint32_t lblock,
+                           uint32_t lo, uint32_t hi)
+{
+    const struct locfs_dir_leaf *leaf;
+    const struct locfs_dir_record *record;
+    uint32_t hash;
+    size_t len;
+    uint64_t i;
+
+    leaf = chain_block(f, map_block(f, li, lblock), LOCFS_DIR_LEAF_MAGIC);
+    if (!leaf || leaf->count > LOCFS_DIR_RECORDS_PER_BLOCK_HSB(&f->sb)) {
+        problem(f, 0, "Directory %llu has a bad leaf %u",
+                (unsigned long long)ino, lblock);
+        return 0;
+    }
+
+    for (i = 0; i < leaf->count; i++) {
+        record = &leaf->records[i];
+        len = strnlen(record->filename, LOCFS_FILENAME_MAXLEN);
+        if (len == 0 || len == LOCFS_FILENAME_MAXLEN) {
+            problem(f, 0, "Directory %llu has a bad name in leaf %u",
+                    (unsigned long long)ino, lblock);
+            continue;
+        }
+
+        hash = locfs_name_hash(record->filename, len);
+        if (hash < lo || hash > hi) {
+            problem(f, 0, "Entry \"%s\" of directory %llu is in the wrong "
+                    "leaf", record->filename, (unsigned long long)ino);
+        }
+
+        link_child(f, ino, record->inode_no, record->filename);
+    }
+
+    return leaf->count;
+}
+
+/*
+ * Checks a hash tree node and everything below it. Its entries have to
+ * cover the hashes from lo to hi, in order.
+ */
+static uint64_t check_dx_node(struct fsck *f, uint64_t ino,
+                              const struct locfs_inode *li,
+                              const struct locfs_dx_node *node,
+                              uint32_t levels, uint32_t lo, uint32_t hi)
+{
+    const struct locfs_dx_node *child;
+    uint64_t records = 0;
+    uint32_t i, next;
+
+    if (node->count == 0
+            || node->count > LOCFS_DX_ENTRIES_PER_BLOCK_HSB(&f->sb)
+            || node->entries[0].hash != lo) {
+        problem(f, 0, "Directory %llu has a bad hash tree node",
+                (unsigned long long)ino);
+        return 0;
+    }
+
+    for (i = 0; i < node->count; i++) {
+        if (i + 1 < node->count) {
+            if (node->entries[i + 1].hash <= node->entries[i].hash
+                    || node->entries[i + 1].hash > hi) {
+                problem(f, 0, "Directory %llu has unsorted hash tree "
+                        "entries", (unsigned long long)ino);
+                return records;
+            }
+            next = node->entries[i + 1].hash - 1;
+        } else {
+            next = hi;
+        }
+
+        if (levels == 0) {
+            records += check_leaf(f, ino, li, node->entries[i].block,
+                                  node->entries[i].hash, next);
+            continue;
+        }
+
+        child = chain_block(f, map_block(f, li, node->entries[i].block),
+                            LOCFS_DX_NODE_MAGIC);
+        if (!child) {
+            problem(f, 0, "Directory %llu has a bad hash tree node %u",
+                    (unsigned long long)ino, node->entries[i].block);
+            continue;
+        }
+        records += check_dx_node(f, ino, li, child, levels - 1,
+                                 node->entries[i].hash, next);
+    }
+
+    return records;
+}
+
+/* Checks the location index against the records found in the tree */
+static void check_locindex(struct fsck *f, uint64_t ino,
+                           const struct locfs_inode *li, uint64_t records)
+{
+    const struct locfs_locindex_block *index;
+    const struct locfs_loclist_block *list;
+    const struct locfs_dir_record *record;
+    uint64_t block_no, list_no, listed = 0, hops = 0;
+    uint64_t limit = f->data_end - f->data_start;
+    uint64_t i, j;
+
+    for (block_no = li->dir_index_block_no; block_no;
+         block_no = index->header.next_block_no) {
+        index = chain_block(f, block_no, LOCFS_LOCINDEX_MAGIC);
+        if (!index || index->header.count
+                > LOCFS_LOCINDEX_ENTRIES_PER_BLOCK_HSB(&f->sb)
+                || ++hops > limit) {
+            problem(f, 0, "Directory %llu has a bad location index block "
+                    "%llu", (unsigned long long)ino,
+                    (unsigned long long)block_no);
+            return;
+        }
+
+        for (i = 0; i < index->header.count; i++) {
+            for (list_no = index->entries[i].first_block_no; list_no;
+                 list_no = list->header.next_block_no) {
+                list = chain_block(f, list_no, LOCFS_LOCLIST_MAGIC);
+                if (!list || list->header.count
+                        > LOCFS_LOCLIST_RECORDS_PER_BLOCK_HSB(&f->sb)
+                        || ++hops > limit) {
+                    problem(f, 0, "Directory %llu has a bad location list "
+                            "block %llu", (unsigned long long)ino,
+                            (unsigned long long)list_no);
+                    return;
+                }
+
+                for (j = 0; j < list->header.count; j++) {
+                    record = &list->records[j];
+                    if (record->inode_no < f->inodes
+                            && INODE_STATE(f->state[record->inode_no])
+                                != INODE_FREE
+                            && inode_at(f, record->inode_no)->location_id
+                                != index->entries[i].location_id) {
+                        problem(f, 0, "Entry \"%.*s\" of directory %llu is "
+                                "listed under the wrong location",
+                                LOCFS_FILENAME_MAXLEN, record->filename,
+                                (unsigned long long)ino);
+                    }
+                }
+                listed += list->header.count;
+            }
+        }
+    }
+
+    if (listed != records) {
+        problem(f, 0, "Directory %llu lists %llu entries by location but "
+                "has %llu", (unsigned long long)ino,
+                (unsigned long long)listed, (unsigned long long)records);
+    }
+}
+
+/* Phase 2, walks every directory and counts the links to each inode */
+static void scan_dir(struct fsck *f, uint64_t ino)
+{
+    const struct locfs_inode *li = inode_at(f, ino);
+    const struct locfs_dx_node *root;
+    struct locfs_inode fixed;
+    uint64_t records;
+
+    if (INODE_STATE(f->state[ino]) != INODE_DIR) {
+        return;
+    }
+    __atomic_fetch_add(&f->dirs, 1, __ATOMIC_RELAXED);
+
+    root = chain_block(f, map_block(f, li, 0), LOCFS_DX_ROOT_MAGIC);
+    if (!root || root->levels > LOCFS_DX_MAX_LEVELS) {
+        problem(f, 0, "Directory %llu has a bad hash tree root",
+                (unsigned long long)ino);
+        return;
+    }
+
+    records = check_dx_node(f, ino, li, root, root->levels, 0, UINT32_MAX);
+    check_locindex(f, ino, li, records);
+
+    if (records != li->dir_children_count) {
+        problem(f, 1, "Directory %llu has %llu children, not %llu",
+                (unsigned long long)ino, (unsigned long long)records,
+                (unsigned long long)li->dir_children_count);
+        if (f->repair) {
+            fixed = *li;
+            fixed.dir_children_count = records;
+            if (pwrite(f->fd, &fixed, sizeof(fixed),
+                       (const uint8_t *)li - f->map) != sizeof(fixed)) {
+                perror("Error fixing a directory");
+            }
+        }
+    }
+}
+
+/* Marks the inodes linked from the root, following each one's parent */
+static void find_reachable(struct fsck *f)
+{
+    uint64_t ino, up, depth;
+
+    if (INODE_STATE(f->state[LOCFS_ROOTDIR_INODE_NO]) != INODE_DIR) {
+        problem(f, 0, "The root inode is not a directory");
+        return;
+    }
+    f->state[LOCFS_ROOTDIR_INODE_NO] |= INODE_REACHABLE;
+
+    for (ino = 0; ino < f->inodes; ino++) {
+        if (INODE_STATE(f->state[ino]) == INODE_FREE
+                || (f->state[ino] & INODE_REACHABLE)) {
+            continue;
+        }
+
+        // Walk up to something known to be reachable, parents that are
+        // not directories or a loop end the walk
+        up = ino;
+        for (depth = 0; depth < f->inodes; depth++) {
+            up = f->parent[up];
+            if (up == NO_PARENT || INODE_STATE(f->state[up]) != INODE_DIR
+                    || (f->state[up] & INODE_REACHABLE)) {
+                break;
+            }
+        }
+
+        if (up != NO_PARENT && (f->state[up] & INODE_REACHABLE)
+                && INODE_STATE(f->state[ino]) != INODE_BAD) {
+            for (up = ino; !(f->state[up] & INODE_REACHABLE);
+                 up = f->parent[up]) {
+                f->state[up] |= INODE_REACHABLE;
+            }
+        } else {
+            problem(f, 1, "Inode %llu is not reachable from the root",
+                    (unsigned long long)ino);
+        }
+    }
+}
+
+/* Phase 3, rebuilds the bitmaps from the reachable inodes */
+static void claim_inode(struct fsck *f, uint64_t ino)
+{
+    const struct locfs_inode *li = inode_at(f, ino);
+    const struct locfs_locindex_block *index;
+    const struct locfs_loclist_block *list;
+    const struct locfs_extent *ext;
+    uint64_t block_no, list_no, b;
+    uint32_t i;
+
+    if (!(f->state[ino] & INODE_REACHABLE)) {
+        return;
+    }
+    claim_bit(f->inode_bitmap, ino);
+
+    if (ino != LOCFS_ROOTDIR_INODE_NO && f->links[ino] != 1) {
+        problem(f, 0, "Inode %llu is linked %u times",
+                (unsigned long long)ino, f->links[ino]);
+    }
+
+    if (li->extent_count > LOCFS_INODE_EXTENTS) {
+        claim_block(f, li->extent_block_no, ino);
+    }
+    for (i = 0; i < li->extent_count; i++) {
+        ext = extent_slot(f, li, i);
+        for (b = 0; b < ext->ee_len; b++) {
+            claim_block(f, ext->ee_start + b, ino);
+        }
+    }
+
+    if (INODE_STATE(f->state[ino]) != INODE_DIR) {
+        return;
+    }
+
+    // scan_dir already found the chains sound, or reported them
+    for (block_no = li->dir_index_block_no; block_no;
+         block_no = index->header.next_block_no) {
+        index = chain_block(f, block_no, LOCFS_LOCINDEX_MAGIC);
+        if (!index || claim_block(f, block_no, ino)) {
+            break;
+        }
+        for (i = 0; i < index->header.count
+                    && i < LOCFS_LOCINDEX_ENTRIES_PER_BLOCK_HSB(&f->sb); i++) {
+            for (list_no = index->entries[i].first_block_no; list_no;
+                 list_no = list->header.next_block_no) {
+                list = chain_block(f, list_no, LOCFS_LOCLIST_MAGIC);
+                if (!list || claim_block(f, list_no, ino)) {
+                    break;
+                }
+            }
+        }
+    }
+}
+
+/* Claims the location table and checks its IDs */
+static void claim_location_table(struct fsck *f)
+{
+    const struct locfs_location_block *table;
+    uint64_t block_no, i, last_id = 0;
+
+    for (block_no = f->sb.location_table_block_no; block_no;
+         block_no = table->header.next_block_no) {
+        table = chain_block(f, block_no, LOCFS_LOCTABLE_MAGIC);
+        if (!table
+                || table->header.count > LOCFS_LOCATIONS_PER_BLOCK_HSB(&f->sb)) {
+            problem(f, 0, "Bad location table block %llu",
+                    (unsigned long long)block_no);
+            return;
+        }
+        if (claim_block(f, block_no, NO_PARENT)) {
+            return;
+        }
+
+        for (i = 0; i < table->header.count; i++) {
+            if (table->entries[i].id <= last_id) {
+                problem(f, 0, "Location table entry %u is out of order",
+                        table->entries[i].id);
+            }
+            last_id = table->entries[i].id;
+        }
+    }
+}
+
+/* Claims a spatial index node and everything below it */
+static void claim_spatial(struct fsck *f, uint64_t block_no, int level)
+{
+    const struct locfs_spatial_node *node;
+    const struct locfs_spatial_bucket *bucket;
+    const struct locfs_spatial_entry *entry;
+    uint64_t bucket_no, i, j;
+
+    node = chain_block(f, block_no, LOCFS_SPATIAL_NODE_MAGIC);
+    if (!node) {
+        problem(f, 0, "Bad spatial index node %llu",
+                (unsigned long long)block_no);
+        return;
+    }
+    if (claim_block(f, block_no, NO_PARENT)) {
+        return;
+    }
+
+    for (i = 0; i < LOCFS_SPATIAL_SPLIT * LOCFS_SPATIAL_SPLIT; i++) {
+        if (node->children[i] == 0) {
+            continue;
+        }
+        if (level < LOCFS_SPATIAL_LEVELS - 1) {
+            claim_spatial(f, node->children[i], level + 1);
+            continue;
+        }
+
+        for (bucket_no = node->children[i]; bucket_no;
+             bucket_no = bucket->header.next_block_no) {
+            bucket = chain_block(f, bucket_no, LOCFS_SPATIAL_BUCKET_MAGIC);
+            if (!bucket || bucket->header.count
+                    > LOCFS_SPATIAL_ENTRIES_PER_BLOCK_HSB(&f->sb)) {
+                problem(f, 0, "Bad spatial index bucket %llu",
+                        (unsigned long long)bucket_no);
+                break;
+            }
+            if (claim_block(f, bucket_no, NO_PARENT)) {
+                break;
+            }
+
+            for (j = 0; j < bucket->header.count; j++) {
+                entry = &bucket->entries[j];
+                if (entry->inode_no >= f->inodes
+                        || !(f->state[entry->inode_no] & INODE_REACHABLE)) {
+                    problem(f, 0, "Spatial index lists unused inode %llu",
+                            (unsigned long long)entry->inode_no);
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Compares a rebuilt bitmap with the one on disk and writes it back when
+ * repairing. Returns the number of bits set.
+ */
+static uint64_t compare_bitmap(struct fsck *f, const char *what,
+                               uint64_t start_block, uint64_t bits,
+                               uint8_t *rebuilt)
+{
+    const uint8_t *disk = f->map + start_block * f->blocksize;
+    uint64_t set = 0, leaked = 0, lost = 0, i;
+    uint64_t bytes = (bits + 7) / 8;
+
+    __atomic_fetch_add(&f->bytes, bytes, __ATOMIC_RELAXED);
+    for (i = 0; i < bits; i++) {
+        // Whole bytes that agree are the common case
+        if (i % 8 == 0 && i + 8 <= bits && disk[i / 8] == rebuilt[i / 8]) {
+            set += __builtin_popcount(rebuilt[i / 8]);
+            i += 7;
+            continue;
+        }
+
+        set += test_bit(rebuilt, i);
+        if (test_bit(disk, i) && !test_bit(rebuilt, i)) {
+            leaked++;
+        } else if (!test_bit(disk, i) && test_bit(rebuilt, i)) {
+            lost++;
+        }
+    }
+
+    if (leaked) {
+        problem(f, 1, "%llu %s marked in use but unused",
+                (unsigned long long)leaked, what);
+    }
+    if (lost) {
+        problem(f, 1, "%llu %s in use but marked free",
+                (unsigned long long)lost, what);
+    }
+
+    if (f->repair && (leaked || lost)) {
+        // Bits past the end of the table keep whatever they had
+        if (bits % 8) {
+            rebuilt[bits / 8] |= disk[bits / 8] & ~((1 << (bits % 8)) - 1);
+        }
+        if (pwrite(f->fd, rebuilt, bytes, start_block * f->blocksize)
+                != (ssize_t)bytes) {
+            perror("Error writing a bitmap");
+            f->uncorrected++;
+        }
+    }
+
+    return set;
+}
+
+/* Standard reflected CRC-32 without the final inversion, as crc32_le */
+static uint32_t crc32_le(uint32_t crc, const uint8_t *p, size_t len)
+{
+    static uint32_t table[256];
+    uint32_t c;
+    int i, k;
+
+    if (table[1] == 0) {
+        for (i = 0; i < 256; i++) {
+            c = i;
+            for (k = 0; k < 8; k++) {
+                c = c & 1 ? (c >> 1) ^ 0xedb88320 : c >> 1;
+            }
+            table[i] = c;
+        }
+    }
+
+    while (len--) {
+        crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+/*
+ * Replays a committed transaction left at the start of the journal, the
+ * same way mounting would. Returns 1 if there is one to replay and it
+ * was not, because the check is read only.
+ */
+static int replay_journal(struct fsck *f, uint64_t device_blocks)
+{
+    struct locfs_journal_super_block *jsb;
+    struct locfs_journal_descriptor *desc;
+    struct locfs_journal_commit *commit;
+    uint64_t bs = f->blocksize;
+    uint64_t start, log, nr, max, i;
+    uint32_t crc = ~0U;
+    uint8_t *buf, *log_block;
+    int ret = 0;
+
+    if (f->sb.journal_size == 0) {
+        return 0;
+    }
+
+    buf = malloc(4 * bs);
+    if (!buf) {
+        return -1;
+    }
+    jsb = (struct locfs_journal_super_block *)buf;
+    desc = (struct locfs_journal_descriptor *)(buf + bs);
+    commit = (struct locfs_journal_commit *)(buf + 2 * bs);
+    log_block = buf + 3 * bs;
+
+    start = LOCFS_JOURNAL_START_BLOCK_NO_HSB(&f->sb);
+    if (pread(f->fd, jsb, bs, start * bs) != (ssize_t)bs
+            || jsb->header.magic != LOCFS_JOURNAL_MAGIC
+            || jsb->header.blocktype != LOCFS_JOURNAL_SUPER
+            || jsb->maxlen != f->sb.journal_size
+            || jsb->first == 0 || jsb->first + 2 >= jsb->maxlen) {
+        problem(f, 0, "Bad journal super block");
+        goto out;
+    }
+
+    log = start + jsb->first;
+    max = jsb->maxlen - jsb->first - 2;
+    if (max > LOCFS_JOURNAL_TAGS_PER_BLOCK_HSB(&f->sb)) {
+        max = LOCFS_JOURNAL_TAGS_PER_BLOCK_HSB(&f->sb);
+    }
+
+    if (pread(f->fd, desc, bs, log * bs) != (ssize_t)bs
+            || desc->header.magic != LOCFS_JOURNAL_MAGIC
+            || desc->header.blocktype != LOCFS_JOURNAL_DESCRIPTOR
+            || desc->header.sequence < jsb->header.sequence
+            || desc->count == 0 || desc->count > max) {
+        goto out;
+    }
+    nr = desc->count;
+
+    if (pread(f->fd, commit, bs, (log + 1 + nr) * bs) != (ssize_t)bs
+            || commit->header.magic != LOCFS_JOURNAL_MAGIC
+            || commit->header.blocktype != LOCFS_JOURNAL_COMMIT
+            || commit->header.sequence != desc->header.sequence
+            || commit->count != nr) {
+        goto out;
+    }
+
+    for (i = 0; i < nr; i++) {
+        if ((desc->tags[i] >= start && desc->tags[i] < start + jsb->maxlen)
+                || desc->tags[i] >= device_blocks
+                || pread(f->fd, log_block, bs, (log + 1 + i) * bs)
+                    != (ssize_t)bs) {
+            problem(f, 0, "Journal transaction %llu is bad",
+                    (unsigned long long)desc->header.sequence);
+            goto out;
+        }
+        crc = crc32_le(crc, log_block, bs);
+    }
+
+    // A torn transaction is skipped, as the kernel would
+    if (crc != commit->checksum) {
+        goto out;
+    }
+
+    if (!f->repair) {
+        problem(f, 1, "Journal transaction %llu needs replaying",
+                (unsigned long long)desc->header.sequence);
+        ret = 1;
+        goto out;
+    }
+
+    for (i = 0; i < nr; i++) {
+        if (pread(f->fd, log_block, bs, (log + 1 + i) * bs)
+                    != (ssize_t)bs
+                || pwrite(f->fd, log_block, bs, desc->tags[i] * bs)
+                    != (ssize_t)bs) {
+            ret = -1;
+            goto out;
+        }
+    }
+
+    jsb->header.sequence = desc->header.sequence + 1;
+    if (fsync(f->fd) == -1
+            || pwrite(f->fd, jsb, bs, start * bs) != (ssize_t)bs
+            || fsync(f->fd) == -1) {
+        ret = -1;
+        goto out;
+    }
+    problem(f, 1, "Replayed journal transaction %llu (%llu blocks)",
+            (unsigned long long)desc->header.sequence,
+            (unsigned long long)nr);
+
+    // The super block may have been in it
+    if (pread(f->fd, &f->sb, sizeof(f->sb), 0) != sizeof(f->sb)) {
+        ret = -1;
+    }
+
+out:
+    free(buf);
+    return ret;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Checks a locfs image offline. The image is mapped read only and
+ * scanned by a pool of threads, repairs are written with pwrite().
+ */
+int main(int argc, char *argv[])
+{
+    struct fsck f;
+    struct stat st;
+    uint64_t size, inode_count, data_count, meta_end;
+    double start, elapsed;
+    int opt;
+
+    memset(&f, 0, sizeof(f));
+    pthread_mutex_init(&f.report_lock, NULL);
+    f.nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    while ((opt = getopt(argc, argv, "nyj:v")) != -1) {
+        switch (opt) {
+        case 'n':
+            f.repair = 0;
+            break;
+        case 'y':
+            f.repair = 1;
+            break;
+        case 'j':
+            f.nthreads = atoi(optarg);
+            break;
+        case 'v':
+            f.verbose = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return FSCK_ERROR;
+        }
+    }
+    if (optind != argc - 1 || f.nthreads < 1) {
+        usage(argv[0]);
+        return FSCK_ERROR;
+    }
+
+    f.fd = open(argv[optind], f.repair ? O_RDWR : O_RDONLY);
+    if (f.fd == -1) {
+        perror("Error opening the device");
+        return FSCK_ERROR;
+    }
+
+    if (fstat(f.fd, &st) == -1) {
+        perror("Error looking at the device");
+        return FSCK_ERROR;
+    }
+    size = st.st_size;
+    if (S_ISBLK(st.st_mode) && ioctl(f.fd, BLKGETSIZE64, &size) == -1) {
+        perror("Error getting the device size");
+        return FSCK_ERROR;
+    }
+
+    if (pread(f.fd, &f.sb, sizeof(f.sb), 0) != sizeof(f.sb)
+            || f.sb.magic != LOCFS_MAGIC) {
+        fprintf(stderr, "%s is not a locfs image\n", argv[optind]);
+        return FSCK_ERROR;
+    }
+    if (f.sb.blocksize < 1024 || f.sb.blocksize > 65536
+            || (f.sb.blocksize & (f.sb.blocksize - 1))
+            || f.sb.inode_table_size == 0
+            || LOCFS_INODE_SIZE_HSB(&f.sb) < LOCFS_INODE_SIZE
+            || LOCFS_INODE_SIZE_HSB(&f.sb) > f.sb.blocksize
+            || (LOCFS_INODE_SIZE_HSB(&f.sb)
+                & (LOCFS_INODE_SIZE_HSB(&f.sb) - 1))) {
+        fprintf(stderr, "Bad super block, blocksize %llu and %llu inodes "
+                "of %llu bytes\n", (unsigned long long)f.sb.blocksize,
+                (unsigned long long)f.sb.inode_table_size,
+                (unsigned long long)LOCFS_INODE_SIZE_HSB(&f.sb));
+        return FSCK_ERROR;
+    }
+    f.blocksize = f.sb.blocksize;
+
+    // Start from a cold cache, so the throughput reported at the end is
+    // that of the device and not of pages mkfs or a mount left behind
+    posix_fadvise(f.fd, 0, 0, POSIX_FADV_DONTNEED);
+
+    start = now();
+    switch (replay_journal(&f, size / f.blocksize)) {
+    case 0:
+        break;
+    case 1:
+        printf("Checking the image as it is, without the transaction\n");
+        break;
+    default:
+        perror("Error replaying the journal");
+        return FSCK_ERROR;
+    }
+
+    f.blocksize = f.sb.blocksize;
+    f.inodes = f.sb.inode_table_size;
+    f.data_start = LOCFS_DATA_BLOCK_TABLE_START_BLOCK_NO_HSB(&f.sb);
+    f.data_end = f.data_start + f.sb.data_block_table_size;
+    if (f.data_end * f.blocksize > size || f.data_end < f.data_start) {
+        fprintf(stderr, "The image is truncated, it needs %llu blocks\n",
+                (unsigned long long)f.data_end);
+        return FSCK_ERROR;
+    }
+
+    f.map_len = f.data_end * f.blocksize;
+    f.map = mmap(NULL, f.map_len, PROT_READ, MAP_SHARED, f.fd, 0);
+    if (f.map == MAP_FAILED) {
+        perror("Error mapping the device");
+        return FSCK_ERROR;
+    }
+    // The bitmaps and the inode table are read from end to end, so start
+    // reading them in now. Directories and indexes are all over the place.
+    meta_end = f.data_start * f.blocksize;
+    madvise((void *)f.map, meta_end, MADV_WILLNEED);
+    madvise((void *)(f.map + meta_end), f.map_len - meta_end, MADV_RANDOM);
+
+    f.state = calloc(f.inodes, 1);
+    f.links = calloc(f.inodes, sizeof(*f.links));
+    f.parent = malloc(f.inodes * sizeof(*f.parent));
+    f.inode_bitmap = calloc(1, LOCFS_INODE_BITMAP_BLOCKS_HSB(&f.sb)
+                               * f.blocksize);
+    f.data_bitmap = calloc(1, LOCFS_DATA_BLOCK_BITMAP_BLOCKS_HSB(&f.sb)
+                              * f.blocksize);
+    if (!f.state || !f.links || !f.parent || !f.inode_bitmap
+            || !f.data_bitmap) {
+        fprintf(stderr, "Out of memory\n");
+        return FSCK_ERROR;
+    }
+    memset(f.parent, 0xff, f.inodes * sizeof(*f.parent));
+
+    run_phase(&f, scan_inode);
+    run_phase(&f, scan_dir);
+    find_reachable(&f);
+    run_phase(&f, claim_inode);
+    claim_location_table(&f);
+    if (f.sb.spatial_root_block_no) {
+        claim_spatial(&f, f.sb.spatial_root_block_no, 0);
+    }
+
+    inode_count = compare_bitmap(&f, "inodes",
+                                 LOCFS_INODE_BITMAP_START_BLOCK_NO,
+                                 f.inodes, f.inode_bitmap);
+    data_count = compare_bitmap(&f, "data blocks",
+                                LOCFS_DATA_BLOCK_BITMAP_START_BLOCK_NO_HSB(&f.sb),
+                                f.sb.data_block_table_size, f.data_bitmap);
+
+    if (inode_count != f.sb.inode_count
+            || data_count != f.sb.data_block_count) {
+        problem(&f, 1, "Super block counts %llu inodes and %llu data "
+                "blocks, not %llu and %llu",
+                (unsigned long long)f.sb.inode_count,
+                (unsigned long long)f.sb.data_block_count,
+                (unsigned long long)inode_count,
+                (unsigned long long)data_count);
+        if (f.repair) {
+            f.sb.inode_count = inode_count;
+            f.sb.data_block_count = data_count;
+            if (pwrite(f.fd, &f.sb, sizeof(f.sb), 0) != sizeof(f.sb)) {
+                perror("Error writing the super block");
+                f.uncorrected++;
+            }
+        }
+    }
+
+    if (f.repair && fsync(f.fd) == -1) {
+        perror("Error syncing the device");
+        f.uncorrected++;
+    }
+    elapsed = now() - start;
+
+    printf("%s: %llu inodes in use, %llu directories, %llu data blocks "
+           "in use\n", argv[optind], (unsigned long long)inode_count,
+           (unsigned long long)f.dirs, (unsigned long long)data_count);
+    printf("Checked %.1f MiB of metadata in %.3f s, %.1f MiB/s with %d "
+           "threads\n", f.bytes / 1048576.0, elapsed,
+           elapsed > 0 ? f.bytes / 1048576.0 / elapsed : 0.0, f.nthreads);
+
+    munmap((void *)f.map, f.map_len);
+    close(f.fd);
+
+    if (f.uncorrected) {
+        printf("%llu problems, %llu left uncorrected\n",
+               (unsigned long long)f.problems,
+               (unsigned long long)f.uncorrected);
+        return FSCK_UNCORRECTED;
+    }
+    if (f.problems) {
+        printf("%llu problems corrected\n", (unsigned long long)f.problems);
+        return FSCK_CORRECTED;
+    }
+    return FSCK_OK;
+}
@@ -0,0 +1,371 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../liblocfs/liblocfs.h"
+
+/*
+ * Tests liblocfs on a fresh image made by mkfs-locfs:
+ *
+ *   create, lookup and readdir, and how locations hide entries
+ *   readdir resuming from the position a listing stopped at
+ *   writes which take more extents than the inode holds, read back
+ *   before and after the image is closed, then checked by fsck.locfs
+ *
+ * Run from this directory after make, as make check does. The image is
+ * made in TMPDIR, or /tmp, and removed afterwards unless -k is given.
+ */
+
+#define TEST_BLOCKS "4096"
+/* Blocks written to each file by the extent test, one at a time */
+#define TEST_FILE_BLOCKS 24
+
+static int failures;
+
+#define CHECK(cond, ...)                                                \
+    do {                                                                \
+        if (!(cond)) {                                                  \
+            fprintf(stderr, "%s:%d: ", __func__, __LINE__);             \
+            fprintf(stderr, __VA_ARGS__);                               \
+            fprintf(stderr, "\n");                                      \
+            failures++;                                                 \
+        }                                                               \
+    } while (0)
+
+/* Runs one of the tools next to this one on the image */
+static int run_tool(const char *tool, const char *opts, const char *image,
+                    const char *args)
+{
+    char cmd[512];
+    int status;
+
+    snprintf(cmd, sizeof(cmd), "./%s %s %s %s >/dev/null", tool, opts, image,
+             args);
+    status = system(cmd);
+    if (status == -1 || !WIFEXITED(status)) {
+        return -1;
+    }
+
+    return WEXITSTATUS(status);
+}
+
+struct listing {
+    char names[8][LOCFS_FILENAME_MAXLEN];
+    uint64_t inodes[8];
+    uint64_t next_pos[8];
+    int count;
+    /* Stop after this many entries, 0 for the whole listing */
+    int stop_after;
+};
+
+static int record_entry(void *ctx, const char *name, uint64_t inode_no,
+                        uint64_t next_pos)
+{
+    struct listing *l = ctx;
+
+    if (l->count == 8) {
+        return 1;
+    }
+
+    snprintf(l->names[l->count], LOCFS_FILENAME_MAXLEN, "%s", name);
+    l->inodes[l->count] = inode_no;
+    l->next_pos[l->count] = next_pos;
+    l->count++;
+
+    return l->stop_after && l->count == l->stop_after;
+}
+
+/* Index of name in the listing, or -1 */
+static int listed(struct listing *l, const char *name)
+{
+    int i;
+
+    for (i = 0; i < l->count; i++) {
+        if (!strcmp(l->names[i], name)) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static void test_namespace(struct locfs_fs *fs)
+{
+    struct locfs_inode inode;
+    struct listing l;
+    uint64_t file, dir, sub, found;
+    int ret, i;
+
+    CHECK(locfs_fs_set_location(fs, "Home") == 0, "set location Home");
+
+    ret = locfs_fs_create(fs, LOCFS_ROOTDIR_INODE_NO, "file",
+                          S_IFREG | 0644, &file);
+    CHECK(ret == 0, "create file: %d", ret);
+    ret = locfs_fs_create(fs, LOCFS_ROOTDIR_INODE_NO, "dir",
+                          S_IFDIR | 0755, &dir);
+    CHECK(ret == 0, "create dir: %d", ret);
+    ret = locfs_fs_create(fs, dir, "sub", S_IFREG | 0600, &sub);
+    CHECK(ret == 0, "create dir/sub: %d", ret);
+
+    ret = locfs_fs_create(fs, LOCFS_ROOTDIR_INODE_NO, "file",
+                          S_IFREG | 0644, &found);
+    CHECK(ret == -EEXIST, "create file again: %d", ret);
+    ret = locfs_fs_create(fs, file, "x", S_IFREG | 0644, &found);
+    CHECK(ret == -ENOTDIR, "create under a file: %d", ret);
+
+    ret = locfs_fs_lookup(fs, LOCFS_ROOTDIR_INODE_NO, "file", &found);
+    CHECK(ret == 0 && found == file, "lookup file: %d", ret);
+    ret = locfs_fs_lookup(fs, LOCFS_ROOTDIR_INODE_NO, "dir", &found);
+    CHECK(ret == 0 && found == dir, "lookup dir: %d", ret);
+    ret = locfs_fs_lookup(fs, dir, "sub", &found);
+    CHECK(ret == 0 && found == sub, "lookup dir/sub: %d", ret);
+    ret = locfs_fs_lookup(fs, LOCFS_ROOTDIR_INODE_NO, "missing", &found);
+    CHECK(ret == -ENOENT, "lookup missing: %d", ret);
+
+    ret = locfs_fs_getattr(fs, dir, &inode);
+    CHECK(ret == 0 && S_ISDIR(inode.mode), "getattr dir: %d", ret);
+    ret = locfs_fs_getattr(fs, sub, &inode);
+    CHECK(ret == 0 && S_ISREG(inode.mode) && (inode.mode & 0777) == 0600
+          && inode.file_size == 0, "getattr dir/sub: %d", ret);
+
+    memset(&l, 0, sizeof(l));
+    ret = locfs_fs_readdir(fs, LOCFS_ROOTDIR_INODE_NO, 0, record_entry, &l);
+    CHECK(ret == 0 && l.count == 2, "readdir root: %d, %d entries",
+          ret, l.count);
+    i = listed(&l, "file");
+    CHECK(i >= 0 && l.inodes[i] == file, "readdir root lists file");
+    i = listed(&l, "dir");
+    CHECK(i >= 0 && l.inodes[i] == dir, "readdir root lists dir");
+
+    // Entries made elsewhere are neither found nor listed
+    CHECK(locfs_fs_set_location(fs, "Work") == 0, "set location Work");
+    ret = locfs_fs_lookup(fs, LOCFS_ROOTDIR_INODE_NO, "file", &found);
+    CHECK(ret == -ENOENT, "lookup file at Work: %d", ret);
+    memset(&l, 0, sizeof(l));
+    ret = locfs_fs_readdir(fs, LOCFS_ROOTDIR_INODE_NO, 0, record_entry, &l);
+    CHECK(ret == 0 && l.count == 0, "readdir root at Work: %d, %d entries",
+          ret, l.count);
+
+    ret = locfs_fs_create(fs, LOCFS_ROOTDIR_INODE_NO, "work",
+                          S_IFREG | 0644, &found);
+    CHECK(ret == 0, "create work: %d", ret);
+    memset(&l, 0, sizeof(l));
+    ret = locfs_fs_readdir(fs, LOCFS_ROOTDIR_INODE_NO, 0, record_entry, &l);
+    CHECK(ret == 0 && l.count == 1 && listed(&l, "work") == 0,
+          "readdir root at Work after create: %d, %d entries", ret, l.count);
+
+    CHECK(locfs_fs_set_location(fs, "Home") == 0, "set location Home");
+    ret = locfs_fs_lookup(fs, LOCFS_ROOTDIR_INODE_NO, "work", &found);
+    CHECK(ret == -ENOENT, "lookup work at Home: %d", ret);
+}
+
+static void test_readdir_resume(struct locfs_fs *fs)
+{
+    struct listing first, rest;
+    char name[32];
+    uint64_t dir, inode_no;
+    int ret, i;
+
+    ret = locfs_fs_create(fs, LOCFS_ROOTDIR_INODE_NO, "resume",
+                          S_IFDIR | 0755, &dir);
+    CHECK(ret == 0, "create resume: %d", ret);
+    for (i = 0; i < 6; i++) {
+        snprintf(name, sizeof(name), "entry%d", i);
+        ret = locfs_fs_create(fs, dir, name, S_IFREG | 0644, &inode_no);
+        CHECK(ret == 0, "create %s: %d", name, ret);
+    }
+
+    memset(&first, 0, sizeof(first));
+    first.stop_after = 2;
+    ret = locfs_fs_readdir(fs, dir, 0, record_entry, &first);
+    CHECK(ret == 0 && first.count == 2, "readdir first part: %d, %d entries",
+          ret, first.count);
+
+    memset(&rest, 0, sizeof(rest));
+    ret = locfs_fs_readdir(fs, dir, first.next_pos[1], record_entry, &rest);
+    CHECK(ret == 0 && rest.count == 4, "readdir the rest: %d, %d entries",
+          ret, rest.count);
+
+    // Together the two parts list every entry once
+    for (i = 0; i < 6; i++) {
+        snprintf(name, sizeof(name), "entry%d", i);
+        CHECK((listed(&first, name) >= 0) + (listed(&rest, name) >= 0) == 1,
+              "%s listed once", name);
+    }
+}
+
+/* The byte at offset off of the test file */
+static uint8_t pattern(uint64_t file, uint64_t off)
+{
+    return (uint8_t)(off * 31 + off / 4093 + file * 7);
+}
+
+/*
+ * Writes two files a block at a time, taking turns, so neither gets two
+ * blocks in a row and both need more extents than fit in the inode.
+ */
+static void test_extents_write(struct locfs_fs *fs, uint64_t *files,
+                               uint64_t blocksize)
+{
+    struct locfs_inode inode;
+    uint8_t *buf;
+    uint64_t b, off;
+    ssize_t n;
+    int f, ret;
+
+    buf = malloc(blocksize);
+    if (!buf) {
+        CHECK(0, "out of memory");
+        return;
+    }
+
+    for (f = 0; f < 2; f++) {
+        ret = locfs_fs_create(fs, LOCFS_ROOTDIR_INODE_NO,
+                              f ? "extents1" : "extents0",
+                              S_IFREG | 0644, &files[f]);
+        CHECK(ret == 0, "create extents%d: %d", f, ret);
+    }
+
+    for (b = 0; b < TEST_FILE_BLOCKS; b++) {
+        for (f = 0; f < 2; f++) {
+            for (off = 0; off < blocksize; off++) {
+                buf[off] = pattern(files[f], b * blocksize + off);
+            }
+            n = locfs_fs_write(fs, files[f], buf, blocksize, b * blocksize);
+            CHECK(n == (ssize_t)blocksize, "write block %llu: %zd",
+                  (unsigned long long)b, n);
+        }
+    }
+
+    for (f = 0; f < 2; f++) {
+        ret = locfs_fs_getattr(fs, files[f], &inode);
+        CHECK(ret == 0 && inode.file_size == TEST_FILE_BLOCKS * blocksize,
+              "getattr extents%d: %d", f, ret);
+        CHECK(inode.extent_count > LOCFS_INODE_EXTENTS
+              && inode.extent_block_no != 0,
+              "extents%d has %u extents, overflow block %llu", f,
+              inode.extent_count,
+              (unsigned long long)inode.extent_block_no);
+    }
+
+    free(buf);
+}
+
+/* Reads the files back in one go, across every extent boundary */
+static void test_extents_read(struct locfs_fs *fs, uint64_t *files,
+                              uint64_t blocksize)
+{
+    uint64_t size = TEST_FILE_BLOCKS * blocksize, off;
+    uint8_t *buf;
+    ssize_t n;
+    int f;
+
+    buf = malloc(size + blocksize);
+    if (!buf) {
+        CHECK(0, "out of memory");
+        return;
+    }
+
+    for (f = 0; f < 2; f++) {
+        n = locfs_fs_read(fs, files[f], buf, size + blocksize, 0);
+        CHECK(n == (ssize_t)size, "read extents%d: %zd", f, n);
+        for (off = 0; n == (ssize_t)size && off < size; off++) {
+            if (buf[off] != pattern(files[f], off)) {
+                CHECK(0, "extents%d differs at byte %llu", f,
+                      (unsigned long long)off);
+                break;
+            }
+        }
+
+        // A read which starts inside a block and ends at the size
+        n = locfs_fs_read(fs, files[f], buf, size, size - blocksize - 100);
+        CHECK(n == (ssize_t)blocksize + 100
+              && buf[0] == pattern(files[f], size - blocksize - 100),
+              "unaligned read of extents%d: %zd", f, n);
+    }
+
+    free(buf);
+}
+
+int main(int argc, char *argv[])
+{
+    struct locfs_super_block sb;
+    struct locfs_fs *fs;
+    char image[256];
+    const char *tmpdir;
+    uint64_t files[2], found;
+    int keep = 0, fd, ret;
+
+    if (argc == 2 && !strcmp(argv[1], "-k")) {
+        keep = 1;
+    } else if (argc != 1) {
+        fprintf(stderr, "Usage: %s [-k]\n", argv[0]);
+        return 2;
+    }
+
+    tmpdir = getenv("TMPDIR");
+    snprintf(image, sizeof(image), "%s/liblocfs-test.XXXXXX",
+             tmpdir ? tmpdir : "/tmp");
+    fd = mkstemp(image);
+    if (fd == -1) {
+        perror("Error creating the image");
+        return 2;
+    }
+    close(fd);
+
+    if (run_tool("mkfs-locfs", "", image, TEST_BLOCKS) != 0) {
+        fprintf(stderr, "mkfs-locfs failed, run make first\n");
+        unlink(image);
+        return 2;
+    }
+
+    ret = locfs_fs_open(image, 0, &fs);
+    if (ret) {
+        fprintf(stderr, "Error opening %s: %s\n", image, strerror(-ret));
+        unlink(image);
+        return 2;
+    }
+    locfs_fs_super(fs, &sb);
+
+    test_namespace(fs);
+    test_readdir_resume(fs);
+    test_extents_write(fs, files, sb.blocksize);
+    test_extents_read(fs, files, sb.blocksize);
+
+    ret = locfs_fs_close(fs);
+    CHECK(ret == 0, "close: %d", ret);
+
+    // Everything must have reached the image
+    ret = locfs_fs_open(image, 1, &fs);
+    CHECK(ret == 0, "reopen: %d", ret);
+    if (!ret) {
+        CHECK(locfs_fs_set_location(fs, "Home") == 0, "set location Home");
+        ret = locfs_fs_lookup(fs, LOCFS_ROOTDIR_INODE_NO, "extents1", &found);
+        CHECK(ret == 0 && found == files[1], "lookup after reopen: %d", ret);
+        test_extents_read(fs, files, sb.blocksize);
+        locfs_fs_close(fs);
+    }
+
+    ret = run_tool("fsck.locfs", "-n", image, "");
+    CHECK(ret == 0, "fsck.locfs -n: %d", ret);
+
+    if (keep) {
+        printf("Image kept at %s\n", image);
+    } else {
+        unlink(image);
+    }
+
+    if (failures) {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+
+    printf("All checks passed\n");
+    return 0;
+}
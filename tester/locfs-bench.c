@@ -0,0 +1,926 @@
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../liblocfs/liblocfs.h"
+
+/*
+ * Benchmarks the operations locfs is built around, either through a
+ * mounted image or on an image file through liblocfs:
+ *
+ *   create       files spread over the locations, see bench_plan()
+ *   lookup       names visible at the current location
+ *   lookup_hidden names created at another location, which must miss
+ *   readdir      a full listing at each location, the fraction of all
+ *                files visible there is its selectivity
+ *   switch_list  a location change followed by a full listing
+ *   seq_write, seq_read, rand_write, rand_read on one large file
+ *
+ * Every result comes with its p50 and p99 latency. -j prints one JSON
+ * object per result and line instead of a table, so runs can be diffed
+ * and compared by scripts. The random choices use a fixed seed, two runs
+ * with the same options do the same operations.
+ *
+ * Nothing is removed afterwards, locfs has no unlink, so run it on a
+ * freshly made image. A mount must not have been given location=, the
+ * location is switched through /proc/locationmod.
+ */
+
+#define BENCH_PROC_LOCATION "/proc/locationmod"
+/* Random I/O operations at most, whatever the file size */
+#define BENCH_MAX_RANDOM_OPS 65536
+
+struct bench;
+
+/* What the benchmarks need from a mount or an image */
+struct bench_ops {
+    int (*set_location)(struct bench *b, const char *name);
+    int (*mkdir)(struct bench *b, uint64_t parent, const char *name,
+                 uint64_t *out_dir);
+    int (*create)(struct bench *b, uint64_t dir, const char *name);
+    int (*lookup)(struct bench *b, uint64_t dir, const char *name);
+    /* Number of entries listed, or a negative errno */
+    int64_t (*list)(struct bench *b, uint64_t dir);
+    int (*open)(struct bench *b, uint64_t dir, const char *name,
+                uint64_t *out_file);
+    ssize_t (*pread)(struct bench *b, uint64_t file, void *buf, size_t size,
+                     off_t offset);
+    ssize_t (*pwrite)(struct bench *b, uint64_t file, const void *buf,
+                      size_t size, off_t offset);
+    /* Makes the file durable and, where there is a cache, drops it */
+    int (*sync)(struct bench *b, uint64_t file);
+    void (*close)(struct bench *b, uint64_t file);
+};
+
+struct bench {
+    const struct bench_ops *ops;
+    int json;
+
+    /* Mount backend */
+    int proc_fd;
+    /* Image backend */
+    struct locfs_fs *fs;
+
+    uint64_t files;
+    uint32_t locations;
+    uint64_t fanout;
+    uint64_t lookups;
+    uint32_t reps;
+    uint64_t io_size;
+    uint64_t seq_block;
+    uint64_t rand_block;
+
+    uint64_t top;
+    uint64_t *dirs;
+    uint64_t nr_dirs;
+    /* Files [first[j], first[j] + count[j]) are created at location j */
+    uint64_t *first;
+    uint64_t *count;
+
+    uint64_t rng;
+    uint64_t *lat;
+};
+
+/* Mount backend, plain system calls on directory file descriptors. Kept
+   open, directories stay usable at locations they are hidden at. */
+
+static int mount_set_location(struct bench *b, const char *name)
+{
+    size_t len = strlen(name);
+
+    return write(b->proc_fd, name, len) == (ssize_t)len ? 0 : -errno;
+}
+
+static int mount_mkdir(struct bench *b, uint64_t parent, const char *name,
+                       uint64_t *out_dir)
+{
+    int fd;
+
+    (void)b;
+    if (mkdirat(parent, name, 0755) == -1) {
+        return -errno;
+    }
+
+    fd = openat(parent, name, O_RDONLY | O_DIRECTORY);
+    if (fd == -1) {
+        return -errno;
+    }
+
+    *out_dir = fd;
+    return 0;
+}
+
+static int mount_create(struct bench *b, uint64_t dir, const char *name)
+{
+    int fd;
+
+    (void)b;
+    fd = openat(dir, name, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd == -1) {
+        return -errno;
+    }
+
+    close(fd);
+    return 0;
+}
+
+static int mount_lookup(struct bench *b, uint64_t dir, const char *name)
+{
+    struct stat st;
+
+    (void)b;
+    return fstatat(dir, name, &st, 0) == -1 ? -errno : 0;
+}
+
+static int64_t mount_list(struct bench *b, uint64_t dir)
+{
+    struct dirent *de;
+    int64_t n = 0;
+    DIR *d;
+    int fd;
+
+    (void)b;
+    fd = openat(dir, ".", O_RDONLY | O_DIRECTORY);
+    if (fd == -1) {
+        return -errno;
+    }
+
+    d = fdopendir(fd);
+    if (!d) {
+        close(fd);
+        return -errno;
+    }
+
+    while ((de = readdir(d)) != NULL) {
+        if (strcmp(de->d_name, ".") && strcmp(de->d_name, "..")) {
+            n++;
+        }
+    }
+
+    closedir(d);
+    return n;
+}
+
+static int mount_open(struct bench *b, uint64_t dir, const char *name,
+                      uint64_t *out_file)
+{
+    int fd;
+
+    (void)b;
+    fd = openat(dir, name, O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        return -errno;
+    }
+
+    *out_file = fd;
+    return 0;
+}
+
+static ssize_t mount_pread(struct bench *b, uint64_t file, void *buf,
+                           size_t size, off_t offset)
+{
+    ssize_t n;
+
+    (void)b;
+    n = pread(file, buf, size, offset);
+    return n == -1 ? -errno : n;
+}
+
+static ssize_t mount_pwrite(struct bench *b, uint64_t file, const void *buf,
+                            size_t size, off_t offset)
+{
+    ssize_t n;
+
+    (void)b;
+    n = pwrite(file, buf, size, offset);
+    return n == -1 ? -errno : n;
+}
+
+static int mount_sync(struct bench *b, uint64_t file)
+{
+    (void)b;
+    if (fsync(file) == -1) {
+        return -errno;
+    }
+
+    // Reads after this come from the device, not the page cache
+    posix_fadvise(file, 0, 0, POSIX_FADV_DONTNEED);
+    return 0;
+}
+
+static void mount_close(struct bench *b, uint64_t file)
+{
+    (void)b;
+    close(file);
+}
+
+static const struct bench_ops mount_ops = {
+    .set_location   = mount_set_location,
+    .mkdir          = mount_mkdir,
+    .create         = mount_create,
+    .lookup         = mount_lookup,
+    .list           = mount_list,
+    .open           = mount_open,
+    .pread          = mount_pread,
+    .pwrite         = mount_pwrite,
+    .sync           = mount_sync,
+    .close          = mount_close,
+};
+
+/* Image backend, liblocfs on an unmounted image */
+
+static int image_set_location(struct bench *b, const char *name)
+{
+    return locfs_fs_set_location(b->fs, name);
+}
+
+static int image_mkdir(struct bench *b, uint64_t parent, const char *name,
+                       uint64_t *out_dir)
+{
+    return locfs_fs_create(b->fs, parent, name, S_IFDIR | 0755, out_dir);
+}
+
+static int image_create(struct bench *b, uint64_t dir, const char *name)
+{
+    uint64_t inode_no;
+
+    return locfs_fs_create(b->fs, dir, name, S_IFREG | 0644, &inode_no);
+}
+
+static int image_lookup(struct bench *b, uint64_t dir, const char *name)
+{
+    uint64_t inode_no;
+
+    return locfs_fs_lookup(b->fs, dir, name, &inode_no);
+}
+
+static int count_entry(void *ctx, const char *name, uint64_t inode_no,
+                       uint64_t next_pos)
+{
+    (void)name;
+    (void)inode_no;
+    (void)next_pos;
+    (*(int64_t *)ctx)++;
+    return 0;
+}
+
+static int64_t image_list(struct bench *b, uint64_t dir)
+{
+    int64_t n = 0;
+    int ret;
+
+    ret = locfs_fs_readdir(b->fs, dir, 0, count_entry, &n);
+    return ret ? ret : n;
+}
+
+static int image_open(struct bench *b, uint64_t dir, const char *name,
+                      uint64_t *out_file)
+{
+    int ret;
+
+    ret = locfs_fs_lookup(b->fs, dir, name, out_file);
+    if (ret == -ENOENT) {
+        ret = locfs_fs_create(b->fs, dir, name, S_IFREG | 0644, out_file);
+    }
+
+    return ret;
+}
+
+static ssize_t image_pread(struct bench *b, uint64_t file, void *buf,
+                           size_t size, off_t offset)
+{
+    return locfs_fs_read(b->fs, file, buf, size, offset);
+}
+
+static ssize_t image_pwrite(struct bench *b, uint64_t file, const void *buf,
+                            size_t size, off_t offset)
+{
+    return locfs_fs_write(b->fs, file, buf, size, offset);
+}
+
+static int image_sync(struct bench *b, uint64_t file)
+{
+    (void)file;
+    return locfs_fs_sync(b->fs);
+}
+
+static void image_close(struct bench *b, uint64_t file)
+{
+    (void)b;
+    (void)file;
+}
+
+static const struct bench_ops image_ops = {
+    .set_location   = image_set_location,
+    .mkdir          = image_mkdir,
+    .create         = image_create,
+    .lookup         = image_lookup,
+    .list           = image_list,
+    .open           = image_open,
+    .pread          = image_pread,
+    .pwrite         = image_pwrite,
+    .sync           = image_sync,
+    .close          = image_close,
+};
+
+/* Timing and reporting */
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* xorshift64*, good enough to pick files and offsets */
+static inline uint64_t bench_random(struct bench *b, uint64_t limit)
+{
+    b->rng ^= b->rng >> 12;
+    b->rng ^= b->rng << 25;
+    b->rng ^= b->rng >> 27;
+    return (b->rng * 2685821657736338717ULL) % limit;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Nearest rank percentile of the sorted latencies, in microseconds */
+static double percentile(const uint64_t *lat, uint64_t n, int p)
+{
+    uint64_t rank;
+
+    if (n == 0) {
+        return 0;
+    }
+
+    rank = (n * p + 99) / 100;
+    return lat[rank ? rank - 1 : 0] / 1000.0;
+}
+
+/*
+ * Prints one result. total_ns is the wall time of the whole run, which
+ * can include work outside the timed operations such as a final fsync.
+ * location is NULL for results not tied to one location.
+ */
+static void report(struct bench *b, const char *name, const char *location,
+                   double selectivity, uint64_t ops, uint64_t bytes,
+                   uint64_t total_ns, uint64_t *lat)
+{
+    double secs = total_ns / 1e9;
+    double ops_per_sec = secs > 0 ? ops / secs : 0;
+    double mib_per_sec = secs > 0 ? bytes / secs / (1 << 20) : 0;
+    char select[16];
+    double p50, p99;
+
+    qsort(lat, ops, sizeof(*lat), cmp_u64);
+    p50 = percentile(lat, ops, 50);
+    p99 = percentile(lat, ops, 99);
+
+    if (b->json) {
+        printf("{\"bench\":\"%s\"", name);
+        if (location) {
+            printf(",\"location\":\"%s\",\"selectivity\":%.4f",
+                   location, selectivity);
+        }
+        printf(",\"ops\":%lu,\"bytes\":%lu,\"seconds\":%.6f"
+               ",\"ops_per_sec\":%.1f,\"mib_per_sec\":%.2f"
+               ",\"p50_us\":%.2f,\"p99_us\":%.2f}\n",
+               ops, bytes, secs, ops_per_sec, mib_per_sec, p50, p99);
+    } else {
+        if (location) {
+            snprintf(select, sizeof(select), "%.2f%%", selectivity * 100);
+        }
+        printf("%-14s %-12s %7s %9lu %10.3f %11.1f %9.2f %10.2f %10.2f\n",
+               name, location ? location : "-", location ? select : "-",
+               ops, secs, ops_per_sec, mib_per_sec, p50, p99);
+    }
+    fflush(stdout);
+}
+
+static void location_name(char *buf, size_t len, uint32_t j)
+{
+    snprintf(buf, len, "bench-%u", j);
+}
+
+static void file_name(char *buf, size_t len, uint64_t i)
+{
+    snprintf(buf, len, "f%08lu", i);
+}
+
+static int bench_set_location(struct bench *b, uint32_t j)
+{
+    char name[32];
+    int ret;
+
+    location_name(name, sizeof(name), j);
+    ret = b->ops->set_location(b, name);
+    if (ret) {
+        fprintf(stderr, "Setting location %s: %s\n", name, strerror(-ret));
+    }
+
+    return ret;
+}
+
+/* Benchmarks */
+
+/*
+ * Decides how many files each location gets: every location holds half
+ * as many as the one before, the last one takes what is left. Listings
+ * at the locations then see from half of the files down to a few.
+ */
+static int bench_plan(struct bench *b)
+{
+    uint64_t left = b->files;
+    uint32_t j;
+
+    b->first = calloc(b->locations, sizeof(*b->first));
+    b->count = calloc(b->locations, sizeof(*b->count));
+    if (!b->first || !b->count) {
+        return -ENOMEM;
+    }
+
+    for (j = 0; j < b->locations; j++) {
+        b->first[j] = b->files - left;
+        b->count[j] = j + 1 < b->locations ? left / 2 : left;
+        left -= b->count[j];
+    }
+
+    return 0;
+}
+
+/* The directories the files are spread over, all at the first location */
+static int bench_setup(struct bench *b)
+{
+    char name[32];
+    uint64_t top, k;
+    int ret;
+
+    ret = bench_set_location(b, 0);
+    if (ret) {
+        return ret;
+    }
+
+    snprintf(name, sizeof(name), "locfs-bench.%d", getpid());
+    ret = b->ops->mkdir(b, b->top, name, &top);
+    if (ret) {
+        fprintf(stderr, "Creating %s: %s\n", name, strerror(-ret));
+        return ret;
+    }
+    b->top = top;
+
+    b->nr_dirs = (b->files + b->fanout - 1) / b->fanout;
+    b->dirs = calloc(b->nr_dirs, sizeof(*b->dirs));
+    if (!b->dirs) {
+        return -ENOMEM;
+    }
+
+    for (k = 0; k < b->nr_dirs; k++) {
+        snprintf(name, sizeof(name), "d%06lu", k);
+        ret = b->ops->mkdir(b, b->top, name, &b->dirs[k]);
+        if (ret) {
+            fprintf(stderr, "Creating %s: %s\n", name, strerror(-ret));
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+static int bench_create(struct bench *b)
+{
+    uint64_t i, t, total = 0;
+    char name[32];
+    uint32_t j;
+    int ret;
+
+    for (j = 0; j < b->locations; j++) {
+        ret = bench_set_location(b, j);
+        if (ret) {
+            return ret;
+        }
+
+        for (i = b->first[j]; i < b->first[j] + b->count[j]; i++) {
+            file_name(name, sizeof(name), i);
+            t = now_ns();
+            ret = b->ops->create(b, b->dirs[i % b->nr_dirs], name);
+            b->lat[i] = now_ns() - t;
+            total += b->lat[i];
+            if (ret) {
+                fprintf(stderr, "Creating %s: %s\n", name, strerror(-ret));
+                return ret;
+            }
+        }
+    }
+
+    report(b, "create", NULL, 0, b->files, 0, total, b->lat);
+    return 0;
+}
+
+/*
+ * Looks up random names, each location getting its share of the lookups.
+ * hidden picks names created anywhere but the current location, which
+ * have to be hidden.
+ */
+static int bench_lookup(struct bench *b, int hidden)
+{
+    uint64_t i, q, n = 0, t, total = 0;
+    char name[32];
+    uint32_t j;
+    int ret;
+
+    for (j = 0; j < b->locations; j++) {
+        if (b->count[j] == 0 || (hidden && b->count[j] == b->files)) {
+            continue;
+        }
+
+        ret = bench_set_location(b, j);
+        if (ret) {
+            return ret;
+        }
+
+        q = b->lookups * b->count[j] / b->files;
+        for (q = q ? q : 1; q > 0 && n < b->lookups; q--) {
+            if (hidden) {
+                do {
+                    i = bench_random(b, b->files);
+                } while (i >= b->first[j] && i < b->first[j] + b->count[j]);
+            } else {
+                i = b->first[j] + bench_random(b, b->count[j]);
+            }
+
+            file_name(name, sizeof(name), i);
+            t = now_ns();
+            ret = b->ops->lookup(b, b->dirs[i % b->nr_dirs], name);
+            b->lat[n] = now_ns() - t;
+            total += b->lat[n++];
+
+            if (hidden ? ret != -ENOENT : ret != 0) {
+                fprintf(stderr, "Looking up %s at bench-%u: %s\n", name, j,
+                        ret ? strerror(-ret) : "visible");
+                return ret ? ret : -EIO;
+            }
+        }
+    }
+
+    report(b, hidden ? "lookup_hidden" : "lookup", NULL, 0, n, 0, total,
+           b->lat);
+    return 0;
+}
+
+/* Lists every directory at the current location */
+static int64_t list_all(struct bench *b)
+{
+    int64_t n, total = 0;
+    uint64_t k;
+
+    for (k = 0; k < b->nr_dirs; k++) {
+        n = b->ops->list(b, b->dirs[k]);
+        if (n < 0) {
+            return n;
+        }
+        total += n;
+    }
+
+    return total;
+}
+
+static int bench_readdir(struct bench *b)
+{
+    uint64_t t, total;
+    char name[32];
+    int64_t n;
+    uint32_t j, r;
+    int ret;
+
+    for (j = 0; j < b->locations; j++) {
+        ret = bench_set_location(b, j);
+        if (ret) {
+            return ret;
+        }
+
+        total = 0;
+        for (r = 0; r < b->reps; r++) {
+            t = now_ns();
+            n = list_all(b);
+            b->lat[r] = now_ns() - t;
+            total += b->lat[r];
+
+            if (n < 0) {
+                fprintf(stderr, "Listing at bench-%u: %s\n", j,
+                        strerror(-n));
+                return n;
+            }
+            if ((uint64_t)n != b->count[j]) {
+                fprintf(stderr, "Listing at bench-%u found %ld of %lu "
+                        "files\n", j, n, b->count[j]);
+                return -EIO;
+            }
+        }
+
+        location_name(name, sizeof(name), j);
+        report(b, "readdir", name, (double)b->count[j] / b->files, b->reps,
+               0, total, b->lat);
+    }
+
+    return 0;
+}
+
+/* A location change and the listing a user would do right after it */
+static int bench_switch_list(struct bench *b)
+{
+    uint64_t r, t, total = 0;
+    uint64_t ops = (uint64_t)b->reps * b->locations;
+    int64_t n;
+    int ret;
+
+    for (r = 0; r < ops; r++) {
+        t = now_ns();
+        ret = bench_set_location(b, r % b->locations);
+        n = ret ? ret : list_all(b);
+        b->lat[r] = now_ns() - t;
+        total += b->lat[r];
+
+        if (n < 0) {
+            return n;
+        }
+    }
+
+    report(b, "switch_list", NULL, 0, ops, 0, total, b->lat);
+    return 0;
+}
+
+/*
+ * One pass over the file in blocks of block bytes, in order or at
+ * random block aligned offsets. The final sync counts towards the total
+ * time of writes, so data still sitting in a cache is not counted as
+ * written.
+ */
+static int bench_io(struct bench *b, uint64_t file, const char *name,
+                    int write, int random, uint64_t block, char *buf)
+{
+    uint64_t blocks = b->io_size / block;
+    uint64_t ops = blocks;
+    uint64_t i, off, t, start, end;
+    ssize_t n;
+    int ret;
+
+    if (random && ops > BENCH_MAX_RANDOM_OPS) {
+        ops = BENCH_MAX_RANDOM_OPS;
+    }
+
+    start = now_ns();
+    for (i = 0; i < ops; i++) {
+        off = (random ? bench_random(b, blocks) : i) * block;
+
+        t = now_ns();
+        n = write ? b->ops->pwrite(b, file, buf, block, off)
+                  : b->ops->pread(b, file, buf, block, off);
+        b->lat[i] = now_ns() - t;
+
+        if (n != (ssize_t)block) {
+            fprintf(stderr, "%s at %lu: %s\n", name, off,
+                    n < 0 ? strerror(-n) : "short transfer");
+            return n < 0 ? n : -EIO;
+        }
+    }
+
+    end = now_ns();
+
+    ret = b->ops->sync(b, file);
+    if (ret) {
+        fprintf(stderr, "Syncing: %s\n", strerror(-ret));
+        return ret;
+    }
+    if (write) {
+        end = now_ns();
+    }
+
+    report(b, name, NULL, 0, ops, ops * block, end - start, b->lat);
+    return 0;
+}
+
+static int bench_rw(struct bench *b)
+{
+    uint64_t file, i;
+    char *buf;
+    int ret;
+
+    buf = malloc(b->seq_block > b->rand_block ? b->seq_block : b->rand_block);
+    if (!buf) {
+        return -ENOMEM;
+    }
+    for (i = 0; i < b->seq_block || i < b->rand_block; i++) {
+        buf[i] = i * 31;
+    }
+
+    ret = bench_set_location(b, 0);
+    if (!ret) {
+        ret = b->ops->open(b, b->top, "io", &file);
+        if (ret) {
+            fprintf(stderr, "Creating io: %s\n", strerror(-ret));
+        }
+    }
+    if (ret) {
+        free(buf);
+        return ret;
+    }
+
+    ret = bench_io(b, file, "seq_write", 1, 0, b->seq_block, buf);
+    if (!ret) {
+        ret = bench_io(b, file, "seq_read", 0, 0, b->seq_block, buf);
+    }
+    if (!ret) {
+        ret = bench_io(b, file, "rand_write", 1, 1, b->rand_block, buf);
+    }
+    if (!ret) {
+        ret = bench_io(b, file, "rand_read", 0, 1, b->rand_block, buf);
+    }
+
+    b->ops->close(b, file);
+    free(buf);
+    return ret;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s (-m <mountpoint> | -i <image>) [-n files] "
+            "[-L locations]\n"
+            "          [-f files per directory] [-q lookups] [-r repeats] "
+            "[-s file MiB]\n"
+            "          [-b sequential KiB] [-k random KiB] [-j]\n",
+            prog);
+}
+
+/* Parses a positive count */
+static int parse_count(const char *arg, uint64_t *out)
+{
+    char *end;
+
+    *out = strtoull(arg, &end, 10);
+    if (end == arg || *end || *out == 0) {
+        fprintf(stderr, "Bad count: %s\n", arg);
+        return -1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct bench b = {
+        .proc_fd = -1,
+        .files = 10000,
+        .locations = 4,
+        .fanout = 1000,
+        .lookups = 10000,
+        .reps = 10,
+        .io_size = 64 << 20,
+        .seq_block = 1 << 20,
+        .rand_block = 4 << 10,
+        .rng = 88172645463325252ULL,
+    };
+    const char *mountpoint = NULL;
+    const char *image = NULL;
+    uint64_t value, max_ops;
+    int opt, fd, ret;
+
+    while ((opt = getopt(argc, argv, "m:i:n:L:f:q:r:s:b:k:j")) != -1) {
+        value = 0;
+        if (opt != 'm' && opt != 'i' && opt != 'j'
+                && parse_count(optarg, &value)) {
+            return -1;
+        }
+
+        switch (opt) {
+        case 'm':
+            mountpoint = optarg;
+            break;
+        case 'i':
+            image = optarg;
+            break;
+        case 'n':
+            b.files = value;
+            break;
+        case 'L':
+            b.locations = value < UINT32_MAX ? value : UINT32_MAX;
+            break;
+        case 'f':
+            b.fanout = value;
+            break;
+        case 'q':
+            b.lookups = value;
+            break;
+        case 'r':
+            b.reps = value < UINT32_MAX ? value : UINT32_MAX;
+            break;
+        case 's':
+            b.io_size = value << 20;
+            break;
+        case 'b':
+            b.seq_block = value << 10;
+            break;
+        case 'k':
+            b.rand_block = value << 10;
+            break;
+        case 'j':
+            b.json = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (optind != argc || !mountpoint == !image
+            || b.seq_block > b.io_size || b.rand_block > b.io_size) {
+        usage(argv[0]);
+        return -1;
+    }
+
+    if (mountpoint) {
+        b.ops = &mount_ops;
+        b.proc_fd = open(BENCH_PROC_LOCATION, O_WRONLY);
+        fd = open(mountpoint, O_RDONLY | O_DIRECTORY);
+        if (b.proc_fd == -1 || fd == -1) {
+            perror(b.proc_fd == -1 ? BENCH_PROC_LOCATION : mountpoint);
+            return -1;
+        }
+        b.top = fd;
+    } else {
+        b.ops = &image_ops;
+        ret = locfs_fs_open(image, 0, &b.fs);
+        if (ret) {
+            fprintf(stderr, "Opening %s: %s\n", image, strerror(-ret));
+            return -1;
+        }
+        b.top = LOCFS_ROOTDIR_INODE_NO;
+    }
+
+    // One latency slot per operation of the longest benchmark
+    max_ops = b.files;
+    if (max_ops < b.lookups) {
+        max_ops = b.lookups;
+    }
+    if (max_ops < (uint64_t)b.reps * b.locations) {
+        max_ops = (uint64_t)b.reps * b.locations;
+    }
+    if (max_ops < b.io_size / b.rand_block) {
+        max_ops = b.io_size / b.rand_block;
+    }
+    b.lat = malloc(max_ops * sizeof(*b.lat));
+    if (!b.lat) {
+        perror("malloc");
+        return -1;
+    }
+
+    if (!b.json) {
+        printf("%-14s %-12s %7s %9s %10s %11s %9s %10s %10s\n",
+               "bench", "location", "select", "ops", "seconds", "ops/s",
+               "MiB/s", "p50 us", "p99 us");
+    }
+
+    ret = bench_plan(&b);
+    if (!ret) {
+        ret = bench_setup(&b);
+    }
+    if (!ret) {
+        ret = bench_create(&b);
+    }
+    if (!ret) {
+        ret = bench_lookup(&b, 0);
+    }
+    if (!ret && b.locations > 1) {
+        ret = bench_lookup(&b, 1);
+    }
+    if (!ret) {
+        ret = bench_readdir(&b);
+    }
+    if (!ret && b.locations > 1) {
+        ret = bench_switch_list(&b);
+    }
+    if (!ret) {
+        ret = bench_rw(&b);
+    }
+
+    if (b.fs && locfs_fs_close(b.fs) && !ret) {
+        ret = -EIO;
+    }
+
+    return ret ? -1 : 0;
+}
@@ -0,0 +1,197 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+
+#include "../include/locfs.h"
+#include "../include/locfs_feed.h"
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-d device] [-r fixes per second] [-b batch]\n"
+            "       %*s [-m ring bytes] [-l] <track file>\n"
+            "\n"
+            "Each line of the track file is \"latitude longitude [altitude\n"
+            "[timestamp]]\" in degrees, metres and seconds since the epoch.\n"
+            "-r 0 replays as fast as possible, -b writes that many fixes per\n"
+            "write(), -m publishes them through a ring of that size instead,\n"
+            "-l replays the track until interrupted.\n",
+            prog, (int)strlen(prog), "");
+}
+
+/* Reads the track into an array of fixes */
+static struct locfs_fix *load_track(const char *path, size_t *out_count)
+{
+    struct locfs_fix *fixes = NULL, *grown;
+    size_t count = 0, cap = 0;
+    unsigned long long ts;
+    double lat, lon, alt;
+    char line[256];
+    FILE *f;
+    int n;
+
+    f = fopen(path, "r");
+    if (!f) {
+        perror("Error opening the track");
+        return NULL;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        if (line[0] == '#' || line[0] == '\n') {
+            continue;
+        }
+
+        n = sscanf(line, "%lf %lf %lf %llu", &lat, &lon, &alt, &ts);
+        if (n < 2 || lat < -90 || lat > 90 || lon < -180 || lon > 180) {
+            fprintf(stderr, "Bad fix: %s", line);
+            continue;
+        }
+
+        if (count == cap) {
+            cap = cap ? cap * 2 : 1024;
+            grown = realloc(fixes, cap * sizeof(*fixes));
+            if (!grown) {
+                free(fixes);
+                fclose(f);
+                return NULL;
+            }
+            fixes = grown;
+        }
+
+        memset(&fixes[count], 0, sizeof(fixes[count]));
+        fixes[count].latitude = (int32_t)lround(lat * LOCFS_COORD_SCALE);
+        fixes[count].longitude = (int32_t)lround(lon * LOCFS_COORD_SCALE);
+        fixes[count].altitude = n > 2 ? (int32_t)lround(alt * 1000)
+                                      : LOCFS_COORD_NONE;
+        fixes[count].timestamp = n > 3 ? ts : 0;
+        count++;
+    }
+
+    fclose(f);
+    *out_count = count;
+    return fixes;
+}
+
+/* Sleeps until the deadline, which then moves on by period nanoseconds */
+static void pace(struct timespec *deadline, long period)
+{
+    if (period == 0) {
+        return;
+    }
+
+    deadline->tv_nsec += period;
+    while (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_nsec -= 1000000000L;
+        deadline->tv_sec++;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, NULL);
+}
+
+/*
+ * Feeds a recorded GPS track to the locfs fix feed, either with batched
+ * writes or through the shared ring.
+ */
+int main(int argc, char *argv[])
+{
+    const char *device = LOCFS_FEED_DEVICE;
+    struct locfs_feed_ring *ring = NULL;
+    struct locfs_fix *fixes;
+    struct timespec deadline;
+    size_t count, i, batch = 1, ring_bytes = 0, n;
+    double rate = 10;
+    long period;
+    int loop = 0;
+    int fd, opt;
+
+    while ((opt = getopt(argc, argv, "d:r:b:m:l")) != -1) {
+        switch (opt) {
+        case 'd':
+            device = optarg;
+            break;
+        case 'r':
+            rate = strtod(optarg, NULL);
+            break;
+        case 'b':
+            batch = strtoul(optarg, NULL, 10);
+            break;
+        case 'm':
+            ring_bytes = strtoul(optarg, NULL, 0);
+            break;
+        case 'l':
+            loop = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if (optind != argc - 1 || batch == 0 || rate < 0) {
+        usage(argv[0]);
+        return -1;
+    }
+
+    fixes = load_track(argv[optind], &count);
+    if (!fixes || count == 0) {
+        fprintf(stderr, "No fixes to replay\n");
+        free(fixes);
+        return -1;
+    }
+
+    fd = open(device, O_WRONLY);
+    if (fd == -1) {
+        perror("Error opening the feed device");
+        free(fixes);
+        return -1;
+    }
+
+    if (ring_bytes) {
+        ring = mmap(NULL, ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    fd, 0);
+        if (ring == MAP_FAILED) {
+            perror("Error mapping the feed ring");
+            close(fd);
+            free(fixes);
+            return -1;
+        }
+        // One fix at a time, the ring is what keeps it cheap
+        batch = 1;
+    }
+
+    period = rate > 0 ? (long)(1e9 / rate) * (long)batch : 0;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+    do {
+        for (i = 0; i < count; i += n) {
+            n = count - i < batch ? count - i : batch;
+
+            if (ring) {
+                ring->fixes[ring->head % ring->size] = fixes[i];
+                __atomic_store_n(&ring->head, ring->head + 1,
+                                 __ATOMIC_RELEASE);
+            } else if (write(fd, &fixes[i], n * sizeof(*fixes))
+                           != (ssize_t)(n * sizeof(*fixes))) {
+                perror("Error feeding fixes");
+                close(fd);
+                free(fixes);
+                return -1;
+            }
+
+            pace(&deadline, period);
+        }
+    } while (loop);
+
+    if (ring) {
+        munmap(ring, ring_bytes);
+    }
+    close(fd);
+    free(fixes);
+    return 0;
+}
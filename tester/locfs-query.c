@@ -0,0 +1,114 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "../include/locfs.h"
+#include "../include/locfs_ioctl.h"
+
+#define LOCFS_QUERY_PAGE 1024
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s <path on locfs> bbox <min lat> <min lon> <max lat> <max lon>\n"
+            "       %s <path on locfs> radius <lat> <lon> <metres>\n",
+            prog, prog);
+}
+
+/* Converts decimal degrees to the fixed point units of locfs.h */
+static int parse_degrees(const char *arg, double limit, int32_t *out)
+{
+    char *end;
+    double deg = strtod(arg, &end);
+
+    if (end == arg || *end || deg < -limit || deg > limit) {
+        fprintf(stderr, "Bad coordinate: %s\n", arg);
+        return -1;
+    }
+
+    *out = (int32_t)lround(deg * LOCFS_COORD_SCALE);
+    return 0;
+}
+
+/*
+ * Lists the inodes of a locfs mount inside a bounding box or a circle,
+ * one "inode latitude longitude" line each.
+ */
+int main(int argc, char *argv[])
+{
+    struct locfs_spatial_query query;
+    struct locfs_spatial_hit *hits;
+    uint64_t found = 0;
+    uint32_t i;
+    int fd;
+
+    if (argc < 3) {
+        usage(argv[0]);
+        return -1;
+    }
+
+    memset(&query, 0, sizeof(query));
+    if (strcmp(argv[2], "bbox") == 0 && argc == 7) {
+        query.type = LOCFS_QUERY_BBOX;
+        if (parse_degrees(argv[3], 90, &query.min_latitude)
+                || parse_degrees(argv[4], 180, &query.min_longitude)
+                || parse_degrees(argv[5], 90, &query.max_latitude)
+                || parse_degrees(argv[6], 180, &query.max_longitude)) {
+            return -1;
+        }
+    } else if (strcmp(argv[2], "radius") == 0 && argc == 6) {
+        query.type = LOCFS_QUERY_RADIUS;
+        if (parse_degrees(argv[3], 90, &query.latitude)
+                || parse_degrees(argv[4], 180, &query.longitude)) {
+            return -1;
+        }
+        query.radius = strtoul(argv[5], NULL, 10);
+    } else {
+        usage(argv[0]);
+        return -1;
+    }
+
+    fd = open(argv[1], O_RDONLY);
+    if (fd == -1) {
+        perror("Error opening the path");
+        return -1;
+    }
+
+    hits = calloc(LOCFS_QUERY_PAGE, sizeof(*hits));
+    if (!hits) {
+        close(fd);
+        return -1;
+    }
+
+    // Read the matches a page at a time
+    do {
+        query.skip = found;
+        query.hits = (uintptr_t)hits;
+        query.count = LOCFS_QUERY_PAGE;
+        if (ioctl(fd, LOCFS_IOC_SPATIAL_QUERY, &query) == -1) {
+            perror("Spatial query failed");
+            free(hits);
+            close(fd);
+            return -1;
+        }
+
+        for (i = 0; i < query.count; i++) {
+            printf("%llu %.7f %.7f\n",
+                   (unsigned long long)hits[i].inode_no,
+                   (double)hits[i].latitude / LOCFS_COORD_SCALE,
+                   (double)hits[i].longitude / LOCFS_COORD_SCALE);
+        }
+        found += query.count;
+    } while (query.more);
+
+    free(hits);
+    close(fd);
+    return 0;
+}
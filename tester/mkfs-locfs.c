@@ -1,115 +1,1510 @@
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
+#include <time.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
 
 #include "../include/locfs.h"
 
 #define LOCFS_DEFAULT_BLOCKSIZE 4096
-#define LOCFS_DEFAULT_INODE_TABLE_SIZE 1024
-#define LOCFS_DEFAULT_DATA_BLOCK_TABLE_SIZE 1024
+#define LOCFS_MIN_BLOCKSIZE 1024
+#define LOCFS_MAX_BLOCKSIZE 65536
+/* Bytes of device per inode, as with mke2fs -i */
+#define LOCFS_DEFAULT_INODE_RATIO 16384
+/* Leaves room for files of up to 120 bytes in the inode */
+#define LOCFS_DEFAULT_INODE_SIZE 256
+/* The journal gets 1/1024th of the device within these bounds */
+#define LOCFS_MIN_JOURNAL_SIZE 64
+#define LOCFS_MAX_JOURNAL_SIZE 32768
+/* Room for the root directory and then some */
+#define LOCFS_MIN_DATA_BLOCKS 16
+/* The data block bitmap has room for the image to grow this many times */
+#define LOCFS_DEFAULT_GROWTH 16
+
+/* Zeroes are written in chunks of this size when nothing faster works */
+#define LOCFS_ZERO_CHUNK (1 << 20)
 
 static const uint64_t LOCFS_ROOTDIR_DATA_BLOCK_NO_OFFSET = 0;
+static const uint64_t LOCFS_ROOTDIR_LEAF_BLOCK_NO_OFFSET = 1;
+static const uint64_t LOCFS_ROOTDIR_INDEX_BLOCK_NO_OFFSET = 2;
+static const uint64_t LOCFS_LOCATION_TABLE_BLOCK_NO_OFFSET = 3;
 
-int main(int argc, char *argv[]) {
+/* Blocks written by mkfs, in the order they sit on the device */
+enum {
+    BLK_SUPER,
+    BLK_INODE_BITMAP,
+    BLK_DATA_BITMAP,
+    BLK_INODE_TABLE,
+    BLK_JOURNAL,
+    BLK_ROOTDIR,
+    BLK_ROOTDIR_LEAF,
+    BLK_ROOTDIR_INDEX,
+    BLK_LOCATION_TABLE,
+    BLK_NR,
+};
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-b blocksize] [-i bytes per inode] [-I inode size]\n"
+            "       %*s [-N inodes] [-J journal blocks] [-G max blocks] [-d]\n"
+            "       %*s [-p spec] <device|image> [blocks]\n"
+            "\n"
+            "The layout is sized from the device, or from blocks when given,\n"
+            "an image file is grown to that size. The blocksize is a power of\n"
+            "two from %d to %d, -d discards the data region as well.\n"
+            "\n"
+            "resize.locfs can later grow the image up to max blocks, %d times\n"
+            "its size by default.\n"
+            "\n"
+            "The inode size is a power of two from %d to the blocksize, %d\n"
+            "by default. Files small enough to fit in the space past the first\n"
+            "%d bytes of an inode are kept there.\n"
+            "\n"
+            "-p fills the new file system with generated files, spec being\n"
+            "files=N[,fanout=N][,size=S|A-B|~M][,locations=N]\n"
+            "[,skew=uniform|zipf][,layout=split|mixed][,coords=0|1][,seed=N]\n",
+            prog, (int)strlen(prog), "", (int)strlen(prog), "",
+            LOCFS_MIN_BLOCKSIZE, LOCFS_MAX_BLOCKSIZE, LOCFS_DEFAULT_GROWTH,
+            LOCFS_INODE_SIZE, LOCFS_DEFAULT_INODE_SIZE, LOCFS_INODE_SIZE);
+}
+
+/* Parses a count with an optional K, M, G or T suffix */
+static int parse_size(const char *s, uint64_t *out)
+{
+    unsigned long long value;
+    char *end;
+
+    errno = 0;
+    value = strtoull(s, &end, 0);
+    if (errno || end == s) {
+        return -1;
+    }
+
+    switch (*end) {
+    case 'T': case 't':
+        value <<= 10;
+        /* fall through */
+    case 'G': case 'g':
+        value <<= 10;
+        /* fall through */
+    case 'M': case 'm':
+        value <<= 10;
+        /* fall through */
+    case 'K': case 'k':
+        value <<= 10;
+        end++;
+        break;
+    }
+    if (*end) {
+        return -1;
+    }
+
+    *out = value;
+    return 0;
+}
+
+/*
+ * Zeroes len bytes at off. Block devices are asked to zero the range
+ * themselves, files get a hole punched, and only when neither works are
+ * zeroes actually written.
+ */
+static int zero_range(int fd, int blkdev, uint64_t off, uint64_t len)
+{
+    uint64_t range[2] = { off, len };
+    static char *zeroes;
+    size_t n;
+
+    if (len == 0) {
+        return 0;
+    }
+
+    if (blkdev) {
+        if (ioctl(fd, BLKZEROOUT, range) == 0) {
+            return 0;
+        }
+    } else if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                         off, len) == 0) {
+        return 0;
+    }
+
+    if (!zeroes) {
+        zeroes = calloc(1, LOCFS_ZERO_CHUNK);
+        if (!zeroes) {
+            return -1;
+        }
+    }
+
+    while (len) {
+        n = len < LOCFS_ZERO_CHUNK ? len : LOCFS_ZERO_CHUNK;
+        if (pwrite(fd, zeroes, n, off) != (ssize_t)n) {
+            return -1;
+        }
+        off += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/* Drops the contents of a range that does not need to read back as zero */
+static void discard_range(int fd, int blkdev, uint64_t off, uint64_t len)
+{
+    uint64_t range[2] = { off, len };
+
+    if (blkdev) {
+        ioctl(fd, BLKDISCARD, range);
+    } else {
+        fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len);
+    }
+}
+
+/*
+ * Writes the blocks, sorted by blockno, with one pwritev() per run of
+ * adjacent blocks
+ */
+static int write_blocks(int fd, uint64_t blocksize, char *blocks,
+                        const uint64_t *blockno, int count)
+{
+    struct iovec iov[BLK_NR];
+    int start, n;
+
+    for (start = 0; start < count; start += n) {
+        for (n = 0; start + n < count; n++) {
+            if (n && blockno[start + n] != blockno[start] + n) {
+                break;
+            }
+            iov[n].iov_base = blocks + (start + n) * blocksize;
+            iov[n].iov_len = blocksize;
+        }
+
+        if (pwritev(fd, iov, n, blockno[start] * blocksize)
+                != (ssize_t)(n * blocksize)) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Populating a new image
+ *
+ * -p writes a generated tree of files straight into the image instead of
+ * leaving the root empty. The spec is a comma separated list of:
+ *
+ *   files=N            regular files to create, required
+ *   fanout=N           entries per directory, deeper trees below that
+ *   size=S | A-B | ~M  file size, fixed, uniform from A to B, or
+ *                      exponential with mean M, with K, M, G suffixes
+ *   locations=N        locations the files are spread over
+ *   skew=uniform|zipf  how the files are spread over the locations
+ *   layout=split|mixed split gives each location a directory of its own
+ *                      under the root, mixed tags every file and directory
+ *                      with a location drawn on its own
+ *   coords=0|1         tag inodes with a GPS fix near their location
+ *   seed=N             seed of the generator, same seed same image
+ *
+ * Everything is laid out front to back: a directory's children are
+ * written before it, inodes are numbered in the order they are written,
+ * so the data region and the inode table are each written sequentially
+ * in large chunks.
+ */
+
+/* Bytes buffered before a sequential write */
+#define POPULATE_CHUNK (8 << 20)
+/* Coordinates of a location's inodes scatter this far around its centre */
+#define POPULATE_SCATTER (LOCFS_COORD_SCALE / 20)
+/* GPS timestamps count up from here, one second per inode */
+#define POPULATE_EPOCH 1500000000ULL
+
+struct populate_spec {
+    uint64_t files;
+    uint64_t fanout;
+    uint64_t size_min;
+    uint64_t size_max;
+    uint64_t size_mean;     /* exponential sizes when not 0 */
+    uint64_t locations;
+    int zipf;
+    int split;
+    int coords;
+    uint64_t seed;
+};
+
+/* A child of the directory being put together */
+struct populate_child {
+    uint64_t inode_no;
+    uint32_t location_id;
+    uint32_t hash;
+    char name[24];
+};
+
+struct populate_spatial {
+    uint32_t key;           /* grid slots of each level, root first */
+    int32_t latitude;
+    int32_t longitude;
+    uint64_t inode_no;
+};
+
+struct populate {
     int fd;
-    ssize_t ret;   
+    struct locfs_super_block *sb;
+    uint64_t blocksize;
+    struct populate_spec spec;
+    uint64_t rng;
+
+    /* Cumulative probability of each location, and where it is */
+    double *location_cdf;
+    int32_t *center_latitude;
+    int32_t *center_longitude;
+
+    /* Data blocks, buffered from block data_first on */
+    char *data;
+    uint64_t data_first;
+    uint64_t data_used;
+    uint64_t data_chunk;
+    uint64_t data_end;
+
+    /* Inode table blocks, buffered from inode itable_first on */
+    char *itable;
+    uint64_t itable_first;
+    uint64_t next_inode_no;
+    uint64_t itable_chunk;
+
+    struct locfs_inode root;
+
+    struct populate_spatial *spatial;
+    uint64_t nr_spatial;
+
+    uint64_t dirs;
+    uint64_t bytes;
+    char *pattern;
+};
+
+/* xorshift64* */
+static uint64_t populate_random(struct populate *p)
+{
+    p->rng ^= p->rng >> 12;
+    p->rng ^= p->rng << 25;
+    p->rng ^= p->rng >> 27;
+    return p->rng * 2685821657736338717ULL;
+}
+
+/* Uniform in [0, 1) */
+static double populate_uniform(struct populate *p)
+{
+    return (populate_random(p) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int parse_spec(char *s, struct populate_spec *spec)
+{
+    char *opt, *value, *dash;
+
+    memset(spec, 0, sizeof(*spec));
+    spec->fanout = 256;
+    spec->locations = 1;
+    spec->split = 1;
+    spec->coords = 1;
+    spec->seed = 1;
+
+    while ((opt = strsep(&s, ",")) != NULL) {
+        value = strchr(opt, '=');
+        if (!value) {
+            return -1;
+        }
+        *value++ = '\0';
+
+        if (strcmp(opt, "files") == 0) {
+            if (parse_size(value, &spec->files)) {
+                return -1;
+            }
+        } else if (strcmp(opt, "fanout") == 0) {
+            if (parse_size(value, &spec->fanout) || spec->fanout < 2) {
+                return -1;
+            }
+        } else if (strcmp(opt, "size") == 0) {
+            dash = strchr(value, '-');
+            if (*value == '~') {
+                if (parse_size(value + 1, &spec->size_mean)) {
+                    return -1;
+                }
+            } else if (dash) {
+                *dash = '\0';
+                if (parse_size(value, &spec->size_min)
+                        || parse_size(dash + 1, &spec->size_max)
+                        || spec->size_min > spec->size_max) {
+                    return -1;
+                }
+            } else {
+                if (parse_size(value, &spec->size_min)) {
+                    return -1;
+                }
+                spec->size_max = spec->size_min;
+            }
+        } else if (strcmp(opt, "locations") == 0) {
+            if (parse_size(value, &spec->locations) || spec->locations == 0
+                    || spec->locations >= UINT32_MAX) {
+                return -1;
+            }
+        } else if (strcmp(opt, "skew") == 0) {
+            if (strcmp(value, "zipf") && strcmp(value, "uniform")) {
+                return -1;
+            }
+            spec->zipf = strcmp(value, "zipf") == 0;
+        } else if (strcmp(opt, "layout") == 0) {
+            if (strcmp(value, "split") && strcmp(value, "mixed")) {
+                return -1;
+            }
+            spec->split = strcmp(value, "split") == 0;
+        } else if (strcmp(opt, "coords") == 0) {
+            spec->coords = strcmp(value, "0") != 0;
+        } else if (strcmp(opt, "seed") == 0) {
+            if (parse_size(value, &spec->seed)) {
+                return -1;
+            }
+        } else {
+            return -1;
+        }
+    }
+
+    return spec->files ? 0 : -1;
+}
+
+static int populate_flush_data(struct populate *p)
+{
+    uint64_t len = p->data_used * p->blocksize;
+
+    if (len && pwrite(p->fd, p->data, len, p->data_first * p->blocksize)
+                   != (ssize_t)len) {
+        return -1;
+    }
+
+    p->data_first += p->data_used;
+    p->data_used = 0;
+    return 0;
+}
+
+/*
+ * Hands out the next data block, zeroed, and its block number. The
+ * pointer stays valid until the next call.
+ */
+static void *populate_block(struct populate *p, uint64_t *out_block_no)
+{
+    void *block;
+
+    if (p->data_first + p->data_used >= p->data_end) {
+        errno = ENOSPC;
+        return NULL;
+    }
+
+    if (p->data_used == p->data_chunk && populate_flush_data(p)) {
+        return NULL;
+    }
+
+    block = p->data + p->data_used * p->blocksize;
+    memset(block, 0, p->blocksize);
+    *out_block_no = p->data_first + p->data_used++;
+    return block;
+}
+
+/* Block number the next populate_block() hands out */
+static inline uint64_t populate_next_block(struct populate *p)
+{
+    return p->data_first + p->data_used;
+}
+
+static int populate_flush_itable(struct populate *p)
+{
+    uint64_t ipb = LOCFS_INODES_PER_BLOCK_HSB(p->sb);
+    uint64_t blocks = (p->next_inode_no - p->itable_first + ipb - 1) / ipb;
+
+    if (blocks && pwrite(p->fd, p->itable, blocks * p->blocksize,
+                         (LOCFS_INODE_TABLE_START_BLOCK_NO_HSB(p->sb)
+                          + p->itable_first / ipb) * p->blocksize)
+                      != (ssize_t)(blocks * p->blocksize)) {
+        return -1;
+    }
+
+    p->itable_first += blocks * ipb;
+    memset(p->itable, 0, p->itable_chunk * p->blocksize);
+    return 0;
+}
+
+static uint32_t populate_location(struct populate *p, uint32_t location_id)
+{
+    uint64_t lo = 0, hi = p->spec.locations - 1, mid;
+    double u;
+
+    if (location_id != LOCFS_LOCATION_NONE) {
+        return location_id;
+    }
+
+    u = populate_uniform(p);
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (p->location_cdf[mid] <= u) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo + 1;
+}
+
+/* Tags the inode with a fix near its location and files it spatially */
+static void populate_coords(struct populate *p, struct locfs_inode *li)
+{
+    struct populate_spatial *entry;
+    int64_t latitude, longitude;
+    uint32_t x, y;
+    int level;
+
+    li->timestamp = POPULATE_EPOCH + li->inode_no;
+    if (!p->spec.coords) {
+        li->latitude = LOCFS_COORD_NONE;
+        li->longitude = LOCFS_COORD_NONE;
+        li->altitude = LOCFS_COORD_NONE;
+        return;
+    }
+
+    latitude = p->center_latitude[li->location_id - 1]
+               + (int64_t)(populate_random(p) % (2 * POPULATE_SCATTER))
+               - POPULATE_SCATTER;
+    longitude = p->center_longitude[li->location_id - 1]
+                + (int64_t)(populate_random(p) % (2 * POPULATE_SCATTER))
+                - POPULATE_SCATTER;
+    if (latitude > 90LL * LOCFS_COORD_SCALE) {
+        latitude = 90LL * LOCFS_COORD_SCALE;
+    } else if (latitude < -90LL * LOCFS_COORD_SCALE) {
+        latitude = -90LL * LOCFS_COORD_SCALE;
+    }
+    if (longitude > 180LL * LOCFS_COORD_SCALE) {
+        longitude -= 360LL * LOCFS_COORD_SCALE;
+    } else if (longitude < -180LL * LOCFS_COORD_SCALE) {
+        longitude += 360LL * LOCFS_COORD_SCALE;
+    }
+    li->latitude = latitude;
+    li->longitude = longitude;
+    li->altitude = 0;
+
+    entry = &p->spatial[p->nr_spatial++];
+    entry->latitude = li->latitude;
+    entry->longitude = li->longitude;
+    entry->inode_no = li->inode_no;
+    entry->key = 0;
+    x = locfs_cell_x(li->longitude);
+    y = locfs_cell_y(li->latitude);
+    for (level = 0; level < LOCFS_SPATIAL_LEVELS; level++) {
+        entry->key = entry->key << (2 * LOCFS_SPATIAL_SPLIT_BITS)
+                     | locfs_spatial_slot(x, y, level);
+    }
+}
+
+/*
+ * Numbers the inode, tags it with a fix near its location and queues it
+ * for the inode table, with len bytes of inline data unless data is NULL
+ */
+static int populate_inode(struct populate *p, struct locfs_inode *li,
+                          const void *data, uint64_t len)
+{
+    struct locfs_inode_extra *extra;
+    char *slot;
+    uint64_t ipb = LOCFS_INODES_PER_BLOCK_HSB(p->sb);
+
+    if (p->next_inode_no >= p->sb->inode_table_size) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    if (p->next_inode_no - p->itable_first == p->itable_chunk * ipb
+            && populate_flush_itable(p)) {
+        return -1;
+    }
+
+    li->inode_no = p->next_inode_no++;
+    populate_coords(p, li);
+    slot = p->itable + (li->inode_no - p->itable_first)
+                       * LOCFS_INODE_SIZE_HSB(p->sb);
+    memcpy(slot, li, sizeof(*li));
+    if (data) {
+        extra = (struct locfs_inode_extra *)(slot + LOCFS_INODE_SIZE);
+        extra->flags = LOCFS_INODE_INLINE_DATA;
+        memcpy(extra->inline_data, data, len);
+    }
+    return 0;
+}
+
+static uint64_t populate_size(struct populate *p)
+{
+    if (p->spec.size_mean) {
+        return (uint64_t)(-log(1.0 - populate_uniform(p))
+                          * p->spec.size_mean);
+    }
+
+    return p->spec.size_min
+           + populate_random(p) % (p->spec.size_max - p->spec.size_min + 1);
+}
+
+/* Writes a file of generated size and data, and its inode */
+static int populate_file(struct populate *p, uint32_t location_id,
+                         struct populate_child *child)
+{
+    struct locfs_inode li = {
+        .mode = S_IFREG | 0644,
+    };
+    uint64_t size = populate_size(p);
+    uint64_t blocks, block_no, i, n;
+    char *block;
+
+    li.file_size = size;
+    li.location_id = populate_location(p, location_id);
+
+    // Files that fit are kept in their inode, as when written by the
+    // kernel, the others get one extent and every file at least a block
+    if (size <= LOCFS_INLINE_DATA_MAX_HSB(p->sb)
+            && LOCFS_INLINE_DATA_MAX_HSB(p->sb) > 0) {
+        if (populate_inode(p, &li, p->pattern, size)) {
+            return -1;
+        }
+        goto out;
+    }
+
+    blocks = (size + p->blocksize - 1) / p->blocksize;
+    if (blocks == 0) {
+        blocks = 1;
+    }
+    if (blocks > UINT32_MAX) {
+        errno = EFBIG;
+        return -1;
+    }
+
+    li.extent_count = 1;
+    li.extents[0].ee_len = blocks;
+    li.extents[0].ee_start = populate_next_block(p);
+    for (i = 0; i < blocks; i++) {
+        block = populate_block(p, &block_no);
+        if (!block) {
+            return -1;
+        }
+        n = size - i * p->blocksize;
+        if (n > p->blocksize) {
+            n = p->blocksize;
+        }
+        memcpy(block, p->pattern + (i % 7) * 64, size ? n : 0);
+    }
+
+    if (populate_inode(p, &li, NULL, 0)) {
+        return -1;
+    }
+
+out:
+    p->bytes += size;
+    child->inode_no = li.inode_no;
+    child->location_id = li.location_id;
+    return 0;
+}
+
+static int cmp_child_hash(const void *a, const void *b)
+{
+    const struct populate_child *x = a, *y = b;
+
+    return x->hash < y->hash ? -1 : x->hash > y->hash;
+}
+
+static int cmp_child_location(const void *a, const void *b)
+{
+    const struct populate_child *x = a, *y = b;
+
+    return x->location_id < y->location_id ? -1
+           : x->location_id > y->location_id;
+}
+
+/*
+ * Writes a directory holding children: its hash tree, then the location
+ * lists and the location index, then its inode. The root keeps inode 0,
+ * any other directory is numbered and returned in out.
+ */
+static int populate_write_dir(struct populate *p,
+                              struct populate_child *children, uint64_t m,
+                              uint32_t location_id, int root,
+                              struct populate_child *out)
+{
+    uint64_t records = LOCFS_DIR_RECORDS_PER_BLOCK_HSB(p->sb);
+    uint64_t dx_entries = LOCFS_DX_ENTRIES_PER_BLOCK_HSB(p->sb);
+    uint64_t list_records = LOCFS_LOCLIST_RECORDS_PER_BLOCK_HSB(p->sb);
+    uint64_t index_entries = LOCFS_LOCINDEX_ENTRIES_PER_BLOCK_HSB(p->sb);
+    struct locfs_inode li = {
+        .mode = S_IFDIR | S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH,
+        .extent_count = 1,
+    };
+    struct locfs_dx_node *node;
+    struct locfs_dir_leaf *leaf;
+    struct locfs_loclist_block *list = NULL;
+    struct locfs_locindex_block *index;
+    struct locfs_locindex_entry *entry;
+    uint64_t *leaf_first, nr_leaves, interior, i, j, k, end, block_no;
+    uint64_t groups, lists_start, list_no, index_start, index_blocks;
+    int ret = -1;
+
+    for (i = 0; i < m; i++) {
+        children[i].hash = locfs_name_hash(children[i].name,
+                                           strlen(children[i].name));
+    }
+    qsort(children, m, sizeof(*children), cmp_child_hash);
+
+    // Fill the leaves, never splitting a run of equal hashes
+    leaf_first = malloc((m + 1) * sizeof(*leaf_first));
+    if (!leaf_first) {
+        return -1;
+    }
+    nr_leaves = 0;
+    for (i = 0; i < m || nr_leaves == 0; i = end) {
+        leaf_first[nr_leaves++] = i;
+        end = i + records < m ? i + records : m;
+        while (end < m && end > i && children[end].hash
+                                     == children[end - 1].hash) {
+            end--;
+        }
+        if (end == i && m) {
+            errno = ENOSPC;
+            goto out;
+        }
+    }
+    leaf_first[nr_leaves] = m;
+
+    // One interior level when the root cannot point at every leaf
+    interior = nr_leaves > dx_entries
+               ? (nr_leaves + dx_entries - 1) / dx_entries : 0;
+    if (interior > dx_entries) {
+        errno = EFBIG;
+        goto out;
+    }
 
-    fd = open(argv[1], O_RDWR);
+    li.extents[0].ee_len = 1 + interior + nr_leaves;
+    li.extents[0].ee_start = populate_next_block(p);
+
+    node = populate_block(p, &block_no);
+    if (!node) {
+        goto out;
+    }
+    node->magic = LOCFS_DX_ROOT_MAGIC;
+    node->levels = interior ? 1 : 0;
+    node->count = interior ? interior : nr_leaves;
+    for (i = 0; i < node->count; i++) {
+        k = interior ? i * dx_entries : i;
+        node->entries[i].hash = k ? children[leaf_first[k]].hash : 0;
+        node->entries[i].block = interior ? 1 + i : 1 + k;
+    }
+
+    for (i = 0; i < interior; i++) {
+        node = populate_block(p, &block_no);
+        if (!node) {
+            goto out;
+        }
+        node->magic = LOCFS_DX_NODE_MAGIC;
+        for (k = i * dx_entries; k < nr_leaves && k < (i + 1) * dx_entries;
+             k++) {
+            node->entries[node->count].hash
+                = k ? children[leaf_first[k]].hash : 0;
+            node->entries[node->count++].block = 1 + interior + k;
+        }
+    }
+
+    for (k = 0; k < nr_leaves; k++) {
+        leaf = populate_block(p, &block_no);
+        if (!leaf) {
+            goto out;
+        }
+        leaf->magic = LOCFS_DIR_LEAF_MAGIC;
+        for (i = leaf_first[k]; i < leaf_first[k + 1]; i++) {
+            strcpy(leaf->records[leaf->count].filename, children[i].name);
+            leaf->records[leaf->count++].inode_no = children[i].inode_no;
+        }
+    }
+
+    // Location lists come next, one chain per location, then the index
+    // pointing at them
+    qsort(children, m, sizeof(*children), cmp_child_location);
+    groups = 0;
+    lists_start = populate_next_block(p);
+    for (i = 0; i < m; i = j) {
+        for (j = i; j < m && children[j].location_id
+                             == children[i].location_id; j++) {
+            if ((j - i) % list_records == 0) {
+                list = populate_block(p, &block_no);
+                if (!list) {
+                    goto out;
+                }
+                list->header.magic = LOCFS_LOCLIST_MAGIC;
+                // The chain goes on in the next block
+                if (j + list_records < m && children[j + list_records]
+                        .location_id == children[i].location_id) {
+                    list->header.next_block_no = block_no + 1;
+                }
+            }
+            strcpy(list->records[list->header.count].filename,
+                   children[j].name);
+            list->records[list->header.count++].inode_no
+                = children[j].inode_no;
+        }
+        groups++;
+    }
+
+    index_start = populate_next_block(p);
+    index_blocks = groups ? (groups + index_entries - 1) / index_entries : 1;
+    list_no = lists_start;
+    for (k = 0, i = 0; k < index_blocks; k++) {
+        index = populate_block(p, &block_no);
+        if (!index) {
+            goto out;
+        }
+        index->header.magic = LOCFS_LOCINDEX_MAGIC;
+        if (k + 1 < index_blocks) {
+            index->header.next_block_no = block_no + 1;
+        }
+
+        for (; i < m && index->header.count < index_entries; i = j) {
+            for (j = i; j < m && children[j].location_id
+                                 == children[i].location_id; j++)
+                ;
+            entry = &index->entries[index->header.count++];
+            entry->location_id = children[i].location_id;
+            entry->first_block_no = list_no;
+            list_no += (j - i + list_records - 1) / list_records;
+            entry->last_block_no = list_no - 1;
+        }
+    }
+
+    li.dir_children_count = m;
+    li.dir_index_block_no = index_start;
+    li.location_id = populate_location(p, location_id);
+
+    if (root) {
+        // The root keeps inode 0, written once the table is
+        li.inode_no = LOCFS_ROOTDIR_INODE_NO;
+        li.location_id = 1;
+        li.latitude = LOCFS_COORD_NONE;
+        li.longitude = LOCFS_COORD_NONE;
+        li.altitude = LOCFS_COORD_NONE;
+        p->root = li;
+    } else {
+        if (populate_inode(p, &li, NULL, 0)) {
+            goto out;
+        }
+        out->inode_no = li.inode_no;
+        out->location_id = li.location_id;
+    }
+
+    p->dirs++;
+    ret = 0;
+
+out:
+    free(leaf_first);
+    return ret;
+}
+
+/*
+ * Generates the children of a directory with n files below it: the files
+ * themselves while they fit in fanout, otherwise as few subdirectories as
+ * it takes, each holding an even share
+ */
+static int populate_children(struct populate *p, uint64_t n,
+                             uint32_t location_id,
+                             struct populate_child **out_children,
+                             uint64_t *out_count)
+{
+    struct populate_child *children, *grandchildren;
+    uint64_t per_dir, c, i, share, count;
+    static uint64_t file_no;
+
+    // Files each subdirectory takes so the tree stays balanced
+    for (per_dir = 1; per_dir < n / p->spec.fanout
+                      + (n % p->spec.fanout != 0); ) {
+        per_dir *= p->spec.fanout;
+    }
+    c = n <= p->spec.fanout ? n : (n + per_dir - 1) / per_dir;
+
+    children = calloc(c ? c : 1, sizeof(*children));
+    if (!children) {
+        return -1;
+    }
+
+    for (i = 0; i < c; i++) {
+        if (n <= p->spec.fanout) {
+            snprintf(children[i].name, sizeof(children[i].name), "f%07llu",
+                     (unsigned long long)file_no++);
+            if (populate_file(p, location_id, &children[i])) {
+                free(children);
+                return -1;
+            }
+            continue;
+        }
+
+        share = n / c + (i < n % c);
+        snprintf(children[i].name, sizeof(children[i].name), "d%04llu",
+                 (unsigned long long)i);
+        if (populate_children(p, share, location_id, &grandchildren,
+                              &count)
+                || populate_write_dir(p, grandchildren, count, location_id,
+                                      0, &children[i])) {
+            free(children);
+            return -1;
+        }
+        free(grandchildren);
+    }
+
+    *out_children = children;
+    *out_count = c;
+    return 0;
+}
+
+/* Writes the location table, "Home" is the first of the locations */
+static int populate_location_table(struct populate *p)
+{
+    uint64_t per_block = LOCFS_LOCATIONS_PER_BLOCK_HSB(p->sb);
+    struct locfs_location_block *block = NULL;
+    uint64_t i, block_no;
+
+    p->sb->location_table_block_no = populate_next_block(p);
+    for (i = 0; i < p->spec.locations; i++) {
+        if (i % per_block == 0) {
+            block = populate_block(p, &block_no);
+            if (!block) {
+                return -1;
+            }
+            block->header.magic = LOCFS_LOCTABLE_MAGIC;
+            if (i + per_block < p->spec.locations) {
+                block->header.next_block_no = block_no + 1;
+            }
+        }
+
+        block->entries[block->header.count].id = i + 1;
+        if (i == 0) {
+            strcpy(block->entries[block->header.count].name, "Home");
+        } else {
+            snprintf(block->entries[block->header.count].name,
+                     LOCFS_LOCATION_MAXLEN, "loc-%llu",
+                     (unsigned long long)i);
+        }
+        block->header.count++;
+    }
+
+    return 0;
+}
+
+static int cmp_spatial(const void *a, const void *b)
+{
+    const struct populate_spatial *x = a, *y = b;
+
+    if (x->key != y->key) {
+        return x->key < y->key ? -1 : 1;
+    }
+    return x->inode_no < y->inode_no ? -1 : x->inode_no > y->inode_no;
+}
+
+/*
+ * Writes the spatial index node of level over the sorted entries [lo, hi)
+ * after everything below it, buckets in chains of consecutive blocks
+ */
+static int populate_spatial_node(struct populate *p, int level, uint64_t lo,
+                                 uint64_t hi, uint64_t *out_block_no)
+{
+    uint64_t per_bucket = LOCFS_SPATIAL_ENTRIES_PER_BLOCK_HSB(p->sb);
+    uint64_t children[LOCFS_SPATIAL_SPLIT * LOCFS_SPATIAL_SPLIT] = {0};
+    int shift = (LOCFS_SPATIAL_LEVELS - 1 - level)
+                * 2 * LOCFS_SPATIAL_SPLIT_BITS;
+    struct locfs_spatial_bucket *bucket = NULL;
+    struct locfs_spatial_node *node;
+    uint64_t i, j, k, block_no, count = 0;
+    unsigned int slot;
+
+    for (i = lo; i < hi; i = j) {
+        slot = (p->spatial[i].key >> shift)
+               & (LOCFS_SPATIAL_SPLIT * LOCFS_SPATIAL_SPLIT - 1);
+        for (j = i; j < hi && ((p->spatial[j].key >> shift)
+                               & (LOCFS_SPATIAL_SPLIT * LOCFS_SPATIAL_SPLIT
+                                  - 1)) == slot; j++)
+            ;
+
+        if (level < LOCFS_SPATIAL_LEVELS - 1) {
+            if (populate_spatial_node(p, level + 1, i, j, &children[slot])) {
+                return -1;
+            }
+            count++;
+            continue;
+        }
+
+        children[slot] = populate_next_block(p);
+        for (k = i; k < j; k++) {
+            if ((k - i) % per_bucket == 0) {
+                bucket = populate_block(p, &block_no);
+                if (!bucket) {
+                    return -1;
+                }
+                bucket->header.magic = LOCFS_SPATIAL_BUCKET_MAGIC;
+                if (k + per_bucket < j) {
+                    bucket->header.next_block_no = block_no + 1;
+                }
+            }
+            bucket->entries[bucket->header.count].inode_no
+                = p->spatial[k].inode_no;
+            bucket->entries[bucket->header.count].latitude
+                = p->spatial[k].latitude;
+            bucket->entries[bucket->header.count++].longitude
+                = p->spatial[k].longitude;
+        }
+    }
+
+    node = populate_block(p, out_block_no);
+    if (!node) {
+        return -1;
+    }
+    node->header.magic = LOCFS_SPATIAL_NODE_MAGIC;
+    node->header.count = count;
+    memcpy(node->children, children, sizeof(children));
+    return 0;
+}
+
+/* Writes a bitmap with its first used bits set */
+static int populate_bitmap(struct populate *p, uint64_t start_block,
+                           uint64_t blocks, uint64_t used)
+{
+    uint8_t *bitmap;
+    int ret;
+
+    bitmap = calloc(blocks, p->blocksize);
+    if (!bitmap) {
+        return -1;
+    }
+
+    memset(bitmap, 0xff, used / 8);
+    if (used % 8) {
+        bitmap[used / 8] = (1 << (used % 8)) - 1;
+    }
+
+    ret = pwrite(p->fd, bitmap, blocks * p->blocksize,
+                 start_block * p->blocksize)
+          == (ssize_t)(blocks * p->blocksize) ? 0 : -1;
+    free(bitmap);
+    return ret;
+}
+
+/*
+ * Fills the freshly formatted image described by sb with the tree the
+ * spec asks for and writes the super block back
+ */
+static int populate(int fd, struct locfs_super_block *sb, char *spec_text)
+{
+    struct populate p = {
+        .fd = fd,
+        .sb = sb,
+        .blocksize = sb->blocksize,
+        .next_inode_no = 1,
+    };
+    struct populate_child *children = NULL, *grandchildren;
+    uint64_t i, n, left, count, nodes, per_location;
+    struct timespec start, end;
+    double weight, total, secs;
+    int ret = -1;
+
+    if (parse_spec(spec_text, &p.spec)) {
+        fprintf(stderr, "Bad populate spec\n");
+        errno = EINVAL;
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // A rough count of the directories tells early whether it fits
+    for (nodes = 0, n = p.spec.files; n > 1; n /= p.spec.fanout) {
+        nodes += (n + p.spec.fanout - 1) / p.spec.fanout;
+    }
+    if (p.spec.files + nodes + (p.spec.split ? p.spec.locations : 0)
+            >= sb->inode_table_size) {
+        fprintf(stderr, "%llu inodes are too few for %llu files, use -N\n",
+                (unsigned long long)sb->inode_table_size,
+                (unsigned long long)p.spec.files);
+        errno = ENOSPC;
+        return -1;
+    }
+
+    p.rng = p.spec.seed * 2654435761ULL + 1;
+    p.data_first = LOCFS_DATA_BLOCK_TABLE_START_BLOCK_NO_HSB(sb);
+    p.data_end = p.data_first + sb->data_block_table_size;
+    p.data_chunk = POPULATE_CHUNK / p.blocksize;
+    p.itable_chunk = POPULATE_CHUNK / p.blocksize;
+    p.location_cdf = malloc(p.spec.locations * sizeof(*p.location_cdf));
+    p.center_latitude = malloc(p.spec.locations * sizeof(int32_t));
+    p.center_longitude = malloc(p.spec.locations * sizeof(int32_t));
+    p.spatial = malloc((sb->inode_table_size) * sizeof(*p.spatial));
+    p.pattern = malloc(p.blocksize + 7 * 64);
+    if (posix_memalign((void **)&p.data, p.blocksize,
+                       p.data_chunk * p.blocksize)) {
+        p.data = NULL;
+    }
+    p.itable = calloc(p.itable_chunk, p.blocksize);
+    if (!p.location_cdf || !p.center_latitude || !p.center_longitude
+            || !p.spatial || !p.pattern || !p.data || !p.itable) {
+        goto out;
+    }
+
+    // Where each location is and how likely it is to be picked
+    for (i = 0, total = 0; i < p.spec.locations; i++) {
+        total += p.spec.zipf ? 1.0 / (i + 1) : 1.0;
+    }
+    for (i = 0, weight = 0; i < p.spec.locations; i++) {
+        weight += p.spec.zipf ? 1.0 / (i + 1) : 1.0;
+        p.location_cdf[i] = weight / total;
+        p.center_latitude[i] = (int32_t)(populate_random(&p)
+                                         % (120ULL * LOCFS_COORD_SCALE))
+                               - 60 * LOCFS_COORD_SCALE;
+        p.center_longitude[i] = (int32_t)(populate_random(&p)
+                                          % (360ULL * LOCFS_COORD_SCALE))
+                                - 180 * LOCFS_COORD_SCALE;
+    }
+    for (i = 0; i < p.blocksize + 7 * 64; i++) {
+        p.pattern[i] = populate_random(&p);
+    }
+
+    if (!p.spec.split) {
+        if (populate_children(&p, p.spec.files, LOCFS_LOCATION_NONE,
+                              &children, &count)) {
+            goto out;
+        }
+    } else {
+        // Every location gets its share of the files in a directory of
+        // its own, tagged with it
+        children = calloc(p.spec.locations, sizeof(*children));
+        if (!children) {
+            goto out;
+        }
+        left = p.spec.files;
+        for (i = 0; i < p.spec.locations; i++) {
+            per_location = i + 1 < p.spec.locations
+                           ? (uint64_t)((p.location_cdf[i]
+                                         - (i ? p.location_cdf[i - 1] : 0))
+                                        * p.spec.files + 0.5)
+                           : left;
+            if (per_location > left) {
+                per_location = left;
+            }
+            left -= per_location;
+
+            if (i == 0) {
+                strcpy(children[i].name, "Home");
+            } else {
+                snprintf(children[i].name, sizeof(children[i].name),
+                         "loc-%llu", (unsigned long long)i);
+            }
+            if (populate_children(&p, per_location, i + 1, &grandchildren,
+                                  &count)
+                    || populate_write_dir(&p, grandchildren, count, i + 1, 0,
+                                          &children[i])) {
+                goto out;
+            }
+            free(grandchildren);
+        }
+        count = p.spec.locations;
+    }
+
+    if (populate_write_dir(&p, children, count, 1, 1, NULL)
+            || populate_location_table(&p)) {
+        goto out;
+    }
+
+    if (p.nr_spatial) {
+        qsort(p.spatial, p.nr_spatial, sizeof(*p.spatial), cmp_spatial);
+        if (populate_spatial_node(&p, 0, 0, p.nr_spatial,
+                                  &sb->spatial_root_block_no)) {
+            goto out;
+        }
+    }
+
+    if (populate_flush_data(&p) || populate_flush_itable(&p)
+            || pwrite(fd, &p.root, sizeof(p.root),
+                      LOCFS_INODE_TABLE_START_BLOCK_NO_HSB(sb) * p.blocksize)
+                   != sizeof(p.root)) {
+        goto out;
+    }
+
+    sb->inode_count = p.next_inode_no;
+    sb->data_block_count = p.data_first
+                           - LOCFS_DATA_BLOCK_TABLE_START_BLOCK_NO_HSB(sb);
+    if (populate_bitmap(&p, LOCFS_INODE_BITMAP_START_BLOCK_NO,
+                        LOCFS_INODE_BITMAP_BLOCKS_HSB(sb), sb->inode_count)
+            || populate_bitmap(&p, LOCFS_DATA_BLOCK_BITMAP_START_BLOCK_NO_HSB(sb),
+                               LOCFS_DATA_BLOCK_BITMAP_BLOCKS_HSB(sb),
+                               sb->data_block_count)
+            || pwrite(fd, sb, sizeof(*sb), 0) != sizeof(*sb)) {
+        goto out;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    secs = end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("Populated %llu files in %llu directories at %llu locations, "
+           "%llu MiB of data blocks in %.1f s (%.0f MiB/s)\n",
+           (unsigned long long)p.spec.files, (unsigned long long)p.dirs,
+           (unsigned long long)p.spec.locations,
+           (unsigned long long)(sb->data_block_count * p.blocksize >> 20),
+           secs, secs > 0 ? (sb->data_block_count * p.blocksize >> 20) / secs
+                          : 0);
+    ret = 0;
+
+out:
+    free(children);
+    free(p.location_cdf);
+    free(p.center_latitude);
+    free(p.center_longitude);
+    free(p.spatial);
+    free(p.pattern);
+    free(p.data);
+    free(p.itable);
+    return ret;
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t blocksize = LOCFS_DEFAULT_BLOCKSIZE;
+    uint64_t inode_ratio = LOCFS_DEFAULT_INODE_RATIO;
+    uint64_t inode_size = LOCFS_DEFAULT_INODE_SIZE;
+    uint64_t inodes = 0, journal = 0, total = 0, grow = 0, size;
+    uint64_t blockno[BLK_NR];
+    char *blocks;
+    char *spec = NULL;
+    struct stat st;
+    int discard = 0;
+    int blkdev;
+    int fd, opt;
+
+    while ((opt = getopt(argc, argv, "b:i:I:N:J:G:dp:")) != -1) {
+        switch (opt) {
+        case 'b':
+            if (parse_size(optarg, &blocksize)) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'i':
+            if (parse_size(optarg, &inode_ratio) || inode_ratio == 0) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'I':
+            if (parse_size(optarg, &inode_size)) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'N':
+            if (parse_size(optarg, &inodes)) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'J':
+            if (parse_size(optarg, &journal)) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'G':
+            if (parse_size(optarg, &grow)) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'd':
+            discard = 1;
+            break;
+        case 'p':
+            spec = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if (optind != argc - 1 && optind != argc - 2) {
+        usage(argv[0]);
+        return -1;
+    }
+    if (optind == argc - 2 && parse_size(argv[optind + 1], &total)) {
+        usage(argv[0]);
+        return -1;
+    }
+
+    if (blocksize < LOCFS_MIN_BLOCKSIZE || blocksize > LOCFS_MAX_BLOCKSIZE
+            || (blocksize & (blocksize - 1))) {
+        fprintf(stderr, "Blocksize must be a power of two from %d to %d\n",
+                LOCFS_MIN_BLOCKSIZE, LOCFS_MAX_BLOCKSIZE);
+        return -1;
+    }
+    if (inode_size < LOCFS_INODE_SIZE || inode_size > blocksize
+            || (inode_size & (inode_size - 1))) {
+        fprintf(stderr, "Inode size must be a power of two from %d to the "
+                "blocksize\n", LOCFS_INODE_SIZE);
+        return -1;
+    }
+    if (blocksize > (uint64_t)sysconf(_SC_PAGESIZE)) {
+        fprintf(stderr, "Warning: this kernel cannot mount blocks larger "
+                "than its %ld byte pages\n", sysconf(_SC_PAGESIZE));
+    }
+
+    // A new image is only created when told how large to make it
+    fd = open(argv[optind], total ? O_RDWR | O_CREAT : O_RDWR, 0644);
     if (fd == -1) {
         perror("Error opening the device");
         return -1;
     }
 
-    // construct superblock
+    if (fstat(fd, &st) == -1) {
+        perror("Error looking at the device");
+        close(fd);
+        return -1;
+    }
+    blkdev = S_ISBLK(st.st_mode);
+    size = st.st_size;
+    if (blkdev && ioctl(fd, BLKGETSIZE64, &size) == -1) {
+        perror("Error getting the device size");
+        close(fd);
+        return -1;
+    }
+
+    // An image file is grown, sparsely, to the size asked for
+    if (total == 0) {
+        total = size / blocksize;
+    } else if (total * blocksize > size) {
+        if (blkdev || ftruncate(fd, total * blocksize) == -1) {
+            fprintf(stderr, "%s is smaller than %llu blocks\n",
+                    argv[optind], (unsigned long long)total);
+            close(fd);
+            return -1;
+        }
+    }
+
+    // construct superblock, sized to the device
     struct locfs_super_block locfs_sb = {
         .version = 1,
         .magic = LOCFS_MAGIC,
-        .blocksize = LOCFS_DEFAULT_BLOCKSIZE,
-        .inode_table_size = LOCFS_DEFAULT_INODE_TABLE_SIZE,
-        .inode_count = 2,
-        .data_block_table_size = LOCFS_DEFAULT_DATA_BLOCK_TABLE_SIZE,
-        .data_block_count = 2,
+        .blocksize = blocksize,
+        .inode_count = 1,
+        .data_block_count = 4,
+        .inode_size = inode_size,
     };
 
+    if (inodes == 0) {
+        inodes = total * blocksize / inode_ratio;
+    }
+    // Whole blocks of inodes, and never fewer than one block's worth
+    locfs_sb.inode_table_size
+        = (inodes + LOCFS_INODES_PER_BLOCK_HSB(&locfs_sb) - 1)
+              / LOCFS_INODES_PER_BLOCK_HSB(&locfs_sb)
+              * LOCFS_INODES_PER_BLOCK_HSB(&locfs_sb);
+    if (locfs_sb.inode_table_size == 0) {
+        locfs_sb.inode_table_size = LOCFS_INODES_PER_BLOCK_HSB(&locfs_sb);
+    }
+
+    if (journal == 0) {
+        journal = total / 1024;
+        if (journal < LOCFS_MIN_JOURNAL_SIZE) {
+            journal = LOCFS_MIN_JOURNAL_SIZE;
+        } else if (journal > LOCFS_MAX_JOURNAL_SIZE) {
+            journal = LOCFS_MAX_JOURNAL_SIZE;
+        }
+    } else if (journal < LOCFS_MIN_JOURNAL_SIZE) {
+        fprintf(stderr, "The journal needs at least %d blocks\n",
+                LOCFS_MIN_JOURNAL_SIZE);
+        close(fd);
+        return -1;
+    }
+    locfs_sb.journal_size = journal;
+
+    // The data block bitmap gets the blocks it needs to cover the largest
+    // size the image may be grown to, so that it never has to move
+    if (grow == 0) {
+        grow = total > UINT64_MAX / LOCFS_DEFAULT_GROWTH
+                   ? total : total * LOCFS_DEFAULT_GROWTH;
+    } else if (grow < total) {
+        fprintf(stderr, "The image cannot be grown to fewer than its %llu "
+                "blocks\n", (unsigned long long)total);
+        close(fd);
+        return -1;
+    }
+    locfs_sb.data_bitmap_blocks
+        = grow / LOCFS_BITS_PER_BLOCK_HSB(&locfs_sb)
+          + (grow % LOCFS_BITS_PER_BLOCK_HSB(&locfs_sb) != 0);
+
+    // The data block bitmap is sized for the whole device first, the
+    // blocks it then turns out not to need stay unused
+    locfs_sb.data_block_table_size = total;
+    if (LOCFS_DATA_BLOCK_TABLE_START_BLOCK_NO_HSB(&locfs_sb)
+            + LOCFS_MIN_DATA_BLOCKS > total) {
+        fprintf(stderr, "%llu blocks are too few for %llu inodes and a "
+                "%llu block journal\n", (unsigned long long)total,
+                (unsigned long long)locfs_sb.inode_table_size,
+                (unsigned long long)journal);
+        close(fd);
+        return -1;
+    }
+    locfs_sb.data_block_table_size
+        = total - LOCFS_DATA_BLOCK_TABLE_START_BLOCK_NO_HSB(&locfs_sb);
+
+    locfs_sb.location_table_block_no
+        = LOCFS_DATA_BLOCK_TABLE_START_BLOCK_NO_HSB(&locfs_sb)
+            + LOCFS_LOCATION_TABLE_BLOCK_NO_OFFSET;
+
+    // Every block mkfs writes, aligned so the device can take them as is
+    if (posix_memalign((void **)&blocks, blocksize, BLK_NR * blocksize)) {
+        close(fd);
+        return -1;
+    }
+    memset(blocks, 0, BLK_NR * blocksize);
+
+    blockno[BLK_SUPER] = 0;
+    blockno[BLK_INODE_BITMAP] = LOCFS_INODE_BITMAP_START_BLOCK_NO;
+    blockno[BLK_DATA_BITMAP]
+        = LOCFS_DATA_BLOCK_BITMAP_START_BLOCK_NO_HSB(&locfs_sb);
+    blockno[BLK_INODE_TABLE] = LOCFS_INODE_TABLE_START_BLOCK_NO_HSB(&locfs_sb);
+    blockno[BLK_JOURNAL] = LOCFS_JOURNAL_START_BLOCK_NO_HSB(&locfs_sb);
+    blockno[BLK_ROOTDIR] = LOCFS_DATA_BLOCK_TABLE_START_BLOCK_NO_HSB(&locfs_sb)
+                               + LOCFS_ROOTDIR_DATA_BLOCK_NO_OFFSET;
+    blockno[BLK_ROOTDIR_LEAF]
+        = LOCFS_DATA_BLOCK_TABLE_START_BLOCK_NO_HSB(&locfs_sb)
+            + LOCFS_ROOTDIR_LEAF_BLOCK_NO_OFFSET;
+    blockno[BLK_ROOTDIR_INDEX]
+        = LOCFS_DATA_BLOCK_TABLE_START_BLOCK_NO_HSB(&locfs_sb)
+            + LOCFS_ROOTDIR_INDEX_BLOCK_NO_OFFSET;
+    blockno[BLK_LOCATION_TABLE] = locfs_sb.location_table_block_no;
+
+    memcpy(blocks + BLK_SUPER * blocksize, &locfs_sb, sizeof(locfs_sb));
+
     // construct inode bitmap
-    char inode_bitmap[locfs_sb.blocksize];
-    memset(inode_bitmap, 0, sizeof(inode_bitmap));
-    inode_bitmap[0] = 1;
+    blocks[BLK_INODE_BITMAP * blocksize] = 1;
 
-    // construct data block bitmap
-    char data_block_bitmap[locfs_sb.blocksize];
-    memset(data_block_bitmap, 0, sizeof(data_block_bitmap));
-    data_block_bitmap[0] = 1;
+    // construct data block bitmap, root directory hash tree root and
+    // leaf, its location index and the location table
+    blocks[BLK_DATA_BITMAP * blocksize] = 1 | 2 | 4 | 8;
 
     // construct root inode
     struct locfs_inode root_locfs_inode = {
         .mode = S_IFDIR | S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH,
         .inode_no = LOCFS_ROOTDIR_INODE_NO,
-        .data_block_no 
-            = LOCFS_DATA_BLOCK_TABLE_START_BLOCK_NO_HSB(&locfs_sb)
-                + LOCFS_ROOTDIR_DATA_BLOCK_NO_OFFSET,
-        .dir_children_count = 1,
-        .location = "Home",
-    };
-
-    // construct root inode data block
-    struct locfs_dir_record root_dir_records[] = {
-        {
-            .filename = "root",
-            .inode_no = LOCFS_ROOTDIR_INODE_NO + 1,
+        .extent_count = 1,
+        .extent_block_no = 0,
+        .extents = {
+            {
+                .ee_block = 0,
+                .ee_len = 2,
+                .ee_start = blockno[BLK_ROOTDIR],
+            },
         },
+        .dir_children_count = 0,
+        .dir_index_block_no = blockno[BLK_ROOTDIR_INDEX],
+        .location_id = 1,
+        .latitude = LOCFS_COORD_NONE,
+        .longitude = LOCFS_COORD_NONE,
+        .altitude = LOCFS_COORD_NONE,
     };
+    memcpy(blocks + BLK_INODE_TABLE * blocksize, &root_locfs_inode,
+           sizeof(root_locfs_inode));
+
+    // construct journal super block, the log starts right after it
+    struct locfs_journal_super_block *journal_sb
+        = (struct locfs_journal_super_block *)(blocks
+                                               + BLK_JOURNAL * blocksize);
+    journal_sb->header.magic = LOCFS_JOURNAL_MAGIC;
+    journal_sb->header.blocktype = LOCFS_JOURNAL_SUPER;
+    journal_sb->header.sequence = 1;
+    journal_sb->blocksize = blocksize;
+    journal_sb->maxlen = locfs_sb.journal_size;
+    journal_sb->first = 1;
+
+    // construct root directory, a hash tree root pointing every hash at
+    // a single empty leaf
+    struct locfs_dx_node *root_dx
+        = (struct locfs_dx_node *)(blocks + BLK_ROOTDIR * blocksize);
+    struct locfs_dir_leaf *root_leaf
+        = (struct locfs_dir_leaf *)(blocks + BLK_ROOTDIR_LEAF * blocksize);
+    root_dx->magic = LOCFS_DX_ROOT_MAGIC;
+    root_dx->levels = 0;
+    root_dx->count = 1;
+    root_dx->entries[0].hash = 0;
+    root_dx->entries[0].block = LOCFS_ROOTDIR_LEAF_BLOCK_NO_OFFSET
+                                    - LOCFS_ROOTDIR_DATA_BLOCK_NO_OFFSET;
+    root_leaf->magic = LOCFS_DIR_LEAF_MAGIC;
 
-    // write super block
-    if (sizeof(locfs_sb)
-            != write(fd, &locfs_sb, sizeof(locfs_sb))) {
+    // construct root location index, no children are filed under any
+    // location yet
+    struct locfs_locindex_block *root_index
+        = (struct locfs_locindex_block *)(blocks
+                                          + BLK_ROOTDIR_INDEX * blocksize);
+    root_index->header.magic = LOCFS_LOCINDEX_MAGIC;
+
+    // construct location table, the root is tagged with its only entry
+    struct locfs_location_block *location_table
+        = (struct locfs_location_block *)(blocks
+                                          + BLK_LOCATION_TABLE * blocksize);
+    location_table->header.magic = LOCFS_LOCTABLE_MAGIC;
+    location_table->header.count = 1;
+    location_table->entries[0].id = 1;
+    strcpy(location_table->entries[0].name, "Home");
+
+    // Clear the bitmaps, the inode table and the journal in one go, so
+    // no stale inode or transaction from a previous format survives
+    if (zero_range(fd, blkdev, blocksize,
+                   (blockno[BLK_ROOTDIR] - 1) * blocksize)) {
+        perror("Error clearing the metadata");
+        free(blocks);
+        close(fd);
         return -1;
     }
-    if ((off_t)-1
-            == lseek(fd, locfs_sb.blocksize, SEEK_SET)) {
-        return -1;
+    if (discard) {
+        discard_range(fd, blkdev, blockno[BLK_ROOTDIR] * blocksize,
+                      locfs_sb.data_block_table_size * blocksize);
     }
 
-    // write inode bitmap
-    if (sizeof(inode_bitmap)
-            != write(fd, inode_bitmap, sizeof(inode_bitmap))) {
+    if (write_blocks(fd, blocksize, blocks, blockno, BLK_NR)) {
+        perror("Error writing the file system");
+        free(blocks);
+        close(fd);
         return -1;
     }
 
-    // write data block bitmap
-    if (sizeof(data_block_bitmap)
-            != write(fd, data_block_bitmap,
-                     sizeof(data_block_bitmap))) {
+    // The generated tree replaces the empty root, writing over its blocks
+    if (spec && populate(fd, &locfs_sb, spec)) {
+        perror("Error populating the file system");
+        free(blocks);
+        close(fd);
         return -1;
     }
 
-    // write root inode
-    if (sizeof(root_locfs_inode)
-            != write(fd, &root_locfs_inode,
-                     sizeof(root_locfs_inode))) {
+    if (fsync(fd) == -1) {
+        perror("Error writing the file system");
+        free(blocks);
+        close(fd);
         return -1;
     }
 
-    // write root inode data block
-    if ((off_t)-1
-            == lseek(
-                fd,
-                LOCFS_DATA_BLOCK_TABLE_START_BLOCK_NO_HSB(&locfs_sb)
-                    * locfs_sb.blocksize,
-                SEEK_SET)) {
-        return -1;
-    }
-    if (sizeof(root_dir_records)
-            != write(fd, root_dir_records,
-                     sizeof(root_dir_records))) {
-        return -1;
-    }
+    printf("%llu blocks of %llu bytes, %llu inodes of %llu bytes, "
+           "%llu journal blocks, %llu data blocks\n",
+           (unsigned long long)total, (unsigned long long)blocksize,
+           (unsigned long long)locfs_sb.inode_table_size,
+           (unsigned long long)inode_size,
+           (unsigned long long)locfs_sb.journal_size,
+           (unsigned long long)locfs_sb.data_block_table_size);
 
+    free(blocks);
     close(fd);
-    return ret;
+    return 0;
 }
@@ -0,0 +1,277 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/statfs.h>
+#include <sys/sysmacros.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/fs.h>
+
+#include "../include/locfs.h"
+#include "../include/locfs_ioctl.h"
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s <mount point|device|image> [blocks]\n"
+            "\n"
+            "Grows a locfs image to blocks blocks in all, or to the size of\n"
+            "the device under it. Given the mount point, a mounted image is\n"
+            "grown online once its device has been enlarged (losetup -c for\n"
+            "a loop device). An unmounted image file is extended to the new\n"
+            "size. New blocks go to the data region, as far as the room mkfs\n"
+            "left in the data block bitmap allows, see mkfs-locfs -G.\n",
+            prog);
+}
+
+/* Parses a count with an optional K, M, G or T suffix, as mkfs-locfs */
+static int parse_size(const char *s, uint64_t *out)
+{
+    unsigned long long value;
+    char *end;
+
+    errno = 0;
+    value = strtoull(s, &end, 0);
+    if (errno || end == s) {
+        return -1;
+    }
+
+    switch (*end) {
+    case 'T': case 't':
+        value <<= 10;
+        /* fall through */
+    case 'G': case 'g':
+        value <<= 10;
+        /* fall through */
+    case 'M': case 'm':
+        value <<= 10;
+        /* fall through */
+    case 'K': case 'k':
+        value <<= 10;
+        end++;
+        break;
+    }
+    if (*end) {
+        return -1;
+    }
+
+    *out = value;
+    return 0;
+}
+
+/* Bytes in the block device a mounted file system lives on */
+static int mounted_device_size(dev_t dev, uint64_t *out)
+{
+    char path[64];
+    unsigned long long sectors;
+    FILE *f;
+    int ret;
+
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/size",
+             major(dev), minor(dev));
+    f = fopen(path, "r");
+    if (!f) {
+        return -1;
+    }
+    ret = fscanf(f, "%llu", &sectors) == 1 ? 0 : -1;
+    fclose(f);
+
+    *out = (uint64_t)sectors * 512;
+    return ret;
+}
+
+/* Grows a mounted file system through LOCFS_IOC_GROW */
+static int grow_online(const char *path, uint64_t blocks)
+{
+    struct statfs before, after;
+    struct stat st;
+    uint64_t size;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_DIRECTORY);
+    if (fd == -1) {
+        perror("Error opening the mount point");
+        return -1;
+    }
+
+    if (fstat(fd, &st) == -1 || fstatfs(fd, &before) == -1) {
+        perror("Error looking at the mount point");
+        close(fd);
+        return -1;
+    }
+    if (before.f_type != LOCFS_MAGIC) {
+        fprintf(stderr, "%s is not on a locfs mount\n", path);
+        close(fd);
+        return -1;
+    }
+
+    if (blocks == 0) {
+        if (mounted_device_size(st.st_dev, &size)) {
+            fprintf(stderr, "Cannot tell the size of the device under %s, "
+                    "pass the number of blocks\n", path);
+            close(fd);
+            return -1;
+        }
+        blocks = size / before.f_bsize;
+    }
+
+    if (ioctl(fd, LOCFS_IOC_GROW, &blocks) == -1) {
+        perror("Growing the file system failed");
+        close(fd);
+        return -1;
+    }
+
+    if (fstatfs(fd, &after) == 0) {
+        printf("%s: data region grew from %llu to %llu blocks\n", path,
+               (unsigned long long)before.f_blocks,
+               (unsigned long long)after.f_blocks);
+    }
+
+    close(fd);
+    return 0;
+}
+
+/* Clears the data block bitmap bits of the new blocks, bits [from, to) */
+static int clear_bitmap(int fd, struct locfs_super_block *sb,
+                        uint64_t from, uint64_t to)
+{
+    uint64_t start = LOCFS_DATA_BLOCK_BITMAP_START_BLOCK_NO_HSB(sb);
+    uint64_t first = from / 8, last = (to + 7) / 8, i;
+    uint8_t *bytes;
+    int ret = 0;
+
+    bytes = malloc(last - first);
+    if (!bytes) {
+        return -1;
+    }
+
+    if (pread(fd, bytes, last - first, start * sb->blocksize + first)
+            != (ssize_t)(last - first)) {
+        free(bytes);
+        return -1;
+    }
+
+    for (i = from; i < to; i++) {
+        bytes[i / 8 - first] &= ~(1 << (i % 8));
+    }
+
+    if (pwrite(fd, bytes, last - first, start * sb->blocksize + first)
+            != (ssize_t)(last - first)) {
+        ret = -1;
+    }
+
+    free(bytes);
+    return ret;
+}
+
+/* Grows an unmounted image in place */
+static int grow_offline(const char *path, uint64_t blocks)
+{
+    struct locfs_super_block sb;
+    struct stat st;
+    uint64_t size, data_start, old_size, new_size;
+    int fd;
+
+    fd = open(path, O_RDWR | O_EXCL);
+    if (fd == -1) {
+        perror("Error opening the device");
+        return -1;
+    }
+
+    if (fstat(fd, &st) == -1) {
+        perror("Error looking at the device");
+        close(fd);
+        return -1;
+    }
+    size = st.st_size;
+    if (S_ISBLK(st.st_mode) && ioctl(fd, BLKGETSIZE64, &size) == -1) {
+        perror("Error getting the device size");
+        close(fd);
+        return -1;
+    }
+
+    if (pread(fd, &sb, sizeof(sb), 0) != sizeof(sb)
+            || sb.magic != LOCFS_MAGIC || sb.blocksize == 0) {
+        fprintf(stderr, "%s is not a locfs image\n", path);
+        close(fd);
+        return -1;
+    }
+
+    if (blocks == 0) {
+        blocks = size / sb.blocksize;
+    }
+
+    data_start = LOCFS_DATA_BLOCK_TABLE_START_BLOCK_NO_HSB(&sb);
+    old_size = sb.data_block_table_size;
+    if (blocks < data_start + old_size) {
+        fprintf(stderr, "%s already has %llu blocks, it cannot shrink\n",
+                path, (unsigned long long)(data_start + old_size));
+        close(fd);
+        return -1;
+    }
+    new_size = blocks - data_start;
+    if (new_size > LOCFS_DATA_BLOCK_TABLE_MAX_HSB(&sb)) {
+        fprintf(stderr, "The data block bitmap only has room for %llu "
+                "blocks in all\n",
+                (unsigned long long)(data_start
+                                     + LOCFS_DATA_BLOCK_TABLE_MAX_HSB(&sb)));
+        close(fd);
+        return -1;
+    }
+
+    // An image file is grown, sparsely, to the size asked for
+    if (blocks * sb.blocksize > size) {
+        if (S_ISBLK(st.st_mode)
+                || ftruncate(fd, blocks * sb.blocksize) == -1) {
+            fprintf(stderr, "%s is smaller than %llu blocks\n", path,
+                    (unsigned long long)blocks);
+            close(fd);
+            return -1;
+        }
+    }
+
+    // The bitmap first, so the new blocks are never seen in use
+    sb.data_block_table_size = new_size;
+    if (clear_bitmap(fd, &sb, old_size, new_size)
+            || fsync(fd) == -1
+            || pwrite(fd, &sb, sizeof(sb), 0) != sizeof(sb)
+            || fsync(fd) == -1) {
+        perror("Error writing the file system");
+        close(fd);
+        return -1;
+    }
+
+    printf("%s: data region grew from %llu to %llu blocks\n", path,
+           (unsigned long long)old_size, (unsigned long long)new_size);
+
+    close(fd);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct stat st;
+    uint64_t blocks = 0;
+
+    if (argc != 2 && argc != 3) {
+        usage(argv[0]);
+        return -1;
+    }
+    if (argc == 3 && (parse_size(argv[2], &blocks) || blocks == 0)) {
+        usage(argv[0]);
+        return -1;
+    }
+
+    if (stat(argv[1], &st) == -1) {
+        perror("Error looking at the path");
+        return -1;
+    }
+
+    return S_ISDIR(st.st_mode) ? grow_online(argv[1], blocks)
+                               : grow_offline(argv[1], blocks);
+}
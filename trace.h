@@ -0,0 +1,191 @@
+/*
+ * Location Based Filesystem
+ *
+ * By, Robert Chrystie
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM locfs
+
+#if !defined(_LOCFS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _LOCFS_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(locfs_lookup,
+    TP_PROTO(struct inode *dir, struct dentry *dentry, int ret),
+    TP_ARGS(dir, dentry, ret),
+
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(unsigned long, dir)
+        __string(name, dentry->d_name.name)
+        __field(unsigned long, ino)
+        __field(int, ret)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = dir->i_sb->s_dev;
+        __entry->dir = dir->i_ino;
+        __assign_str(name, dentry->d_name.name);
+        __entry->ino = d_really_is_positive(dentry)
+                           ? d_inode(dentry)->i_ino : 0;
+        __entry->ret = ret;
+    ),
+
+    TP_printk("dev %d,%d dir %lu name %s ino %lu ret %d",
+              MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir,
+              __get_str(name), __entry->ino, __entry->ret)
+);
+
+TRACE_EVENT(locfs_iterate,
+    TP_PROTO(struct inode *dir, uint32_t location_id, loff_t start,
+             loff_t end, int ret),
+    TP_ARGS(dir, location_id, start, end, ret),
+
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(unsigned long, dir)
+        __field(uint32_t, location_id)
+        __field(loff_t, start)
+        __field(loff_t, end)
+        __field(int, ret)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = dir->i_sb->s_dev;
+        __entry->dir = dir->i_ino;
+        __entry->location_id = location_id;
+        __entry->start = start;
+        __entry->end = end;
+        __entry->ret = ret;
+    ),
+
+    TP_printk("dev %d,%d dir %lu location %u pos %lld..%lld ret %d",
+              MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir,
+              __entry->location_id, __entry->start, __entry->end,
+              __entry->ret)
+);
+
+TRACE_EVENT(locfs_create,
+    TP_PROTO(struct inode *dir, struct dentry *dentry, umode_t mode,
+             uint64_t ino, uint32_t location_id, int ret),
+    TP_ARGS(dir, dentry, mode, ino, location_id, ret),
+
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(unsigned long, dir)
+        __string(name, dentry->d_name.name)
+        __field(umode_t, mode)
+        __field(uint64_t, ino)
+        __field(uint32_t, location_id)
+        __field(int, ret)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = dir->i_sb->s_dev;
+        __entry->dir = dir->i_ino;
+        __assign_str(name, dentry->d_name.name);
+        __entry->mode = mode;
+        __entry->ino = ino;
+        __entry->location_id = location_id;
+        __entry->ret = ret;
+    ),
+
+    TP_printk("dev %d,%d dir %lu name %s mode 0%o ino %llu location %u ret %d",
+              MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir,
+              __get_str(name), __entry->mode, __entry->ino,
+              __entry->location_id, __entry->ret)
+);
+
+TRACE_EVENT(locfs_alloc,
+    TP_PROTO(struct super_block *sb, bool inode, uint64_t goal,
+             uint64_t count, uint64_t start, uint64_t len, int ret),
+    TP_ARGS(sb, inode, goal, count, start, len, ret),
+
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(bool, inode)
+        __field(uint64_t, goal)
+        __field(uint64_t, count)
+        __field(uint64_t, start)
+        __field(uint64_t, len)
+        __field(int, ret)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = sb->s_dev;
+        __entry->inode = inode;
+        __entry->goal = goal;
+        __entry->count = count;
+        __entry->start = start;
+        __entry->len = len;
+        __entry->ret = ret;
+    ),
+
+    TP_printk("dev %d,%d %s goal %llu count %llu got %llu+%llu ret %d",
+              MAJOR(__entry->dev), MINOR(__entry->dev),
+              __entry->inode ? "inode" : "data", __entry->goal,
+              __entry->count, __entry->start, __entry->len, __entry->ret)
+);
+
+DECLARE_EVENT_CLASS(locfs_rw,
+    TP_PROTO(struct inode *inode, loff_t pos, size_t count, ssize_t ret),
+    TP_ARGS(inode, pos, count, ret),
+
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(unsigned long, ino)
+        __field(loff_t, pos)
+        __field(size_t, count)
+        __field(ssize_t, ret)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = inode->i_sb->s_dev;
+        __entry->ino = inode->i_ino;
+        __entry->pos = pos;
+        __entry->count = count;
+        __entry->ret = ret;
+    ),
+
+    TP_printk("dev %d,%d ino %lu pos %lld count %zu ret %zd",
+              MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+              __entry->pos, __entry->count, __entry->ret)
+);
+
+DEFINE_EVENT(locfs_rw, locfs_read,
+    TP_PROTO(struct inode *inode, loff_t pos, size_t count, ssize_t ret),
+    TP_ARGS(inode, pos, count, ret)
+);
+
+DEFINE_EVENT(locfs_rw, locfs_write,
+    TP_PROTO(struct inode *inode, loff_t pos, size_t count, ssize_t ret),
+    TP_ARGS(inode, pos, count, ret)
+);
+
+TRACE_EVENT(locfs_location_change,
+    TP_PROTO(const char *location, unsigned int gen),
+    TP_ARGS(location, gen),
+
+    TP_STRUCT__entry(
+        __string(location, location)
+        __field(unsigned int, gen)
+    ),
+
+    TP_fast_assign(
+        __assign_str(location, location);
+        __entry->gen = gen;
+    ),
+
+    TP_printk("location %s gen %u", __get_str(location), __entry->gen)
+);
+
+#endif /* _LOCFS_TRACE_H */
+
+/* This part must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace
+#include <trace/define_trace.h>